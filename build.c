@@ -2,6 +2,12 @@
 #include "cbuild.h"
 #include <stdbool.h>
 
+// The event loop, the send queue and the file bodies are built on epoll, eventfd,
+// splice, MSG_ZEROCOPY and TCP_CORK, stop here rather than in a pile of compile errors
+#ifndef __linux__
+#error "chttp only builds on Linux, see Prerequisites in readme.md"
+#endif
+
 bool check_deps() {
     // check if the directory ./vendor/zlib exists
     if (access("./vendor/zlib", F_OK) == -1) {
@@ -11,6 +17,28 @@ bool check_deps() {
     return true;
 }
 
+// subcommands don't see the arguments after their name, so the ones given to
+// `./cbuild <name> ...` are quoted onto the command line here
+static const char* forward_args(const char* name, const char* command, int argc, char** argv) {
+    static char line[4096];
+    if (argc < 3 || strcmp(argv[1], name) != 0) return command;
+
+    size_t len = (size_t)snprintf(line, sizeof(line), "%s", command);
+    for (int i = 2; i < argc && len < sizeof(line); i++) {
+        len += (size_t)snprintf(line + len, sizeof(line) - len, " '");
+        for (const char* c = argv[i]; *c && len < sizeof(line); c++) {
+            if (*c == '\'') len += (size_t)snprintf(line + len, sizeof(line) - len, "'\\''");
+            else line[len++] = *c;
+        }
+        if (len < sizeof(line)) len += (size_t)snprintf(line + len, sizeof(line) - len, "'");
+    }
+    if (len >= sizeof(line)) {
+        fprintf(stderr, "Arguments for %s are too long\n", name);
+        exit(1);
+    }
+    return line;
+}
+
 int main(int argc, char** argv) {
     CBUILD_SELF_REBUILD("build.c", "cbuild.h");
 
@@ -39,11 +67,11 @@ int main(int argc, char** argv) {
     cbuild_set_output_dir("build");
     cbuild_set_compiler("gcc");
     cbuild_enable_compile_commands(1);
-#ifdef __APPLE__
-    cbuild_add_global_cflags("-std=c2x -Wall -Wextra -Wpedantic -Werror");
-#else
     cbuild_add_global_cflags("-std=gnu23 -Wall -Wextra -Wpedantic -Werror -fPIC");
-#endif
+    // the profiler and the allocation check unwind by frame pointer and name functions
+    // from the dynamic symbol table
+    cbuild_add_global_cflags("-fno-omit-frame-pointer");
+    cbuild_add_global_ldflags("-rdynamic");
 
     target_t* zlib;
     CBUILD_SHARED_LIBRARY(zlib,
@@ -63,7 +91,13 @@ int main(int argc, char** argv) {
     CBUILD_STATIC_LIBRARY(http,
         CBUILD_SOURCES(http, "src/http.c", "src/router.c", "src/routes.c",
             "src/layers.c", "src/alloc.c", "src/cstring.c", "src/utils.c",
-            "src/builtin.c", "src/server.c");
+            "src/builtin.c", "src/server.c", "src/event.c", "src/sendq.c",
+            "src/splice.c", "src/upstream.c", "src/proxy.c", "src/client.c",
+            "src/hpack.c", "src/h2.c", "src/websocket.c",
+            "src/sse.c", "src/ratelimit.c", "src/admission.c",
+            "src/loadshed.c", "src/histogram.c", "src/capture.c",
+            "src/trace.c", "src/slowlog.c", "src/shmstats.c", "src/profile.c",
+            "src/memstats.c");
         CBUILD_INCLUDES(http, "include", "vendor/zlib");
     );
     cbuild_target_link_library(http, zlib);
@@ -82,7 +116,42 @@ int main(int argc, char** argv) {
     command_t* copy_cmd = cbuild_command("copy server exe to root", "cp ./build/server server");
     cbuild_target_add_post_command(server, copy_cmd);
 
+    // load generator, `./cbuild bench -c 64 -d 10` drives a server already running
+    target_t* bench = cbuild_executable("chttp-bench");
+    cbuild_add_source(bench, "src/bench.c");
+    cbuild_add_source(bench, "src/perfcheck.c");
+    cbuild_add_include_dir(bench, "include");
+    cbuild_add_link_library(bench, "m");
+    cbuild_target_link_library(bench, zlib);
+    cbuild_target_link_library(bench, http);
+
+    // microbenchmarks of the library's hot paths, `./cbuild microbench -f router`
+    target_t* microbench = cbuild_executable("microbench");
+    cbuild_add_source(microbench, "src/microbench.c");
+    cbuild_add_source(microbench, "src/perfcheck.c");
+    cbuild_add_include_dir(microbench, "include");
+    cbuild_add_link_library(microbench, "m");
+    cbuild_target_link_library(microbench, zlib);
+    cbuild_target_link_library(microbench, http);
+
+    // live view of a server started with --shm-stats, `./cbuild top -i 500`
+    target_t* top = cbuild_executable("chttp-top");
+    cbuild_add_source(top, "src/top.c");
+    cbuild_add_include_dir(top, "include");
+    cbuild_target_link_library(top, zlib);
+    cbuild_target_link_library(top, http);
+
     cbuild_register_subcommand("run", server, "./build/server", NULL, NULL);
+    cbuild_register_subcommand("bench", bench, forward_args("bench", "./build/chttp-bench", argc, argv), NULL, NULL);
+    // `./cbuild replay capture.bin -x 2` plays a capture made with `server -C` back at twice its speed
+    cbuild_register_subcommand("replay", bench, forward_args("replay", "./build/chttp-bench -R", argc, argv), NULL, NULL);
+    cbuild_register_subcommand("microbench", microbench,
+        forward_args("microbench", "./build/microbench", argc, argv), NULL, NULL);
+    // `./cbuild perfcheck baseline.json` fails on a significant slowdown, the run is
+    // kept in build/perfcheck.json to become the next baseline
+    cbuild_register_subcommand("perfcheck", microbench,
+        forward_args("perfcheck", "./build/microbench -s 10 -t 50 -j build/perfcheck.json -C", argc, argv), NULL, NULL);
+    cbuild_register_subcommand("top", top, forward_args("top", "./build/chttp-top", argc, argv), NULL, NULL);
     cbuild_register_subcommand("submit", NULL, "./scripts/submit.sh", NULL, NULL);
     cbuild_register_subcommand("vendor", NULL, "./scripts/download.sh", NULL, NULL);
 
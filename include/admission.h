@@ -0,0 +1,68 @@
+#ifndef HTTP_ADMISSION_H
+#define HTTP_ADMISSION_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+// Independently locked parts of the per-host table
+#define ADMISSION_SHARDS 16
+
+// Slots a shard starts with, it doubles when 3/4 full
+#define ADMISSION_SHARD_INITIAL 64
+
+typedef struct {
+    uint64_t key;         // hash_peer() of the host, 0 marks an empty slot
+    uint32_t count;       // its open connections
+} AdmissionEntry;
+
+typedef struct {
+    _Alignas(64) pthread_mutex_t lock;
+    AdmissionEntry* entries;
+    size_t capacity;      // a power of two
+    size_t count;
+} AdmissionShard;
+
+// Accept-time caps on open connections, shared by every worker
+typedef struct {
+    size_t max_total;     // 0 for no global cap
+    size_t max_per_host;  // 0 for no per-host cap
+    atomic_size_t open;
+    AdmissionShard shards[ADMISSION_SHARDS];
+    atomic_uint_fast64_t refused_total;
+    atomic_uint_fast64_t refused_host;
+    void* tag;
+} Admission;
+
+/**
+ * @brief Sets up the caps. With both at 0 admission only counts connections.
+ * @return `false` on allocation failure.
+ */
+bool admission_init(Admission* admission, size_t max_total, size_t max_per_host, void* tag);
+
+/**
+ * @brief Frees the per-host table.
+ */
+void admission_free(Admission* admission);
+
+/**
+ * @brief Counts a newly accepted connection from `peer`.
+ * @return `false` if a cap is reached, the connection should be closed right away.
+ *         Nothing was counted then.
+ */
+bool admission_acquire(Admission* admission, const struct sockaddr_storage* peer);
+
+/**
+ * @brief Forgets a connection `admission_acquire` let in.
+ */
+void admission_release(Admission* admission, const struct sockaddr_storage* peer);
+
+/**
+ * @brief Prints open connections and how many were refused at each cap.
+ */
+void admission_print_stats(Admission* admission);
+
+#endif // HTTP_ADMISSION_H
@@ -18,6 +18,7 @@ typedef struct tag_entry {
     void* tag; // Tag value
     void** ptrs; // Array of pointers with this tag
     size_t count; // Number of pointers
+    size_t bytes; // Bytes allocated by those pointers
     size_t capacity; // Current capacity of the ptrs array
     struct tag_entry* next; // For hash collision chaining
 } tag_entry;
@@ -30,6 +31,34 @@ typedef struct tag_entry {
 
 #define TAG(value) (void*)(size_t)value
 
+// Per-connection tags are made from the connection's serial number, which unlike its fd
+// is never reused. The top bit keeps them apart from tags made from pointers.
+#define CONNECTION_TAG_BIT ((size_t)1 << (sizeof(size_t) * 8 - 1))
+#define CONNECTION_TAG(id) TAG((CONNECTION_TAG_BIT | (size_t)(id)))
+#define IS_CONNECTION_TAG(tag) (((size_t)(tag) & CONNECTION_TAG_BIT) != 0)
+
+// Running totals of allocator calls, see palloc_get_stats
+typedef struct palloc_stats {
+    size_t allocations; // pmalloc, pcalloc and prealloc calls that succeeded
+    size_t bytes; // bytes requested by those calls
+    size_t frees; // allocations released by pfree, pfree_tag or replaced by prealloc
+} palloc_stats;
+
+// Size classes of palloc_summary, class n holds blocks of 2^(n-1) + 1 to 2^n bytes and
+// the last one everything larger
+#define PALLOC_SIZE_CLASSES 32
+
+// What is allocated right now, see palloc_get_summary
+typedef struct palloc_summary {
+    size_t allocations; // live blocks
+    size_t bytes; // bytes in those blocks
+    size_t tags; // tag entries, some may be empty
+    size_t class_count[PALLOC_SIZE_CLASSES]; // live blocks by size class
+    size_t class_bytes[PALLOC_SIZE_CLASSES];
+    size_t connection_allocations; // the live blocks held by connection tags
+    size_t connection_bytes;
+} palloc_summary;
+
 /**
  * @brief Allocates memory and tracks it with a tag.
  *
@@ -95,6 +124,28 @@ void pfree(void* ptr);
  */
 void pfree_tag(void* tag);
 
+/**
+ * @brief Drops the bookkeeping kept for a tag that no longer owns anything.
+ *
+ * A tag's entry and pointer list otherwise stay around after pfree_tag, sized
+ * for the most blocks the tag ever held. Long-lived tags that sit empty most of
+ * the time, like an idle connection's, can give that memory back. The entry is
+ * created again by the next allocation with the tag.
+ *
+ * @param tag The tag to forget. Nothing happens if it still owns allocations.
+ */
+void palloc_release_tag(void* tag);
+
+typedef void (*palloc_tag_fn)(void* tag, size_t count, size_t bytes, void* ctx);
+
+/**
+ * @brief Calls `fn` with the live allocation count and bytes of every tag that holds any.
+ *
+ * The allocator is locked for the walk, which only touches one entry per tag, so
+ * `fn` must be quick and must not allocate.
+ */
+void palloc_visit_tags(palloc_tag_fn fn, void* ctx);
+
 /**
  * @brief Finds the allocation information for a given pointer.
  *
@@ -146,5 +197,59 @@ void pinspect(void* ptr);
  */
 size_t ptag_size(void* tag);
 
+// Frames kept of the first allocation a probe sees
+#define PALLOC_PROBE_DEPTH 8
+
+// What the calling thread allocated between palloc_probe_begin and palloc_probe_end
+typedef struct palloc_probe {
+    size_t system_calls; // malloc, calloc and realloc calls, the allocator's own bookkeeping included
+    size_t bytes; // bytes requested through pmalloc, pcalloc and prealloc
+    void* sites[PALLOC_PROBE_DEPTH]; // call stack of the first allocation
+    size_t depth; // frames in `sites`, 0 when nothing was allocated
+} palloc_probe;
+
+/**
+ * @brief Gets the allocator's running totals.
+ *
+ * The totals only grow, take two snapshots and subtract them to measure
+ * how much a piece of code allocates.
+ *
+ * @param stats Receives the totals.
+ */
+void palloc_get_stats(palloc_stats* stats);
+
+/**
+ * @brief Gets what is allocated right now, broken down by size class and by whether
+ *        connection tags hold it.
+ *
+ * The figures are kept up to date as blocks come and go, so this only copies them
+ * and holds the allocator lock for no longer than a pmalloc.
+ *
+ * @param summary Receives the figures.
+ */
+void palloc_get_summary(palloc_summary* summary);
+
+/**
+ * @brief Starts counting the calling thread's allocations.
+ *
+ * Every system allocator call made on behalf of pmalloc, pcalloc, prealloc
+ * and pfree_tag on this thread is counted until palloc_probe_end. The call
+ * stack of the first allocation is kept so it can be reported.
+ */
+void palloc_probe_begin(void);
+
+/**
+ * @brief Stops counting and returns what the thread allocated since palloc_probe_begin.
+ *
+ * @param probe Receives the counts and the first call stack.
+ */
+void palloc_probe_end(palloc_probe* probe);
+
+/**
+ * @brief Prints the call stack of a probe's first allocation, one frame per line.
+ *
+ * @param probe A probe filled in by palloc_probe_end.
+ */
+void palloc_probe_print(const palloc_probe* probe);
 
 #endif // ALLOC_H
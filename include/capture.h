@@ -0,0 +1,70 @@
+#ifndef HTTP_CAPTURE_H
+#define HTTP_CAPTURE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// A capture file starts with CAPTURE_MAGIC and the capture's start time, then holds one
+// record per request: the nanoseconds since the previous record, the connection it came
+// in on and its length as LEB128 varints, followed by the raw request bytes.
+#define CAPTURE_MAGIC "CHTTPCAP"
+#define CAPTURE_VERSION 1
+
+typedef struct {
+    uint64_t offset_ns;     // since the first record
+    uint64_t connection;    // requests of one connection share it, in the order they arrived
+    char* data;
+    size_t len;
+} CaptureRecord;
+
+typedef struct {
+    FILE* fp;
+    uint64_t offset_ns;
+    uint64_t start_ns;      // wall clock time the capture began
+} CaptureReader;
+
+/**
+ * @brief Starts writing the requests handed to capture_request to `path`. Only every
+ *        `sample`th connection is kept, whole, so replayed keep-alive sessions look like
+ *        the real ones. Recording stops once the file would grow past `max_bytes`.
+ * @return `true` on success.
+ */
+bool capture_start(const char* path, uint32_t sample, uint64_t max_bytes);
+
+/**
+ * @brief Whether capture_start succeeded and capture_stop has not been called.
+ */
+bool capture_enabled(void);
+
+/**
+ * @brief Appends one complete request, `now_ns` from CLOCK_MONOTONIC. Safe to call
+ *        from every worker.
+ */
+void capture_request(uint64_t connection, uint64_t now_ns, const char* data, size_t len);
+
+/**
+ * @brief Flushes and closes the capture file.
+ */
+void capture_stop(void);
+
+/**
+ * @brief Prints how many requests were seen, written and dropped by the size cap.
+ */
+void capture_print_stats(void);
+
+/**
+ * @brief Opens a capture file for reading and checks its header.
+ */
+bool capture_reader_open(CaptureReader* reader, const char* path);
+
+/**
+ * @brief Reads the next record, its data is allocated with `tag`.
+ * @return 1 for a record, 0 at the end of the file and -1 if the file is damaged.
+ */
+int capture_reader_next(CaptureReader* reader, CaptureRecord* record, void* tag);
+
+void capture_reader_close(CaptureReader* reader);
+
+#endif // HTTP_CAPTURE_H
@@ -0,0 +1,115 @@
+#ifndef HTTP_CLIENT_H
+#define HTTP_CLIENT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "event.h"
+#include "http.h"
+#include "sendq.h"
+#include "upstream.h"
+
+// Decoded response bodies larger than this fail with EFBIG
+#define HTTP_CLIENT_MAX_BODY (8 * 1024 * 1024)
+
+// Defaults for new clients: requests in flight on one connection, and connections
+// a client opens to one upstream
+#define HTTP_CLIENT_PIPELINE_DEPTH 8
+#define HTTP_CLIENT_MAX_CONNS 4
+
+// Receives the outcome of an async request. `response` belongs to the callback and is
+// allocated with the request's tag, it is NULL when `error` (an errno value) is set.
+typedef void (*HttpClientCallback)(HttpRequest* request, HttpResponse* response, int error, void* data);
+
+typedef struct HttpClientCall {
+    HttpRequest* request;
+    HttpResponse* response;
+    HttpClientCallback done;
+    void* data;
+    Upstream* upstream;
+    bool idempotent;       // may be resent if the connection dies before it is answered
+    bool retried;
+    struct HttpClientCall* next;
+} HttpClientCall;
+
+typedef struct HttpClientConn {
+    struct HttpClient* client;
+    Upstream* upstream;
+    int fd;
+    EventWatch* watch;
+    EventTimer* timer;            // connect, io and idle timeouts
+    bool connecting;
+    bool reused;                  // answered a request before, the peer may close it any time
+    bool received;                // bytes of the oldest call's response have arrived
+    SendQueue out;
+    char* buf;                    // received bytes not yet parsed
+    size_t len;
+    size_t cap;
+    HttpResponseParser parser;    // for the oldest call
+    HttpClientCall* calls;        // written or queued, answered in this order
+    HttpClientCall* last;
+    size_t outstanding;
+    struct HttpClientConn* next;
+} HttpClientConn;
+
+typedef struct HttpClient {
+    EventLoop* loop;
+    HttpClientConn* conns;
+    HttpClientCall* waiting;      // no connection had room, sent once one does
+    HttpClientCall* waiting_last;
+    size_t pipeline_depth;
+    size_t max_conns;             // per upstream
+    size_t max_body;
+    void* tag;
+} HttpClient;
+
+/**
+ * @brief Sends a request over a pooled keep-alive connection and waits for the response.
+ *        Blocks the calling thread up to the upstream's timeouts, so it is meant for code
+ *        that doesn't run on a worker, like tools and threads of their own. A route handler
+ *        would hold up every connection of its worker, it uses http_client_request_async
+ *        instead. A Host header is added when the request has none.
+ * @param upstream Where to send the request.
+ * @param request The request. The target is sent as-is, e.g. "/users?id=4".
+ * @return The response allocated with the request's tag, or NULL with errno set.
+ */
+HttpResponse* http_client_request(Upstream* upstream, HttpRequest* request);
+
+/**
+ * @brief Writes every request back to back on one connection, then reads the responses
+ *        in order. Stale pooled connections are retried once when every request is
+ *        idempotent.
+ * @param responses Receives one response per request, allocated with that request's tag.
+ * @return `true` if every response arrived, `false` with errno set and every
+ *         `responses` entry NULL otherwise.
+ */
+bool http_client_pipeline(Upstream* upstream, HttpRequest** requests, HttpResponse** responses, size_t count);
+
+/**
+ * @brief Creates a non-blocking client whose connections live on `loop`.
+ * @return The client, or NULL on failure.
+ */
+HttpClient* http_client_new(EventLoop* loop, void* tag);
+
+/**
+ * @brief Closes the client's connections. Requests still pending complete with
+ *        ECANCELED. Don't call it from a completion callback.
+ * @param client The client to free. If NULL, the function does nothing.
+ */
+void http_client_free(HttpClient* client);
+
+/**
+ * @brief Queues a request and returns at once, `done` runs on the loop's thread with
+ *        the response. Idempotent requests are pipelined on a connection already busy
+ *        with others, other methods wait for a connection of their own. Only call it
+ *        from the loop's thread.
+ *        A route handler uses a client on `request->loop`: it calls
+ *        http_response_defer, returns, and `done` fills in the response and calls
+ *        http_response_resume. The `cancel` given to http_response_defer must keep
+ *        `done` from touching the response once the request has gone away.
+ * @param request Must stay valid until `done` runs.
+ * @return `false` if the request couldn't be queued, `done` is not called then.
+ */
+bool http_client_request_async(HttpClient* client, Upstream* upstream, HttpRequest* request,
+                               HttpClientCallback done, void* data);
+
+#endif // HTTP_CLIENT_H
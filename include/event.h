@@ -0,0 +1,142 @@
+#ifndef HTTP_EVENT_H
+#define HTTP_EVENT_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+
+#define EV_READ  EPOLLIN
+#define EV_WRITE EPOLLOUT
+#define EV_ERROR EPOLLERR
+#define EV_HUP   (EPOLLHUP | EPOLLRDHUP)
+
+#define EVENT_LOOP_MAX_EVENTS 256
+
+// An epoll_wait that returns sooner than this didn't sleep, its events were already waiting
+#define EVENT_LOOP_SLEPT_NS 50000
+
+// Timer wheel resolution and size. Deadlines further out than one turn of the
+// wheel just stay in their slot for extra rotations.
+#define EVENT_TIMER_TICK_MS 10
+#define EVENT_TIMER_SLOTS 512
+
+typedef struct EventLoop EventLoop;
+
+// define the handler function type
+typedef void (*EventHandler)(EventLoop* loop, int fd, uint32_t events, void* data);
+typedef void (*TimerHandler)(EventLoop* loop, void* data);
+
+typedef struct EventTimer {
+    uint64_t deadline;     // in ticks since the loop was created
+    uint32_t interval_ms;  // 0 for one-shot timers
+    TimerHandler fn;
+    void* data;
+    bool linked;           // sitting in a wheel slot
+    bool cancelled;        // cancelled from inside its own callback
+    struct EventTimer* prev;
+    struct EventTimer* next;
+} EventTimer;
+
+// A callback handed to the loop from another thread
+typedef struct EventTask {
+    TimerHandler fn;
+    void* data;
+    struct EventTask* next;
+} EventTask;
+
+typedef struct EventWatch {
+    int fd;
+    uint32_t events;
+    EventHandler fn;
+    void* data;
+    struct EventWatch* next_dead; // pending release after the current dispatch
+} EventWatch;
+
+struct EventLoop {
+    int epoll_fd;
+    int wake_fd;
+    volatile bool running;
+    EventWatch* dead;
+    EventTimer* wheel[EVENT_TIMER_SLOTS];
+    size_t timer_count;
+    uint64_t tick;         // last tick whose slot was processed
+    uint64_t start_ms;     // monotonic time of tick 0
+    EventTimer* firing;    // the timer whose callback is running
+    pthread_mutex_t posted_lock;
+    EventTask* posted;     // tasks from other threads, newest first
+    // earliest monotonic time, in ns, the current batch of events may have been ready:
+    // when epoll_wait returned if it slept, otherwise when the previous batch started
+    uint64_t ready_ns;
+    void* tag;
+};
+
+/**
+ * @brief Creates a new epoll backed event loop.
+ * @param tag A memory allocation tag.
+ * @return A pointer to the new loop, or NULL on failure.
+ */
+EventLoop* event_loop_new(void* tag);
+
+/**
+ * @brief Frees the loop. Watches still registered belong to the loop's tag.
+ * @param loop The loop to free. If NULL, the function does nothing.
+ */
+void event_loop_free(EventLoop* loop);
+
+/**
+ * @brief Starts watching `fd` for `events` (a mask of EV_READ / EV_WRITE).
+ * @param extra Extra raw epoll flags, e.g. EPOLLEXCLUSIVE for shared listeners.
+ * @return The watch handle, or NULL on failure.
+ */
+EventWatch* event_loop_add(EventLoop* loop, int fd, uint32_t events, uint32_t extra, EventHandler fn, void* data);
+
+/**
+ * @brief Changes the event mask of an existing watch. A no-op when unchanged.
+ */
+bool event_loop_modify(EventLoop* loop, EventWatch* watch, uint32_t events);
+
+/**
+ * @brief Stops watching the fd. The watch is released once the current
+ *        dispatch round finishes, so it is safe to call from a handler.
+ *        The fd itself is not closed.
+ */
+void event_loop_remove(EventLoop* loop, EventWatch* watch);
+
+/**
+ * @brief Schedules `fn` to run on the loop's thread after `delay_ms`, then every
+ *        `interval_ms` if it is not 0. Only call it from the loop's thread.
+ * @return The timer, or NULL on allocation failure. One-shot timers are freed after
+ *         they fire, so the handle is only valid until then.
+ */
+EventTimer* event_timer_add(EventLoop* loop, uint32_t delay_ms, uint32_t interval_ms, TimerHandler fn, void* data);
+
+/**
+ * @brief Pushes the timer's next expiry to `delay_ms` from now.
+ */
+void event_timer_reset(EventLoop* loop, EventTimer* timer, uint32_t delay_ms);
+
+/**
+ * @brief Stops and frees a pending timer. Safe from inside the timer's own callback.
+ */
+void event_timer_cancel(EventLoop* loop, EventTimer* timer);
+
+/**
+ * @brief Runs `fn` on the loop's thread during its next iteration. Safe from any
+ *        thread, tasks run in the order they were posted. Tasks still pending when
+ *        the loop is freed are dropped without running.
+ * @return `false` on allocation failure.
+ */
+bool event_loop_post(EventLoop* loop, TimerHandler fn, void* data);
+
+/**
+ * @brief Runs the loop on the calling thread until `event_loop_stop` is called.
+ */
+void event_loop_run(EventLoop* loop);
+
+/**
+ * @brief Asks the loop to return from `event_loop_run`. Safe from any thread.
+ */
+void event_loop_stop(EventLoop* loop);
+
+#endif // HTTP_EVENT_H
@@ -0,0 +1,214 @@
+#ifndef HTTP_H2_H
+#define HTTP_H2_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "event.h"
+#include "hpack.h"
+#include "http.h"
+#include "sendq.h"
+#include "slowlog.h"
+#include "utils.h"
+
+// Client connection preface, sent before any frame
+#define H2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_PREFACE_LEN 24
+
+#define H2_FRAME_HEADER_SIZE 9
+
+// Protocol defaults, RFC 9113 section 6.5.2
+#define H2_DEFAULT_FRAME_SIZE 16384
+#define H2_DEFAULT_WINDOW 65535
+#define H2_MAX_WINDOW 0x7fffffff
+#define H2_DEFAULT_WEIGHT 16
+
+// Streams a client may have open at once
+#define H2_MAX_STREAMS 100
+
+// Receive windows we advertise, large enough that uploads aren't held back by round trips
+#define H2_STREAM_WINDOW (1024 * 1024)
+#define H2_CONNECTION_WINDOW (16 * 1024 * 1024)
+
+// How long a stream response body may stall before the stream is reset
+#define H2_BODY_READ_TIMEOUT_MS 30000
+
+// Bytes a stream may send per scheduling round for each unit of its weight
+#define H2_QUANTUM_PER_WEIGHT 1024
+
+typedef enum {
+    H2_DATA = 0,
+    H2_HEADERS = 1,
+    H2_PRIORITY = 2,
+    H2_RST_STREAM = 3,
+    H2_SETTINGS = 4,
+    H2_PUSH_PROMISE = 5,
+    H2_PING = 6,
+    H2_GOAWAY = 7,
+    H2_WINDOW_UPDATE = 8,
+    H2_CONTINUATION = 9,
+} H2FrameType;
+
+#define H2_FLAG_END_STREAM 0x1
+#define H2_FLAG_ACK 0x1
+#define H2_FLAG_END_HEADERS 0x4
+#define H2_FLAG_PADDED 0x8
+#define H2_FLAG_PRIORITY 0x20
+
+typedef enum {
+    H2_NO_ERROR = 0x0,
+    H2_PROTOCOL_ERROR = 0x1,
+    H2_INTERNAL_ERROR = 0x2,
+    H2_FLOW_CONTROL_ERROR = 0x3,
+    H2_STREAM_CLOSED = 0x5,
+    H2_FRAME_SIZE_ERROR = 0x6,
+    H2_REFUSED_STREAM = 0x7,
+    H2_CANCEL = 0x8,
+    H2_COMPRESSION_ERROR = 0x9,
+} H2Error;
+
+typedef enum {
+    H2_SETTINGS_HEADER_TABLE_SIZE = 0x1,
+    H2_SETTINGS_ENABLE_PUSH = 0x2,
+    H2_SETTINGS_MAX_CONCURRENT_STREAMS = 0x3,
+    H2_SETTINGS_INITIAL_WINDOW_SIZE = 0x4,
+    H2_SETTINGS_MAX_FRAME_SIZE = 0x5,
+    H2_SETTINGS_MAX_HEADER_LIST_SIZE = 0x6,
+} H2Setting;
+
+typedef enum {
+    H2_STREAM_OPEN,        // receiving the request
+    H2_STREAM_RESPONDING,  // request complete (half-closed remote), response going out
+} H2StreamState;
+
+struct HttpServer;
+struct H2Session;
+
+// Tells the owner of the connection that frames were queued outside its own input handling
+typedef void (*H2NotifyFn)(void* data);
+
+typedef struct H2Stream {
+    struct H2Session* session;
+    uint32_t id;
+    H2StreamState state;
+    HttpRequest* request;       // allocated with the stream's own tag
+    HttpResponse* response;
+    SlowTimeline* slow;         // the timeline of a deferred response, with the request's tag
+    ByteBuffer body;            // request DATA until END_STREAM
+    int64_t send_window;
+    int64_t recv_window;
+
+    // the response body still to send: bytes, then a descriptor
+    const uint8_t* data;
+    size_t data_len;
+    size_t data_sent;
+    int body_fd;
+    off_t body_offset;
+    size_t body_remaining;
+    SegmentDoneFn body_done;    // stream descriptors go back here instead of close()
+    void* body_done_data;
+    EventWatch* body_watch;     // set while a streamed body has nothing to read
+    EventTimer* body_timer;     // resets the stream if it stays that way
+
+    uint16_t weight;            // 1 to 256, share of the connection while others send too
+    int64_t deficit;            // bytes left in this scheduling round
+    bool ready;                 // queued for sending
+    struct H2Stream* next;
+    struct H2Stream* ready_next;
+} H2Stream;
+
+typedef struct H2Session {
+    struct HttpServer* server;
+    EventLoop* loop;             // the connection's, deferred responses resume on it
+    SendQueue* out;
+    H2NotifyFn notify;
+    void* notify_data;
+    ByteBuffer pending;          // frames built but not yet handed to `out`
+    HpackTable decoder;
+    HpackTable encoder;
+    bool preface_received;
+    bool settings_received;      // the first frame after the preface must be SETTINGS
+
+    H2Stream* streams;
+    size_t stream_count;
+    uint32_t last_stream_id;     // highest stream the client opened
+
+    // a header block spread over HEADERS and CONTINUATION frames
+    ByteBuffer header_block;
+    uint32_t header_stream;      // 0 when no block is open
+    bool header_end_stream;
+
+    uint32_t peer_max_frame;
+    uint32_t peer_initial_window;
+    int64_t send_window;
+    int64_t recv_window;
+
+    H2Stream* ready_head;        // streams with response data and window to send it
+    H2Stream* ready_tail;
+
+    bool goaway_received;
+    bool failed;                 // connection error, GOAWAY queued
+    struct sockaddr_storage peer; // copied into every stream's request
+    uint64_t received_ns;        // when the input being processed was ready, see EventLoop
+    void* tag;
+} H2Session;
+
+/**
+ * @brief Checks received bytes against the client connection preface.
+ * @return 1 if they start with the whole preface, 0 if they match so far but more
+ *         bytes are needed, -1 if this isn't HTTP/2.
+ */
+int h2_preface_check(const char* data, size_t len);
+
+/**
+ * @brief Starts an HTTP/2 session on a connection. Our SETTINGS are queued at once,
+ *        the client's preface is expected as the first input.
+ * @param server Routes and layers every stream's request.
+ * @param loop The loop running the connection.
+ * @param out The connection's send queue.
+ * @param notify Called when frames were queued from a callback of `loop` rather than
+ *        from h2_session_input or h2_session_pump.
+ * @param tag A memory allocation tag that outlives the connection.
+ * @return The session, or NULL on failure.
+ */
+H2Session* h2_session_new(struct HttpServer* server, EventLoop* loop, SendQueue* out, H2NotifyFn notify,
+                          void* notify_data, void* tag);
+
+/**
+ * @brief Frees the session and every stream still open.
+ * @param session The session to free. If NULL, the function does nothing.
+ */
+void h2_session_free(H2Session* session);
+
+/**
+ * @brief Continues an HTTP/1.1 request that asked for `Upgrade: h2c` as stream 1.
+ *        The caller has already queued the 101 response.
+ * @param request The upgrading request. It is copied, the caller still owns it.
+ * @param settings The request's HTTP2-Settings header, base64url encoded.
+ * @return `false` if the settings are invalid.
+ */
+bool h2_session_upgrade(H2Session* session, HttpRequest* request, const char* settings);
+
+/**
+ * @brief Processes every complete frame in `data`. Finished requests run through the
+ *        server's layers and router and their responses are queued.
+ * @param used Receives the number of bytes consumed, the rest is an incomplete frame.
+ * @return `false` on a connection error, the connection should close once the queued
+ *         GOAWAY is flushed.
+ */
+bool h2_session_input(H2Session* session, const char* data, size_t len, size_t* used);
+
+/**
+ * @brief Moves response DATA frames into the send queue, round-robin across streams
+ *        by weight, as far as flow control windows and the queue's high water allow.
+ * @return `true` if anything was queued.
+ */
+bool h2_session_pump(H2Session* session);
+
+/**
+ * @brief `true` once the session failed, or the client sent GOAWAY and every stream
+ *        is done. The connection can close after flushing.
+ */
+bool h2_session_finished(const H2Session* session);
+
+#endif // HTTP_H2_H
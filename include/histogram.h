@@ -0,0 +1,51 @@
+#ifndef HTTP_HISTOGRAM_H
+#define HTTP_HISTOGRAM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Log-linear buckets in the style of HdrHistogram. Values below HISTOGRAM_SUB_BUCKETS
+// are exact, larger ones land in one of HISTOGRAM_SUB_BUCKETS / 2 buckets per power of
+// two, so any recorded value is off by less than 1/128 (0.8%).
+#define HISTOGRAM_SUB_BITS 8
+#define HISTOGRAM_SUB_BUCKETS (1u << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS (HISTOGRAM_SUB_BUCKETS + (64 - HISTOGRAM_SUB_BITS) * (HISTOGRAM_SUB_BUCKETS / 2))
+
+// A fixed-size histogram of 64-bit values, usually nanoseconds. It needs no
+// allocation, so recording is a handful of instructions.
+typedef struct {
+    uint64_t counts[HISTOGRAM_BUCKETS];
+    uint64_t total;
+    uint64_t min;
+    uint64_t max;
+    double sum;
+} Histogram;
+
+/**
+ * @brief Empties the histogram.
+ */
+void histogram_init(Histogram* histogram);
+
+/**
+ * @brief Adds one value.
+ */
+void histogram_record(Histogram* histogram, uint64_t value);
+
+/**
+ * @brief Adds every value of `other`, e.g. to combine per-thread histograms.
+ */
+void histogram_merge(Histogram* histogram, const Histogram* other);
+
+/**
+ * @brief The value at `percentile` (0 to 100): the highest value its bucket could hold,
+ *        capped at the largest value recorded. 0 when empty.
+ */
+uint64_t histogram_percentile(const Histogram* histogram, double percentile);
+
+/**
+ * @brief The mean of the recorded values, 0 when empty.
+ */
+double histogram_mean(const Histogram* histogram);
+
+#endif // HTTP_HISTOGRAM_H
@@ -0,0 +1,84 @@
+#ifndef HTTP_HPACK_H
+#define HTTP_HPACK_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "cstring.h"
+#include "http.h"
+#include "utils.h"
+
+// Dynamic table size we accept from peers and use for our own header blocks
+#define HPACK_TABLE_SIZE 4096
+
+// Per-entry accounting overhead from RFC 7541 section 4.1
+#define HPACK_ENTRY_OVERHEAD 32
+
+// Decoded header lists larger than this (names, values and overhead) are rejected
+#define HPACK_MAX_HEADER_LIST (64 * 1024)
+
+// Entries in the static table, dynamic entries are numbered after them
+#define HPACK_STATIC_ENTRIES 61
+
+typedef struct {
+    char* name;         // name and value share one allocation
+    size_t name_len;
+    char* value;
+    size_t value_len;
+} HpackEntry;
+
+// One direction's dynamic table. Entries live in a ring, newest at `head`.
+typedef struct {
+    HpackEntry* entries;
+    size_t capacity;    // ring slots, enough for `limit` worth of the smallest entries
+    size_t head;
+    size_t count;
+    size_t size;        // RFC 7541 size of the current entries
+    size_t max_size;    // current maximum, changed by size updates
+    size_t limit;       // what the maximum may be raised to
+    bool size_update;   // encoder: the next block must announce `max_size`
+    void* tag;
+} HpackTable;
+
+/**
+ * @brief Creates an empty dynamic table.
+ * @param limit The largest size the table may grow to, and its initial maximum.
+ * @param tag A memory allocation tag.
+ * @return `true` on success.
+ */
+bool hpack_table_init(HpackTable* table, size_t limit, void* tag);
+
+/**
+ * @brief Frees the table's entries.
+ */
+void hpack_table_free(HpackTable* table);
+
+/**
+ * @brief Encoder side: the peer's SETTINGS_HEADER_TABLE_SIZE changed. The table
+ *        shrinks to fit and the next block starts with a size update.
+ */
+void hpack_table_resize(HpackTable* table, size_t peer_size);
+
+/**
+ * @brief Decodes a complete header block into `headers`, in order, pseudo-headers
+ *        included.
+ * @param tag A memory allocation tag for the header strings.
+ * @return `false` on a compression error, the connection can't continue then.
+ */
+bool hpack_decode(HpackTable* table, const uint8_t* data, size_t len, HeaderArray* headers, void* tag);
+
+/**
+ * @brief Starts a header block, writing a pending table size update.
+ */
+void hpack_encode_begin(HpackTable* table, ByteBuffer* out);
+
+/**
+ * @brief Appends one header field to a block. Fields matching a table entry are
+ *        indexed, stable ones are added to the dynamic table and values that change
+ *        with every response are sent as literals.
+ * @param name Lowercase field name.
+ */
+void hpack_encode(HpackTable* table, const char* name, size_t name_len, const char* value, size_t value_len,
+                  ByteBuffer* out);
+
+#endif // HTTP_HPACK_H
@@ -4,6 +4,8 @@
 
 #include "array.h"
 #include "cstring.h"
+#include "sendq.h"
+#include "utils.h"
 #include <sys/socket.h>
 
 typedef enum {
@@ -47,10 +49,18 @@ typedef struct {
 
 ARRAY_DECLARE(Header, HeaderArray)
 
+struct EventLoop;
+
+// Runs on the loop of a deferred response, see http_response_defer
+typedef void (*HttpDeferFn)(void* data);
+
 typedef struct {
     RequestLine request_line;
     HeaderArray* headers;
     String* body;
+    struct sockaddr_storage peer; // the client's address, ss_family is AF_UNSPEC when unknown
+    uint64_t received_ns; // monotonic time its bytes were ready to be read, 0 when unknown
+    struct EventLoop* loop; // the worker loop handling it, NULL outside the server
     void* tag;
 } HttpRequest;
 
@@ -61,20 +71,92 @@ typedef struct {
     String* body;
     uint8_t* raw_body;
     size_t raw_body_len;
+    int body_fd;         // descriptor body sent after any bytes in `body`, -1 when there is none
+    off_t body_offset;
+    size_t body_len;     // bytes taken from `body_fd`
+    SegmentDoneFn body_done; // set for stream bodies, receives `body_fd` back instead of close()
+    void* body_done_data;
+    struct SseChannel* sse; // set by `sse_response`, the connection then subscribes to it
+    bool deferred;       // set by `http_response_defer` until `http_response_resume`
+    HttpDeferFn cancel;  // runs instead of the resume when the request goes away first
+    void* cancel_data;
+    HttpDeferFn resume;  // set by whoever queues the response once it is complete
+    void* resume_data;
     void* tag;
 } HttpResponse;
 
+// Upper bound on the size of a request line plus headers
+#define HTTP_MAX_HEAD_SIZE (16 * 1024)
+
+// Upper bound on a request body after Content-Encoding is undone
+#define HTTP_MAX_INFLATED_BODY (64 * 1024 * 1024)
+
+// Where a response parser is within the message
+typedef enum {
+    HTTP_PARSE_HEAD,        // waiting for the complete status line and headers
+    HTTP_PARSE_BODY,        // Content-Length body, `remaining` bytes to go
+    HTTP_PARSE_CHUNK_SIZE,
+    HTTP_PARSE_CHUNK_DATA,  // `remaining` bytes of the current chunk to go
+    HTTP_PARSE_CHUNK_END,   // the CRLF after a chunk
+    HTTP_PARSE_TRAILERS,
+    HTTP_PARSE_UNTIL_CLOSE, // no framing, the body ends when the peer closes
+    HTTP_PARSE_DONE,
+    HTTP_PARSE_ERROR,       // `error` holds an errno value
+} HttpParseState;
+
+// Incremental response parser. Bytes are fed as they arrive, the decoded body
+// accumulates in `response->body`.
+typedef struct {
+    HttpParseState state;
+    HttpResponse* response;
+    Method method;          // of the request being answered, HEAD responses have no body
+    bool keep_alive;        // set with the head, false when the peer closes after this response
+    size_t content_length;  // SIZE_MAX without a Content-Length
+    size_t remaining;
+    size_t max_body;        // larger bodies fail with EFBIG
+    int error;
+} HttpResponseParser;
+
 HttpRequest* http_request_new(void* tag);
 void http_request_free(HttpRequest* request);
 void http_request_print(const HttpRequest* request);
 bool http_request_parse(HttpRequest* request, String* raw);
+size_t http_request_frame(const char* data, size_t len, size_t* head_len, size_t* body_len, int* status);
 char* http_request_method_to_string(Method method);
 Header* http_request_get_header(const HttpRequest* request, const char* key);
+InflateStatus http_request_read_body(const HttpRequest* request, size_t max_len, InflateChunkFn fn, void* ctx);
 
 HttpResponse* http_response_new(void* tag);
 void http_response_free(HttpResponse* response);
 void http_response_print(const HttpResponse* response);
-bool http_response_send(const HttpResponse* response, int client_fd);
+bool http_response_send(HttpResponse* response, int client_fd);
+bool http_response_queue(HttpResponse* response, SendQueue* queue);
+bool http_response_set_file(HttpResponse* response, const char* path);
+bool http_response_set_stream(HttpResponse* response, int fd, size_t len, SegmentDoneFn done, void* data);
+/**
+ * @brief Answers 200 with a copy of `len` bytes of `data` as the body and `content_type`
+ *        as its Content-Type, or 500 when `data` is NULL or the copy fails.
+ */
+bool http_response_set_body(HttpResponse* response, const char* data, size_t len, const char* content_type);
+/**
+ * @brief Lets a handler answer after it returned, from `request->loop`. Work done on
+ *        another thread gets back there with event_loop_post. If the request goes away
+ *        first, `cancel` runs on that loop instead and the response is freed with it.
+ */
+void http_response_defer(HttpResponse* response, HttpDeferFn cancel, void* data);
+/**
+ * @brief Hands a deferred response on once its status, headers and body are set. Call
+ *        it from `request->loop`. Calling it before the handler returned just undoes
+ *        http_response_defer.
+ */
+void http_response_resume(HttpResponse* response);
+bool http_response_parse(HttpResponse* response, String* raw);
+int http_response_status_code(const HttpResponse* response);
 Header* http_response_get_header(const HttpResponse* request, const char* key);
 
+String* http_request_serialize_head(const HttpRequest* request, void* tag);
+void http_response_parser_init(HttpResponseParser* parser, HttpResponse* response, Method method, size_t max_body);
+size_t http_response_parser_feed(HttpResponseParser* parser, const char* data, size_t len);
+bool http_response_parser_finish(HttpResponseParser* parser);
+
 #endif
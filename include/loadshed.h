@@ -0,0 +1,75 @@
+#ifndef HTTP_LOADSHED_H
+#define HTTP_LOADSHED_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "array.h"
+#include "cstring.h"
+#include "http.h"
+
+// Queue delay a worker may keep up for a whole interval before it counts as overloaded
+#define LOADSHED_TARGET_MS 5
+
+// Window over which the smallest queue delay is taken
+#define LOADSHED_INTERVAL_MS 100
+
+// Lower classes are shed first. Each class above SHED_LOW tolerates twice the delay
+// of the one below it, SHED_CRITICAL is never shed.
+typedef enum {
+    SHED_LOW,
+    SHED_NORMAL,
+    SHED_HIGH,
+    SHED_CRITICAL,
+    SHED_CLASSES,
+} ShedPriority;
+
+typedef struct {
+    String* prefix;
+    ShedPriority priority;
+} ShedRoute;
+
+ARRAY_DECLARE(ShedRoute, ShedRouteArray)
+
+// Sent as-is to HTTP/1.1 requests that are shed, so refusing costs almost nothing
+extern const char loadshed_response[];
+extern const size_t loadshed_response_len;
+
+/**
+ * @brief Turns shedding on. A worker is overloaded once every request over an
+ *        interval waited longer than `target_ms`. It then sheds requests waiting
+ *        longer than the target, scaled by their class. Otherwise it only sheds
+ *        those that waited longer than the scaled interval.
+ * @return `true` on success.
+ */
+bool loadshed_enable(uint32_t target_ms, uint32_t interval_ms, void* tag);
+
+/**
+ * @brief Puts requests under `prefix` in a priority class, the longest matching
+ *        prefix wins. Anything unmatched is SHED_NORMAL.
+ */
+bool loadshed_set_priority(const char* prefix, ShedPriority priority);
+
+/**
+ * @brief Parses "low", "normal", "high" or "critical".
+ */
+bool loadshed_priority_parse(const char* name, ShedPriority* priority);
+
+/**
+ * @brief Turns shedding off and forgets the priorities.
+ */
+void loadshed_clear(void);
+
+/**
+ * @brief Prints how many requests of each class were shed.
+ */
+void loadshed_print_stats(void);
+
+/**
+ * @brief Updates the calling worker's delay estimate with the request and decides
+ *        whether to serve it. Uses `request->received_ns`.
+ * @return `false` if the request should be answered with 503 right away.
+ */
+bool loadshed_admit(const HttpRequest* request);
+
+#endif // HTTP_LOADSHED_H
@@ -0,0 +1,27 @@
+#ifndef HTTP_MEMSTATS_H
+#define HTTP_MEMSTATS_H
+
+#include <stdbool.h>
+#include <stdio.h>
+#include "http.h"
+
+// Tags listed by size and by growth
+#define MEMSTATS_TOP_TAGS 20
+
+/**
+ * @brief Writes what the allocator holds as JSON: live blocks and bytes, the tags
+ *        holding the most, live blocks by size class and what grew since the previous
+ *        call. The allocator is only locked while its running figures and one entry per
+ *        tag are copied, everything else works on that copy.
+ * @param save_baseline Also keep this snapshot as the baseline.
+ * @param diff Also compare against the baseline kept last.
+ */
+bool memstats_write_json(FILE* fp, bool save_baseline, bool diff);
+
+/**
+ * @brief Route handler answering with memstats_write_json's output. `?baseline` saves
+ *        the baseline, `?diff` compares against it.
+ */
+void memstats_route(HttpRequest* request, HttpResponse* response);
+
+#endif // HTTP_MEMSTATS_H
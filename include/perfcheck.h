@@ -0,0 +1,91 @@
+#ifndef HTTP_PERFCHECK_H
+#define HTTP_PERFCHECK_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include "array.h"
+
+#define PERF_MAX_SAMPLES 64
+#define PERF_NAME_LEN 64
+
+// Where a run was measured. Runs from different machines or compilers are still
+// compared, but with a warning, since their numbers don't mean the same thing.
+typedef struct {
+    char timestamp[32];     // UTC, ISO 8601
+    char host[64];
+    char kernel[200];
+    char cpu[128];
+    char governor[32];      // cpufreq scaling governor, "unknown" when there is none
+    char compiler[128];
+    int cpus;
+} PerfEnv;
+
+typedef struct {
+    char name[PERF_NAME_LEN];
+    size_t iterations;      // per sample
+    double samples[PERF_MAX_SAMPLES]; // ns/op of each run
+    size_t sample_count;
+    double allocs_per_op;
+    double bytes_per_op;
+} PerfResult;
+
+ARRAY_DECLARE(PerfResult, PerfResultArray)
+
+typedef struct {
+    PerfEnv env;
+    PerfResultArray results;
+} PerfRun;
+
+/**
+ * @brief Fills `env` in from the running machine.
+ */
+void perf_env_collect(PerfEnv* env);
+
+/**
+ * @brief Starts an empty run measured on this machine.
+ */
+bool perf_run_init(PerfRun* run, void* tag);
+
+/**
+ * @brief Frees the results of a run.
+ */
+void perf_run_free(PerfRun* run);
+
+/**
+ * @brief Writes the run as JSON, `path` "-" writes to stdout.
+ */
+bool perf_run_write(const PerfRun* run, const char* path);
+
+/**
+ * @brief Reads a run written by perf_run_write.
+ */
+bool perf_run_load(PerfRun* run, const char* path, void* tag);
+
+/**
+ * @brief Writes the env as a JSON object, e.g. for embedding in other reports.
+ */
+void perf_env_write_json(const PerfEnv* env, FILE* fp);
+
+/**
+ * @brief Two-sided p-value of the Mann-Whitney U test that `a` and `b` come from the
+ *        same distribution. Uses the normal approximation with a tie correction.
+ */
+double perf_mann_whitney(const double* a, size_t a_len, const double* b, size_t b_len);
+
+/**
+ * @brief 95% bootstrap confidence interval of median(current) / median(baseline).
+ */
+void perf_bootstrap_ratio(const double* baseline, size_t baseline_len, const double* current,
+                          size_t current_len, double* low, double* high);
+
+/**
+ * @brief Prints every benchmark of `current` against `baseline`. A benchmark regresses
+ *        when its median time grew by more than `threshold` (0.05 for 5%) and the
+ *        difference is significant at `alpha`, or when it allocates more than
+ *        `threshold` more per operation.
+ * @return The number of regressions.
+ */
+size_t perf_compare(const PerfRun* baseline, const PerfRun* current, double threshold, double alpha);
+
+#endif // HTTP_PERFCHECK_H
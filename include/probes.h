@@ -0,0 +1,40 @@
+#ifndef HTTP_PROBES_H
+#define HTTP_PROBES_H
+
+// USDT probes for bpftrace, perf and systemtap, provider "chttp". With <sys/sdt.h>
+// (systemtap-sdt-dev) each probe is a single nop plus a note in the ELF file, so it
+// costs nothing until a tracer attaches. Without the header, or when built with
+// -DCHTTP_NO_USDT, the probes compile to nothing.
+//
+//   bpftrace -e 'usdt:./server:chttp:request__done { @us = hist(arg2); }'
+//
+// Arguments are values the code already has at hand, strings are passed as pointers
+// for the tracer to read (str(arg1) in bpftrace).
+//
+//   request__start  (int fd, const char* method, const char* target)
+//   request__done   (int fd, const char* status_line, long latency_us)
+//   route__match    (const char* target, const char* route_path)
+//   route__miss     (const char* target)
+//   layer           (const char* name, int stage, int ok)
+//   gzip            (size_t in_bytes, size_t out_bytes)
+//   alloc           (void* ptr, size_t size, void* tag)
+//   free__tag       (void* tag, size_t count)
+
+#if !defined(CHTTP_NO_USDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define CHTTP_USDT 1
+#endif
+#endif
+
+#ifdef CHTTP_USDT
+#define CHTTP_PROBE1(name, a) DTRACE_PROBE1(chttp, name, a)
+#define CHTTP_PROBE2(name, a, b) DTRACE_PROBE2(chttp, name, a, b)
+#define CHTTP_PROBE3(name, a, b, c) DTRACE_PROBE3(chttp, name, a, b, c)
+#else
+#define CHTTP_PROBE1(name, a) ((void)(a))
+#define CHTTP_PROBE2(name, a, b) ((void)(a), (void)(b))
+#define CHTTP_PROBE3(name, a, b, c) ((void)(a), (void)(b), (void)(c))
+#endif
+
+#endif // HTTP_PROBES_H
@@ -0,0 +1,67 @@
+#ifndef HTTP_PROFILE_H
+#define HTTP_PROFILE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "http.h"
+
+// Threads that can be sampled, registrations past this are ignored
+#define PROFILE_MAX_THREADS 256
+
+// Frames kept per sample, deeper stacks are cut at the root end
+#define PROFILE_MAX_DEPTH 64
+
+// Words of samples each thread buffers per profile, a sample takes its depth plus one.
+// Samples that no longer fit are counted as dropped.
+#define PROFILE_BUFFER_WORDS (256 * 1024)
+
+// How long /debug/pprof/profile samples without a `seconds` parameter, and the most it allows
+#define PROFILE_DEFAULT_SECONDS 30
+#define PROFILE_MAX_SECONDS 300
+
+// Samples per second of CPU time a thread takes by default, off the beat of 100 Hz timers
+#define PROFILE_DEFAULT_HZ 99
+
+/**
+ * @brief Installs the SIGPROF handler. Threads that call profile_thread_register
+ *        afterwards are sampled `hz` times per second of CPU time they use while a
+ *        profile runs, and not at all otherwise.
+ * @return `true` on success.
+ */
+bool profile_enable(uint32_t hz, void* tag);
+
+/**
+ * @brief Whether profile_enable was called.
+ */
+bool profile_enabled(void);
+
+/**
+ * @brief Adds the calling thread to those sampled. Does nothing while profiling is off.
+ */
+void profile_thread_register(void);
+
+/**
+ * @brief Removes the calling thread again, it must be called before the thread exits.
+ */
+void profile_thread_unregister(void);
+
+/**
+ * @brief Samples every registered thread for `seconds`, then writes the stacks in the
+ *        folded format of flamegraph.pl and speedscope: root first, frames separated by
+ *        ';', a space and the number of samples. Each thread unwinds its own stack by
+ *        its frame pointers from the signal handler, so code built without them shows
+ *        up cut short. Blocks the calling thread for the whole time.
+ * @return `false` when another profile is running or the buffers can't be allocated.
+ */
+bool profile_run(uint32_t seconds, FILE* fp);
+
+/**
+ * @brief Route handler running profile_run for the `seconds` query parameter. The
+ *        profile runs on a thread of its own and the response is deferred until it
+ *        is done, the worker serving it goes on with other connections meanwhile.
+ */
+void profile_route(HttpRequest* request, HttpResponse* response);
+
+#endif // HTTP_PROFILE_H
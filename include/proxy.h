@@ -0,0 +1,59 @@
+#ifndef HTTP_PROXY_H
+#define HTTP_PROXY_H
+
+#include "array.h"
+#include "cstring.h"
+#include "http.h"
+#include "upstream.h"
+
+// Content-Length bodies up to this size are read whole so the upstream connection goes
+// straight back to the pool. Larger ones are spliced to the client as they arrive.
+#define PROXY_BUFFER_BODY_MAX (64 * 1024)
+
+// Chunked and close-delimited bodies are decoded in memory, up to this size
+#define PROXY_MAX_DECODED_BODY (8 * 1024 * 1024)
+
+typedef struct {
+    String* prefix;     // request targets starting with this go to `group`
+    bool strip_prefix;  // forward "/api/users" as "/users"
+    UpstreamGroup* group;
+} ProxyMount;
+
+ARRAY_DECLARE(ProxyMount, ProxyMountArray)
+
+/**
+ * @brief Forwards requests under `prefix` to an upstream group. The prefix still needs
+ *        a route pointing at `proxy_route`.
+ * @param prefix The path prefix to forward.
+ * @param group The upstreams, owned by the mount from here on.
+ * @param strip_prefix If `true`, the prefix is removed from the forwarded target.
+ * @param tag A memory allocation tag.
+ * @return `true` on success.
+ */
+bool proxy_add(const char* prefix, UpstreamGroup* group, bool strip_prefix, void* tag);
+
+/**
+ * @brief Removes every mount and frees their groups. Stops the health checks.
+ */
+void proxy_clear(void);
+
+/**
+ * @brief Starts active health probes for every mounted group that has a probe path.
+ */
+bool proxy_start_health_checks(void* tag);
+
+/**
+ * @brief Prints the per-upstream counters of every mount.
+ */
+void proxy_print_stats(void);
+
+/**
+ * @brief Route handler forwarding the request to the mount with the longest matching
+ *        prefix. The group picks an upstream and the request goes over a pooled
+ *        keep-alive connection to it. The response is deferred while the exchange runs
+ *        on the request's event loop. Answers 502 when no upstream can be reached or
+ *        one misbehaves and 504 when it times out.
+ */
+void proxy_route(HttpRequest* request, HttpResponse* response);
+
+#endif // HTTP_PROXY_H
@@ -0,0 +1,75 @@
+#ifndef HTTP_RATELIMIT_H
+#define HTTP_RATELIMIT_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include "array.h"
+#include "cstring.h"
+#include "http.h"
+
+// Independently locked parts of a rule's bucket table, picked by key hash
+#define RATELIMIT_SHARDS 64
+
+// Buckets a shard starts with, the table doubles once live buckets fill half of it
+#define RATELIMIT_SHARD_INITIAL 64
+
+typedef struct {
+    uint64_t key;         // hash of the client key, 0 marks an empty slot
+    double tokens;
+    uint64_t updated_ns;  // monotonic time `tokens` was last refilled
+} RateBucket;
+
+// One shard, on its own cache line so workers hitting different shards don't contend
+typedef struct {
+    _Alignas(64) pthread_mutex_t lock;
+    RateBucket* buckets;
+    size_t capacity;      // a power of two
+    size_t count;
+    void* tag;
+} RateShard;
+
+typedef struct {
+    String* prefix;       // requests whose target starts with this are counted
+    String* header;       // clients are told apart by this header, NULL for their address
+    double rate;          // tokens added per second
+    double burst;         // bucket size
+    uint64_t idle_ns;     // a bucket idle this long is full again and gets dropped
+    RateShard* shards;
+    atomic_uint_fast64_t allowed;
+    atomic_uint_fast64_t limited;
+} RateLimitRule;
+
+ARRAY_DECLARE(RateLimitRule*, RateLimitRuleArray)
+
+/**
+ * @brief Limits requests under `prefix` to `rate` per second per client, with bursts
+ *        of up to `burst`. Every matching rule is applied, so a "/" rule and a
+ *        stricter "/api" rule combine.
+ * @param header Tells clients apart by this header's value, NULL (or a request
+ *        without it) uses the client address.
+ * @param tag A memory allocation tag that outlives the server.
+ * @return `true` on success.
+ */
+bool ratelimit_add(const char* prefix, const char* header, double rate, double burst, void* tag);
+
+/**
+ * @brief Removes every rule. Only call it once the server stopped.
+ */
+void ratelimit_clear(void);
+
+/**
+ * @brief Prints how many requests each rule allowed and refused.
+ */
+void ratelimit_print_stats(void);
+
+/**
+ * @brief Pre-route layer taking a token from every rule matching the request. A
+ *        client out of tokens for any of them gets 429 with the longest Retry-After
+ *        and the request is not routed, without taking a token from the others.
+ *        Register it with `can_fail` false.
+ */
+bool ratelimit_layer(HttpRequest* request, HttpResponse* response);
+
+#endif // HTTP_RATELIMIT_H
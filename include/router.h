@@ -11,7 +11,14 @@
 #define HTTP_201 "HTTP/1.1 201 Created";
 #define HTTP_400 "HTTP/1.1 400 Bad Request";
 #define HTTP_404 "HTTP/1.1 404 Not Found";
+#define HTTP_413 "HTTP/1.1 413 Content Too Large";
+#define HTTP_415 "HTTP/1.1 415 Unsupported Media Type";
+#define HTTP_429 "HTTP/1.1 429 Too Many Requests";
 #define HTTP_500 "HTTP/1.1 500 Internal Server Error";
+#define HTTP_501 "HTTP/1.1 501 Not Implemented";
+#define HTTP_502 "HTTP/1.1 502 Bad Gateway";
+#define HTTP_503 "HTTP/1.1 503 Service Unavailable";
+#define HTTP_504 "HTTP/1.1 504 Gateway Timeout";
 
 // define the handler function type
 typedef void (*RouteHandler)(HttpRequest* request, HttpResponse* response);
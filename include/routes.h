@@ -3,11 +3,15 @@
 
 #include "http.h"
 
+// Largest body /bytes/<n> builds
+#define ROUTES_MAX_BYTES (64 * 1024 * 1024)
+
 void set_file_search_dir(String* dir);
 
 void index_route(HttpRequest *request, HttpResponse *response);
 void echo_route(HttpRequest *request, HttpResponse *response);
 void user_agent_route(HttpRequest *request, HttpResponse *response);
 void files_route(HttpRequest *request, HttpResponse *response);
+void bytes_route(HttpRequest *request, HttpResponse *response);
 
 #endif
@@ -0,0 +1,219 @@
+#ifndef HTTP_SENDQ_H
+#define HTTP_SENDQ_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include "array.h"
+#include "splice.h"
+
+// Default high and low water marks for a connection's output queue
+#define SENDQ_HIGH_WATER (1024 * 1024)
+#define SENDQ_LOW_WATER (256 * 1024)
+
+// Max buffer segments gathered into a single writev
+#define SENDQ_MAX_IOV 64
+
+// Gathered writes at least this large go out with MSG_ZEROCOPY when enabled. The default
+// is a guess, not a measurement: scripts/zerocopy-sweep.sh finds the crossover for a NIC.
+#define SENDQ_ZEROCOPY_THRESHOLD (128 * 1024)
+
+typedef enum {
+    SEGMENT_BUFFER,
+    SEGMENT_FILE,
+    SEGMENT_STREAM, // read from a socket or pipe, no offsets
+} SegmentKind;
+
+// Called instead of close() when a stream segment is done with its descriptor.
+// `complete` is true when every byte was written, false when the queue dropped it.
+typedef void (*SegmentDoneFn)(void* data, int fd, bool complete);
+
+// Bytes queued on several connections at once, e.g. one broadcast frame. Freed when
+// the last reference is released.
+typedef struct {
+    atomic_size_t refs;
+    size_t len;
+    uint8_t data[];
+} SharedBuffer;
+
+typedef struct {
+    SegmentKind kind;
+    const uint8_t* data; // SEGMENT_BUFFER: bytes to send
+    void* owned;         // SEGMENT_BUFFER: pfree'd once the segment is sent
+    SharedBuffer* shared; // SEGMENT_BUFFER: released instead when set
+    int fd;              // SEGMENT_FILE/STREAM: closed (or handed to `done`) once the segment is sent
+    off_t offset;        // SEGMENT_FILE: start offset within the file
+    off_t read_pos;      // SEGMENT_FILE: next offset to read, ahead of `sent` by what the pipe holds
+    SplicePipe* pipe;    // SEGMENT_FILE/STREAM: borrowed from the worker's pool while in flight
+    SegmentDoneFn done;  // SEGMENT_STREAM: receives the descriptor back
+    void* done_data;
+    size_t len;          // total length of the segment
+    size_t sent;         // bytes of this segment already written
+    bool cork;           // set TCP_CORK before the first byte of this segment goes out
+    bool uncork;         // clear TCP_CORK once this segment is fully written
+    bool zerocopy;       // some of it went out with MSG_ZEROCOPY
+    uint32_t zc_seq;     // sequence number of the last zerocopy send that covered it
+} Segment;
+
+ARRAY_DECLARE(Segment, SegmentArray)
+
+// A sent buffer the kernel may still be reading, freed on its completion notification
+typedef struct {
+    void* owned;
+    SharedBuffer* shared;
+    uint32_t zc_seq;
+} ZerocopyHold;
+
+ARRAY_DECLARE(ZerocopyHold, ZerocopyHoldArray)
+
+typedef enum {
+    SENDQ_DONE,  // everything queued has been written
+    SENDQ_AGAIN, // the socket is full, wait for it to become writable
+    SENDQ_SOURCE, // a stream segment's source has nothing to read, wait for it to become readable
+    SENDQ_ERROR, // the peer is gone or a file read failed
+} SendqStatus;
+
+typedef struct {
+    SegmentArray segments;
+    size_t head;       // index of the first unsent segment
+    size_t pending;    // bytes queued but not yet written
+    size_t total_sent; // bytes written over the queue's lifetime
+    size_t high_water;
+    size_t low_water;
+    bool cork_next;             // the next pushed segment starts a corked run
+    bool corked;                // TCP_CORK is currently set on the socket
+    bool zerocopy;              // SO_ZEROCOPY is enabled on the socket
+    size_t zerocopy_threshold;
+    uint32_t zc_next_seq;       // the kernel numbers zerocopy sends from 0
+    ZerocopyHoldArray zc_held;
+    size_t zc_sends;            // sends issued with MSG_ZEROCOPY
+    size_t zc_copied;           // completions where the kernel fell back to copying
+    void* tag;
+} SendQueue;
+
+/**
+ * @brief Initializes an empty queue with the default water marks.
+ * @param queue The queue to initialize.
+ * @param tag A memory allocation tag for the segment array.
+ * @return `true` on success.
+ */
+bool sendq_init(SendQueue* queue, void* tag);
+
+/**
+ * @brief Releases every unsent segment (buffers freed, files closed) and the segment array.
+ * @param queue The queue to free. If NULL, the function does nothing.
+ */
+void sendq_free(SendQueue* queue);
+
+/**
+ * @brief Queues a buffer. The queue takes ownership of `owned` (pmalloc'd, may be NULL
+ *        for static data) and frees it once all of `data` has been written.
+ */
+bool sendq_push_buffer(SendQueue* queue, const uint8_t* data, size_t len, void* owned);
+
+/**
+ * @brief Creates a shared buffer holding a copy of `data`, with one reference.
+ * @param data The bytes to copy, NULL leaves them for the caller to fill.
+ * @return The buffer, or NULL on allocation failure.
+ */
+SharedBuffer* shared_buffer_new(const void* data, size_t len, void* tag);
+
+/**
+ * @brief Adds a reference. Safe from any thread.
+ */
+SharedBuffer* shared_buffer_retain(SharedBuffer* buffer);
+
+/**
+ * @brief Drops a reference, the last one frees the buffer. Safe from any thread.
+ */
+void shared_buffer_release(SharedBuffer* buffer);
+
+/**
+ * @brief Queues a shared buffer without copying it. The queue takes a reference of
+ *        its own, the caller keeps theirs.
+ */
+bool sendq_push_shared(SendQueue* queue, SharedBuffer* buffer);
+
+/**
+ * @brief Queues `len` bytes of the file `fd` starting at `offset`. The queue takes
+ *        ownership of the descriptor and closes it once the segment is written.
+ */
+bool sendq_push_file(SendQueue* queue, int fd, off_t offset, size_t len);
+
+/**
+ * @brief Queues `len` bytes read from the non-blocking socket or pipe `fd`. The queue
+ *        doesn't close the descriptor, it hands it to `done` once the bytes were
+ *        written or the queue is freed. While `fd` has nothing to read the flush
+ *        returns SENDQ_SOURCE, the caller bounds how long it waits.
+ */
+bool sendq_push_stream(SendQueue* queue, int fd, size_t len, SegmentDoneFn done, void* data);
+
+/**
+ * @brief Marks the next pushed segment as the start of a corked run. Together with
+ *        `sendq_uncork` it keeps a response head and a separately sent body (a file
+ *        segment) from leaving as a tiny head-only packet.
+ */
+void sendq_cork(SendQueue* queue);
+
+/**
+ * @brief Ends the corked run after the most recently pushed segment.
+ */
+void sendq_uncork(SendQueue* queue);
+
+/**
+ * @brief Turns on SO_ZEROCOPY for `socket_fd`. Gathered writes of at least
+ *        `threshold` bytes are then sent with MSG_ZEROCOPY and their buffers are
+ *        held until `sendq_reap_zerocopy` sees the kernel's completion.
+ * @return `true` if the socket supports zerocopy sends.
+ */
+bool sendq_enable_zerocopy(SendQueue* queue, int socket_fd, size_t threshold);
+
+/**
+ * @brief Drains zerocopy completions from the socket error queue and frees the
+ *        buffers they cover. Call it when the socket reports EPOLLERR.
+ * @return The number of completion notifications processed.
+ */
+size_t sendq_reap_zerocopy(SendQueue* queue, int socket_fd);
+
+/**
+ * @brief Number of sent buffers still waiting on a zerocopy completion.
+ */
+size_t sendq_zerocopy_pending(const SendQueue* queue);
+
+/**
+ * @brief Frees the segment arrays of a queue that has nothing left to send or reap,
+ *        so an idle connection doesn't hold them. The next push allocates them again.
+ */
+void sendq_shrink(SendQueue* queue);
+
+/**
+ * @brief Writes as much as the socket accepts without blocking.
+ * @param queue The queue to flush.
+ * @param socket_fd A non-blocking socket.
+ * @return SENDQ_DONE when drained, SENDQ_AGAIN on a short write, SENDQ_SOURCE when a
+ *         stream segment waits on its source, SENDQ_ERROR on failure.
+ */
+SendqStatus sendq_flush(SendQueue* queue, int socket_fd);
+
+/**
+ * @brief The descriptor a SENDQ_SOURCE flush is waiting on, -1 when the first unsent
+ *        segment isn't a stream.
+ */
+int sendq_source_fd(const SendQueue* queue);
+
+/**
+ * @brief Flushes the queue completely, waiting for writability (or a stream segment's
+ *        source to be readable) with poll().
+ * @param timeout_ms Per-wait timeout, or -1 to wait forever.
+ * @return `true` once everything has been written.
+ */
+bool sendq_flush_blocking(SendQueue* queue, int socket_fd, int timeout_ms);
+
+size_t sendq_pending(const SendQueue* queue);
+bool sendq_is_empty(const SendQueue* queue);
+bool sendq_above_high_water(const SendQueue* queue);
+bool sendq_below_low_water(const SendQueue* queue);
+
+#endif // HTTP_SENDQ_H
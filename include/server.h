@@ -1,16 +1,112 @@
 #ifndef HTTP_SERVER_H
 #define HTTP_SERVER_H
 
+#include <pthread.h>
+#include <time.h>
 #include "router.h"
 #include "layers.h"
+#include "event.h"
+#include "admission.h"
+#include "h2.h"
+#include "sse.h"
+#include "websocket.h"
+#include "sendq.h"
+#include "shmstats.h"
+#include "slowlog.h"
+
+// Bytes requested from the socket per recv
+#define SERVER_READ_CHUNK 4096
+
+// Size of a fresh receive buffer, requests that fit are read without growing it
+#define SERVER_BUFFER_SIZE (SERVER_READ_CHUNK * 2)
+
+// Receive buffers each worker keeps for connections that go idle and wake up again
+#define SERVER_SPARE_BUFFERS 64
+
+// With connection caps set, connections that send nothing for this long are dropped by the
+// kernel before accept (TCP_DEFER_ACCEPT), so half-open floods never reach the caps
+#define SERVER_DEFER_ACCEPT_S 5
+
+// How long a streamed response body may have nothing to read before the connection is closed
+#define SERVER_STREAM_READ_TIMEOUT_MS 30000
+
+// Largest request (head plus body) a connection will buffer
+#define SERVER_MAX_REQUEST_SIZE (8 * 1024 * 1024)
+
+// Exit status when the fatal allocation check catches a request that allocated
+#define SERVER_ALLOC_CHECK_EXIT 3
+
+// Distinct allocating call stacks each worker reports before it goes quiet
+#define SERVER_ALLOC_CHECK_SITES 64
+
+struct HttpServer;
+
+typedef struct {
+    struct HttpServer* server;
+    EventLoop* loop;
+    pthread_t thread;
+    int id;
+    char* spare_buffers[SERVER_SPARE_BUFFERS]; // SERVER_BUFFER_SIZE each, handed back by idle connections
+    size_t spare_count;
+    ShmWorkerStats* stats;  // this worker's block of the shared stats segment, NULL while it is off
+} ServerWorker;
 
 typedef struct {
+    int fd;
+    uint64_t id;        // serial number, unlike the fd never reused while the server runs
+    ServerWorker* worker;
+    EventWatch* watch;
+    char* in;           // received bytes not yet consumed by a request, NULL while idle
+    size_t in_len;
+    size_t in_cap;
+    SendQueue out;      // serialized responses waiting for the socket
+    bool paused;        // reading stopped until `out` drains below its low water mark
+    bool closing;       // close once `out` is flushed
+    H2Session* h2;      // set once the connection speaks HTTP/2
+    WebSocket* ws;      // set once the connection was upgraded to a WebSocket
+    SseSubscriber* sse; // set once the connection streams events
+    // a request whose handler deferred its response, later requests wait until it is queued
+    HttpRequest* pending_request;
+    HttpResponse* pending_response;
+    struct timespec pending_start;
+    SlowTimeline* pending_slow; // its timeline, with the per-request tag
+    uint64_t pending_trace;       // its trace id, 0 when it isn't traced
+    uint64_t pending_trace_start; // where its "request" span starts
+    // a streamed body in `out` whose source has nothing to read, writing waits on it
+    EventWatch* source_watch;
+    EventTimer* source_timer;
+    struct sockaddr_storage peer;
+    void* tag;          // per-request allocation tag
+    // timestamps taken while tracing is on, recorded once a request is picked for tracing
+    uint64_t accept_start_ns; // cleared after the first request, which the accept belongs to
+    uint64_t accept_end_ns;
+    uint64_t recv_start_ns;   // the read that completed the latest request
+    uint64_t recv_end_ns;
+    uint64_t trace_send;      // traced request whose response is being written, 0 for none
+} Connection;
+
+typedef struct HttpServer {
     String* host;
     int port;
     int server_fd;
     char* directory;
     Router* router;
     LayerCtx* layer_ctx;
+    WebSocketRouteArray websocket_routes;
+    int worker_count;
+    ServerWorker* workers;
+    size_t send_high_water;
+    size_t send_low_water;
+    size_t zerocopy_threshold; // 0 disables MSG_ZEROCOPY sends
+    size_t max_connections;    // open connections at once, 0 for no cap
+    size_t max_connections_per_host; // open connections from one address, 0 for no cap
+    Admission admission;       // counts connections against the caps while running
+    bool alloc_check;          // report HTTP/1.1 requests that reach the system allocator after the warmup
+    bool alloc_check_fatal;    // exit with SERVER_ALLOC_CHECK_EXIT on the first one instead
+    size_t alloc_check_warmup; // requests each worker serves before checking starts
+    atomic_uint_fast64_t alloc_checked;
+    atomic_uint_fast64_t alloc_failed;
+    atomic_uint_fast64_t connections_opened;
     void* tag;
 } HttpServer;
 
@@ -20,4 +116,29 @@ bool http_server_start(HttpServer* server);
 bool http_server_stop(HttpServer* server);
 void http_server_add_builtins(HttpServer* server, bool verbose);
 
+/**
+ * @brief Hands `Upgrade: websocket` requests for `path` to `handler`. Other requests
+ *        for the path still go through the router.
+ * @param path Exact path to match, the query string is ignored.
+ * @param handler Must outlive the server.
+ */
+bool http_server_add_websocket(HttpServer* server, const char* path, const WebSocketHandler* handler);
+
+/**
+ * @brief Runs a request through the pre-route layers, the router and the post-route
+ *        layers. The caller queues the response and runs the cleanup layers. When the
+ *        handler deferred the response, the post-route layers wait for http_server_finish.
+ */
+void http_server_handle(HttpServer* server, HttpRequest* request, HttpResponse* response);
+
+/**
+ * @brief Runs a resumed deferred response through the post-route layers.
+ */
+void http_server_finish(HttpServer* server, HttpRequest* request, HttpResponse* response);
+
+/**
+ * @brief Prints how many requests the allocation check saw and how many of them allocated.
+ */
+void http_server_print_alloc_check(HttpServer* server);
+
 #endif
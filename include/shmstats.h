@@ -0,0 +1,140 @@
+#ifndef HTTP_SHMSTATS_H
+#define HTTP_SHMSTATS_H
+
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// The segment is /dev/shm/chttp.<pid>, shm_open takes the name without the directory
+#define SHMSTATS_NAME_FORMAT "/chttp.%d"
+#define SHMSTATS_DIRECTORY "/dev/shm"
+
+#define SHMSTATS_MAGIC "CHTTPSTS"
+#define SHMSTATS_VERSION 1
+
+// Latency buckets, bucket n counts requests that took [2^(n-1), 2^n) microseconds,
+// the last one everything from about 36 minutes up
+#define SHMSTATS_LATENCY_BUCKETS 32
+
+// How often the allocator totals are republished
+#define SHMSTATS_PUBLISH_MS 1000
+
+// Every block starts with a sequence number that is odd while its writer is updating
+// it. Readers copy the block and retry when the number was odd or changed meanwhile,
+// so writers never wait on them.
+
+// Counters of one worker, written only by that worker's thread. Each has its own
+// cache lines so workers don't slow each other down.
+typedef struct {
+    alignas(64) atomic_uint_fast64_t seq;
+    uint64_t requests;
+    uint64_t status[6];             // by class, status[2] counts 2xx, status[0] anything out of range
+    uint64_t latency[SHMSTATS_LATENCY_BUCKETS]; // received to response queued
+    uint64_t latency_sum_us;
+    uint64_t connections_open;
+    uint64_t connections_accepted;
+    uint64_t bytes_received;
+    uint64_t buffer_reuses;         // receive buffers taken from the worker's spare pool
+    uint64_t buffer_allocations;    // receive buffers allocated or grown
+} ShmWorkerStats;
+
+// Process wide totals, republished every SHMSTATS_PUBLISH_MS by a background thread
+typedef struct {
+    alignas(64) atomic_uint_fast64_t seq;
+    uint64_t updated_ns;            // CLOCK_REALTIME of the last publish
+    uint64_t live_allocations;
+    uint64_t live_bytes;
+    uint64_t connection_allocations; // held by connection and request tags
+    uint64_t connection_bytes;
+    uint64_t other_allocations;     // held by the server and other long-lived tags
+    uint64_t other_bytes;
+    uint64_t total_allocations;     // palloc_get_stats, only grows
+    uint64_t total_bytes;
+    uint64_t total_frees;
+} ShmGlobalStats;
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t size;                  // bytes in the whole segment
+    uint32_t worker_count;
+    int32_t pid;
+    uint64_t started_ns;            // CLOCK_REALTIME the server started
+    ShmGlobalStats global;
+    ShmWorkerStats workers[];
+} ShmStatsHeader;
+
+/**
+ * @brief Creates the segment for `worker_count` workers and starts publishing the
+ *        allocator totals. Any segment left behind by a process with the same pid
+ *        is replaced.
+ * @return `true` on success.
+ */
+bool shmstats_start(int worker_count);
+
+/**
+ * @brief The block worker `id` writes to, NULL when the segment is off.
+ */
+ShmWorkerStats* shmstats_worker(int id);
+
+/**
+ * @brief Stops publishing, unmaps and removes the segment. Safe to call when it
+ *        was never started or already stopped. Call it only once every worker
+ *        has stopped, they write to the segment without any lock.
+ */
+void shmstats_stop(void);
+
+/**
+ * @brief Counts a finished request with its status and the time from its bytes being
+ *        ready to its response being queued. `stats` may be NULL.
+ */
+void shmstats_request(ShmWorkerStats* stats, int status, uint64_t latency_ns);
+
+/**
+ * @brief Counts a connection being opened or closed. `stats` may be NULL.
+ */
+void shmstats_connection(ShmWorkerStats* stats, bool opened);
+
+/**
+ * @brief Counts bytes read from a connection. `stats` may be NULL.
+ */
+void shmstats_received(ShmWorkerStats* stats, size_t bytes);
+
+/**
+ * @brief Counts a receive buffer taken from the spare pool (`reused`) or allocated.
+ *        `stats` may be NULL.
+ */
+void shmstats_buffer(ShmWorkerStats* stats, bool reused);
+
+/**
+ * @brief Maps the segment of the server with `pid` read-only. A `pid` of 0 picks the
+ *        most recently started one in SHMSTATS_DIRECTORY.
+ * @return The segment, or NULL when there is none or it has an unknown layout.
+ */
+const ShmStatsHeader* shmstats_attach(pid_t pid);
+
+/**
+ * @brief Unmaps a segment returned by shmstats_attach.
+ */
+void shmstats_detach(const ShmStatsHeader* header);
+
+/**
+ * @brief Takes a consistent copy of one worker's counters.
+ */
+void shmstats_read_worker(const ShmWorkerStats* stats, ShmWorkerStats* copy);
+
+/**
+ * @brief Takes a consistent copy of the process wide totals.
+ */
+void shmstats_read_global(const ShmGlobalStats* stats, ShmGlobalStats* copy);
+
+/**
+ * @brief The latency below which `percentile` (0 to 100) of the requests counted in
+ *        `latency` finished, in microseconds. 0 when it is empty.
+ */
+uint64_t shmstats_latency_percentile(const uint64_t latency[SHMSTATS_LATENCY_BUCKETS], double percentile);
+
+#endif // HTTP_SHMSTATS_H
@@ -0,0 +1,125 @@
+#ifndef HTTP_SLOWLOG_H
+#define HTTP_SLOWLOG_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "http.h"
+
+// Slow requests kept, the oldest is overwritten first
+#define SLOWLOG_ENTRIES 64
+
+// Layers and headers kept per slow request, the rest are counted but dropped
+#define SLOWLOG_MAX_LAYERS 16
+#define SLOWLOG_MAX_HEADERS 32
+
+// Longest header value or request target kept, longer ones are cut
+#define SLOWLOG_TEXT_LEN 192
+
+// Points on a request's timeline, stages are the time between consecutive marks
+typedef enum {
+    SLOW_RECEIVED,      // its bytes were ready to be read
+    SLOW_PARSE_START,
+    SLOW_PARSE_END,
+    SLOW_ROUTE_START,   // pre-route layers done
+    SLOW_ROUTE_END,     // handler done
+    SLOW_LAYERS_END,    // post-route layers done
+    SLOW_QUEUED,        // response serialized onto the send queue
+    SLOW_MARKS,
+} SlowMark;
+
+// What every request pays for: timestamps, names are pointers until it turns out slow.
+// Each thread times one request at a time, a deferred one is saved until it resumes.
+typedef struct SlowTimeline {
+    bool active;
+    uint64_t marks[SLOW_MARKS];
+    const char* layer_names[SLOWLOG_MAX_LAYERS];
+    uint64_t layer_ns[SLOWLOG_MAX_LAYERS];
+    bool layer_ok[SLOWLOG_MAX_LAYERS];
+    size_t layer_count;
+} SlowTimeline;
+
+/**
+ * @brief Turns the recorder on. Requests taking `threshold_ms` or more from being
+ *        received to having their response queued are kept with their timeline. The
+ *        ring is allocated here, so recording a slow request allocates nothing.
+ * @return `true` on success.
+ */
+bool slowlog_enable(uint32_t threshold_ms, void* tag);
+
+/**
+ * @brief Whether slowlog_enable was called.
+ */
+bool slowlog_enabled(void);
+
+/**
+ * @brief Starts the calling thread's timeline for a new request.
+ * @param received_ns CLOCK_MONOTONIC time the request's bytes were ready.
+ */
+void slowlog_begin(uint64_t received_ns);
+
+/**
+ * @brief Timestamps `mark` on the calling thread's timeline, if one is running.
+ */
+void slowlog_mark(SlowMark mark);
+
+/**
+ * @brief Start of a layer's run for slowlog_layer, 0 when no timeline is running.
+ */
+uint64_t slowlog_clock(void);
+
+/**
+ * @brief Adds a layer's duration and result to the timeline.
+ * @param name Must outlive the request, the name is only copied if it turns out slow.
+ */
+void slowlog_layer(const char* name, uint64_t start_ns, bool ok);
+
+/**
+ * @brief Ends the timeline. If the request was slow, copies it into the ring with
+ *        its allocator usage, sizes and headers, credential headers redacted.
+ */
+void slowlog_end(const HttpRequest* request, const HttpResponse* response, size_t request_bytes,
+                 size_t response_bytes);
+
+/**
+ * @brief Drops the calling thread's timeline unrecorded, e.g. for a request that failed
+ *        to parse or was upgraded. Does nothing after slowlog_end.
+ */
+void slowlog_cancel(void);
+
+/**
+ * @brief Moves the calling thread's timeline into `saved`, which is inactive if none
+ *        was running. The thread is free to time another request afterwards.
+ */
+void slowlog_save(SlowTimeline* saved);
+
+/**
+ * @brief slowlog_save into a copy allocated with `tag`, for a request whose response
+ *        was deferred.
+ * @return The copy, or NULL when no timeline was running or the copy failed.
+ */
+SlowTimeline* slowlog_detach(void* tag);
+
+/**
+ * @brief Makes `saved` the calling thread's timeline again, e.g. once a deferred
+ *        response resumes. NULL just stops the running one.
+ */
+void slowlog_restore(const SlowTimeline* saved);
+
+/**
+ * @brief Writes the kept requests as JSON, newest first.
+ */
+bool slowlog_write_json(FILE* fp);
+
+/**
+ * @brief Route handler answering with slowlog_write_json's output.
+ */
+void slowlog_route(HttpRequest* request, HttpResponse* response);
+
+/**
+ * @brief Prints how many requests were checked and how many were slow.
+ */
+void slowlog_print_stats(void);
+
+#endif // HTTP_SLOWLOG_H
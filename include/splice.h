@@ -0,0 +1,94 @@
+#ifndef HTTP_SPLICE_H
+#define HTTP_SPLICE_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Requested capacity of pooled pipes, capped by /proc/sys/fs/pipe-max-size
+#define SPLICE_PIPE_SIZE (1024 * 1024)
+
+// Idle pipes a worker keeps around before closing returned ones
+#define SPLICE_POOL_MAX_IDLE 16
+
+// Bounce buffer for the read/write fallback
+#define SPLICE_BOUNCE_SIZE (64 * 1024)
+
+// Written by the worker owning the pool, read by whoever sums them up
+typedef struct {
+    atomic_uint_fast64_t transfers;      // splice_transfer calls
+    atomic_uint_fast64_t spliced_bytes;  // bytes delivered through a pipe
+    atomic_uint_fast64_t fallback_bytes; // bytes delivered by read/write
+    atomic_uint_fast64_t fallbacks;      // transfers that could not use splice
+    atomic_uint_fast64_t busy_ns;        // time spent inside splice_transfer
+} SpliceStats;
+
+typedef struct SplicePipe {
+    int read_fd;
+    int write_fd;
+    size_t capacity;
+    size_t buffered;         // bytes read from the source but not yet delivered
+    uint8_t* bounce;         // fallback buffer, allocated on first use
+    size_t bounce_off;
+    struct SplicePipe* next; // idle list link
+} SplicePipe;
+
+typedef struct PipePool {
+    SplicePipe* idle;
+    size_t idle_count;
+    SpliceStats stats;
+    struct PipePool* next; // list of every worker's pool, for stats
+} PipePool;
+
+/**
+ * @brief Returns the calling thread's pipe pool, creating it on first use.
+ */
+PipePool* pipe_pool_get(void);
+
+/**
+ * @brief Takes an empty pipe from the pool or creates a new pre-sized one. When no
+ *        pipe can be created the returned one has no descriptors and transfers through
+ *        it use the read/write fallback.
+ * @return The pipe, or NULL on allocation failure.
+ */
+SplicePipe* pipe_pool_acquire(PipePool* pool);
+
+/**
+ * @brief Returns a pipe to the pool. Pipes still holding data, or beyond the idle
+ *        limit, are closed instead.
+ */
+void pipe_pool_release(PipePool* pool, SplicePipe* pipe);
+
+/**
+ * @brief Moves bytes from `in_fd` to `out_fd` without copying them through userspace.
+ *
+ * Bytes are spliced into `pipe` and from there into `out_fd`. When the kernel can't
+ * splice one of the descriptors the transfer falls back to read/write through the
+ * pipe's bounce buffer. Either way, bytes already read from the source stay parked
+ * in the pipe until `out_fd` accepts them, so a non-blocking `out_fd` is fine.
+ *
+ * @param pipe A pipe from `pipe_pool_acquire`, or one with only a bounce buffer.
+ * @param in_fd The source. A file or a non-blocking socket. When the socket has nothing
+ *              to read the transfer stops early with the pipe empty.
+ * @param in_offset Read position for files, advanced as bytes are read. NULL for sockets.
+ * @param out_fd The destination, usually a non-blocking client socket.
+ * @param remaining Bytes not yet delivered to `out_fd`, including those parked in the pipe.
+ * @param stats Counters to update, may be NULL.
+ * @return Bytes delivered to `out_fd`, 0 if either side would block, or -1 on error. A source
+ *         that ends before `remaining` bytes were read fails with errno ENODATA.
+ */
+ssize_t splice_transfer(SplicePipe* pipe, int in_fd, off_t* in_offset, int out_fd, size_t remaining, SpliceStats* stats);
+
+/**
+ * @brief Sums the counters of every worker's pool.
+ */
+void splice_stats_total(SpliceStats* out);
+
+/**
+ * @brief Prints the summed counters and the effective throughput.
+ */
+void splice_stats_print(void);
+
+#endif // HTTP_SPLICE_H
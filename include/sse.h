@@ -0,0 +1,129 @@
+#ifndef HTTP_SSE_H
+#define HTTP_SSE_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "event.h"
+#include "http.h"
+#include "sendq.h"
+
+// Default bytes a subscriber may have queued before the channel's slow policy applies
+#define SSE_MAX_QUEUED (1024 * 1024)
+
+// A comment goes to every subscriber this often so proxies keep idle streams open
+#define SSE_HEARTBEAT_MS 15000
+
+// Events kept for subscribers that reconnect with Last-Event-ID or fell behind
+#define SSE_HISTORY 64
+
+// What happens to a subscriber whose send queue is over the channel's limit
+typedef enum {
+    SSE_SLOW_DROP,   // skip events until it catches up, then replay what history still has
+    SSE_SLOW_CLOSE,  // close the stream, the client reconnects with Last-Event-ID
+} SseSlowPolicy;
+
+struct SseShard;
+
+// Tells the owner of the connection that events were queued or the stream should close
+typedef void (*SseNotifyFn)(void* data);
+
+typedef struct SseSubscriber {
+    struct SseChannel* channel;
+    struct SseShard* shard;
+    SendQueue* out;
+    SseNotifyFn notify;
+    void* notify_data;
+    size_t index;         // position in the shard's member array
+    uint64_t last_id;     // newest event queued for this subscriber
+    size_t dropped;       // events skipped while it was behind
+    bool closed;          // the slow policy closed it, the connection should go
+} SseSubscriber;
+
+// The subscribers of one channel on one event loop. Shards live as long as the channel.
+// Only the loop changes its members, under `lock`, so it walks them without locking,
+// other threads lock it to look at them.
+typedef struct SseShard {
+    pthread_mutex_t lock;
+    EventLoop* loop;
+    SseSubscriber** members;
+    size_t count;
+    size_t capacity;
+    EventTimer* heartbeat;   // running while the shard has members
+    struct SseChannel* channel;
+} SseShard;
+
+typedef struct SseChannel {
+    pthread_mutex_t lock;    // the shard list, ids, history and `published`
+    SseShard** shards;
+    size_t shard_count;
+    SseSlowPolicy policy;
+    size_t max_queued;
+    uint64_t next_id;
+
+    // ring of the last `history_size` events, chunk-encoded
+    SharedBuffer** history;
+    uint64_t* history_ids;
+    size_t history_size;
+    size_t history_count;
+    size_t history_next;
+    SharedBuffer* heartbeat;
+
+    atomic_size_t subscribers;
+    uint64_t published;
+    atomic_uint_fast64_t dropped; // deliveries skipped under SSE_SLOW_DROP
+    atomic_uint_fast64_t closed;  // subscribers closed under SSE_SLOW_CLOSE
+    void* tag;
+} SseChannel;
+
+/**
+ * @brief Creates a channel. It must outlive its subscribers, typically it lives as
+ *        long as the server.
+ * @param policy What to do with subscribers that don't keep up.
+ * @param history Recent events kept for replay, 0 for none.
+ * @return The channel, or NULL on allocation failure.
+ */
+SseChannel* sse_channel_new(SseSlowPolicy policy, size_t history, void* tag);
+
+/**
+ * @brief Frees the channel. Only call it once the server stopped.
+ */
+void sse_channel_free(SseChannel* channel);
+
+/**
+ * @brief Turns the response into an event stream on `channel`. Call it from a route
+ *        handler: the head goes out at once, the connection then stays open and
+ *        receives every event published to the channel.
+ * @return `false` on allocation failure.
+ */
+bool sse_response(HttpResponse* response, SseChannel* channel);
+
+/**
+ * @brief Publishes an event to every subscriber. It is serialized once and the same
+ *        buffer is queued on every connection. Safe from any thread.
+ * @param event The event name, NULL for the default "message".
+ * @param data The payload, split into one `data:` line per line.
+ * @return The event's id, 0 on allocation failure.
+ */
+uint64_t sse_publish(SseChannel* channel, const char* event, const char* data, size_t len);
+
+/**
+ * @brief Adds a subscriber whose response head is already queued on `out`. Events
+ *        after `last_event_id` that history still holds are queued right away, without
+ *        calling `notify`. Check `closed` afterwards, the replay may have been too
+ *        large for SSE_SLOW_CLOSE. Call it from the thread running `loop`.
+ * @param last_event_id The request's Last-Event-ID header, may be NULL.
+ * @return The subscriber, or NULL on failure.
+ */
+SseSubscriber* sse_subscribe(SseChannel* channel, EventLoop* loop, SendQueue* out, SseNotifyFn notify,
+                             void* notify_data, const char* last_event_id);
+
+/**
+ * @brief Removes and frees the subscriber. Call it from the thread running its loop.
+ * @param subscriber The subscriber to free. If NULL, the function does nothing.
+ */
+void sse_unsubscribe(SseSubscriber* subscriber);
+
+#endif // HTTP_SSE_H
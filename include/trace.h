@@ -0,0 +1,93 @@
+#ifndef HTTP_TRACE_H
+#define HTTP_TRACE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "http.h"
+
+// Spans each thread keeps, the oldest are overwritten first
+#define TRACE_RING_EVENTS 16384
+
+// Header that asks for a request to be traced when tracing is on
+#define TRACE_DEFAULT_HEADER "X-Trace"
+
+/**
+ * @brief Turns tracing on. Every `sample`th request is traced, 0 traces none by
+ *        sampling. Requests carrying `header` (any value) are always traced, NULL
+ *        disables that.
+ * @return `true` on success.
+ */
+bool trace_enable(uint32_t sample, const char* header, void* tag);
+
+/**
+ * @brief Whether trace_enable was called.
+ */
+bool trace_enabled(void);
+
+/**
+ * @brief CLOCK_MONOTONIC in ns while tracing is on, 0 otherwise. For timestamps taken
+ *        before it is known whether a request will be traced.
+ */
+uint64_t trace_clock(void);
+
+/**
+ * @brief Decides whether the parsed `request` is traced. If so, it becomes the calling
+ *        thread's current request until trace_request_end.
+ * @return The id its spans are recorded under, 0 when it is not traced.
+ */
+uint64_t trace_request_begin(const HttpRequest* request);
+
+/**
+ * @brief Ends the calling thread's current request.
+ */
+void trace_request_end(void);
+
+/**
+ * @brief Makes `request` the calling thread's current request again, e.g. while a
+ *        deferred response is finished. Hand the returned one back the same way once
+ *        done, a response may be resumed from inside another request's handler.
+ * @param request An id from trace_request_begin, or 0 for none.
+ * @return The request it replaces, 0 for none.
+ */
+uint64_t trace_request_swap(uint64_t request);
+
+/**
+ * @brief Start of a span of the current request, 0 when the thread has none.
+ */
+uint64_t trace_start(void);
+
+/**
+ * @brief Records the span from `start_ns` (from trace_start) until now under the
+ *        current request. Does nothing for a start of 0.
+ * @param name Must outlive the trace, e.g. a string literal or a layer's name.
+ */
+void trace_span(const char* name, uint64_t start_ns);
+
+/**
+ * @brief Records a finished span of request `request`, e.g. one measured before the
+ *        request was known to be traced. Does nothing if either time is 0.
+ */
+void trace_record(const char* name, uint64_t request, uint64_t start_ns, uint64_t end_ns);
+
+/**
+ * @brief Writes what every thread's ring holds as Chrome trace event JSON, which
+ *        chrome://tracing and ui.perfetto.dev open.
+ */
+bool trace_write_json(FILE* fp);
+
+/**
+ * @brief Route handler answering with trace_write_json's output.
+ */
+void trace_route(HttpRequest* request, HttpResponse* response);
+
+/**
+ * @brief Starts a thread that writes the trace to "chttp-trace-<pid>-<n>.json" whenever
+ *        `signum` arrives. Blocks `signum` on the calling thread, so it has to be called
+ *        before any other thread is started.
+ * @return `true` on success.
+ */
+bool trace_dump_on_signal(int signum);
+
+#endif // HTTP_TRACE_H
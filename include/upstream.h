@@ -0,0 +1,253 @@
+#ifndef HTTP_UPSTREAM_H
+#define HTTP_UPSTREAM_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include "array.h"
+#include "cstring.h"
+#include "event.h"
+
+// Defaults for new upstreams
+#define UPSTREAM_CONNECT_TIMEOUT_MS 1000
+#define UPSTREAM_IO_TIMEOUT_MS 30000
+
+// Pooled connections idle longer than this are closed instead of reused
+#define UPSTREAM_IDLE_TIMEOUT_MS 30000
+
+// Idle connections a worker keeps per upstream
+#define UPSTREAM_POOL_MAX_IDLE 32
+
+// Initial size of a connection's read buffer
+#define UPSTREAM_BUFFER_SIZE (16 * 1024)
+
+// Consecutive failures that eject an upstream from selection, and for how long
+#define UPSTREAM_EJECT_FAILURES 3
+#define UPSTREAM_EJECT_MS 10000
+
+// Active health probes
+#define UPSTREAM_PROBE_INTERVAL_MS 2000
+#define UPSTREAM_PROBE_TIMEOUT_MS 1000
+
+// Points each upstream gets on a consistent-hash ring
+#define UPSTREAM_HASH_VNODES 160
+
+// An upstream's latency average halves for every this many ms without a sample, so a
+// slow instance gets retried now and then instead of being starved for good
+#define UPSTREAM_LATENCY_DECAY_MS 1000
+
+typedef struct {
+    String* address;       // as configured, "host:port" or "unix:/path"
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    int connect_timeout_ms;
+    int io_timeout_ms;     // applied to every read and write on the connection
+
+    // shared by every worker, they feed selection
+    _Atomic uint32_t inflight;
+    _Atomic uint64_t latency_us;   // moving average of time to the response head
+    _Atomic uint64_t latency_at;   // monotonic ms of the last sample
+    _Atomic uint64_t requests;
+    _Atomic uint64_t failures;
+    _Atomic uint32_t consecutive_failures;
+    _Atomic uint64_t ejected_until; // monotonic ms, passive ejection after repeated failures
+    _Atomic bool healthy;           // last active probe result, true until probed
+} Upstream;
+
+typedef enum {
+    BALANCE_ROUND_ROBIN,
+    BALANCE_LEAST_OUTSTANDING, // fewest in flight, weighted by latency
+    BALANCE_HASH_PATH,         // consistent hash of the request path
+    BALANCE_HASH_HEADER,       // consistent hash of a request header
+} BalancePolicy;
+
+typedef struct {
+    uint32_t hash;
+    Upstream* upstream;
+} HashPoint;
+
+ARRAY_DECLARE(Upstream*, UpstreamPtrArray)
+ARRAY_DECLARE(HashPoint, HashPointArray)
+
+typedef struct {
+    UpstreamPtrArray upstreams;
+    BalancePolicy policy;
+    String* hash_header;          // BALANCE_HASH_HEADER: the header to hash
+    HashPointArray ring;          // sorted, rebuilt when upstreams are added
+    _Atomic uint32_t cursor;      // round-robin position
+    String* probe_path;           // NULL disables active health probes
+    uint32_t probe_interval_ms;
+    void* tag;
+} UpstreamGroup;
+
+typedef struct UpstreamConn {
+    Upstream* upstream;
+    int fd;                // non-blocking, upstream_fill and upstream_write wait on it with poll()
+    int io_timeout_ms;     // how long those waits last
+    char* buf;             // bytes received but not yet consumed
+    size_t len;
+    size_t cap;
+    bool reused;           // taken from the pool, the peer may have closed it meanwhile
+    bool keep_alive;       // the current response allows another request afterwards
+    uint64_t idle_since;   // monotonic ms, while pooled
+    struct UpstreamConn* next;
+} UpstreamConn;
+
+/**
+ * @brief Resolves an upstream address.
+ * @param address "host:port", "[v6addr]:port" or "unix:/path/to/socket".
+ * @param tag A memory allocation tag.
+ * @return The upstream, or NULL if the address can't be resolved.
+ */
+Upstream* upstream_new(const char* address, void* tag);
+
+/**
+ * @brief Frees an upstream. Connections to it must already be released.
+ * @param upstream The upstream to free. If NULL, the function does nothing.
+ */
+void upstream_free(Upstream* upstream);
+
+/**
+ * @brief Opens a non-blocking socket to the upstream and starts connecting.
+ * @param in_progress Set when the connect hasn't finished yet, the socket turns
+ *                    writable once it has and SO_ERROR tells how it went.
+ * @return The socket, or -1 with errno set.
+ */
+int upstream_dial(Upstream* upstream, bool* in_progress);
+
+/**
+ * @brief Takes an idle connection from the calling worker's pool, or connects a new one.
+ * @return The connection, or NULL with errno set (ETIMEDOUT when the connect timed out).
+ */
+UpstreamConn* upstream_acquire(Upstream* upstream);
+
+/**
+ * @brief Takes an idle connection from the calling worker's pool, or starts connecting a
+ *        new one without waiting for it, so it can be driven from an event loop.
+ * @param connecting Set when the connect hasn't finished yet, the socket turns writable
+ *                   once it has and SO_ERROR tells how it went.
+ * @return The connection, or NULL with errno set.
+ */
+UpstreamConn* upstream_take(Upstream* upstream, bool* connecting);
+
+/**
+ * @brief Returns a connection to the calling worker's pool, or closes it.
+ * @param conn The connection. If NULL, the function does nothing.
+ * @param reusable `false` if the connection can't carry another request (closed by the
+ *                 peer, a message only partially read, unexpected leftover bytes).
+ */
+void upstream_release(UpstreamConn* conn, bool reusable);
+
+/**
+ * @brief Reads whatever is available into the buffer without waiting.
+ * @return Bytes read, 0 when the peer closed, or -1 with errno set (EAGAIN when nothing
+ *         has arrived yet).
+ */
+ssize_t upstream_recv(UpstreamConn* conn);
+
+/**
+ * @brief Reads whatever is available into the buffer, waiting up to the io timeout for
+ *        something to arrive.
+ * @return Bytes read, 0 when the peer closed, or -1 with errno set (ETIMEDOUT on timeout).
+ */
+ssize_t upstream_fill(UpstreamConn* conn);
+
+/**
+ * @brief Drops `n` bytes from the front of the buffer.
+ */
+void upstream_consume(UpstreamConn* conn, size_t n);
+
+/**
+ * @brief Writes what the socket takes without waiting, advancing `iov` and `count` past it.
+ * @return Bytes written, or -1 with errno set (EAGAIN when the socket is full).
+ */
+ssize_t upstream_send(UpstreamConn* conn, struct iovec** iov, int* count);
+
+/**
+ * @brief Writes every byte of `iov` to the connection, waiting up to the io timeout
+ *        whenever the socket is full.
+ * @return `true` on success, `false` with errno set (ETIMEDOUT on timeout) otherwise.
+ */
+bool upstream_write(UpstreamConn* conn, struct iovec* iov, int count);
+
+/**
+ * @brief Creates an empty upstream group.
+ * @param policy How requests are spread over the group's upstreams.
+ * @param hash_header For BALANCE_HASH_HEADER, the header whose value is hashed.
+ * @param tag A memory allocation tag.
+ * @return The group, or NULL on failure.
+ */
+UpstreamGroup* upstream_group_new(BalancePolicy policy, const char* hash_header, void* tag);
+
+/**
+ * @brief Frees the group and its upstreams. Probes must be stopped first.
+ * @param group The group to free. If NULL, the function does nothing.
+ */
+void upstream_group_free(UpstreamGroup* group);
+
+/**
+ * @brief Resolves `address` and adds it to the group.
+ * @return The new upstream, so its timeouts can be adjusted, or NULL on failure.
+ */
+Upstream* upstream_group_add(UpstreamGroup* group, const char* address);
+
+/**
+ * @brief Parses "round-robin", "least", "hash-path" or "hash-header:<name>".
+ * @param header Receives the header name for "hash-header:", NULL otherwise.
+ * @return `false` if the policy is unknown.
+ */
+bool upstream_policy_parse(const char* text, BalancePolicy* policy, const char** header);
+
+/**
+ * @brief Picks an upstream for a request. Ejected and unhealthy upstreams are skipped
+ *        unless every upstream is down, then the policy's choice other than `skip` is
+ *        used anyway. A group of one has no such fallback.
+ * @return NULL when a group of one has its upstream down or skipped.
+ * @param key The hash key for the consistent-hash policies, ignored otherwise.
+ * @param skip An upstream that just failed this request, or NULL.
+ */
+Upstream* upstream_group_pick(UpstreamGroup* group, const char* key, size_t key_len, Upstream* skip);
+
+/**
+ * @brief Counts a request as in flight on `upstream`.
+ */
+void upstream_begin(Upstream* upstream);
+
+/**
+ * @brief Ends a request started with `upstream_begin`.
+ * @param ok `false` for transport failures and timeouts, they count toward ejection.
+ * @param latency_us Time to the response head, 0 when there is no sample.
+ */
+void upstream_end(Upstream* upstream, bool ok, uint64_t latency_us);
+
+/**
+ * @brief Probes every upstream of the group with `GET path` every `interval_ms`, once
+ *        `upstream_health_start` runs. Upstreams failing the probe are skipped until
+ *        they answer 2xx or 3xx again.
+ */
+bool upstream_group_set_probe(UpstreamGroup* group, const char* path, uint32_t interval_ms);
+
+/**
+ * @brief Starts the health check thread for every group with a probe path.
+ * @param groups The groups to watch.
+ * @param count Number of groups.
+ * @return `true` if the thread started, or there was nothing to probe.
+ */
+bool upstream_health_start(UpstreamGroup** groups, size_t count, void* tag);
+
+/**
+ * @brief Stops the health check thread and waits for it.
+ */
+void upstream_health_stop(void);
+
+/**
+ * @brief Prints the counters of every upstream in the group.
+ */
+void upstream_group_print(UpstreamGroup* group);
+
+#endif // HTTP_UPSTREAM_H
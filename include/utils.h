@@ -1,8 +1,60 @@
 #ifndef HTTP_UTILS_H
 #define HTTP_UTILS_H
 
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/socket.h>
 #include "cstring.h"
 
+// Growable buffer for binary output, unlike String it keeps no character count
+typedef struct {
+    uint8_t* data;
+    size_t len;
+    size_t cap;
+    void* tag;
+} ByteBuffer;
+
 size_t gzip_string(String* str, uint8_t** out_ptr);
 
+// Most bytes `inflate_stream` hands to its callback at once
+#define INFLATE_CHUNK (16 * 1024)
+
+typedef enum {
+    INFLATE_OK,
+    INFLATE_TOO_LARGE,    // the output passed `max_len`
+    INFLATE_CORRUPT,      // not valid gzip or zlib data, or truncated
+    INFLATE_UNSUPPORTED,  // an encoding other than gzip, deflate or identity
+    INFLATE_STOPPED,      // the callback returned false
+} InflateStatus;
+
+typedef bool (*InflateChunkFn)(const uint8_t* data, size_t len, void* ctx);
+
+/**
+ * @brief Decompresses gzip or zlib data, handing the output to `fn` in chunks of at
+ *        most INFLATE_CHUNK bytes. Runs on a per-thread inflate context that is reset,
+ *        not reallocated, between calls.
+ * @param max_len Output limit, decompression stops with INFLATE_TOO_LARGE past it.
+ */
+InflateStatus inflate_stream(const uint8_t* data, size_t len, size_t max_len, InflateChunkFn fn, void* ctx);
+
+void byte_buffer_init(ByteBuffer* buffer, void* tag);
+void byte_buffer_free(ByteBuffer* buffer);
+bool byte_buffer_reserve(ByteBuffer* buffer, size_t len);
+bool byte_buffer_append(ByteBuffer* buffer, const void* data, size_t len);
+bool byte_buffer_push(ByteBuffer* buffer, uint8_t byte);
+uint8_t* byte_buffer_take(ByteBuffer* buffer, size_t* len);
+
+// FNV-1a with a murmur3 finalizer, never 0 so tables can use 0 for an empty slot
+uint64_t hash_bytes(const void* data, size_t len);
+
+// hash of the address without the port, the same for every connection from one host
+uint64_t hash_peer(const struct sockaddr_storage* peer);
+
+// SHA-1 digest, only for protocol handshakes that require it
+#define SHA1_DIGEST_SIZE 20
+void sha1(const void* data, size_t len, uint8_t digest[SHA1_DIGEST_SIZE]);
+
+// Standard base64 with padding. `out` needs room for 4 * ((len + 2) / 3) + 1 bytes.
+size_t base64_encode(const uint8_t* data, size_t len, char* out);
+
 #endif
@@ -0,0 +1,219 @@
+#ifndef HTTP_WEBSOCKET_H
+#define HTTP_WEBSOCKET_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "array.h"
+#include "event.h"
+#include "http.h"
+#include "sendq.h"
+#include "utils.h"
+
+// Largest message, after joining fragments, a connection accepts. Larger ones close
+// it with 1009. A single frame must also fit the connection's receive buffer.
+#define WEBSOCKET_MAX_MESSAGE (4 * 1024 * 1024)
+
+// A ping goes out after this long without hearing from the client, the connection
+// is dropped when the next interval passes without an answer
+#define WEBSOCKET_PING_INTERVAL_MS 30000
+
+// How long a close we started waits for the client's close frame
+#define WEBSOCKET_CLOSE_TIMEOUT_MS 5000
+
+// A client this far behind on its send queue is closed instead of buffered for
+#define WEBSOCKET_MAX_QUEUED (8 * 1024 * 1024)
+
+// Broadcast groups one connection may be in at once
+#define WEBSOCKET_MAX_GROUPS 8
+
+// Largest frame header: 2 bytes, a 64-bit length and a mask key
+#define WEBSOCKET_MAX_HEADER 14
+
+typedef enum {
+    WS_CONTINUATION = 0x0,
+    WS_TEXT = 0x1,
+    WS_BINARY = 0x2,
+    WS_CLOSE = 0x8,
+    WS_PING = 0x9,
+    WS_PONG = 0xa,
+} WebSocketOpcode;
+
+// Close status codes, RFC 6455 section 7.4.1
+#define WS_CLOSE_NORMAL 1000
+#define WS_CLOSE_GOING_AWAY 1001
+#define WS_CLOSE_PROTOCOL_ERROR 1002
+#define WS_CLOSE_UNSUPPORTED 1003
+#define WS_CLOSE_NO_STATUS 1005
+#define WS_CLOSE_ABNORMAL 1006
+#define WS_CLOSE_INVALID_DATA 1007
+#define WS_CLOSE_POLICY 1008
+#define WS_CLOSE_TOO_BIG 1009
+#define WS_CLOSE_INTERNAL 1011
+
+typedef struct WebSocket WebSocket;
+
+// Callbacks for one WebSocket endpoint, all run on the connection's worker thread.
+// Any of them may be NULL.
+typedef struct {
+    // The handshake completed. `request` is only valid during the call.
+    void (*on_open)(WebSocket* ws, HttpRequest* request);
+    // A complete text or binary message, fragments already joined. Text is valid UTF-8.
+    void (*on_message)(WebSocket* ws, WebSocketOpcode opcode, const uint8_t* data, size_t len);
+    // The connection is going away, `code` is WS_CLOSE_ABNORMAL when it dropped without a close frame.
+    // The WebSocket is freed right after.
+    void (*on_close)(WebSocket* ws, uint16_t code);
+    void* data;
+} WebSocketHandler;
+
+typedef struct {
+    char* path;
+    const WebSocketHandler* handler;
+} WebSocketRoute;
+
+ARRAY_DECLARE(WebSocketRoute, WebSocketRouteArray)
+
+// Tells the owner of the connection that frames were queued or the socket should close
+typedef void (*WebSocketNotifyFn)(void* data);
+
+struct WebSocket {
+    EventLoop* loop;
+    SendQueue* out;
+    const WebSocketHandler* handler;
+    WebSocketNotifyFn notify;
+    void* notify_data;
+
+    EventTimer* timer;           // ping interval, then the close timeout
+    bool heard;                  // a frame arrived since the last ping interval
+    bool awaiting_pong;
+
+    ByteBuffer message;          // fragments of the message being received
+    WebSocketOpcode message_opcode; // WS_CONTINUATION when none is in progress
+    bool sending_fragments;      // a fragmented message of ours is half sent
+
+    bool close_sent;
+    bool close_received;
+    bool finished;               // nothing more to exchange, the connection can close
+    uint16_t close_code;         // what on_close will report
+
+    struct WebSocketGroup* groups[WEBSOCKET_MAX_GROUPS];
+    size_t group_count;
+    void* user;                  // free for the handler's per-connection state
+    void* tag;
+};
+
+// Connections that receive the same broadcasts, possibly across workers
+typedef struct WebSocketGroup {
+    pthread_mutex_t lock;
+    WebSocket** members;
+    EventLoop** loops;           // the loop each member runs on
+    size_t count;
+    size_t capacity;
+    void* tag;
+} WebSocketGroup;
+
+/**
+ * @brief XORs `data` with the 4-byte masking key, 16 or 32 bytes at a time where
+ *        SSE2, AVX2 or NEON are available.
+ * @param offset Position of `data` within the payload, which selects the key byte.
+ */
+void websocket_unmask(uint8_t* data, size_t len, const uint8_t key[4], size_t offset);
+
+/**
+ * @brief Writes an unmasked server frame header.
+ * @param header Room for WEBSOCKET_MAX_HEADER bytes.
+ * @return The header length.
+ */
+size_t websocket_frame_header(uint8_t* header, WebSocketOpcode opcode, bool fin, size_t len);
+
+/**
+ * @brief Validates the upgrade request and computes Sec-WebSocket-Accept.
+ * @param accept Receives the accept value, NUL terminated, needs 29 bytes.
+ * @return 0 if the request is a valid handshake, otherwise the HTTP status to
+ *         refuse it with (400, or 426 for an unsupported version).
+ */
+int websocket_handshake_check(const HttpRequest* request, char* accept);
+
+/**
+ * @brief Starts a WebSocket on an upgraded connection and arms its ping timer.
+ *        `on_open` is not called yet, see `websocket_open`.
+ * @param loop The connection's event loop.
+ * @param out The connection's send queue.
+ * @param notify Called after frames are queued, and once the WebSocket finished.
+ * @param tag A memory allocation tag that outlives the connection.
+ * @return The WebSocket, or NULL on failure.
+ */
+WebSocket* websocket_new(EventLoop* loop, SendQueue* out, const WebSocketHandler* handler,
+                         WebSocketNotifyFn notify, void* notify_data, void* tag);
+
+/**
+ * @brief Runs the handler's `on_open`, once the 101 response is queued.
+ */
+void websocket_open(WebSocket* ws, HttpRequest* request);
+
+/**
+ * @brief Runs `on_close`, leaves every group and frees the WebSocket.
+ * @param ws The WebSocket to free. If NULL, the function does nothing.
+ */
+void websocket_free(WebSocket* ws);
+
+/**
+ * @brief Processes every complete frame in `data`, which is unmasked in place.
+ * @param used Receives the number of bytes consumed, the rest is an incomplete frame.
+ * @return `false` once the WebSocket finished, the connection closes after flushing.
+ */
+bool websocket_input(WebSocket* ws, uint8_t* data, size_t len, size_t* used);
+
+/**
+ * @brief Sends a whole message as one frame.
+ * @param opcode WS_TEXT, WS_BINARY, WS_PING or WS_PONG.
+ * @return `false` if the WebSocket is closing or the client is too far behind, in
+ *         which case it is closed with WS_CLOSE_POLICY.
+ */
+bool websocket_send(WebSocket* ws, WebSocketOpcode opcode, const void* data, size_t len);
+
+/**
+ * @brief Sends part of a message. The first call picks the opcode, later ones send
+ *        continuation frames until `fin` is set.
+ */
+bool websocket_send_fragment(WebSocket* ws, WebSocketOpcode opcode, const void* data, size_t len, bool fin);
+
+/**
+ * @brief Starts the closing handshake. The connection closes once the client
+ *        answers or WEBSOCKET_CLOSE_TIMEOUT_MS passes.
+ * @param reason Optional text, truncated to fit a control frame.
+ */
+void websocket_close(WebSocket* ws, uint16_t code, const char* reason);
+
+/**
+ * @brief Creates an empty broadcast group. It must outlive its members and any
+ *        broadcast still in flight, typically it lives as long as the server.
+ */
+WebSocketGroup* websocket_group_new(void* tag);
+
+/**
+ * @brief Frees the group. Only call it once the server stopped.
+ */
+void websocket_group_free(WebSocketGroup* group);
+
+/**
+ * @brief Adds the WebSocket to the group, it leaves by itself when it closes.
+ *        Call it from the WebSocket's worker thread.
+ */
+bool websocket_group_join(WebSocketGroup* group, WebSocket* ws);
+
+/**
+ * @brief Removes the WebSocket from the group.
+ */
+void websocket_group_leave(WebSocketGroup* group, WebSocket* ws);
+
+/**
+ * @brief Sends one message to every member. The frame is serialized once and the
+ *        same buffer is queued on every connection, members on other workers get it
+ *        through their event loop. Safe from any thread.
+ * @return `false` on allocation failure.
+ */
+bool websocket_group_broadcast(WebSocketGroup* group, WebSocketOpcode opcode, const void* data, size_t len);
+
+#endif // HTTP_WEBSOCKET_H
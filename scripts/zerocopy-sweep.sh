@@ -0,0 +1,34 @@
+#!/bin/bash
+# Sweeps response sizes against two servers, one with MSG_ZEROCOPY off (-z 0) and one
+# with it on for every response (-z 1), to find where zerocopy starts to pay off.
+# Run it from another machine, over loopback the kernel copies anyway.
+#
+#   server host: ./server -p 8080 -z 0 & ./server -p 8081 -z 1 &
+#   client host: ./scripts/zerocopy-sweep.sh <server-host> 8080 8081
+set -e
+
+host=${1:-127.0.0.1}
+port_off=${2:-8080}
+port_on=${3:-8081}
+duration=${DURATION:-10}
+connections=${CONNECTIONS:-16}
+sizes=${SIZES:-"4096 16384 65536 131072 262144 1048576 4194304"}
+bench=${BENCH:-./build/chttp-bench}
+
+json=$(mktemp)
+trap 'rm -f "$json"' EXIT
+
+# prints "<req/s> <MB/s> <p99 ms>" for one run
+run() {
+    "$bench" -a "$host:$1" -u "/bytes/$2" -c "$connections" -d "$duration" -j "$json" > /dev/null
+    local rps p99
+    rps=$(grep -o '"requests_per_s":[0-9.]*' "$json" | cut -d: -f2)
+    p99=$(grep -o '"p99":[0-9.]*' "$json" | cut -d: -f2)
+    awk -v rps="$rps" -v size="$2" -v p99="$p99" \
+        'BEGIN { printf "%10.0f %9.1f %8.2f", rps, rps * size / 1048576, p99 / 1000 }'
+}
+
+printf "%10s | %10s %9s %8s | %10s %9s %8s\n" "bytes" "off req/s" "MB/s" "p99 ms" "on req/s" "MB/s" "p99 ms"
+for size in $sizes; do
+    printf "%10s | %s | %s\n" "$size" "$(run "$port_off" "$size")" "$(run "$port_on" "$size")"
+done
@@ -0,0 +1,157 @@
+#include <stdio.h>
+#include <string.h>
+#include "admission.h"
+#include "alloc.h"
+#include "utils.h"
+
+bool admission_init(Admission* admission, size_t max_total, size_t max_per_host, void* tag) {
+    if (!admission) return false;
+
+    memset(admission, 0, sizeof(Admission));
+    admission->max_total = max_total;
+    admission->max_per_host = max_per_host;
+    admission->tag = tag;
+    atomic_init(&admission->open, 0);
+    atomic_init(&admission->refused_total, 0);
+    atomic_init(&admission->refused_host, 0);
+
+    for (size_t i = 0; i < ADMISSION_SHARDS; i++) {
+        AdmissionShard* shard = &admission->shards[i];
+        pthread_mutex_init(&shard->lock, NULL);
+        if (max_per_host == 0) continue;
+
+        shard->capacity = ADMISSION_SHARD_INITIAL;
+        shard->entries = pcalloc(shard->capacity, sizeof(AdmissionEntry), tag);
+        if (!shard->entries) {
+            admission_free(admission);
+            return false;
+        }
+    }
+    return true;
+}
+
+void admission_free(Admission* admission) {
+    if (!admission) return;
+
+    for (size_t i = 0; i < ADMISSION_SHARDS; i++) {
+        AdmissionShard* shard = &admission->shards[i];
+        pthread_mutex_destroy(&shard->lock);
+        if (shard->entries) pfree(shard->entries);
+        shard->entries = NULL;
+        shard->capacity = 0;
+        shard->count = 0;
+    }
+}
+
+static size_t admission_slot(const AdmissionShard* shard, uint64_t key) {
+    size_t mask = shard->capacity - 1;
+    size_t i = key & mask;
+    while (shard->entries[i].key != key && shard->entries[i].key != 0) i = (i + 1) & mask;
+    return i;
+}
+
+static bool admission_grow(AdmissionShard* shard, void* tag) {
+    size_t capacity = shard->capacity * 2;
+    AdmissionEntry* entries = pcalloc(capacity, sizeof(AdmissionEntry), tag);
+    if (!entries) return false;
+
+    AdmissionEntry* old = shard->entries;
+    size_t old_capacity = shard->capacity;
+    shard->entries = entries;
+    shard->capacity = capacity;
+    for (size_t i = 0; i < old_capacity; i++) {
+        if (old[i].key != 0) shard->entries[admission_slot(shard, old[i].key)] = old[i];
+    }
+    pfree(old);
+    return true;
+}
+
+// empties slot `i` and shifts later entries of its probe run back, so lookups
+// never need tombstones
+static void admission_remove(AdmissionShard* shard, size_t i) {
+    size_t mask = shard->capacity - 1;
+    size_t hole = i;
+    for (size_t j = (i + 1) & mask; shard->entries[j].key != 0; j = (j + 1) & mask) {
+        size_t home = shard->entries[j].key & mask;
+        // the entry may move into the hole unless its home lies between the hole and it
+        bool stays = hole <= j ? (hole < home && home <= j) : (hole < home || home <= j);
+        if (stays) continue;
+        shard->entries[hole] = shard->entries[j];
+        hole = j;
+    }
+    shard->entries[hole].key = 0;
+    shard->entries[hole].count = 0;
+    shard->count--;
+}
+
+bool admission_acquire(Admission* admission, const struct sockaddr_storage* peer) {
+    size_t open = atomic_fetch_add_explicit(&admission->open, 1, memory_order_relaxed);
+    if (admission->max_total > 0 && open >= admission->max_total) {
+        atomic_fetch_sub_explicit(&admission->open, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&admission->refused_total, 1, memory_order_relaxed);
+        return false;
+    }
+    if (admission->max_per_host == 0) return true;
+
+    uint64_t key = hash_peer(peer);
+    AdmissionShard* shard = &admission->shards[(key >> 32) % ADMISSION_SHARDS];
+    bool admitted = true;
+
+    pthread_mutex_lock(&shard->lock);
+    size_t i = admission_slot(shard, key);
+    if (shard->entries[i].key == 0 && (shard->count + 1) * 4 > shard->capacity * 3) {
+        if (admission_grow(shard, admission->tag)) {
+            i = admission_slot(shard, key);
+        } else {
+            admitted = false;
+        }
+    }
+    if (admitted && shard->entries[i].count >= admission->max_per_host) {
+        admitted = false;
+        atomic_fetch_add_explicit(&admission->refused_host, 1, memory_order_relaxed);
+    }
+    if (admitted) {
+        if (shard->entries[i].key == 0) {
+            shard->entries[i].key = key;
+            shard->count++;
+        }
+        shard->entries[i].count++;
+    }
+    pthread_mutex_unlock(&shard->lock);
+
+    if (!admitted) atomic_fetch_sub_explicit(&admission->open, 1, memory_order_relaxed);
+    return admitted;
+}
+
+void admission_release(Admission* admission, const struct sockaddr_storage* peer) {
+    atomic_fetch_sub_explicit(&admission->open, 1, memory_order_relaxed);
+    if (admission->max_per_host == 0) return;
+
+    uint64_t key = hash_peer(peer);
+    AdmissionShard* shard = &admission->shards[(key >> 32) % ADMISSION_SHARDS];
+
+    pthread_mutex_lock(&shard->lock);
+    size_t i = admission_slot(shard, key);
+    // hosts with no connections left are dropped, the table only holds connected ones
+    if (shard->entries[i].key == key && --shard->entries[i].count == 0) {
+        admission_remove(shard, i);
+    }
+    pthread_mutex_unlock(&shard->lock);
+}
+
+void admission_print_stats(Admission* admission) {
+    size_t hosts = 0;
+    for (size_t i = 0; i < ADMISSION_SHARDS; i++) {
+        pthread_mutex_lock(&admission->shards[i].lock);
+        hosts += admission->shards[i].count;
+        pthread_mutex_unlock(&admission->shards[i].lock);
+    }
+
+    printf("\n=== Admission Stats ===\n");
+    printf("Open connections: %zu from %zu host(s)\n", atomic_load(&admission->open), hosts);
+    printf("Refused at the global cap (%zu): %llu\n", admission->max_total,
+           (unsigned long long)atomic_load(&admission->refused_total));
+    printf("Refused at the per-host cap (%zu): %llu\n", admission->max_per_host,
+           (unsigned long long)atomic_load(&admission->refused_host));
+    printf("=== End Admission Stats ===\n\n");
+}
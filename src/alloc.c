@@ -1,9 +1,13 @@
 #include "alloc.h"
+#include "probes.h"
 #include <assert.h>
+#include <execinfo.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <unistd.h>
 
 // Hash tables
 static alloc_info** g_alloc_table = NULL;
@@ -16,6 +20,64 @@ static size_t g_tag_count = 0;
 
 static int g_allocator_initialized = 0;
 
+// Running totals since start, kept across pallocator_cleanup
+static palloc_stats g_stats;
+
+// Live blocks and bytes by size class, kept as allocations come and go so reading them
+// never walks the tables
+static size_t g_live_bytes = 0;
+static size_t g_class_count[PALLOC_SIZE_CLASSES];
+static size_t g_class_bytes[PALLOC_SIZE_CLASSES];
+// the part of them held by connection tags
+static size_t g_connection_count = 0;
+static size_t g_connection_bytes = 0;
+
+// System allocator calls made by this thread, bookkeeping included
+static _Thread_local palloc_probe t_probe;
+static _Thread_local int t_probe_active = 0;
+
+static inline void count_system_call(void) {
+    t_probe.system_calls++;
+}
+
+// remembers where the first allocation of a probed span came from
+static inline void probe_allocation(size_t size) {
+    t_probe.bytes += size;
+    if (t_probe_active && t_probe.depth == 0) {
+        t_probe.depth = (size_t)backtrace(t_probe.sites, PALLOC_PROBE_DEPTH);
+    }
+}
+
+static size_t size_class(size_t size) {
+    size_t class = size <= 1 ? 0 : (size_t)(64 - __builtin_clzll((unsigned long long)(size - 1)));
+    return class < PALLOC_SIZE_CLASSES ? class : PALLOC_SIZE_CLASSES - 1;
+}
+
+static inline void count_live(size_t size, void* tag) {
+    size_t class = size_class(size);
+    g_class_count[class]++;
+    g_class_bytes[class] += size;
+    g_live_bytes += size;
+    if (IS_CONNECTION_TAG(tag)) {
+        g_connection_count++;
+        g_connection_bytes += size;
+    }
+}
+
+static inline void uncount_live(size_t size, void* tag) {
+    size_t class = size_class(size);
+    g_class_count[class]--;
+    g_class_bytes[class] -= size;
+    g_live_bytes -= size;
+    if (IS_CONNECTION_TAG(tag)) {
+        g_connection_count--;
+        g_connection_bytes -= size;
+    }
+}
+
+// Serializes every public entry point, workers allocate concurrently
+static pthread_mutex_t g_alloc_lock = PTHREAD_MUTEX_INITIALIZER;
+
 // Simple hash function for pointers
 static size_t hash_pointer(const void* ptr, size_t table_size) {
     return ((uintptr_t)ptr >> 3) % table_size;
@@ -71,13 +133,14 @@ static tag_entry* find_tag_entry(void* tag) {
 }
 
 // Add pointer to tag entry
-static void add_ptr_to_tag(tag_entry* entry, void* ptr) {
+static void add_ptr_to_tag(tag_entry* entry, void* ptr, size_t size) {
     // Ensure capacity
     if (entry->count >= entry->capacity) {
         size_t new_capacity = entry->capacity * 2;
         if (new_capacity == 0) new_capacity = PTR_LIST_INITIAL_SIZE;
 
         void** new_ptrs = realloc(entry->ptrs, new_capacity * sizeof(void*));
+        count_system_call();
         if (!new_ptrs) return; // Memory allocation failed
 
         entry->ptrs = new_ptrs;
@@ -86,12 +149,14 @@ static void add_ptr_to_tag(tag_entry* entry, void* ptr) {
 
     // Add the pointer
     entry->ptrs[entry->count++] = ptr;
+    entry->bytes += size;
 }
 
 // Remove pointer from tag entry
-static void remove_ptr_from_tag(tag_entry* entry, void* ptr) {
+static void remove_ptr_from_tag(tag_entry* entry, void* ptr, size_t size) {
     for (size_t i = 0; i < entry->count; i++) {
         if (entry->ptrs[i] == ptr) {
+            entry->bytes -= size;
             // Move the last element to this position (if not already the last)
             if (i < entry->count - 1) {
                 entry->ptrs[i] = entry->ptrs[entry->count - 1];
@@ -105,12 +170,15 @@ static void remove_ptr_from_tag(tag_entry* entry, void* ptr) {
 // Create new tag entry
 static tag_entry* create_tag_entry(void* tag) {
     tag_entry* entry = malloc(sizeof(tag_entry));
+    count_system_call();
     if (!entry) return NULL;
 
     entry->tag = tag;
     entry->count = 0;
+    entry->bytes = 0;
     entry->capacity = PTR_LIST_INITIAL_SIZE;
     entry->ptrs = malloc(entry->capacity * sizeof(void*));
+    count_system_call();
     entry->next = NULL;
 
     if (!entry->ptrs) {
@@ -130,6 +198,7 @@ static tag_entry* create_tag_entry(void* tag) {
 // Register allocation in our tables
 static void register_allocation(void* ptr, size_t size, void* tag) {
     alloc_info* info = malloc(sizeof(alloc_info));
+    count_system_call();
     if (!info) return;
 
     info->ptr = ptr;
@@ -141,6 +210,9 @@ static void register_allocation(void* ptr, size_t size, void* tag) {
     info->next = g_alloc_table[index];
     g_alloc_table[index] = info;
     g_alloc_count++;
+    g_stats.allocations++;
+    g_stats.bytes += size;
+    count_live(size, tag);
 
     // Find or create tag entry and add pointer
     tag_entry* tag_e = find_tag_entry(tag);
@@ -149,7 +221,7 @@ static void register_allocation(void* ptr, size_t size, void* tag) {
     }
 
     if (tag_e) {
-        add_ptr_to_tag(tag_e, ptr);
+        add_ptr_to_tag(tag_e, ptr, size);
     }
 }
 
@@ -172,11 +244,13 @@ static alloc_info* unregister_allocation(void* ptr) {
             }
 
             g_alloc_count--;
+            g_stats.frees++;
+            uncount_live(info->size, info->tag);
 
             // Remove from tag entry
             tag_entry* tag_e = find_tag_entry(info->tag);
             if (tag_e) {
-                remove_ptr_from_tag(tag_e, ptr);
+                remove_ptr_from_tag(tag_e, ptr, info->size);
 
                 // If tag entry is now empty, we could remove it
                 if (tag_e->count == 0) {
@@ -197,32 +271,45 @@ static alloc_info* unregister_allocation(void* ptr) {
 // Public API implementations
 
 void* pmalloc(size_t size, void* tag) {
-    allocator_init_once();
+    probe_allocation(size);
     void* ptr = malloc(size);
+    count_system_call();
     if (!ptr) return NULL;
 
     // zero-initialize memory
     memset(ptr, 0, size);
 
+    pthread_mutex_lock(&g_alloc_lock);
+    allocator_init_once();
     register_allocation(ptr, size, tag);
+    pthread_mutex_unlock(&g_alloc_lock);
+    CHTTP_PROBE3(alloc, ptr, size, tag);
     return ptr;
 }
 
 void* pcalloc(size_t n, size_t size, void* tag) {
-    allocator_init_once();
+    probe_allocation(n * size);
     void* ptr = calloc(n, size);
+    count_system_call();
     if (!ptr) return NULL;
 
+    pthread_mutex_lock(&g_alloc_lock);
+    allocator_init_once();
     register_allocation(ptr, n * size, tag);
+    pthread_mutex_unlock(&g_alloc_lock);
+    CHTTP_PROBE3(alloc, ptr, n * size, tag);
     return ptr;
 }
 
 void* prealloc(void* ptr, size_t size, void* tag) {
-    allocator_init_once();
     if (!ptr) return pmalloc(size, tag);
 
+    probe_allocation(size);
+    pthread_mutex_lock(&g_alloc_lock);
+    allocator_init_once();
     alloc_info* info = find_alloc_info(ptr);
     if (!info) {
+        pthread_mutex_unlock(&g_alloc_lock);
         assert(0 && "prealloc: pointer not found");
         return NULL;
     }
@@ -234,7 +321,11 @@ void* prealloc(void* ptr, size_t size, void* tag) {
 
     // Perform reallocation
     void* new_ptr = realloc(ptr, size);
-    if (!new_ptr) return NULL;
+    count_system_call();
+    if (!new_ptr) {
+        pthread_mutex_unlock(&g_alloc_lock);
+        return NULL;
+    }
 
     if (new_ptr != original_ptr) {
         // Handle pointer change - original ptr is now invalid
@@ -252,6 +343,8 @@ void* prealloc(void* ptr, size_t size, void* tag) {
                     g_alloc_table[old_hash_index] = curr->next;
                 }
                 g_alloc_count--;
+                g_stats.frees++;
+                uncount_live(info->size, old_tag);
                 break;
             }
             prev = curr;
@@ -269,6 +362,7 @@ void* prealloc(void* ptr, size_t size, void* tag) {
                         old_tag_e->ptrs[i] = old_tag_e->ptrs[old_tag_e->count - 1];
                     }
                     old_tag_e->count--;
+                    old_tag_e->bytes -= info->size;
                     break;
                 }
             }
@@ -289,7 +383,7 @@ void* prealloc(void* ptr, size_t size, void* tag) {
 
             if (old_tag_e) {
                 // We can use remove_ptr_from_tag here as the pointer is still valid
-                remove_ptr_from_tag(old_tag_e, new_ptr);
+                remove_ptr_from_tag(old_tag_e, new_ptr, info->size);
             }
 
             if (!new_tag_e) {
@@ -297,22 +391,34 @@ void* prealloc(void* ptr, size_t size, void* tag) {
             }
 
             if (new_tag_e) {
-                add_ptr_to_tag(new_tag_e, new_ptr);
+                add_ptr_to_tag(new_tag_e, new_ptr, size);
             }
+        } else {
+            tag_entry* tag_e = find_tag_entry(tag);
+            if (tag_e) tag_e->bytes = tag_e->bytes - info->size + size;
         }
 
+        // counted like a moved block, one allocation replacing another
+        g_stats.allocations++;
+        g_stats.bytes += size;
+        g_stats.frees++;
+        uncount_live(info->size, old_tag);
+        count_live(size, tag);
         info->size = size;
         info->tag = tag;
     }
 
+    pthread_mutex_unlock(&g_alloc_lock);
     return new_ptr;
 }
 
 void pfree(void* ptr) {
     if (!ptr) return;
 
+    pthread_mutex_lock(&g_alloc_lock);
     allocator_init_once();
     alloc_info* info = unregister_allocation(ptr);
+    pthread_mutex_unlock(&g_alloc_lock);
 
     if (!info) {
         assert(0 && "pfree: unknown pointer");
@@ -324,17 +430,23 @@ void pfree(void* ptr) {
 }
 
 void pfree_tag(void* tag) {
+    pthread_mutex_lock(&g_alloc_lock);
     allocator_init_once();
 
     tag_entry* tag_e = find_tag_entry(tag);
     if (!tag_e || tag_e->count == 0) {
+        pthread_mutex_unlock(&g_alloc_lock);
         return; // Nothing to free
     }
 
     // Copy pointers to a temp array to avoid problems while freeing
     size_t count = tag_e->count;
     void** ptrs = malloc(count * sizeof(void*));
-    if (!ptrs) return;
+    count_system_call();
+    if (!ptrs) {
+        pthread_mutex_unlock(&g_alloc_lock);
+        return;
+    }
 
     memcpy(ptrs, tag_e->ptrs, count * sizeof(void*));
 
@@ -349,11 +461,50 @@ void pfree_tag(void* tag) {
         }
     }
 
+    pthread_mutex_unlock(&g_alloc_lock);
     free(ptrs);
+    CHTTP_PROBE2(free__tag, tag, count);
+}
+
+void palloc_visit_tags(palloc_tag_fn fn, void* ctx) {
+    pthread_mutex_lock(&g_alloc_lock);
+    for (size_t i = 0; g_tag_table && i < g_tag_table_size; i++) {
+        for (tag_entry* entry = g_tag_table[i]; entry; entry = entry->next) {
+            if (entry->count > 0) fn(entry->tag, entry->count, entry->bytes, ctx);
+        }
+    }
+    pthread_mutex_unlock(&g_alloc_lock);
+}
+
+void palloc_release_tag(void* tag) {
+    pthread_mutex_lock(&g_alloc_lock);
+    if (!g_tag_table) {
+        pthread_mutex_unlock(&g_alloc_lock);
+        return;
+    }
+
+    size_t index = hash_pointer(tag, g_tag_table_size);
+    tag_entry* prev = NULL;
+    for (tag_entry* entry = g_tag_table[index]; entry; prev = entry, entry = entry->next) {
+        if (entry->tag != tag) continue;
+        if (entry->count == 0) {
+            if (prev) prev->next = entry->next;
+            else g_tag_table[index] = entry->next;
+            g_tag_count--;
+            free(entry->ptrs);
+            free(entry);
+        }
+        break;
+    }
+    pthread_mutex_unlock(&g_alloc_lock);
 }
 
 void pallocator_cleanup(void) {
-    if (!g_allocator_initialized) return;
+    pthread_mutex_lock(&g_alloc_lock);
+    if (!g_allocator_initialized) {
+        pthread_mutex_unlock(&g_alloc_lock);
+        return;
+    }
 
     // Free all allocated memory
     for (size_t i = 0; i < g_alloc_table_size; i++) {
@@ -388,12 +539,54 @@ void pallocator_cleanup(void) {
     g_tag_table_size = 0;
     g_alloc_count = 0;
     g_tag_count = 0;
+    g_live_bytes = 0;
+    g_connection_count = 0;
+    g_connection_bytes = 0;
+    memset(g_class_count, 0, sizeof(g_class_count));
+    memset(g_class_bytes, 0, sizeof(g_class_bytes));
     g_allocator_initialized = 0;
+    pthread_mutex_unlock(&g_alloc_lock);
+}
+
+void palloc_get_stats(palloc_stats* stats) {
+    pthread_mutex_lock(&g_alloc_lock);
+    *stats = g_stats;
+    pthread_mutex_unlock(&g_alloc_lock);
+}
+
+void palloc_get_summary(palloc_summary* summary) {
+    pthread_mutex_lock(&g_alloc_lock);
+    summary->allocations = g_alloc_count;
+    summary->bytes = g_live_bytes;
+    summary->tags = g_tag_count;
+    memcpy(summary->class_count, g_class_count, sizeof(g_class_count));
+    memcpy(summary->class_bytes, g_class_bytes, sizeof(g_class_bytes));
+    summary->connection_allocations = g_connection_count;
+    summary->connection_bytes = g_connection_bytes;
+    pthread_mutex_unlock(&g_alloc_lock);
+}
+
+void palloc_probe_begin(void) {
+    memset(&t_probe, 0, sizeof(t_probe));
+    t_probe_active = 1;
+}
+
+void palloc_probe_end(palloc_probe* probe) {
+    t_probe_active = 0;
+    *probe = t_probe;
+}
+
+void palloc_probe_print(const palloc_probe* probe) {
+    fflush(stdout);
+    // resolve with addr2line, function names need -rdynamic
+    backtrace_symbols_fd((void* const*)probe->sites, (int)probe->depth, STDOUT_FILENO);
 }
 
 // Pretty print the current state of memory allocations
 void palloc_print_state(void) {
+    pthread_mutex_lock(&g_alloc_lock);
     if (!g_allocator_initialized) {
+        pthread_mutex_unlock(&g_alloc_lock);
         printf("Memory allocator not initialized.\n");
         return;
     }
@@ -483,6 +676,7 @@ void palloc_print_state(void) {
     }
 
     printf("\n=== End Memory Allocator State ===\n\n");
+    pthread_mutex_unlock(&g_alloc_lock);
 }
 
 // Inspect a specific memory location with detailed hex and ASCII display
@@ -584,9 +778,13 @@ void pinspect(void* ptr) {
 size_t ptag_size(void* tag) {
     if (!tag) return 0;
 
+    pthread_mutex_lock(&g_alloc_lock);
     allocator_init_once();
     tag_entry* entry = find_tag_entry(tag);
-    if (!entry) return 0;
+    if (!entry) {
+        pthread_mutex_unlock(&g_alloc_lock);
+        return 0;
+    }
 
     size_t total_size = 0;
     for (size_t i = 0; i < entry->count; i++) {
@@ -596,5 +794,6 @@ size_t ptag_size(void* tag) {
         }
     }
 
+    pthread_mutex_unlock(&g_alloc_lock);
     return total_size;
 }
@@ -0,0 +1,946 @@
+#define _GNU_SOURCE
+#define CLI_IMPLEMENTATION
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include "alloc.h"
+#include "capture.h"
+#include "cli.h"
+#include "histogram.h"
+#include "perfcheck.h"
+
+// chttp-bench: drives a server over loopback and reports throughput and latency.
+//
+// Closed loop (the default) sends a request as soon as a connection has room for it.
+// With --rate the load is open loop: every request has a time it was meant to be sent
+// at and latency is measured from then, so a stalled server is charged for the
+// requests it held back (coordinated omission) instead of silently slowing the client.
+//
+// --replay sends the requests of a server capture instead, each at its recorded time
+// scaled by --speed, or as fast as the connections allow with --speed 0. Requests of
+// one captured connection stay on one connection and in order, and latency is again
+// measured from when a request was due.
+
+#define BENCH_MAX_DEPTH 64
+#define BENCH_MAX_REQUESTS 256
+#define BENCH_MAX_REQUEST_LEN 4096
+#define BENCH_IN_CAP 16384
+#define BENCH_OUT_CAP 16384
+#define BENCH_EVENTS 256
+#define BENCH_WARMUP_MS 100     // time to connect before the clock starts
+#define BENCH_DRAIN_MS 2000     // how long in-flight requests may finish after the run
+#define BENCH_RETRY_MS 10       // wait before reconnecting after a failed connect
+
+typedef struct {
+    char* data;
+    size_t len;
+    uint64_t weight_end;        // cumulative weight, picks are a binary search
+} BenchRequest;
+
+typedef enum {
+    PARSE_HEAD,
+    PARSE_BODY,
+    PARSE_CHUNK_SIZE,
+    PARSE_CHUNK_DATA,
+    PARSE_TRAILER,
+    PARSE_UNTIL_CLOSE,
+} ParseState;
+
+typedef struct {
+    int fd;
+    bool connecting;
+    uint64_t retry_at;
+
+    // intended send times of the requests in flight, oldest first
+    uint64_t intended[BENCH_MAX_DEPTH];
+    size_t head;
+    size_t inflight;
+    uint64_t next_send;
+
+    // indices into g_replay of the captured requests this connection sends, in order
+    size_t* replay;
+    size_t replay_count;
+    size_t replay_next;
+
+    char out[BENCH_OUT_CAP];
+    size_t out_len;
+    size_t out_sent;
+
+    char in[BENCH_IN_CAP];
+    size_t in_len;
+    ParseState state;
+    uint64_t remaining;
+    int status;
+    bool close_after;
+} BenchConn;
+
+typedef struct {
+    pthread_t thread;
+    BenchConn* conns;
+    size_t count;
+    int epfd;
+    uint64_t rng;
+
+    Histogram latency;
+    uint64_t completed;
+    uint64_t errors;            // requests that got no response
+    uint64_t connect_errors;
+    uint64_t connects;
+    uint64_t bytes;
+    uint64_t status[6];         // by class, [2] counts 2xx
+} BenchThread;
+
+static BenchRequest g_requests[BENCH_MAX_REQUESTS];
+static size_t g_request_count = 0;
+static uint64_t g_total_weight = 0;
+static struct sockaddr_storage g_address;
+static socklen_t g_address_len;
+static size_t g_depth = 1;
+static bool g_keepalive = true;
+static uint64_t g_interval_ns = 0;  // per connection, 0 for closed loop
+static uint64_t g_start_ns;
+static uint64_t g_end_ns;
+static CaptureRecord* g_replay = NULL;
+static size_t g_replay_count = 0;
+static uint64_t g_speed = 1;        // replay speed-up, 0 for as fast as possible
+
+static uint64_t bench_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static bool bench_resolve(const char* address) {
+    char host[256];
+    const char* colon = strrchr(address, ':');
+    if (!colon || (size_t)(colon - address) >= sizeof(host)) {
+        printf("Invalid address, expected host:port: %s\n", address);
+        return false;
+    }
+    memcpy(host, address, colon - address);
+    host[colon - address] = '\0';
+
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+    struct addrinfo* result = NULL;
+    int rc = getaddrinfo(host, colon + 1, &hints, &result);
+    if (rc != 0) {
+        printf("Failed to resolve %s: %s\n", address, gai_strerror(rc));
+        return false;
+    }
+    memcpy(&g_address, result->ai_addr, result->ai_addrlen);
+    g_address_len = result->ai_addrlen;
+    freeaddrinfo(result);
+    return true;
+}
+
+// reads a capture and deals its requests out to the connections, a captured connection
+// always lands on the same one
+static bool bench_load_capture(const char* file, BenchConn* conns, size_t count, void* tag) {
+    CaptureReader reader;
+    if (!capture_reader_open(&reader, file)) return false;
+
+    size_t capacity = 0;
+    size_t skipped = 0;
+    int rc;
+    CaptureRecord record;
+    while ((rc = capture_reader_next(&reader, &record, tag)) == 1) {
+        if (record.len > BENCH_OUT_CAP) {
+            pfree(record.data);
+            skipped++;
+            continue;
+        }
+        if (g_replay_count == capacity) {
+            capacity = capacity ? capacity * 2 : 1024;
+            CaptureRecord* grown = prealloc(g_replay, capacity * sizeof(CaptureRecord), tag);
+            if (!grown) {
+                pfree(record.data);
+                capture_reader_close(&reader);
+                return false;
+            }
+            g_replay = grown;
+        }
+        g_replay[g_replay_count++] = record;
+    }
+    capture_reader_close(&reader);
+    if (rc < 0) {
+        printf("%s is damaged after %zu request(s)\n", file, g_replay_count);
+        return false;
+    }
+    if (skipped) printf("Skipping %zu request(s) larger than %d bytes\n", skipped, BENCH_OUT_CAP);
+    if (g_replay_count == 0) {
+        printf("%s has no requests\n", file);
+        return false;
+    }
+
+    for (size_t i = 0; i < g_replay_count; i++) conns[g_replay[i].connection % count].replay_count++;
+    for (size_t i = 0; i < count; i++) {
+        if (conns[i].replay_count == 0) continue;
+        conns[i].replay = pmalloc(conns[i].replay_count * sizeof(size_t), tag);
+        if (!conns[i].replay) return false;
+        conns[i].replay_count = 0;
+    }
+    for (size_t i = 0; i < g_replay_count; i++) {
+        BenchConn* conn = &conns[g_replay[i].connection % count];
+        conn->replay[conn->replay_count++] = i;
+    }
+    return true;
+}
+
+static bool bench_add_request(const char* method, const char* path, uint64_t weight, const char* host, void* tag) {
+    if (g_request_count == BENCH_MAX_REQUESTS) {
+        printf("Too many requests in the mix, at most %d\n", BENCH_MAX_REQUESTS);
+        return false;
+    }
+    char text[BENCH_MAX_REQUEST_LEN];
+    int len = snprintf(text, sizeof(text), "%s %s HTTP/1.1\r\nHost: %s\r\n%s\r\n", method, path, host,
+                       g_keepalive ? "" : "Connection: close\r\n");
+    if (len < 0 || (size_t)len >= sizeof(text)) {
+        printf("Request too long: %s %s\n", method, path);
+        return false;
+    }
+
+    BenchRequest* request = &g_requests[g_request_count];
+    request->data = pmalloc((size_t)len + 1, tag);
+    if (!request->data) return false;
+    memcpy(request->data, text, (size_t)len + 1);
+    request->len = (size_t)len;
+    g_total_weight += weight;
+    request->weight_end = g_total_weight;
+    g_request_count++;
+    return true;
+}
+
+// one request per line: METHOD PATH [WEIGHT], blank lines and #comments are skipped
+static bool bench_load_requests(const char* file, const char* host, void* tag) {
+    FILE* fp = fopen(file, "r");
+    if (!fp) {
+        printf("Failed to open %s: %s\n", file, strerror(errno));
+        return false;
+    }
+
+    char line[BENCH_MAX_REQUEST_LEN];
+    size_t number = 0;
+    bool ok = true;
+    while (ok && fgets(line, sizeof(line), fp)) {
+        number++;
+        char method[32], path[BENCH_MAX_REQUEST_LEN];
+        unsigned long weight = 1;
+        char* start = line + strspn(line, " \t");
+        if (*start == '#' || *start == '\n' || *start == '\r' || *start == '\0') continue;
+
+        int fields = sscanf(start, "%31s %4095s %lu", method, path, &weight);
+        if (fields < 2 || weight == 0) {
+            printf("%s:%zu: expected METHOD PATH [WEIGHT]\n", file, number);
+            ok = false;
+            break;
+        }
+        ok = bench_add_request(method, path, weight, host, tag);
+    }
+    fclose(fp);
+
+    if (ok && g_request_count == 0) {
+        printf("%s has no requests\n", file);
+        ok = false;
+    }
+    return ok;
+}
+
+static const BenchRequest* bench_pick(BenchThread* thread) {
+    if (g_request_count == 1) return &g_requests[0];
+
+    // xorshift64, the mix only needs to be roughly right
+    thread->rng ^= thread->rng << 13;
+    thread->rng ^= thread->rng >> 7;
+    thread->rng ^= thread->rng << 17;
+    uint64_t pick = thread->rng % g_total_weight;
+
+    size_t lo = 0, hi = g_request_count - 1;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (g_requests[mid].weight_end > pick) hi = mid;
+        else lo = mid + 1;
+    }
+    return &g_requests[lo];
+}
+
+static void bench_connect(BenchThread* thread, BenchConn* conn, uint64_t now) {
+    conn->fd = socket(g_address.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (conn->fd < 0) {
+        thread->connect_errors++;
+        conn->retry_at = now + BENCH_RETRY_MS * 1000000u;
+        return;
+    }
+    int one = 1;
+    setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    if (connect(conn->fd, (struct sockaddr*)&g_address, g_address_len) < 0 && errno != EINPROGRESS) {
+        close(conn->fd);
+        conn->fd = -1;
+        thread->connect_errors++;
+        conn->retry_at = now + BENCH_RETRY_MS * 1000000u;
+        return;
+    }
+    conn->connecting = true;
+    struct epoll_event event = { .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, .data.ptr = conn };
+    epoll_ctl(thread->epfd, EPOLL_CTL_ADD, conn->fd, &event);
+    thread->connects++;
+}
+
+// drops the connection, anything still in flight on it failed
+static void bench_disconnect(BenchThread* thread, BenchConn* conn, uint64_t now, bool failed) {
+    if (conn->fd >= 0) {
+        epoll_ctl(thread->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+        close(conn->fd);
+    }
+    thread->errors += conn->inflight;
+    conn->fd = -1;
+    conn->connecting = false;
+    conn->head = 0;
+    conn->inflight = 0;
+    conn->out_len = conn->out_sent = 0;
+    conn->in_len = 0;
+    conn->state = PARSE_HEAD;
+    conn->close_after = false;
+    conn->retry_at = failed ? now + BENCH_RETRY_MS * 1000000u : now;
+}
+
+static bool bench_flush(BenchConn* conn) {
+    while (!conn->connecting && conn->out_sent < conn->out_len) {
+        ssize_t n = send(conn->fd, conn->out + conn->out_sent, conn->out_len - conn->out_sent, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return true;
+            if (errno == EINTR) continue;
+            return false;
+        }
+        conn->out_sent += (size_t)n;
+    }
+    if (conn->out_sent == conn->out_len) conn->out_len = conn->out_sent = 0;
+    return true;
+}
+
+// queues as many requests as the schedule and the pipeline depth allow
+static bool bench_fill(BenchThread* thread, BenchConn* conn, uint64_t now) {
+    if (now < g_start_ns || now >= g_end_ns) return true;
+    if (conn->fd < 0) {
+        if (now < conn->retry_at) return true;
+        bench_connect(thread, conn, now);
+        if (conn->fd < 0) return true;
+    }
+    if (conn->fd < 0 && g_replay_count && conn->replay_next == conn->replay_count) return true;
+    // without keep-alive a connection carries exactly one request
+    if (!g_keepalive && conn->close_after) return true;
+
+    while (conn->inflight < g_depth) {
+        uint64_t intended = now;
+        const char* data;
+        size_t len;
+        if (g_replay_count) {
+            if (conn->replay_next == conn->replay_count) break;
+            const CaptureRecord* record = &g_replay[conn->replay[conn->replay_next]];
+            if (g_speed) {
+                intended = g_start_ns + record->offset_ns / g_speed;
+                if (intended > now) break;
+            }
+            data = record->data;
+            len = record->len;
+        } else {
+            if (g_interval_ns) {
+                if (conn->next_send > now) break;
+                intended = conn->next_send;
+            }
+            const BenchRequest* request = bench_pick(thread);
+            data = request->data;
+            len = request->len;
+        }
+        if (conn->out_len + len > BENCH_OUT_CAP) break;
+
+        memcpy(conn->out + conn->out_len, data, len);
+        conn->out_len += len;
+        conn->intended[(conn->head + conn->inflight) % BENCH_MAX_DEPTH] = intended;
+        conn->inflight++;
+        if (g_replay_count) conn->replay_next++;
+        if (g_interval_ns) conn->next_send += g_interval_ns;
+        if (!g_keepalive) {
+            conn->close_after = true;
+            break;
+        }
+    }
+    return bench_flush(conn);
+}
+
+static void bench_complete(BenchThread* thread, BenchConn* conn, uint64_t now) {
+    if (conn->inflight == 0) {
+        // a response nobody asked for
+        thread->errors++;
+        return;
+    }
+    uint64_t intended = conn->intended[conn->head];
+    conn->head = (conn->head + 1) % BENCH_MAX_DEPTH;
+    conn->inflight--;
+
+    histogram_record(&thread->latency, now > intended ? now - intended : 0);
+    thread->completed++;
+    int class = conn->status / 100;
+    thread->status[class >= 1 && class <= 5 ? class : 0]++;
+    conn->state = PARSE_HEAD;
+}
+
+static bool bench_header_is(const char* line, size_t len, const char* name, size_t name_len) {
+    return len > name_len && line[name_len] == ':' && strncasecmp(line, name, name_len) == 0;
+}
+
+// starts a response from its head, [head, end) excludes the blank line
+static bool bench_parse_head(BenchConn* conn, const char* head, const char* end) {
+    if (end - head < 12 || strncmp(head, "HTTP/1.", 7) != 0) return false;
+    conn->status = atoi(head + 9);
+
+    bool chunked = false;
+    bool has_length = false;
+    uint64_t length = 0;
+    const char* line = memchr(head, '\n', end - head);
+    while (line && ++line < end) {
+        const char* eol = memchr(line, '\r', end - line);
+        if (!eol) eol = end;
+        size_t len = eol - line;
+        if (bench_header_is(line, len, "content-length", 14)) {
+            has_length = true;
+            length = strtoull(line + 15, NULL, 10);
+        } else if (bench_header_is(line, len, "transfer-encoding", 17)) {
+            chunked = memmem(line, len, "chunked", 7) != NULL;
+        } else if (bench_header_is(line, len, "connection", 10)) {
+            if (memmem(line, len, "close", 5)) conn->close_after = true;
+        }
+        line = memchr(line, '\n', end - line);
+    }
+
+    if (conn->status >= 100 && conn->status < 200) {
+        conn->state = PARSE_HEAD;
+    } else if (chunked) {
+        conn->state = PARSE_CHUNK_SIZE;
+    } else if (has_length || conn->status == 204 || conn->status == 304) {
+        conn->state = PARSE_BODY;
+        conn->remaining = length;
+    } else {
+        conn->state = PARSE_UNTIL_CLOSE;
+    }
+    return true;
+}
+
+// consumes whatever complete pieces of responses are buffered
+static bool bench_parse(BenchThread* thread, BenchConn* conn, uint64_t now) {
+    size_t pos = 0;
+    bool more = true;
+    while (more) {
+        char* data = conn->in + pos;
+        size_t avail = conn->in_len - pos;
+        switch (conn->state) {
+            case PARSE_HEAD: {
+                char* end = memmem(data, avail, "\r\n\r\n", 4);
+                if (!end) {
+                    more = false;
+                    break;
+                }
+                if (!bench_parse_head(conn, data, end)) return false;
+                pos += end - data + 4;
+                if (conn->state == PARSE_BODY && conn->remaining == 0) bench_complete(thread, conn, now);
+                break;
+            }
+            case PARSE_BODY:
+            case PARSE_CHUNK_DATA: {
+                if (avail == 0) {
+                    more = false;
+                    break;
+                }
+                size_t take = avail < conn->remaining ? avail : (size_t)conn->remaining;
+                pos += take;
+                conn->remaining -= take;
+                if (conn->remaining > 0) break;
+                if (conn->state == PARSE_BODY) bench_complete(thread, conn, now);
+                else conn->state = PARSE_CHUNK_SIZE;
+                break;
+            }
+            case PARSE_CHUNK_SIZE: {
+                char* eol = memmem(data, avail, "\r\n", 2);
+                if (!eol) {
+                    more = false;
+                    break;
+                }
+                uint64_t size = strtoull(data, NULL, 16);
+                pos += eol - data + 2;
+                conn->state = size == 0 ? PARSE_TRAILER : PARSE_CHUNK_DATA;
+                conn->remaining = size + 2;
+                break;
+            }
+            case PARSE_TRAILER: {
+                char* eol = memmem(data, avail, "\r\n", 2);
+                if (!eol) {
+                    more = false;
+                    break;
+                }
+                pos += eol - data + 2;
+                if (eol == data) bench_complete(thread, conn, now);
+                break;
+            }
+            case PARSE_UNTIL_CLOSE:
+                pos = conn->in_len;
+                more = false;
+                break;
+        }
+    }
+
+    memmove(conn->in, conn->in + pos, conn->in_len - pos);
+    conn->in_len -= pos;
+    // a head that does not fit the buffer is not something this tool can measure
+    return conn->in_len < BENCH_IN_CAP;
+}
+
+static void bench_read(BenchThread* thread, BenchConn* conn) {
+    for (;;) {
+        ssize_t n = recv(conn->fd, conn->in + conn->in_len, BENCH_IN_CAP - conn->in_len, 0);
+        uint64_t now = bench_now_ns();
+        if (n > 0) {
+            thread->bytes += (uint64_t)n;
+            conn->in_len += (size_t)n;
+            if (!bench_parse(thread, conn, now)) {
+                bench_disconnect(thread, conn, now, true);
+                return;
+            }
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        if (n < 0 && errno == EINTR) continue;
+
+        // closed: the end of an unframed response, or the server hung up on us
+        if (n == 0 && conn->state == PARSE_UNTIL_CLOSE) bench_complete(thread, conn, now);
+        bench_disconnect(thread, conn, now, n < 0 || (g_keepalive && !conn->close_after));
+        return;
+    }
+
+    // the server said it will close, requests pipelined behind that response are lost
+    if (conn->close_after && conn->inflight == 0) {
+        bench_disconnect(thread, conn, bench_now_ns(), false);
+    }
+}
+
+static void bench_event(BenchThread* thread, BenchConn* conn, uint32_t events) {
+    if (conn->connecting && (events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+        int error = 0;
+        socklen_t len = sizeof(error);
+        getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &error, &len);
+        if (error != 0) {
+            bench_disconnect(thread, conn, bench_now_ns(), true);
+            thread->connect_errors++;
+            return;
+        }
+        conn->connecting = false;
+    }
+    if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+        bench_read(thread, conn);
+        if (conn->fd < 0) return;
+    }
+    if (!bench_flush(conn)) bench_disconnect(thread, conn, bench_now_ns(), true);
+}
+
+// whether every captured request of the thread's connections has been sent
+static bool bench_replay_sent(const BenchThread* thread) {
+    for (size_t i = 0; i < thread->count; i++) {
+        if (thread->conns[i].replay_next < thread->conns[i].replay_count) return false;
+    }
+    return true;
+}
+
+static void* bench_thread_main(void* arg) {
+    BenchThread* thread = arg;
+    struct epoll_event events[BENCH_EVENTS];
+    uint64_t now = bench_now_ns();
+
+    for (size_t i = 0; i < thread->count; i++) bench_connect(thread, &thread->conns[i], now);
+
+    // a replay runs until its last request went out
+    uint64_t end = g_end_ns;
+    uint64_t drain_until = g_replay_count ? UINT64_MAX : end + BENCH_DRAIN_MS * 1000000u;
+    for (;;) {
+        now = bench_now_ns();
+        if (g_replay_count && end == UINT64_MAX && bench_replay_sent(thread)) {
+            end = now;
+            drain_until = now + BENCH_DRAIN_MS * 1000000u;
+        }
+        if (now >= end) {
+            size_t inflight = 0;
+            for (size_t i = 0; i < thread->count; i++) inflight += thread->conns[i].inflight;
+            if (inflight == 0 || now >= drain_until) {
+                thread->errors += inflight;
+                break;
+            }
+        }
+
+        // the next moment something has to be sent, responses wake us up on their own
+        uint64_t wake = now < g_start_ns ? g_start_ns : (now < end ? end : drain_until);
+        for (size_t i = 0; i < thread->count; i++) {
+            BenchConn* conn = &thread->conns[i];
+            if (!bench_fill(thread, conn, now)) {
+                bench_disconnect(thread, conn, now, true);
+            }
+            if (conn->fd < 0 && conn->retry_at < wake) wake = conn->retry_at;
+            if (g_interval_ns && conn->inflight < g_depth && conn->next_send < wake) wake = conn->next_send;
+            if (g_replay_count && g_speed && conn->inflight < g_depth && conn->replay_next < conn->replay_count) {
+                uint64_t due = g_start_ns + g_replay[conn->replay[conn->replay_next]].offset_ns / g_speed;
+                if (due < wake) wake = due;
+            }
+        }
+
+        // open loop schedules are finer than a millisecond, so wait with nanoseconds
+        uint64_t wait = wake > now ? wake - now : 0;
+        struct timespec timeout = { .tv_sec = (time_t)(wait / 1000000000u), .tv_nsec = (long)(wait % 1000000000u) };
+        int n = epoll_pwait2(thread->epfd, events, BENCH_EVENTS, &timeout, NULL);
+        for (int i = 0; i < n; i++) {
+            bench_event(thread, events[i].data.ptr, events[i].events);
+        }
+    }
+
+    for (size_t i = 0; i < thread->count; i++) {
+        if (thread->conns[i].fd >= 0) close(thread->conns[i].fd);
+    }
+    return NULL;
+}
+
+// resident set of a process from /proc, 0 when it can't be read
+static uint64_t bench_rss_bytes(long pid) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%ld/status", pid);
+    FILE* fp = fopen(path, "r");
+    if (!fp) return 0;
+
+    char line[256];
+    unsigned long long kb = 0;
+    while (fgets(line, sizeof(line), fp)) {
+        if (sscanf(line, "VmRSS: %llu kB", &kb) == 1) break;
+    }
+    fclose(fp);
+    return (uint64_t)kb * 1024;
+}
+
+// opens one connection and has it served one request, so the server sees a keep-alive
+// connection that went idle rather than one that never spoke
+static bool bench_idle_open(BenchThread* thread, BenchConn* scratch, int* fd_out, size_t index) {
+    int fd = socket(g_address.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        printf("Socket failed after %zu connection(s): %s\n", index, strerror(errno));
+        return false;
+    }
+    // one source address only has ~28k ephemeral ports, spread over 127.0.0.0/8
+    struct sockaddr_in* target = (struct sockaddr_in*)&g_address;
+    if (g_address.ss_family == AF_INET && (ntohl(target->sin_addr.s_addr) >> 24) == 127) {
+        int one = 1;
+        setsockopt(fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &one, sizeof(one));
+        struct sockaddr_in source = { .sin_family = AF_INET };
+        source.sin_addr.s_addr = htonl(0x7f000000u | (uint32_t)(2 + index % 250) << 8 | 1);
+        bind(fd, (struct sockaddr*)&source, sizeof(source));
+    }
+    struct timeval timeout = { .tv_sec = 5 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    const BenchRequest* request = &g_requests[0];
+    if (connect(fd, (struct sockaddr*)&g_address, g_address_len) < 0
+        || send(fd, request->data, request->len, MSG_NOSIGNAL) != (ssize_t)request->len) {
+        printf("Connection %zu failed: %s\n", index, strerror(errno));
+        close(fd);
+        return false;
+    }
+
+    scratch->fd = fd;
+    scratch->state = PARSE_HEAD;
+    scratch->in_len = 0;
+    scratch->head = 0;
+    scratch->inflight = 1;
+    scratch->intended[0] = bench_now_ns();
+    uint64_t completed = thread->completed;
+    while (thread->completed == completed) {
+        ssize_t n = recv(fd, scratch->in + scratch->in_len, BENCH_IN_CAP - scratch->in_len, 0);
+        if (n > 0) scratch->in_len += (size_t)n;
+        if (n <= 0 || !bench_parse(thread, scratch, bench_now_ns())) {
+            printf("Connection %zu got no response\n", index);
+            close(fd);
+            return false;
+        }
+    }
+    *fd_out = fd;
+    return true;
+}
+
+// holds `count` idle keep-alive connections open and reports how much memory the server
+// spends on each, measured from its resident set
+static int bench_idle(int count, long server_pid, const char* json, void* tag) {
+    struct rlimit files;
+    if (getrlimit(RLIMIT_NOFILE, &files) == 0 && files.rlim_cur < files.rlim_max) {
+        files.rlim_cur = files.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &files);
+    }
+
+    int* fds = pmalloc((size_t)count * sizeof(int), tag);
+    BenchConn* scratch = pcalloc(1, sizeof(BenchConn), tag);
+    BenchThread* thread = pcalloc(1, sizeof(BenchThread), tag);
+    if (!fds || !scratch || !thread) return 1;
+    histogram_init(&thread->latency);
+
+    uint64_t before = server_pid ? bench_rss_bytes(server_pid) : 0;
+    if (server_pid && before == 0) {
+        printf("Failed to read the memory of process %ld\n", server_pid);
+        return 1;
+    }
+
+    size_t opened = 0;
+    while (opened < (size_t)count && bench_idle_open(thread, scratch, &fds[opened], opened)) opened++;
+
+    // let the server finish handing buffers back before looking
+    sleep(1);
+    uint64_t after = server_pid ? bench_rss_bytes(server_pid) : 0;
+    double per_connection = opened ? ((double)after - (double)before) / (double)opened : 0;
+
+    printf("Idle: %zu of %d connection(s) open, each served one request\n", opened, count);
+    if (server_pid) {
+        printf("Server RSS: %.1f MB before, %.1f MB after, %.0f bytes per idle connection\n",
+               before / (1024.0 * 1024.0), after / (1024.0 * 1024.0), per_connection);
+    } else {
+        printf("Pass --server-pid to measure the server's memory per connection\n");
+    }
+
+    int rc = opened == (size_t)count ? 0 : 1;
+    FILE* fp = !json ? NULL : strcmp(json, "-") == 0 ? stdout : fopen(json, "w");
+    if (json && !fp) {
+        printf("Failed to open %s: %s\n", json, strerror(errno));
+        rc = 1;
+    } else if (fp) {
+        PerfEnv env;
+        perf_env_collect(&env);
+        fprintf(fp, "{\"env\":");
+        perf_env_write_json(&env, fp);
+        fprintf(fp, ",\"idle_connections\":%zu,\"rss_before\":%llu,\"rss_after\":%llu,"
+                "\"rss_per_connection\":%.1f}\n",
+                opened, (unsigned long long)before, (unsigned long long)after, per_connection);
+        if (fp != stdout) fclose(fp);
+    }
+
+    for (size_t i = 0; i < opened; i++) close(fds[i]);
+    return rc;
+}
+
+static void bench_format(char* out, size_t size, uint64_t ns) {
+    if (ns < 1000000u) snprintf(out, size, "%.2fus", ns / 1e3);
+    else if (ns < 1000000000u) snprintf(out, size, "%.2fms", ns / 1e6);
+    else snprintf(out, size, "%.2fs", ns / 1e9);
+}
+
+static const double g_percentiles[] = { 50.0, 75.0, 90.0, 99.0, 99.9, 99.99 };
+#define BENCH_PERCENTILES (sizeof(g_percentiles) / sizeof(g_percentiles[0]))
+
+static void bench_print(const BenchThread* total, const Histogram* latency, double elapsed) {
+    char text[32];
+    printf("Requests: %llu in %.2fs, %.1f req/s, %.2f MB/s read\n", (unsigned long long)total->completed,
+           elapsed, total->completed / elapsed, total->bytes / elapsed / (1024.0 * 1024.0));
+    printf("Status: 2xx %llu, 3xx %llu, 4xx %llu, 5xx %llu, other %llu\n",
+           (unsigned long long)total->status[2], (unsigned long long)total->status[3],
+           (unsigned long long)total->status[4], (unsigned long long)total->status[5],
+           (unsigned long long)(total->status[0] + total->status[1]));
+    printf("Errors: %llu request(s) unanswered, %llu failed connect(s), %llu connection(s) opened\n",
+           (unsigned long long)total->errors, (unsigned long long)total->connect_errors,
+           (unsigned long long)total->connects);
+
+    printf("Latency%s:\n", g_interval_ns || (g_replay_count && g_speed) ? " (from intended send time)" : "");
+    bench_format(text, sizeof(text), latency->total ? latency->min : 0);
+    printf("  %-8s %s\n", "min", text);
+    bench_format(text, sizeof(text), (uint64_t)histogram_mean(latency));
+    printf("  %-8s %s\n", "mean", text);
+    for (size_t i = 0; i < BENCH_PERCENTILES; i++) {
+        char name[16];
+        snprintf(name, sizeof(name), "p%g", g_percentiles[i]);
+        bench_format(text, sizeof(text), histogram_percentile(latency, g_percentiles[i]));
+        printf("  %-8s %s\n", name, text);
+    }
+    bench_format(text, sizeof(text), latency->max);
+    printf("  %-8s %s\n", "max", text);
+}
+
+static bool bench_write_json(const char* path, const BenchThread* total, const Histogram* latency,
+                             double elapsed, int connections, int threads, double rate) {
+    FILE* fp = strcmp(path, "-") == 0 ? stdout : fopen(path, "w");
+    if (!fp) {
+        printf("Failed to open %s: %s\n", path, strerror(errno));
+        return false;
+    }
+
+    PerfEnv env;
+    perf_env_collect(&env);
+    fprintf(fp, "{\"env\":");
+    perf_env_write_json(&env, fp);
+    fprintf(fp, ",\"connections\":%d,\"threads\":%d,\"pipeline\":%zu,\"keepalive\":%s,\"rate\":%.1f,",
+            connections, threads, g_depth, g_keepalive ? "true" : "false", rate);
+    fprintf(fp, "\"duration_s\":%.3f,\"requests\":%llu,\"errors\":%llu,\"connect_errors\":%llu,",
+            elapsed, (unsigned long long)total->completed, (unsigned long long)total->errors,
+            (unsigned long long)total->connect_errors);
+    fprintf(fp, "\"connects\":%llu,\"bytes\":%llu,", (unsigned long long)total->connects,
+            (unsigned long long)total->bytes);
+    fprintf(fp, "\"requests_per_s\":%.1f,", total->completed / elapsed);
+    fprintf(fp, "\"status\":{\"2xx\":%llu,\"3xx\":%llu,\"4xx\":%llu,\"5xx\":%llu,\"other\":%llu},",
+            (unsigned long long)total->status[2], (unsigned long long)total->status[3],
+            (unsigned long long)total->status[4], (unsigned long long)total->status[5],
+            (unsigned long long)(total->status[0] + total->status[1]));
+    fprintf(fp, "\"latency_us\":{\"min\":%.3f,\"mean\":%.3f,\"max\":%.3f",
+            (latency->total ? latency->min : 0) / 1e3, histogram_mean(latency) / 1e3, latency->max / 1e3);
+    for (size_t i = 0; i < BENCH_PERCENTILES; i++) {
+        fprintf(fp, ",\"p%g\":%.3f", g_percentiles[i], histogram_percentile(latency, g_percentiles[i]) / 1e3);
+    }
+    fprintf(fp, "}}\n");
+
+    if (fp != stdout) fclose(fp);
+    return true;
+}
+
+int main(int argc, char** argv) {
+    const char* address = NULL;
+    const char* path = NULL;
+    const char* file = NULL;
+    const char* json = NULL;
+    const char* replay = NULL;
+    int speed;
+    int idle;
+    int server_pid;
+    int connections;
+    int threads;
+    int duration;
+    int depth;
+    int rate;
+    int no_keepalive = 0;
+
+    CLI_BEGIN(options, argc, argv)
+        CLI_STRING('a', "address", address, "127.0.0.1:8080", "Server to load, host:port (default: 127.0.0.1:8080)")
+        CLI_STRING('u', "path", path, "/hello", "Path requested with GET when no request file is given (default: /hello)")
+        CLI_STRING('f', "requests", file, NULL, "Request mix, one \"METHOD PATH [WEIGHT]\" per line")
+        CLI_INT('c', "connections", connections, 64, "Open connections (default: 64)")
+        CLI_INT('t', "threads", threads, 1, "Client threads (default: 1)")
+        CLI_INT('d', "duration", duration, 10, "Seconds to run for (default: 10)")
+        CLI_INT('p', "pipeline", depth, 1, "Requests in flight per connection (default: 1)")
+        CLI_INT('r', "rate", rate, 0, "Total requests per second for an open loop, 0 for a closed loop (default: 0)")
+        CLI_FLAG('k', "no-keepalive", no_keepalive, "Open a new connection for every request")
+        CLI_STRING('j', "json", json, NULL, "Also write the results as JSON to this file, - for stdout")
+        CLI_STRING('R', "replay", replay, NULL, "Send the requests of a capture made with the server's --capture")
+        CLI_INT('x', "speed", speed, 1, "Replay speed-up, 0 for as fast as possible (default: 1)")
+        CLI_INT('I', "idle", idle, 0, "Instead of loading, hold this many idle keep-alive connections open (default: 0)")
+        CLI_INT('P', "server-pid", server_pid, 0, "Server process whose memory --idle measures")
+    CLI_END(options);
+
+    if (connections < 1 || threads < 1 || duration < 1 || depth < 1 || depth > BENCH_MAX_DEPTH || rate < 0
+        || speed < 0) {
+        printf("Invalid options: need connections, threads and duration >= 1, pipeline 1-%d, rate and speed >= 0\n",
+               BENCH_MAX_DEPTH);
+        return 1;
+    }
+    if (threads > connections) threads = connections;
+    // a capture decides its own schedule, and its requests their own connection handling
+    if (replay) {
+        rate = 0;
+        no_keepalive = 0;
+        g_speed = (uint64_t)speed;
+    }
+    g_keepalive = !no_keepalive;
+    g_depth = g_keepalive ? (size_t)depth : 1;
+    if (rate > 0) g_interval_ns = (uint64_t)connections * 1000000000u / (uint64_t)rate;
+    if (!bench_resolve(address)) return 1;
+
+    void* tag = TAG(&g_requests);
+    if (idle > 0) {
+        int rc = bench_add_request("GET", path, 1, address, tag) ? bench_idle(idle, server_pid, json, tag) : 1;
+        pfree_tag(tag);
+        pallocator_cleanup();
+        return rc;
+    }
+    bool loaded = replay || (file ? bench_load_requests(file, address, tag)
+                                  : bench_add_request("GET", path, 1, address, tag));
+    BenchThread* workers = loaded ? pcalloc((size_t)threads, sizeof(BenchThread), tag) : NULL;
+    BenchConn* conns = workers ? pcalloc((size_t)connections, sizeof(BenchConn), tag) : NULL;
+    if (!conns || (replay && !bench_load_capture(replay, conns, (size_t)connections, tag))) {
+        pfree_tag(tag);
+        pallocator_cleanup();
+        return 1;
+    }
+
+    g_start_ns = bench_now_ns() + BENCH_WARMUP_MS * 1000000u;
+    g_end_ns = replay ? UINT64_MAX : g_start_ns + (uint64_t)duration * 1000000000u;
+
+    if (replay) {
+        printf("Replaying %zu request(s) from %s against %s: %d connection(s), %d thread(s), pipeline %zu, ",
+               g_replay_count, replay, address, connections, threads, g_depth);
+        if (g_speed) printf("%llux speed over %.2fs\n", (unsigned long long)g_speed,
+                            g_replay[g_replay_count - 1].offset_ns / (double)g_speed / 1e9);
+        else printf("as fast as possible\n");
+    } else {
+        printf("Running %ds against %s: %d connection(s), %d thread(s), pipeline %zu, %s, ", duration, address,
+               connections, threads, g_depth, g_keepalive ? "keep-alive" : "no keep-alive");
+        if (rate > 0) printf("open loop at %d req/s\n", rate);
+        else printf("closed loop\n");
+    }
+
+    size_t next = 0;
+    for (int t = 0; t < threads; t++) {
+        BenchThread* thread = &workers[t];
+        thread->count = connections / threads + ((size_t)t < (size_t)(connections % threads) ? 1 : 0);
+        thread->conns = &conns[next];
+        thread->rng = 0x9e3779b97f4a7c15ull * (uint64_t)(t + 1);
+        histogram_init(&thread->latency);
+        for (size_t i = 0; i < thread->count; i++) {
+            // spread the schedule so the connections don't fire in lockstep
+            thread->conns[i].fd = -1;
+            thread->conns[i].next_send = g_start_ns + (next + i) * (g_interval_ns / (uint64_t)connections);
+        }
+        next += thread->count;
+    }
+    for (int t = 0; t < threads; t++) {
+        workers[t].epfd = epoll_create1(EPOLL_CLOEXEC);
+        pthread_create(&workers[t].thread, NULL, bench_thread_main, &workers[t]);
+    }
+
+    BenchThread total = { 0 };
+    Histogram* latency = pmalloc(sizeof(Histogram), tag);
+    if (latency) histogram_init(latency);
+    for (int t = 0; t < threads; t++) {
+        pthread_join(workers[t].thread, NULL);
+        close(workers[t].epfd);
+        total.completed += workers[t].completed;
+        total.errors += workers[t].errors;
+        total.connect_errors += workers[t].connect_errors;
+        total.connects += workers[t].connects;
+        total.bytes += workers[t].bytes;
+        for (int i = 0; i < 6; i++) total.status[i] += workers[t].status[i];
+        if (latency) histogram_merge(latency, &workers[t].latency);
+    }
+    uint64_t finished = bench_now_ns();
+    double elapsed = (double)(finished - g_start_ns) / 1e9;
+
+    int rc = 0;
+    if (latency) {
+        bench_print(&total, latency, elapsed);
+        if (json && !bench_write_json(json, &total, latency, elapsed, connections, threads, rate)) rc = 1;
+    } else {
+        rc = 1;
+    }
+
+    pfree_tag(tag);
+    pallocator_cleanup();
+    return rc;
+}
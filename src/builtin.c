@@ -1,7 +1,10 @@
 #include "builtin.h"
 #include "alloc.h"
+#include "router.h"
+#include "trace.h"
 #include "utils.h"
 #include <stdio.h>
+#include <strings.h>
 
 bool logging_layer_preroute_verbose(HttpRequest* request, HttpResponse* response) {
     (void)response;
@@ -37,6 +40,22 @@ bool content_encoding_layer(HttpRequest* request, HttpResponse* response) {
     if (!header) {
         return false;
     }
+    if (response->body_fd >= 0) {
+        // file bodies are streamed from disk as-is
+        return false;
+    }
+    if (response->sse) {
+        // event streams are chunked and written as events arrive
+        return false;
+    }
+    if (http_response_get_header(response, "Content-Encoding")) {
+        // already encoded, e.g. by a proxied upstream
+        return false;
+    }
+    if (string_byte_length(response->body) == 0) {
+        // nothing to compress, e.g. a proxied HEAD or 304 answer
+        return false;
+    }
     String* encoding;
     size_t index = 0;
     do { // loop through the encodings, we will get null after the last one or find what we want
@@ -53,7 +72,9 @@ bool content_encoding_layer(HttpRequest* request, HttpResponse* response) {
         response->encoding = COMPRESSION_GZIP;
         // compress the body
         uint8_t* out = NULL;
+        uint64_t start = trace_start();
         size_t compressed_size = gzip_string(response->body, &out);
+        trace_span("gzip", start);
         if (compressed_size == 0 || !out) {
             printf("Failed to compress response body\n");
             return false;
@@ -81,9 +102,26 @@ bool content_length_layer(HttpRequest* request, HttpResponse* response) {
         // already set in the content encoding layer
         return true;
     }
+    if (response->sse) {
+        // an event stream has no length, it is chunked
+        return true;
+    }
+    int status = http_response_status_code(response);
+    if (status == 204 || (status >= 100 && status < 200)) {
+        // these never carry a length (RFC 9110 8.6)
+        return true;
+    }
+    if (http_response_get_header(response, "Content-Length")) {
+        // set by the handler, e.g. a proxied HEAD or 304 passing on the upstream's
+        return true;
+    }
     // set the content length header
+    size_t content_length = string_byte_length(response->body);
+    if (response->body_fd >= 0) {
+        content_length += response->body_len;
+    }
     char content_length_str[32];
-    snprintf(content_length_str, sizeof(content_length_str), "%zu", string_byte_length(response->body));
+    snprintf(content_length_str, sizeof(content_length_str), "%zu", content_length);
     Header content_length_header = { .key = string_new("Content-Length", request->tag),
                                       .value = string_new(content_length_str, request->tag) };
     if (!HeaderArray_push(response->headers, content_length_header)) {
@@ -119,3 +157,69 @@ bool request_memory_usage_layer(HttpRequest* request, HttpResponse* response) {
     }
     return true;
 }
+
+static bool request_body_collect(const uint8_t* data, size_t len, void* ctx) {
+    return byte_buffer_append(ctx, data, len);
+}
+
+// pre-route layer that undoes Content-Encoding on request bodies, so handlers see plain
+// bytes. Register it with can_fail false: a body that can't be inflated is answered here.
+bool request_decompression_layer(HttpRequest* request, HttpResponse* response) {
+    Header* encoding = http_request_get_header(request, "Content-Encoding");
+    if (!encoding || !request->body) {
+        return true;
+    }
+
+    ByteBuffer body;
+    byte_buffer_init(&body, request->tag);
+    InflateStatus status = http_request_read_body(request, HTTP_MAX_INFLATED_BODY, request_body_collect, &body);
+    if (status != INFLATE_OK) {
+        byte_buffer_free(&body);
+        switch (status) {
+        case INFLATE_TOO_LARGE:
+            printf("Decompressed request body exceeds %d bytes\n", HTTP_MAX_INFLATED_BODY);
+            response->status = HTTP_413;
+            break;
+        case INFLATE_UNSUPPORTED:
+            response->status = HTTP_415;
+            break;
+        case INFLATE_CORRUPT:
+            printf("Failed to decompress request body\n");
+            response->status = HTTP_400;
+            break;
+        default:
+            response->status = HTTP_500;
+            break;
+        }
+        return false;
+    }
+
+    String* plain = string_new_len(body.len > 0 ? (const char*)body.data : "", body.len, request->tag);
+    byte_buffer_free(&body);
+    if (!plain) {
+        response->status = HTTP_500;
+        return false;
+    }
+    string_free(request->body);
+    request->body = plain;
+
+    // the headers now describe the decompressed body
+    for (size_t i = 0; i < HeaderArray_size(request->headers); i++) {
+        Header* header = &request->headers->data[i];
+        if (strcasecmp(string_cstr(header->key), "Content-Encoding") == 0) {
+            Header removed;
+            HeaderArray_remove(request->headers, i, &removed);
+            string_free(removed.key);
+            string_free(removed.value);
+            break;
+        }
+    }
+    Header* length = http_request_get_header(request, "Content-Length");
+    if (length) {
+        char length_str[32];
+        snprintf(length_str, sizeof(length_str), "%zu", string_byte_length(plain));
+        string_free(length->value);
+        length->value = string_new(length_str, request->tag);
+    }
+    return true;
+}
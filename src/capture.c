@@ -0,0 +1,190 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <time.h>
+#include "alloc.h"
+#include "capture.h"
+
+// larger records mean the file is damaged, no request the server accepts comes close
+#define CAPTURE_MAX_RECORD (64u * 1024 * 1024)
+
+static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
+static FILE* g_file = NULL;
+static atomic_bool g_enabled = false;
+static uint32_t g_sample = 1;
+static uint64_t g_max_bytes;
+static uint64_t g_written;
+static uint64_t g_last_ns;      // monotonic time of the previous record, 0 before the first
+static atomic_uint_fast64_t g_seen;
+static uint64_t g_records;
+static uint64_t g_dropped;
+
+static size_t capture_put_varint(uint8_t* out, uint64_t value) {
+    size_t len = 0;
+    while (value >= 0x80) {
+        out[len++] = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    out[len++] = (uint8_t)value;
+    return len;
+}
+
+static bool capture_get_varint(FILE* fp, uint64_t* value, bool* eof) {
+    *value = 0;
+    for (unsigned shift = 0; shift < 64; shift += 7) {
+        int byte = fgetc(fp);
+        if (byte == EOF) {
+            // a clean end only falls between records
+            *eof = shift == 0;
+            return false;
+        }
+        *value |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) return true;
+    }
+    *eof = false;
+    return false;
+}
+
+bool capture_start(const char* path, uint32_t sample, uint64_t max_bytes) {
+    if (capture_enabled() || sample == 0) return false;
+
+    FILE* fp = fopen(path, "wb");
+    if (!fp) {
+        printf("Failed to open capture file %s: %s\n", path, strerror(errno));
+        return false;
+    }
+
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    uint8_t header[sizeof(CAPTURE_MAGIC) - 1 + 1 + 10];
+    size_t len = sizeof(CAPTURE_MAGIC) - 1;
+    memcpy(header, CAPTURE_MAGIC, len);
+    header[len++] = CAPTURE_VERSION;
+    len += capture_put_varint(header + len, (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec);
+    if (fwrite(header, 1, len, fp) != len) {
+        printf("Failed to write capture file %s: %s\n", path, strerror(errno));
+        fclose(fp);
+        return false;
+    }
+
+    pthread_mutex_lock(&g_lock);
+    g_file = fp;
+    g_sample = sample;
+    g_max_bytes = max_bytes;
+    g_written = len;
+    g_last_ns = 0;
+    g_records = 0;
+    g_dropped = 0;
+    atomic_store(&g_seen, 0);
+    pthread_mutex_unlock(&g_lock);
+    atomic_store(&g_enabled, true);
+    return true;
+}
+
+bool capture_enabled(void) {
+    return atomic_load_explicit(&g_enabled, memory_order_relaxed);
+}
+
+void capture_request(uint64_t connection, uint64_t now_ns, const char* data, size_t len) {
+    if (!capture_enabled()) return;
+    atomic_fetch_add_explicit(&g_seen, 1, memory_order_relaxed);
+    if (connection % g_sample != 0) return;
+
+    uint8_t prefix[30];
+    pthread_mutex_lock(&g_lock);
+    if (!g_file) {
+        pthread_mutex_unlock(&g_lock);
+        return;
+    }
+
+    // workers stamp their batches independently, so time never runs backwards here
+    uint64_t delta = g_last_ns && now_ns > g_last_ns ? now_ns - g_last_ns : 0;
+    size_t prefix_len = capture_put_varint(prefix, delta);
+    prefix_len += capture_put_varint(prefix + prefix_len, connection);
+    prefix_len += capture_put_varint(prefix + prefix_len, len);
+
+    if (g_written + prefix_len + len > g_max_bytes) {
+        if (g_dropped++ == 0) printf("CAPTURE: size cap of %llu bytes reached\n", (unsigned long long)g_max_bytes);
+        pthread_mutex_unlock(&g_lock);
+        return;
+    }
+    if (fwrite(prefix, 1, prefix_len, g_file) != prefix_len || fwrite(data, 1, len, g_file) != len) {
+        printf("CAPTURE: write failed, stopping: %s\n", strerror(errno));
+        fclose(g_file);
+        g_file = NULL;
+        atomic_store(&g_enabled, false);
+        pthread_mutex_unlock(&g_lock);
+        return;
+    }
+    if (now_ns > g_last_ns) g_last_ns = now_ns;
+    g_written += prefix_len + len;
+    g_records++;
+    pthread_mutex_unlock(&g_lock);
+}
+
+void capture_stop(void) {
+    atomic_store(&g_enabled, false);
+    pthread_mutex_lock(&g_lock);
+    if (g_file) {
+        fclose(g_file);
+        g_file = NULL;
+    }
+    pthread_mutex_unlock(&g_lock);
+}
+
+void capture_print_stats(void) {
+    pthread_mutex_lock(&g_lock);
+    printf("Capture: %llu request(s) seen, %llu written in %llu bytes, %llu dropped at the size cap\n",
+           (unsigned long long)atomic_load(&g_seen), (unsigned long long)g_records,
+           (unsigned long long)g_written, (unsigned long long)g_dropped);
+    pthread_mutex_unlock(&g_lock);
+}
+
+bool capture_reader_open(CaptureReader* reader, const char* path) {
+    reader->fp = fopen(path, "rb");
+    reader->offset_ns = 0;
+    reader->start_ns = 0;
+    if (!reader->fp) {
+        printf("Failed to open %s: %s\n", path, strerror(errno));
+        return false;
+    }
+
+    char magic[sizeof(CAPTURE_MAGIC) - 1];
+    bool eof = false;
+    if (fread(magic, 1, sizeof(magic), reader->fp) != sizeof(magic) || memcmp(magic, CAPTURE_MAGIC, sizeof(magic)) != 0
+        || fgetc(reader->fp) != CAPTURE_VERSION || !capture_get_varint(reader->fp, &reader->start_ns, &eof)) {
+        printf("%s is not a capture file\n", path);
+        capture_reader_close(reader);
+        return false;
+    }
+    return true;
+}
+
+int capture_reader_next(CaptureReader* reader, CaptureRecord* record, void* tag) {
+    uint64_t delta, connection, len;
+    bool eof = false;
+    if (!capture_get_varint(reader->fp, &delta, &eof)) return eof ? 0 : -1;
+    if (!capture_get_varint(reader->fp, &connection, &eof) || !capture_get_varint(reader->fp, &len, &eof)
+        || len == 0 || len > CAPTURE_MAX_RECORD) {
+        return -1;
+    }
+
+    record->data = pmalloc((size_t)len, tag);
+    if (!record->data) return -1;
+    if (fread(record->data, 1, (size_t)len, reader->fp) != len) {
+        pfree(record->data);
+        record->data = NULL;
+        return -1;
+    }
+    reader->offset_ns += delta;
+    record->offset_ns = reader->offset_ns;
+    record->connection = connection;
+    record->len = (size_t)len;
+    return 1;
+}
+
+void capture_reader_close(CaptureReader* reader) {
+    if (reader->fp) fclose(reader->fp);
+    reader->fp = NULL;
+}
@@ -0,0 +1,559 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "alloc.h"
+#include "client.h"
+
+static bool client_idempotent(Method method) {
+    return method != HTTP_POST && method != HTTP_PATCH;
+}
+
+// the serialized head, with a Host header added to the request if it had none
+static String* client_head(Upstream* upstream, HttpRequest* request) {
+    if (!http_request_get_header(request, "Host")) {
+        const char* host = upstream->addr.ss_family == AF_UNIX ? "localhost" : string_cstr(upstream->address);
+        Header header = { .key = string_new("Host", request->tag), .value = string_new(host, request->tag) };
+        if (!header.key || !header.value || !HeaderArray_push(request->headers, header)) {
+            string_free(header.key);
+            string_free(header.value);
+            return NULL;
+        }
+    }
+    return http_request_serialize_head(request, request->tag);
+}
+
+static bool client_write(UpstreamConn* conn, HttpRequest* request) {
+    String* head = client_head(conn->upstream, request);
+    if (!head) {
+        errno = ENOMEM;
+        return false;
+    }
+
+    size_t body_len = request->body ? string_byte_length(request->body) : 0;
+    struct iovec iov[2] = {
+        { .iov_base = string_bytes(head), .iov_len = string_byte_length(head) },
+        { .iov_base = body_len > 0 ? string_bytes(request->body) : NULL, .iov_len = body_len },
+    };
+    bool written = upstream_write(conn, iov, body_len > 0 ? 2 : 1);
+    string_free(head);
+    return written;
+}
+
+// reads one whole response through `parser`
+static bool client_read(UpstreamConn* conn, HttpResponseParser* parser, bool* received) {
+    while (true) {
+        size_t used = http_response_parser_feed(parser, conn->buf, conn->len);
+        upstream_consume(conn, used);
+        if (parser->state == HTTP_PARSE_DONE) return true;
+        if (parser->state == HTTP_PARSE_ERROR) {
+            errno = parser->error;
+            return false;
+        }
+        // the feed stops after the head, the body may already be here
+        if (used > 0) continue;
+
+        ssize_t n = upstream_fill(conn);
+        if (n > 0) {
+            *received = true;
+            continue;
+        }
+        if (n < 0) return false;
+        if (!http_response_parser_finish(parser)) {
+            errno = parser->error;
+            return false;
+        }
+    }
+}
+
+static void client_free_responses(HttpResponse** responses, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        http_response_free(responses[i]);
+        responses[i] = NULL;
+    }
+}
+
+bool http_client_pipeline(Upstream* upstream, HttpRequest** requests, HttpResponse** responses, size_t count) {
+    if (!upstream || !requests || !responses) {
+        errno = EINVAL;
+        return false;
+    }
+    for (size_t i = 0; i < count; i++) {
+        responses[i] = NULL;
+    }
+
+    bool idempotent = true;
+    for (size_t i = 0; i < count; i++) {
+        idempotent = idempotent && client_idempotent(requests[i]->request_line.method);
+    }
+
+    for (int attempt = 0; attempt < 2; attempt++) {
+        UpstreamConn* conn = upstream_acquire(upstream);
+        if (!conn) return false;
+
+        bool ok = true;
+        for (size_t i = 0; ok && i < count; i++) {
+            ok = client_write(conn, requests[i]);
+        }
+
+        bool received = false;
+        bool keep_alive = true;
+        for (size_t i = 0; ok && i < count; i++) {
+            responses[i] = http_response_new(requests[i]->tag);
+            if (!responses[i]) {
+                errno = ENOMEM;
+                ok = false;
+                break;
+            }
+
+            HttpResponseParser parser;
+            http_response_parser_init(&parser, responses[i], requests[i]->request_line.method, HTTP_CLIENT_MAX_BODY);
+            ok = client_read(conn, &parser, &received);
+            keep_alive = parser.keep_alive;
+            if (ok && !keep_alive && i + 1 < count) {
+                // the peer won't read the rest of the pipeline
+                errno = ECONNRESET;
+                ok = false;
+            }
+        }
+
+        if (ok) {
+            upstream_release(conn, keep_alive);
+            return true;
+        }
+
+        // a pooled connection the peer closed while idle never saw the requests
+        int err = errno;
+        bool stale = conn->reused && !received && (err == EPIPE || err == ECONNRESET);
+        upstream_release(conn, false);
+        client_free_responses(responses, count);
+        if (!stale || !idempotent) {
+            errno = err;
+            return false;
+        }
+    }
+    return false;
+}
+
+HttpResponse* http_client_request(Upstream* upstream, HttpRequest* request) {
+    if (!request) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    HttpResponse* response = NULL;
+    if (!http_client_pipeline(upstream, &request, &response, 1)) return NULL;
+    return response;
+}
+
+HttpClient* http_client_new(EventLoop* loop, void* tag) {
+    if (!loop) return NULL;
+
+    HttpClient* client = pmalloc(sizeof(HttpClient), tag);
+    if (!client) return NULL;
+
+    client->loop = loop;
+    client->conns = NULL;
+    client->waiting = NULL;
+    client->waiting_last = NULL;
+    client->pipeline_depth = HTTP_CLIENT_PIPELINE_DEPTH;
+    client->max_conns = HTTP_CLIENT_MAX_CONNS;
+    client->max_body = HTTP_CLIENT_MAX_BODY;
+    client->tag = tag;
+    return client;
+}
+
+static void client_complete(HttpClientCall* call, int error) {
+    HttpResponse* response = call->response;
+    if (error != 0) {
+        http_response_free(response);
+        response = NULL;
+    }
+    HttpClientCallback done = call->done;
+    HttpRequest* request = call->request;
+    void* data = call->data;
+    pfree(call);
+    done(request, response, error, data);
+}
+
+static void client_wait(HttpClient* client, HttpClientCall* call) {
+    call->next = NULL;
+    if (client->waiting_last) {
+        client->waiting_last->next = call;
+    } else {
+        client->waiting = call;
+    }
+    client->waiting_last = call;
+}
+
+static void client_drain(HttpClient* client);
+
+// unhooks the connection and settles its calls. `error` 0 means the peer ended the
+// connection after a response. Idempotent calls that never got a response byte are
+// resent once, when the connection was closed under them rather than failing outright.
+static void client_conn_close(HttpClientConn* conn, int error) {
+    HttpClient* client = conn->client;
+    for (HttpClientConn** link = &client->conns; *link; link = &(*link)->next) {
+        if (*link == conn) {
+            *link = conn->next;
+            break;
+        }
+    }
+
+    event_loop_remove(client->loop, conn->watch);
+    event_timer_cancel(client->loop, conn->timer);
+    close(conn->fd);
+    sendq_free(&conn->out);
+    pfree(conn->buf);
+
+    HttpClientCall* calls = conn->calls;
+    bool received = conn->received;
+    bool reused = conn->reused;
+    pfree(conn);
+
+    HttpClientCall* failed = NULL;
+    HttpClientCall** failed_last = &failed;
+    bool first = true;
+    while (calls) {
+        HttpClientCall* call = calls;
+        calls = call->next;
+        call->next = NULL;
+
+        bool untouched = !(first && received);
+        first = false;
+        // a stale pooled connection or one the peer ended early, not a dead upstream
+        bool resend = untouched && call->idempotent && !call->retried && (error == 0 || (reused && error == ECONNRESET));
+        if (resend) {
+            // the parser may have seen part of a head, start the response afresh
+            http_response_free(call->response);
+            call->response = NULL;
+            call->retried = true;
+            client_wait(client, call);
+        } else {
+            *failed_last = call;
+            failed_last = &call->next;
+        }
+    }
+
+    while (failed) {
+        HttpClientCall* call = failed;
+        failed = call->next;
+        client_complete(call, error != 0 ? error : ECONNRESET);
+    }
+    if (error != ECANCELED) client_drain(client);
+}
+
+static void client_conn_timeout(EventLoop* loop, void* data) {
+    (void)loop;
+    HttpClientConn* conn = data;
+    client_conn_close(conn, conn->outstanding > 0 || conn->connecting ? ETIMEDOUT : 0);
+}
+
+// re-arms the timer for whatever the connection is waiting on
+static void client_conn_touch(HttpClientConn* conn) {
+    uint32_t delay = UPSTREAM_IDLE_TIMEOUT_MS;
+    if (conn->connecting) {
+        delay = (uint32_t)conn->upstream->connect_timeout_ms;
+    } else if (conn->outstanding > 0) {
+        delay = (uint32_t)conn->upstream->io_timeout_ms;
+    }
+    event_timer_reset(conn->client->loop, conn->timer, delay);
+}
+
+// hands the parser to the oldest call
+static void client_conn_next(HttpClientConn* conn) {
+    conn->received = false;
+    if (conn->calls) {
+        http_response_parser_init(&conn->parser, conn->calls->response,
+                                  conn->calls->request->request_line.method, conn->client->max_body);
+    }
+}
+
+// parses whatever has arrived, completing calls in order. Returns `false` if the
+// connection was closed.
+static bool client_conn_parse(HttpClientConn* conn, bool eof) {
+    while (conn->calls) {
+        size_t used = http_response_parser_feed(&conn->parser, conn->buf, conn->len);
+        if (used > 0) {
+            memmove(conn->buf, conn->buf + used, conn->len - used);
+            conn->len -= used;
+        }
+
+        if (conn->parser.state == HTTP_PARSE_ERROR) {
+            client_conn_close(conn, conn->parser.error);
+            return false;
+        }
+        if (conn->parser.state != HTTP_PARSE_DONE) {
+            // the feed stops after the head, the body may already be here
+            if (used > 0) continue;
+            if (!eof) return true;
+            if (!http_response_parser_finish(&conn->parser)) {
+                client_conn_close(conn, conn->received ? conn->parser.error : ECONNRESET);
+                return false;
+            }
+        }
+
+        HttpClientCall* call = conn->calls;
+        conn->calls = call->next;
+        if (!conn->calls) conn->last = NULL;
+        conn->outstanding--;
+        conn->reused = true;
+        conn->received = false;
+        if (!conn->parser.keep_alive || eof) {
+            // whatever was pipelined behind it goes out again on another connection
+            HttpClient* client = conn->client;
+            client_conn_close(conn, 0);
+            client_complete(call, 0);
+            client_drain(client);
+            return false;
+        }
+        client_conn_next(conn);
+        client_conn_touch(conn);
+
+        // the callback may queue more requests, on this connection too
+        HttpClient* client = conn->client;
+        client_complete(call, 0);
+        client_drain(client);
+    }
+
+    if (conn->len > 0 || eof) {
+        // bytes nobody asked for, or an idle connection the peer closed
+        client_conn_close(conn, 0);
+        return false;
+    }
+    return true;
+}
+
+static void client_conn_event(EventLoop* loop, int fd, uint32_t events, void* data) {
+    HttpClientConn* conn = data;
+
+    if (conn->connecting) {
+        int err = 0;
+        socklen_t err_len = sizeof(err);
+        if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &err_len) != 0) err = errno;
+        if (err != 0) {
+            printf("Client connect to %s failed: %s\n", string_cstr(conn->upstream->address), strerror(err));
+            client_conn_close(conn, err);
+            return;
+        }
+        conn->connecting = false;
+        client_conn_touch(conn);
+        events |= EV_WRITE;
+    }
+
+    if (events & EV_WRITE) {
+        SendqStatus status = sendq_flush(&conn->out, fd);
+        if (status == SENDQ_ERROR) {
+            client_conn_close(conn, errno == EPIPE ? ECONNRESET : errno);
+            return;
+        }
+        if (status == SENDQ_DONE) event_loop_modify(loop, conn->watch, EV_READ);
+    }
+
+    if (!(events & (EV_READ | EV_HUP | EV_ERROR))) return;
+
+    bool eof = false;
+    while (true) {
+        if (conn->len == conn->cap) {
+            char* grown = prealloc(conn->buf, conn->cap * 2, conn->client->tag);
+            if (!grown) {
+                client_conn_close(conn, ENOMEM);
+                return;
+            }
+            conn->buf = grown;
+            conn->cap *= 2;
+        }
+
+        ssize_t n = recv(fd, conn->buf + conn->len, conn->cap - conn->len, 0);
+        if (n > 0) {
+            conn->len += (size_t)n;
+            if (conn->calls) conn->received = true;
+            continue;
+        }
+        if (n == 0) {
+            eof = true;
+            break;
+        }
+        if (errno == EINTR) continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+        client_conn_close(conn, errno);
+        return;
+    }
+
+    if (conn->outstanding > 0) client_conn_touch(conn);
+    client_conn_parse(conn, eof);
+}
+
+static HttpClientConn* client_conn_open(HttpClient* client, Upstream* upstream) {
+    bool in_progress = false;
+    int fd = upstream_dial(upstream, &in_progress);
+    if (fd < 0) {
+        int err = errno;
+        printf("Client connect to %s failed: %s\n", string_cstr(upstream->address), strerror(err));
+        errno = err;
+        return NULL;
+    }
+
+    HttpClientConn* conn = pmalloc(sizeof(HttpClientConn), client->tag);
+    char* buf = pmalloc(UPSTREAM_BUFFER_SIZE, client->tag);
+    if (!conn || !buf || !sendq_init(&conn->out, client->tag)) {
+        if (conn) pfree(conn);
+        if (buf) pfree(buf);
+        close(fd);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    conn->client = client;
+    conn->upstream = upstream;
+    conn->fd = fd;
+    conn->connecting = in_progress;
+    conn->reused = false;
+    conn->received = false;
+    conn->buf = buf;
+    conn->len = 0;
+    conn->cap = UPSTREAM_BUFFER_SIZE;
+    conn->calls = NULL;
+    conn->last = NULL;
+    conn->outstanding = 0;
+    conn->timer = event_timer_add(client->loop, (uint32_t)upstream->connect_timeout_ms,
+                                  (uint32_t)upstream->io_timeout_ms, client_conn_timeout, conn);
+    conn->watch = event_loop_add(client->loop, fd, EV_READ | EV_WRITE, 0, client_conn_event, conn);
+    if (!conn->timer || !conn->watch) {
+        event_timer_cancel(client->loop, conn->timer);
+        event_loop_remove(client->loop, conn->watch);
+        sendq_free(&conn->out);
+        pfree(buf);
+        pfree(conn);
+        close(fd);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    conn->next = client->conns;
+    client->conns = conn;
+    return conn;
+}
+
+// a connection to `upstream` with room for the call, a new one if allowed, else NULL.
+// `failed` is set when a new connection was needed and couldn't be opened.
+static HttpClientConn* client_pick(HttpClient* client, Upstream* upstream, bool idempotent, bool* failed) {
+    *failed = false;
+    HttpClientConn* best = NULL;
+    size_t open = 0;
+    for (HttpClientConn* conn = client->conns; conn; conn = conn->next) {
+        if (conn->upstream != upstream) continue;
+        open++;
+
+        // side effects aren't pipelined, if the connection dies nobody knows whether they happened
+        size_t room = idempotent ? client->pipeline_depth : 1;
+        if (conn->outstanding >= room) continue;
+        if (!best || conn->outstanding < best->outstanding) best = conn;
+    }
+
+    if (best && best->outstanding == 0) return best;
+    if (open < client->max_conns) {
+        HttpClientConn* conn = client_conn_open(client, upstream);
+        if (conn) return conn;
+        *failed = !best;
+    }
+    return best;
+}
+
+// writes the call on `conn`. Returns `false` if it can't be serialized.
+static bool client_send(HttpClientConn* conn, HttpClientCall* call) {
+    HttpRequest* request = call->request;
+    call->response = http_response_new(request->tag);
+    String* head = call->response ? client_head(conn->upstream, request) : NULL;
+    if (!head) return false;
+
+    // copied, the request may change before the socket takes it
+    size_t head_len = string_byte_length(head);
+    size_t body_len = request->body ? string_byte_length(request->body) : 0;
+    uint8_t* bytes = pmalloc(head_len + body_len, conn->client->tag);
+    if (!bytes) {
+        string_free(head);
+        return false;
+    }
+    memcpy(bytes, string_bytes(head), head_len);
+    if (body_len > 0) memcpy(bytes + head_len, string_bytes(request->body), body_len);
+    string_free(head);
+    if (!sendq_push_buffer(&conn->out, bytes, head_len + body_len, bytes)) {
+        pfree(bytes);
+        return false;
+    }
+
+    call->next = NULL;
+    if (conn->last) {
+        conn->last->next = call;
+    } else {
+        conn->calls = call;
+    }
+    conn->last = call;
+    conn->outstanding++;
+    if (conn->calls == call) client_conn_next(conn);
+
+    if (!conn->connecting) {
+        client_conn_touch(conn);
+        event_loop_modify(conn->client->loop, conn->watch, EV_READ | EV_WRITE);
+    }
+    return true;
+}
+
+// sends waiting calls, in order, as long as connections have room
+static void client_drain(HttpClient* client) {
+    while (client->waiting) {
+        HttpClientCall* call = client->waiting;
+        bool failed = false;
+        HttpClientConn* conn = client_pick(client, call->upstream, call->idempotent, &failed);
+        if (!conn && !failed) return;
+
+        client->waiting = call->next;
+        if (!client->waiting) client->waiting_last = NULL;
+        if (!conn) {
+            client_complete(call, errno != 0 ? errno : ECONNREFUSED);
+        } else if (!client_send(conn, call)) {
+            client_complete(call, ENOMEM);
+        }
+    }
+}
+
+bool http_client_request_async(HttpClient* client, Upstream* upstream, HttpRequest* request,
+                               HttpClientCallback done, void* data) {
+    if (!client || !upstream || !request || !done) return false;
+
+    HttpClientCall* call = pmalloc(sizeof(HttpClientCall), client->tag);
+    if (!call) return false;
+
+    call->request = request;
+    call->response = NULL;
+    call->done = done;
+    call->data = data;
+    call->upstream = upstream;
+    call->idempotent = client_idempotent(request->request_line.method);
+    call->retried = false;
+    call->next = NULL;
+
+    // behind anything already waiting, requests go out in the order they were made
+    client_wait(client, call);
+    client_drain(client);
+    return true;
+}
+
+void http_client_free(HttpClient* client) {
+    if (!client) return;
+
+    while (client->conns) {
+        client_conn_close(client->conns, ECANCELED);
+    }
+    while (client->waiting) {
+        HttpClientCall* call = client->waiting;
+        client->waiting = call->next;
+        client_complete(call, ECANCELED);
+    }
+    pfree(client);
+}
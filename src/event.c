@@ -0,0 +1,344 @@
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include "alloc.h"
+#include "event.h"
+
+static uint64_t monotonic_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000u + (uint64_t)ts.tv_nsec / 1000000u;
+}
+
+static uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+// drain the wakeup counter and run posted tasks, the flag checks happen in the run loop
+static void event_loop_on_wake(EventLoop* loop, int fd, uint32_t events, void* data) {
+    (void)events;
+    (void)data;
+    uint64_t value;
+    while (read(fd, &value, sizeof(value)) > 0) {}
+
+    pthread_mutex_lock(&loop->posted_lock);
+    EventTask* tasks = loop->posted;
+    loop->posted = NULL;
+    pthread_mutex_unlock(&loop->posted_lock);
+
+    // the list is newest first, run it in posting order
+    EventTask* ordered = NULL;
+    while (tasks) {
+        EventTask* next = tasks->next;
+        tasks->next = ordered;
+        ordered = tasks;
+        tasks = next;
+    }
+    while (ordered) {
+        EventTask* next = ordered->next;
+        ordered->fn(loop, ordered->data);
+        pfree(ordered);
+        ordered = next;
+    }
+}
+
+static void event_loop_wake(EventLoop* loop) {
+    uint64_t one = 1;
+    if (write(loop->wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        printf("event loop wakeup failed: %s\n", strerror(errno));
+    }
+}
+
+EventLoop* event_loop_new(void* tag) {
+    EventLoop* loop = pmalloc(sizeof(EventLoop), tag);
+    if (!loop) return NULL;
+
+    loop->tag = tag;
+    loop->dead = NULL;
+    loop->running = false;
+    memset(loop->wheel, 0, sizeof(loop->wheel));
+    loop->timer_count = 0;
+    loop->tick = 0;
+    loop->start_ms = monotonic_ms();
+    loop->ready_ns = monotonic_ns();
+    loop->firing = NULL;
+    loop->posted = NULL;
+    pthread_mutex_init(&loop->posted_lock, NULL);
+
+    loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epoll_fd < 0) {
+        printf("epoll_create1 failed: %s\n", strerror(errno));
+        pfree(loop);
+        return NULL;
+    }
+
+    loop->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (loop->wake_fd < 0) {
+        printf("eventfd failed: %s\n", strerror(errno));
+        close(loop->epoll_fd);
+        pfree(loop);
+        return NULL;
+    }
+
+    if (!event_loop_add(loop, loop->wake_fd, EV_READ, 0, event_loop_on_wake, NULL)) {
+        close(loop->wake_fd);
+        close(loop->epoll_fd);
+        pfree(loop);
+        return NULL;
+    }
+
+    return loop;
+}
+
+static void event_loop_release_dead(EventLoop* loop) {
+    while (loop->dead) {
+        EventWatch* next = loop->dead->next_dead;
+        pfree(loop->dead);
+        loop->dead = next;
+    }
+}
+
+void event_loop_free(EventLoop* loop) {
+    if (!loop) return;
+
+    event_loop_release_dead(loop);
+    for (size_t i = 0; i < EVENT_TIMER_SLOTS; i++) {
+        while (loop->wheel[i]) {
+            EventTimer* next = loop->wheel[i]->next;
+            pfree(loop->wheel[i]);
+            loop->wheel[i] = next;
+        }
+    }
+    while (loop->posted) {
+        EventTask* next = loop->posted->next;
+        pfree(loop->posted);
+        loop->posted = next;
+    }
+    pthread_mutex_destroy(&loop->posted_lock);
+    close(loop->wake_fd);
+    close(loop->epoll_fd);
+    pfree(loop);
+}
+
+EventWatch* event_loop_add(EventLoop* loop, int fd, uint32_t events, uint32_t extra, EventHandler fn, void* data) {
+    if (!loop || fd < 0 || !fn) return NULL;
+
+    EventWatch* watch = pmalloc(sizeof(EventWatch), loop->tag);
+    if (!watch) return NULL;
+
+    watch->fd = fd;
+    watch->events = events;
+    watch->fn = fn;
+    watch->data = data;
+    watch->next_dead = NULL;
+
+    struct epoll_event ev = { .events = events | extra, .data.ptr = watch };
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+        printf("epoll_ctl add failed: %s\n", strerror(errno));
+        pfree(watch);
+        return NULL;
+    }
+
+    return watch;
+}
+
+bool event_loop_modify(EventLoop* loop, EventWatch* watch, uint32_t events) {
+    if (!loop || !watch || watch->fd < 0) return false;
+    if (watch->events == events) return true;
+
+    struct epoll_event ev = { .events = events, .data.ptr = watch };
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, watch->fd, &ev) != 0) {
+        printf("epoll_ctl mod failed: %s\n", strerror(errno));
+        return false;
+    }
+
+    watch->events = events;
+    return true;
+}
+
+void event_loop_remove(EventLoop* loop, EventWatch* watch) {
+    if (!loop || !watch || watch->fd < 0) return;
+
+    epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, watch->fd, NULL);
+
+    // events for this watch may still be queued in the current batch
+    watch->fd = -1;
+    watch->next_dead = loop->dead;
+    loop->dead = watch;
+}
+
+static void event_timer_link(EventLoop* loop, EventTimer* timer, uint32_t delay_ms) {
+    uint64_t now = (monotonic_ms() - loop->start_ms) / EVENT_TIMER_TICK_MS;
+    // round up so a timer never fires early, and never lands in a slot already processed
+    uint64_t ticks = (delay_ms + EVENT_TIMER_TICK_MS - 1) / EVENT_TIMER_TICK_MS;
+    timer->deadline = (now > loop->tick ? now : loop->tick) + (ticks > 0 ? ticks : 1);
+
+    EventTimer** slot = &loop->wheel[timer->deadline % EVENT_TIMER_SLOTS];
+    timer->prev = NULL;
+    timer->next = *slot;
+    if (*slot) (*slot)->prev = timer;
+    *slot = timer;
+    timer->linked = true;
+}
+
+static void event_timer_unlink(EventLoop* loop, EventTimer* timer) {
+    if (!timer->linked) return;
+
+    if (timer->prev) {
+        timer->prev->next = timer->next;
+    } else {
+        loop->wheel[timer->deadline % EVENT_TIMER_SLOTS] = timer->next;
+    }
+    if (timer->next) timer->next->prev = timer->prev;
+    timer->prev = NULL;
+    timer->next = NULL;
+    timer->linked = false;
+}
+
+EventTimer* event_timer_add(EventLoop* loop, uint32_t delay_ms, uint32_t interval_ms, TimerHandler fn, void* data) {
+    if (!loop || !fn) return NULL;
+
+    EventTimer* timer = pmalloc(sizeof(EventTimer), loop->tag);
+    if (!timer) return NULL;
+
+    timer->interval_ms = interval_ms;
+    timer->fn = fn;
+    timer->data = data;
+    timer->linked = false;
+    timer->cancelled = false;
+    event_timer_link(loop, timer, delay_ms);
+    loop->timer_count++;
+    return timer;
+}
+
+void event_timer_reset(EventLoop* loop, EventTimer* timer, uint32_t delay_ms) {
+    if (!loop || !timer || timer->cancelled) return;
+
+    event_timer_unlink(loop, timer);
+    event_timer_link(loop, timer, delay_ms);
+}
+
+void event_timer_cancel(EventLoop* loop, EventTimer* timer) {
+    if (!loop || !timer || timer->cancelled) return;
+
+    event_timer_unlink(loop, timer);
+    if (timer == loop->firing) {
+        // freed once its callback returns
+        timer->cancelled = true;
+        return;
+    }
+    loop->timer_count--;
+    pfree(timer);
+}
+
+static EventTimer* event_timer_next_due(EventTimer* timer, uint64_t now) {
+    while (timer && timer->deadline > now) timer = timer->next; // due on a later rotation
+    return timer;
+}
+
+// fires every timer that came due, slot by slot, up to the current tick
+static void event_loop_run_timers(EventLoop* loop) {
+    uint64_t now = (monotonic_ms() - loop->start_ms) / EVENT_TIMER_TICK_MS;
+    uint64_t steps = now - loop->tick;
+    if (steps > EVENT_TIMER_SLOTS) steps = EVENT_TIMER_SLOTS;
+
+    for (uint64_t i = 1; i <= steps; i++) {
+        EventTimer** slot = &loop->wheel[(loop->tick + i) % EVENT_TIMER_SLOTS];
+        EventTimer* timer;
+        // rescan from the head each time, callbacks may add or cancel timers in this slot
+        while ((timer = event_timer_next_due(*slot, now))) {
+            event_timer_unlink(loop, timer);
+            loop->firing = timer;
+            timer->fn(loop, timer->data);
+            loop->firing = NULL;
+
+            if (timer->cancelled || (!timer->linked && timer->interval_ms == 0)) {
+                loop->timer_count--;
+                pfree(timer);
+            } else if (!timer->linked) {
+                event_timer_link(loop, timer, timer->interval_ms);
+            }
+        }
+    }
+    loop->tick = now;
+}
+
+// how long epoll_wait may sleep before the next occupied slot comes up
+static int event_loop_timeout(EventLoop* loop) {
+    if (loop->timer_count == 0) return -1;
+
+    uint64_t ticks = 1;
+    while (ticks < EVENT_TIMER_SLOTS && !loop->wheel[(loop->tick + ticks) % EVENT_TIMER_SLOTS]) {
+        ticks++;
+    }
+
+    uint64_t elapsed = monotonic_ms() - loop->start_ms;
+    uint64_t wake = (loop->tick + ticks) * EVENT_TIMER_TICK_MS;
+    return wake > elapsed ? (int)(wake - elapsed) : 0;
+}
+
+void event_loop_run(EventLoop* loop) {
+    if (!loop) return;
+
+    struct epoll_event events[EVENT_LOOP_MAX_EVENTS];
+    uint64_t batch_ns = monotonic_ns(); // when the previous batch started
+    loop->running = true;
+
+    while (loop->running) {
+        uint64_t waited_ns = monotonic_ns();
+        int count = epoll_wait(loop->epoll_fd, events, EVENT_LOOP_MAX_EVENTS, event_loop_timeout(loop));
+        if (count < 0) {
+            if (errno == EINTR) continue;
+            printf("epoll_wait failed: %s\n", strerror(errno));
+            break;
+        }
+
+        // returning at once means these events queued up while the last batch ran,
+        // they may have waited since it started
+        uint64_t woke_ns = monotonic_ns();
+        loop->ready_ns = woke_ns - waited_ns > EVENT_LOOP_SLEPT_NS ? woke_ns : batch_ns;
+        batch_ns = woke_ns;
+
+        for (int i = 0; i < count; i++) {
+            EventWatch* watch = events[i].data.ptr;
+            if (watch->fd < 0) continue; // removed earlier in this batch
+            watch->fn(loop, watch->fd, events[i].events, watch->data);
+        }
+
+        event_loop_run_timers(loop);
+        event_loop_release_dead(loop);
+    }
+
+    loop->running = false;
+}
+
+bool event_loop_post(EventLoop* loop, TimerHandler fn, void* data) {
+    if (!loop || !fn) return false;
+
+    EventTask* task = pmalloc(sizeof(EventTask), loop->tag);
+    if (!task) return false;
+    task->fn = fn;
+    task->data = data;
+
+    pthread_mutex_lock(&loop->posted_lock);
+    bool idle = loop->posted == NULL;
+    task->next = loop->posted;
+    loop->posted = task;
+    pthread_mutex_unlock(&loop->posted_lock);
+
+    // one wakeup covers every task posted before the loop gets to them
+    if (idle) event_loop_wake(loop);
+    return true;
+}
+
+void event_loop_stop(EventLoop* loop) {
+    if (!loop) return;
+
+    loop->running = false;
+    event_loop_wake(loop);
+}
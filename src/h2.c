@@ -0,0 +1,1046 @@
+#define _GNU_SOURCE
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include "alloc.h"
+#include "h2.h"
+#include "loadshed.h"
+#include "server.h"
+
+// connection-specific fields have no meaning in HTTP/2 and must not be sent
+static const char* const h2_connection_headers[] = {
+    "connection", "keep-alive", "proxy-connection", "transfer-encoding", "upgrade",
+};
+
+static uint32_t h2_read_u32(const uint8_t* p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static void h2_frame_header_write(uint8_t* header, size_t len, H2FrameType type, uint8_t flags, uint32_t stream_id) {
+    header[0] = (uint8_t)(len >> 16);
+    header[1] = (uint8_t)(len >> 8);
+    header[2] = (uint8_t)len;
+    header[3] = (uint8_t)type;
+    header[4] = flags;
+    header[5] = (uint8_t)((stream_id >> 24) & 0x7f);
+    header[6] = (uint8_t)(stream_id >> 16);
+    header[7] = (uint8_t)(stream_id >> 8);
+    header[8] = (uint8_t)stream_id;
+}
+
+static void h2_frame_header(ByteBuffer* out, size_t len, H2FrameType type, uint8_t flags, uint32_t stream_id) {
+    uint8_t header[H2_FRAME_HEADER_SIZE];
+    h2_frame_header_write(header, len, type, flags, stream_id);
+    byte_buffer_append(out, header, sizeof(header));
+}
+
+static void h2_frame(H2Session* session, H2FrameType type, uint8_t flags, uint32_t stream_id,
+                     const void* payload, size_t len) {
+    h2_frame_header(&session->pending, len, type, flags, stream_id);
+    byte_buffer_append(&session->pending, payload, len);
+}
+
+static void h2_frame_u32(H2Session* session, H2FrameType type, uint32_t stream_id, uint32_t value) {
+    uint8_t payload[4] = { (uint8_t)(value >> 24), (uint8_t)(value >> 16), (uint8_t)(value >> 8), (uint8_t)value };
+    h2_frame(session, type, 0, stream_id, payload, sizeof(payload));
+}
+
+// hands the frames built so far to the connection's send queue
+static void h2_flush(H2Session* session) {
+    if (session->pending.len == 0) return;
+
+    size_t len = 0;
+    uint8_t* data = byte_buffer_take(&session->pending, &len);
+    if (!sendq_push_buffer(session->out, data, len, data)) {
+        session->failed = true;
+    }
+}
+
+static bool h2_connection_error(H2Session* session, H2Error error, const char* why) {
+    printf("HTTP/2 connection error %d: %s\n", error, why);
+    if (!session->failed) {
+        uint8_t payload[8] = {
+            (uint8_t)(session->last_stream_id >> 24), (uint8_t)(session->last_stream_id >> 16),
+            (uint8_t)(session->last_stream_id >> 8), (uint8_t)session->last_stream_id,
+            0, 0, 0, (uint8_t)error,
+        };
+        h2_frame(session, H2_GOAWAY, 0, 0, payload, sizeof(payload));
+        session->failed = true;
+    }
+    return false;
+}
+
+int h2_preface_check(const char* data, size_t len) {
+    if (!data) return -1;
+
+    size_t n = len < H2_PREFACE_LEN ? len : H2_PREFACE_LEN;
+    if (memcmp(data, H2_PREFACE, n) != 0) return -1;
+    return n == H2_PREFACE_LEN ? 1 : 0;
+}
+
+H2Session* h2_session_new(struct HttpServer* server, EventLoop* loop, SendQueue* out, H2NotifyFn notify,
+                          void* notify_data, void* tag) {
+    if (!server || !loop || !out || !notify) return NULL;
+
+    H2Session* session = pcalloc(1, sizeof(H2Session), tag);
+    if (!session) return NULL;
+
+    if (!hpack_table_init(&session->decoder, HPACK_TABLE_SIZE, tag)) {
+        pfree(session);
+        return NULL;
+    }
+    if (!hpack_table_init(&session->encoder, HPACK_TABLE_SIZE, tag)) {
+        hpack_table_free(&session->decoder);
+        pfree(session);
+        return NULL;
+    }
+
+    session->server = server;
+    session->loop = loop;
+    session->out = out;
+    session->notify = notify;
+    session->notify_data = notify_data;
+    session->tag = tag;
+    byte_buffer_init(&session->pending, tag);
+    byte_buffer_init(&session->header_block, tag);
+    session->peer_max_frame = H2_DEFAULT_FRAME_SIZE;
+    session->peer_initial_window = H2_DEFAULT_WINDOW;
+    session->send_window = H2_DEFAULT_WINDOW;
+    session->recv_window = H2_CONNECTION_WINDOW;
+
+    // our preface: SETTINGS, then the connection window raised past its default
+    uint8_t settings[18];
+    const uint32_t values[3][2] = {
+        { H2_SETTINGS_MAX_CONCURRENT_STREAMS, H2_MAX_STREAMS },
+        { H2_SETTINGS_INITIAL_WINDOW_SIZE, H2_STREAM_WINDOW },
+        { H2_SETTINGS_ENABLE_PUSH, 0 },
+    };
+    for (int i = 0; i < 3; i++) {
+        uint8_t* p = settings + i * 6;
+        p[0] = (uint8_t)(values[i][0] >> 8);
+        p[1] = (uint8_t)values[i][0];
+        p[2] = (uint8_t)(values[i][1] >> 24);
+        p[3] = (uint8_t)(values[i][1] >> 16);
+        p[4] = (uint8_t)(values[i][1] >> 8);
+        p[5] = (uint8_t)values[i][1];
+    }
+    h2_frame(session, H2_SETTINGS, 0, 0, settings, sizeof(settings));
+    h2_frame_u32(session, H2_WINDOW_UPDATE, 0, H2_CONNECTION_WINDOW - H2_DEFAULT_WINDOW);
+    h2_flush(session);
+    return session;
+}
+
+static H2Stream* h2_stream_find(H2Session* session, uint32_t id) {
+    for (H2Stream* stream = session->streams; stream; stream = stream->next) {
+        if (stream->id == id) return stream;
+    }
+    return NULL;
+}
+
+static H2Stream* h2_stream_new(H2Session* session, uint32_t id) {
+    H2Stream* stream = pcalloc(1, sizeof(H2Stream), session->tag);
+    if (!stream) return NULL;
+
+    // everything the request and response allocate goes under the stream's own tag
+    stream->request = http_request_new(TAG(stream));
+    if (!stream->request) {
+        pfree(stream);
+        return NULL;
+    }
+
+    stream->session = session;
+    stream->id = id;
+    stream->state = H2_STREAM_OPEN;
+    stream->request->request_line.version = HTTP_2_0;
+    stream->request->peer = session->peer;
+    stream->request->loop = session->loop;
+    byte_buffer_init(&stream->body, session->tag);
+    stream->send_window = session->peer_initial_window;
+    stream->recv_window = H2_STREAM_WINDOW;
+    stream->body_fd = -1;
+    stream->weight = H2_DEFAULT_WEIGHT;
+
+    stream->next = session->streams;
+    session->streams = stream;
+    session->stream_count++;
+    if (id > session->last_stream_id) session->last_stream_id = id;
+    return stream;
+}
+
+static void h2_unschedule(H2Session* session, H2Stream* stream) {
+    if (!stream->ready) return;
+
+    H2Stream** link = &session->ready_head;
+    H2Stream* prev = NULL;
+    while (*link && *link != stream) {
+        prev = *link;
+        link = &(*link)->ready_next;
+    }
+    if (*link) *link = stream->ready_next;
+    if (session->ready_tail == stream) session->ready_tail = prev;
+    stream->ready_next = NULL;
+    stream->ready = false;
+}
+
+static void h2_schedule(H2Session* session, H2Stream* stream) {
+    if (stream->ready || stream->state != H2_STREAM_RESPONDING) return;
+    // waiting on its body descriptor, h2_stream_on_body schedules it once that is readable
+    if (stream->body_watch) return;
+
+    stream->ready_next = NULL;
+    if (session->ready_tail) {
+        session->ready_tail->ready_next = stream;
+    } else {
+        session->ready_head = stream;
+    }
+    session->ready_tail = stream;
+    stream->ready = true;
+}
+
+// `complete` is false when the stream was reset before its whole body went out
+static void h2_stream_close(H2Session* session, H2Stream* stream, bool complete) {
+    for (H2Stream** link = &session->streams; *link; link = &(*link)->next) {
+        if (*link == stream) {
+            *link = stream->next;
+            break;
+        }
+    }
+    session->stream_count--;
+    h2_unschedule(session, stream);
+
+    if (stream->body_watch) event_loop_remove(session->loop, stream->body_watch);
+    if (stream->body_timer) event_timer_cancel(session->loop, stream->body_timer);
+    if (stream->body_fd >= 0) {
+        if (stream->body_done) {
+            stream->body_done(stream->body_done_data, stream->body_fd, complete && stream->body_remaining == 0);
+        } else {
+            close(stream->body_fd);
+        }
+    }
+    if (stream->response) {
+        layers_apply(session->server->layer_ctx, LAYER_CLEANUP, stream->request, stream->response);
+        http_response_free(stream->response);
+    }
+    http_request_free(stream->request);
+    pfree_tag(TAG(stream));
+    byte_buffer_free(&stream->body);
+    pfree(stream);
+}
+
+static void h2_stream_reset(H2Session* session, H2Stream* stream, uint32_t id, H2Error error) {
+    h2_frame_u32(session, H2_RST_STREAM, id, error);
+    if (stream) h2_stream_close(session, stream, false);
+}
+
+void h2_session_free(H2Session* session) {
+    if (!session) return;
+
+    while (session->streams) {
+        h2_stream_close(session, session->streams, false);
+    }
+    hpack_table_free(&session->decoder);
+    hpack_table_free(&session->encoder);
+    byte_buffer_free(&session->pending);
+    byte_buffer_free(&session->header_block);
+    pfree(session);
+}
+
+static bool h2_is_connection_header(const char* name) {
+    for (size_t i = 0; i < sizeof(h2_connection_headers) / sizeof(h2_connection_headers[0]); i++) {
+        if (strcasecmp(name, h2_connection_headers[i]) == 0) return true;
+    }
+    return false;
+}
+
+// HEADERS plus as many CONTINUATION frames as the peer's frame size needs
+static void h2_send_headers(H2Session* session, uint32_t stream_id, const ByteBuffer* block, bool end_stream) {
+    size_t offset = 0;
+    bool first = true;
+    do {
+        size_t chunk = block->len - offset;
+        if (chunk > session->peer_max_frame) chunk = session->peer_max_frame;
+        bool last = offset + chunk == block->len;
+
+        uint8_t flags = last ? H2_FLAG_END_HEADERS : 0;
+        if (first && end_stream) flags |= H2_FLAG_END_STREAM;
+        h2_frame(session, first ? H2_HEADERS : H2_CONTINUATION, flags, stream_id, block->data + offset, chunk);
+        offset += chunk;
+        first = false;
+    } while (offset < block->len);
+}
+
+// queues the response head and sets the stream up to send the body
+static void h2_stream_respond(H2Session* session, H2Stream* stream) {
+    HttpResponse* response = stream->response;
+    int status = http_response_status_code(response);
+    if (status < 100 || status > 999) status = 500;
+
+    ByteBuffer block;
+    byte_buffer_init(&block, session->tag);
+    hpack_encode_begin(&session->encoder, &block);
+
+    char status_text[4];
+    snprintf(status_text, sizeof(status_text), "%d", status);
+    hpack_encode(&session->encoder, ":status", 7, status_text, 3, &block);
+
+    char name[256];
+    for (size_t i = 0; i < HeaderArray_size(response->headers); i++) {
+        Header* header = &response->headers->data[i];
+        size_t name_len = string_byte_length(header->key);
+        if (name_len == 0 || name_len >= sizeof(name) || h2_is_connection_header(string_cstr(header->key))) continue;
+
+        // field names are lowercase on the wire
+        for (size_t j = 0; j < name_len; j++) {
+            name[j] = (char)tolower((unsigned char)string_bytes(header->key)[j]);
+        }
+        hpack_encode(&session->encoder, name, name_len, string_cstr(header->value),
+                     string_byte_length(header->value), &block);
+    }
+
+    // the body is sent as it was prepared, compressed or not, followed by any descriptor
+    if (response->encoding == COMPRESSION_GZIP && response->raw_body) {
+        stream->data = response->raw_body;
+        stream->data_len = response->raw_body_len;
+    } else if (response->body) {
+        stream->data = (const uint8_t*)string_bytes(response->body);
+        stream->data_len = string_byte_length(response->body);
+    }
+    if (response->body_fd >= 0) {
+        stream->body_fd = response->body_fd;
+        stream->body_offset = response->body_offset;
+        stream->body_remaining = response->body_len;
+        stream->body_done = response->body_done;
+        stream->body_done_data = response->body_done_data;
+        response->body_fd = -1; // the stream closes it from here on
+    }
+
+    bool no_body = stream->request->request_line.method == HTTP_HEAD
+        || status == 204 || status == 304 || (stream->data_len == 0 && stream->body_remaining == 0);
+    if (no_body) {
+        stream->data_len = 0;
+        stream->body_remaining = 0;
+    }
+
+    h2_send_headers(session, stream->id, &block, no_body);
+    slowlog_mark(SLOW_QUEUED);
+    slowlog_end(stream->request, response, stream->request->body ? string_byte_length(stream->request->body) : 0,
+                block.len + stream->data_len + stream->body_remaining);
+    byte_buffer_free(&block);
+
+    if (no_body) {
+        h2_stream_close(session, stream, true);
+    } else {
+        h2_schedule(session, stream);
+    }
+}
+
+static Method h2_method(const String* value) {
+    static const struct {
+        const char* name;
+        Method method;
+    } methods[] = {
+        { "GET", HTTP_GET }, { "POST", HTTP_POST }, { "PUT", HTTP_PUT }, { "DELETE", HTTP_DELETE },
+        { "PATCH", HTTP_PATCH }, { "OPTIONS", HTTP_OPTIONS }, { "HEAD", HTTP_HEAD },
+    };
+    for (size_t i = 0; i < sizeof(methods) / sizeof(methods[0]); i++) {
+        if (string_equals_cstr(value, methods[i].name)) return methods[i].method;
+    }
+    return HTTP_UNKNOWN;
+}
+
+// queues the head of a handled request's response
+static void h2_stream_finish(H2Session* session, H2Stream* stream) {
+    HttpRequest* request = stream->request;
+    if (stream->response->sse) {
+        // event streams are only served over HTTP/1.1
+        http_response_free(stream->response);
+        stream->response = http_response_new(request->tag);
+        if (!stream->response) {
+            h2_stream_reset(session, stream, stream->id, H2_INTERNAL_ERROR);
+            return;
+        }
+        stream->response->status = HTTP_501;
+    }
+    h2_stream_respond(session, stream);
+}
+
+// a deferred response is complete, it goes out like any other
+static void h2_stream_resume(void* data) {
+    H2Stream* stream = data;
+    H2Session* session = stream->session;
+    // the resume may come from inside another request's handler, whose timeline is kept aside
+    SlowTimeline outer;
+    slowlog_save(&outer);
+    slowlog_restore(stream->slow);
+    stream->slow = NULL;
+    http_server_finish(session->server, stream->request, stream->response);
+    h2_stream_finish(session, stream);
+    slowlog_restore(&outer);
+    h2_flush(session);
+    session->notify(session->notify_data);
+}
+
+// runs the finished request through the layers and router
+static void h2_stream_dispatch(H2Session* session, H2Stream* stream) {
+    HttpRequest* request = stream->request;
+    stream->state = H2_STREAM_RESPONDING;
+    if (stream->body.len > 0) {
+        request->body = string_new_len((const char*)stream->body.data, stream->body.len, request->tag);
+    }
+    byte_buffer_free(&stream->body);
+
+    stream->response = http_response_new(request->tag);
+    if (!stream->response) {
+        h2_stream_reset(session, stream, stream->id, H2_INTERNAL_ERROR);
+        return;
+    }
+    request->received_ns = session->received_ns;
+    // the head was decoded as its frames arrived, the timeline picks up from there
+    slowlog_begin(session->received_ns);
+    slowlog_mark(SLOW_PARSE_END);
+    if (!loadshed_admit(request)) {
+        // refused before any layer or handler runs
+        Header retry = { .key = string_new("Retry-After", request->tag), .value = string_new("1", request->tag) };
+        if (!HeaderArray_push(stream->response->headers, retry)) {
+            string_free(retry.key);
+            string_free(retry.value);
+        }
+        stream->response->status = HTTP_503;
+        h2_stream_respond(session, stream);
+        return;
+    }
+    http_server_handle(session->server, request, stream->response);
+    if (stream->response->deferred) {
+        stream->response->resume = h2_stream_resume;
+        stream->response->resume_data = stream;
+        stream->slow = slowlog_detach(request->tag);
+        return;
+    }
+    h2_stream_finish(session, stream);
+}
+
+// Moves decoded fields into the request. Pseudo-headers come first and carry the
+// request line, :authority becomes Host. Returns false for a malformed request.
+static bool h2_stream_headers(H2Stream* stream, HeaderArray* fields) {
+    HttpRequest* request = stream->request;
+    bool regular_seen = false;
+    bool ok = true;
+    bool has_method = false;
+    bool has_path = false;
+
+    for (size_t i = 0; i < HeaderArray_size(fields); i++) {
+        Header field = fields->data[i];
+        const char* name = string_cstr(field.key);
+        bool keep = false;
+
+        for (const char* c = name; *c; c++) {
+            if (isupper((unsigned char)*c)) ok = false;
+        }
+
+        if (name[0] == ':') {
+            if (regular_seen) ok = false;
+            if (strcmp(name, ":method") == 0) {
+                request->request_line.method = h2_method(field.value);
+                has_method = true;
+            } else if (strcmp(name, ":path") == 0) {
+                if (request->request_line.target) string_free(request->request_line.target);
+                request->request_line.target = field.value;
+                field.value = NULL;
+                has_path = string_byte_length(request->request_line.target) > 0;
+            } else if (strcmp(name, ":authority") == 0) {
+                if (!http_request_get_header(request, "host")) {
+                    string_free(field.key);
+                    field.key = string_new("host", request->tag);
+                    keep = true;
+                }
+            } else if (strcmp(name, ":scheme") != 0) {
+                ok = false;
+            }
+        } else {
+            regular_seen = true;
+            keep = !h2_is_connection_header(name) || strcmp(name, "te") == 0;
+            if (!keep) ok = false;
+        }
+
+        if (keep && HeaderArray_push(request->headers, field)) continue;
+        string_free(field.key);
+        string_free(field.value);
+    }
+    HeaderArray_clear(fields);
+    return ok && has_method && has_path;
+}
+
+// the header block on `session->header_stream` is complete
+static bool h2_headers_done(H2Session* session) {
+    uint32_t id = session->header_stream;
+    bool end_stream = session->header_end_stream;
+    session->header_stream = 0;
+
+    H2Stream* stream = h2_stream_find(session, id);
+    bool new_stream = !stream && id > session->last_stream_id;
+    bool refused = new_stream && (session->stream_count >= H2_MAX_STREAMS || session->goaway_received);
+    if (new_stream && !refused) {
+        stream = h2_stream_new(session, id);
+        if (!stream) refused = true;
+    }
+
+    // the block is decoded no matter what, HPACK state depends on it
+    void* tag = stream ? TAG(stream) : session->tag;
+    HeaderArray fields;
+    if (!HeaderArray_init(&fields, tag)) return h2_connection_error(session, H2_INTERNAL_ERROR, "out of memory");
+    bool decoded = hpack_decode(&session->decoder, session->header_block.data, session->header_block.len, &fields, tag);
+    session->header_block.len = 0;
+    if (!decoded) {
+        for (size_t i = 0; i < HeaderArray_size(&fields); i++) {
+            string_free(fields.data[i].key);
+            string_free(fields.data[i].value);
+        }
+        HeaderArray_destroy(&fields);
+        return h2_connection_error(session, H2_COMPRESSION_ERROR, "header block");
+    }
+
+    bool ok = true;
+    if (!stream || refused || !new_stream) {
+        // trailers on a stream still sending its body are dropped, anything else is an error
+        for (size_t i = 0; i < HeaderArray_size(&fields); i++) {
+            string_free(fields.data[i].key);
+            string_free(fields.data[i].value);
+        }
+        if (refused) {
+            h2_frame_u32(session, H2_RST_STREAM, id, H2_REFUSED_STREAM);
+        } else if (!stream) {
+            ok = h2_connection_error(session, H2_PROTOCOL_ERROR, "HEADERS on a closed stream");
+        } else if (stream->state != H2_STREAM_OPEN || !end_stream) {
+            h2_stream_reset(session, stream, id, stream->state == H2_STREAM_OPEN ? H2_PROTOCOL_ERROR : H2_STREAM_CLOSED);
+        } else {
+            h2_stream_dispatch(session, stream);
+        }
+        HeaderArray_destroy(&fields);
+        return ok;
+    }
+
+    bool valid = h2_stream_headers(stream, &fields);
+    HeaderArray_destroy(&fields);
+    if (!valid) {
+        h2_stream_reset(session, stream, id, H2_PROTOCOL_ERROR);
+    } else if (end_stream) {
+        h2_stream_dispatch(session, stream);
+    }
+    return true;
+}
+
+// strips padding from DATA and HEADERS payloads
+static bool h2_unpad(uint8_t flags, const uint8_t** payload, size_t* len) {
+    if (!(flags & H2_FLAG_PADDED)) return true;
+    if (*len < 1) return false;
+
+    size_t pad = (*payload)[0];
+    if (pad >= *len) return false;
+    (*payload)++;
+    *len -= 1 + pad;
+    return true;
+}
+
+static bool h2_on_headers(H2Session* session, uint8_t flags, uint32_t id, const uint8_t* payload, size_t len) {
+    if (id == 0 || (id % 2) == 0) return h2_connection_error(session, H2_PROTOCOL_ERROR, "HEADERS stream id");
+    if (!h2_unpad(flags, &payload, &len)) return h2_connection_error(session, H2_PROTOCOL_ERROR, "HEADERS padding");
+
+    H2Stream* stream = h2_stream_find(session, id);
+    if (!stream && id <= session->last_stream_id) {
+        return h2_connection_error(session, H2_STREAM_CLOSED, "HEADERS on a closed stream");
+    }
+
+    uint16_t weight = H2_DEFAULT_WEIGHT;
+    if (flags & H2_FLAG_PRIORITY) {
+        if (len < 5) return h2_connection_error(session, H2_FRAME_SIZE_ERROR, "HEADERS priority");
+        weight = (uint16_t)(payload[4] + 1);
+        payload += 5;
+        len -= 5;
+    }
+
+    session->header_stream = id;
+    session->header_end_stream = flags & H2_FLAG_END_STREAM;
+    session->header_block.len = 0;
+    if (session->header_block.len + len > HPACK_MAX_HEADER_LIST || !byte_buffer_append(&session->header_block, payload, len)) {
+        return h2_connection_error(session, H2_PROTOCOL_ERROR, "header block too large");
+    }
+    if (!(flags & H2_FLAG_END_HEADERS)) return true;
+
+    if (!h2_headers_done(session)) return false;
+    stream = h2_stream_find(session, id);
+    if (stream) stream->weight = weight;
+    return true;
+}
+
+static bool h2_on_continuation(H2Session* session, uint8_t flags, uint32_t id, const uint8_t* payload, size_t len) {
+    if (session->header_stream == 0 || id != session->header_stream) {
+        return h2_connection_error(session, H2_PROTOCOL_ERROR, "unexpected CONTINUATION");
+    }
+    if (session->header_block.len + len > HPACK_MAX_HEADER_LIST || !byte_buffer_append(&session->header_block, payload, len)) {
+        return h2_connection_error(session, H2_PROTOCOL_ERROR, "header block too large");
+    }
+    return (flags & H2_FLAG_END_HEADERS) ? h2_headers_done(session) : true;
+}
+
+static bool h2_on_data(H2Session* session, uint8_t flags, uint32_t id, const uint8_t* payload, size_t len) {
+    if (id == 0) return h2_connection_error(session, H2_PROTOCOL_ERROR, "DATA on stream 0");
+
+    // the whole payload, padding included, counts against both windows
+    session->recv_window -= (int64_t)len;
+    if (session->recv_window < 0) return h2_connection_error(session, H2_FLOW_CONTROL_ERROR, "connection window");
+    if (session->recv_window < H2_CONNECTION_WINDOW / 2) {
+        h2_frame_u32(session, H2_WINDOW_UPDATE, 0, (uint32_t)(H2_CONNECTION_WINDOW - session->recv_window));
+        session->recv_window = H2_CONNECTION_WINDOW;
+    }
+
+    H2Stream* stream = h2_stream_find(session, id);
+    if (!stream) {
+        if (id > session->last_stream_id) return h2_connection_error(session, H2_PROTOCOL_ERROR, "DATA on an idle stream");
+        h2_frame_u32(session, H2_RST_STREAM, id, H2_STREAM_CLOSED);
+        return true;
+    }
+    if (stream->state != H2_STREAM_OPEN) {
+        h2_stream_reset(session, stream, id, H2_STREAM_CLOSED);
+        return true;
+    }
+
+    stream->recv_window -= (int64_t)len;
+    if (stream->recv_window < 0) {
+        h2_stream_reset(session, stream, id, H2_FLOW_CONTROL_ERROR);
+        return true;
+    }
+    if (!h2_unpad(flags, &payload, &len)) return h2_connection_error(session, H2_PROTOCOL_ERROR, "DATA padding");
+
+    if (stream->body.len + len > SERVER_MAX_REQUEST_SIZE || !byte_buffer_append(&stream->body, payload, len)) {
+        printf("HTTP/2 request body exceeds the limit\n");
+        h2_stream_reset(session, stream, id, H2_CANCEL);
+        return true;
+    }
+
+    if (flags & H2_FLAG_END_STREAM) {
+        h2_stream_dispatch(session, stream);
+    } else if (stream->recv_window < H2_STREAM_WINDOW / 2) {
+        h2_frame_u32(session, H2_WINDOW_UPDATE, id, (uint32_t)(H2_STREAM_WINDOW - stream->recv_window));
+        stream->recv_window = H2_STREAM_WINDOW;
+    }
+    return true;
+}
+
+// SETTINGS payload, from a frame or the HTTP2-Settings header of an upgrade
+static bool h2_apply_settings(H2Session* session, const uint8_t* payload, size_t len) {
+    if (len % 6 != 0) return h2_connection_error(session, H2_FRAME_SIZE_ERROR, "SETTINGS length");
+
+    for (size_t i = 0; i < len; i += 6) {
+        uint16_t id = (uint16_t)((payload[i] << 8) | payload[i + 1]);
+        uint32_t value = h2_read_u32(payload + i + 2);
+
+        switch (id) {
+            case H2_SETTINGS_HEADER_TABLE_SIZE:
+                hpack_table_resize(&session->encoder, value);
+                break;
+            case H2_SETTINGS_ENABLE_PUSH:
+                if (value > 1) return h2_connection_error(session, H2_PROTOCOL_ERROR, "ENABLE_PUSH");
+                break;
+            case H2_SETTINGS_INITIAL_WINDOW_SIZE: {
+                if (value > H2_MAX_WINDOW) return h2_connection_error(session, H2_FLOW_CONTROL_ERROR, "INITIAL_WINDOW_SIZE");
+                // applies to every open stream as a delta
+                int64_t delta = (int64_t)value - session->peer_initial_window;
+                session->peer_initial_window = value;
+                for (H2Stream* stream = session->streams; stream; stream = stream->next) {
+                    stream->send_window += delta;
+                    if (stream->send_window > H2_MAX_WINDOW) {
+                        return h2_connection_error(session, H2_FLOW_CONTROL_ERROR, "stream window overflow");
+                    }
+                    if (stream->send_window > 0) h2_schedule(session, stream);
+                }
+                break;
+            }
+            case H2_SETTINGS_MAX_FRAME_SIZE:
+                if (value < H2_DEFAULT_FRAME_SIZE || value > 0xffffff) {
+                    return h2_connection_error(session, H2_PROTOCOL_ERROR, "MAX_FRAME_SIZE");
+                }
+                session->peer_max_frame = value;
+                break;
+            default:
+                // MAX_CONCURRENT_STREAMS only limits pushes, unknown settings are ignored
+                break;
+        }
+    }
+    return true;
+}
+
+static bool h2_on_frame(H2Session* session, H2FrameType type, uint8_t flags, uint32_t id,
+                        const uint8_t* payload, size_t len) {
+    if (session->header_stream != 0 && type != H2_CONTINUATION) {
+        return h2_connection_error(session, H2_PROTOCOL_ERROR, "header block interrupted");
+    }
+    if (!session->settings_received && type != H2_SETTINGS) {
+        return h2_connection_error(session, H2_PROTOCOL_ERROR, "preface without SETTINGS");
+    }
+
+    switch (type) {
+        case H2_DATA:
+            return h2_on_data(session, flags, id, payload, len);
+        case H2_HEADERS:
+            return h2_on_headers(session, flags, id, payload, len);
+        case H2_CONTINUATION:
+            return h2_on_continuation(session, flags, id, payload, len);
+
+        case H2_PRIORITY: {
+            if (id == 0) return h2_connection_error(session, H2_PROTOCOL_ERROR, "PRIORITY on stream 0");
+            if (len != 5) {
+                h2_stream_reset(session, h2_stream_find(session, id), id, H2_FRAME_SIZE_ERROR);
+                return true;
+            }
+            H2Stream* stream = h2_stream_find(session, id);
+            if (stream) stream->weight = (uint16_t)(payload[4] + 1);
+            return true;
+        }
+
+        case H2_RST_STREAM: {
+            if (id == 0) return h2_connection_error(session, H2_PROTOCOL_ERROR, "RST_STREAM on stream 0");
+            if (len != 4) return h2_connection_error(session, H2_FRAME_SIZE_ERROR, "RST_STREAM length");
+            if (id > session->last_stream_id) return h2_connection_error(session, H2_PROTOCOL_ERROR, "RST_STREAM on an idle stream");
+            H2Stream* stream = h2_stream_find(session, id);
+            if (stream) h2_stream_close(session, stream, false);
+            return true;
+        }
+
+        case H2_SETTINGS:
+            if (id != 0) return h2_connection_error(session, H2_PROTOCOL_ERROR, "SETTINGS on a stream");
+            if (flags & H2_FLAG_ACK) {
+                if (len != 0) return h2_connection_error(session, H2_FRAME_SIZE_ERROR, "SETTINGS ack with payload");
+                return true;
+            }
+            if (!h2_apply_settings(session, payload, len)) return false;
+            session->settings_received = true;
+            h2_frame(session, H2_SETTINGS, H2_FLAG_ACK, 0, NULL, 0);
+            return true;
+
+        case H2_PUSH_PROMISE:
+            return h2_connection_error(session, H2_PROTOCOL_ERROR, "PUSH_PROMISE from a client");
+
+        case H2_PING:
+            if (id != 0) return h2_connection_error(session, H2_PROTOCOL_ERROR, "PING on a stream");
+            if (len != 8) return h2_connection_error(session, H2_FRAME_SIZE_ERROR, "PING length");
+            if (!(flags & H2_FLAG_ACK)) h2_frame(session, H2_PING, H2_FLAG_ACK, 0, payload, len);
+            return true;
+
+        case H2_GOAWAY:
+            if (id != 0) return h2_connection_error(session, H2_PROTOCOL_ERROR, "GOAWAY on a stream");
+            if (len < 8) return h2_connection_error(session, H2_FRAME_SIZE_ERROR, "GOAWAY length");
+            session->goaway_received = true;
+            return true;
+
+        case H2_WINDOW_UPDATE: {
+            if (len != 4) return h2_connection_error(session, H2_FRAME_SIZE_ERROR, "WINDOW_UPDATE length");
+            uint32_t increment = h2_read_u32(payload) & 0x7fffffff;
+            if (id == 0) {
+                if (increment == 0) return h2_connection_error(session, H2_PROTOCOL_ERROR, "WINDOW_UPDATE of 0");
+                session->send_window += increment;
+                if (session->send_window > H2_MAX_WINDOW) {
+                    return h2_connection_error(session, H2_FLOW_CONTROL_ERROR, "connection window overflow");
+                }
+                return true;
+            }
+
+            H2Stream* stream = h2_stream_find(session, id);
+            if (!stream) {
+                if (id > session->last_stream_id) return h2_connection_error(session, H2_PROTOCOL_ERROR, "WINDOW_UPDATE on an idle stream");
+                return true;
+            }
+            if (increment == 0) {
+                h2_stream_reset(session, stream, id, H2_PROTOCOL_ERROR);
+                return true;
+            }
+            stream->send_window += increment;
+            if (stream->send_window > H2_MAX_WINDOW) {
+                h2_stream_reset(session, stream, id, H2_FLOW_CONTROL_ERROR);
+                return true;
+            }
+            h2_schedule(session, stream);
+            return true;
+        }
+
+        default:
+            // unknown frame types are ignored
+            return true;
+    }
+}
+
+bool h2_session_input(H2Session* session, const char* data, size_t len, size_t* used) {
+    if (!session || !used) return false;
+
+    *used = 0;
+    if (session->failed) return false;
+
+    const uint8_t* p = (const uint8_t*)data;
+    size_t offset = 0;
+    bool ok = true;
+
+    if (!session->preface_received) {
+        int preface = h2_preface_check(data, len);
+        if (preface < 0) {
+            ok = h2_connection_error(session, H2_PROTOCOL_ERROR, "bad connection preface");
+        } else if (preface == 0) {
+            return true;
+        } else {
+            session->preface_received = true;
+            offset = H2_PREFACE_LEN;
+        }
+    }
+
+    while (ok && len - offset >= H2_FRAME_HEADER_SIZE) {
+        const uint8_t* header = p + offset;
+        size_t frame_len = ((size_t)header[0] << 16) | ((size_t)header[1] << 8) | header[2];
+        if (frame_len > H2_DEFAULT_FRAME_SIZE) {
+            ok = h2_connection_error(session, H2_FRAME_SIZE_ERROR, "frame larger than SETTINGS_MAX_FRAME_SIZE");
+            break;
+        }
+        if (len - offset - H2_FRAME_HEADER_SIZE < frame_len) break;
+
+        H2FrameType type = (H2FrameType)header[3];
+        uint8_t flags = header[4];
+        uint32_t id = h2_read_u32(header + 5) & 0x7fffffff;
+        offset += H2_FRAME_HEADER_SIZE + frame_len;
+        ok = h2_on_frame(session, type, flags, id, header + H2_FRAME_HEADER_SIZE, frame_len);
+    }
+
+    *used = offset;
+    h2_flush(session);
+    return ok && !session->failed;
+}
+
+static bool h2_base64url_decode(const char* text, ByteBuffer* out) {
+    uint32_t acc = 0;
+    int bits = 0;
+    for (const char* c = text; *c && *c != '='; c++) {
+        int value;
+        if (*c >= 'A' && *c <= 'Z') value = *c - 'A';
+        else if (*c >= 'a' && *c <= 'z') value = *c - 'a' + 26;
+        else if (*c >= '0' && *c <= '9') value = *c - '0' + 52;
+        else if (*c == '-' || *c == '+') value = 62;
+        else if (*c == '_' || *c == '/') value = 63;
+        else return false;
+
+        acc = (acc << 6) | (uint32_t)value;
+        bits += 6;
+        if (bits >= 8) {
+            bits -= 8;
+            if (!byte_buffer_push(out, (uint8_t)(acc >> bits))) return false;
+        }
+    }
+    return true;
+}
+
+bool h2_session_upgrade(H2Session* session, HttpRequest* request, const char* settings) {
+    if (!session || !request || !settings) return false;
+
+    ByteBuffer decoded;
+    byte_buffer_init(&decoded, session->tag);
+    bool ok = h2_base64url_decode(settings, &decoded) && h2_apply_settings(session, decoded.data, decoded.len);
+    byte_buffer_free(&decoded);
+    if (!ok) {
+        h2_flush(session);
+        return false;
+    }
+
+    // the upgrading request becomes stream 1, already half-closed by the client
+    H2Stream* stream = h2_stream_new(session, 1);
+    if (!stream) return false;
+
+    HttpRequest* copy = stream->request;
+    void* tag = copy->tag;
+    copy->request_line.method = request->request_line.method;
+    copy->request_line.target = string_new(string_cstr(request->request_line.target), tag);
+    for (size_t i = 0; i < HeaderArray_size(request->headers); i++) {
+        Header* header = &request->headers->data[i];
+        const char* name = string_cstr(header->key);
+        if (h2_is_connection_header(name) || strcasecmp(name, "HTTP2-Settings") == 0) continue;
+
+        Header field = { .key = string_new(name, tag), .value = string_new(string_cstr(header->value), tag) };
+        if (!field.key || !field.value || !HeaderArray_push(copy->headers, field)) {
+            string_free(field.key);
+            string_free(field.value);
+        }
+    }
+    if (request->body && string_byte_length(request->body) > 0) {
+        byte_buffer_append(&stream->body, string_bytes(request->body), string_byte_length(request->body));
+    }
+
+    h2_stream_dispatch(session, stream);
+    h2_flush(session);
+    return true;
+}
+
+// the descriptor of a streamed body has bytes again, or reached its end
+static void h2_stream_on_body(EventLoop* loop, int fd, uint32_t events, void* data) {
+    (void)fd;
+    (void)events;
+    H2Stream* stream = data;
+    H2Session* session = stream->session;
+    event_loop_remove(loop, stream->body_watch);
+    stream->body_watch = NULL;
+    event_timer_cancel(loop, stream->body_timer);
+    stream->body_timer = NULL;
+
+    h2_schedule(session, stream);
+    session->notify(session->notify_data);
+}
+
+static void h2_stream_on_body_timeout(EventLoop* loop, void* data) {
+    H2Stream* stream = data;
+    H2Session* session = stream->session;
+    stream->body_timer = NULL; // one-shot, freed once this returns
+    event_loop_remove(loop, stream->body_watch);
+    stream->body_watch = NULL;
+
+    printf("HTTP/2 body source stalled on stream %u\n", stream->id);
+    h2_stream_reset(session, stream, stream->id, H2_INTERNAL_ERROR);
+    h2_flush(session);
+    session->notify(session->notify_data);
+}
+
+// takes the stream off the schedule until its body descriptor is readable
+static bool h2_stream_wait_body(H2Session* session, H2Stream* stream) {
+    stream->body_watch = event_loop_add(session->loop, stream->body_fd, EV_READ, 0, h2_stream_on_body, stream);
+    if (!stream->body_watch) return false;
+    stream->body_timer = event_timer_add(session->loop, H2_BODY_READ_TIMEOUT_MS, 0, h2_stream_on_body_timeout, stream);
+    if (!stream->body_timer) {
+        event_loop_remove(session->loop, stream->body_watch);
+        stream->body_watch = NULL;
+        return false;
+    }
+    return true;
+}
+
+// One DATA frame of up to `max` bytes from the stream's body. Returns the bytes sent.
+// 0 means the stream was reset, when `*waiting` is set instead a streamed body had
+// nothing to read yet and the stream waits on its descriptor.
+static size_t h2_stream_send(H2Session* session, H2Stream* stream, size_t max, bool* waiting) {
+    *waiting = false;
+    size_t from_data = stream->data_len - stream->data_sent;
+    size_t len = from_data + stream->body_remaining;
+    if (len > max) len = max;
+    size_t take = from_data < len ? from_data : len;
+    size_t want = len - take;
+
+    // the header is filled in once the length is known, a streamed body may have less ready
+    size_t header_at = session->pending.len;
+    if (!byte_buffer_reserve(&session->pending, H2_FRAME_HEADER_SIZE + len)) {
+        h2_stream_reset(session, stream, stream->id, H2_INTERNAL_ERROR);
+        return 0;
+    }
+    session->pending.len += H2_FRAME_HEADER_SIZE;
+    byte_buffer_append(&session->pending, stream->data + stream->data_sent, take);
+    stream->data_sent += take;
+
+    // descriptor bytes are read straight into the frame
+    size_t got = 0;
+    bool blocked = false;
+    while (got < want) {
+        uint8_t* dest = session->pending.data + session->pending.len;
+        ssize_t n = stream->body_done
+            ? read(stream->body_fd, dest, want - got)
+            : pread(stream->body_fd, dest, want - got, stream->body_offset);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            // a streamed upstream body that hasn't arrived yet
+            blocked = true;
+            break;
+        }
+        if (n <= 0) break;
+        session->pending.len += (size_t)n;
+        stream->body_offset += n;
+        got += (size_t)n;
+    }
+    stream->body_remaining -= got;
+
+    if (got < want && !blocked) {
+        // the body source ended early, nothing to do but end the stream abnormally
+        printf("HTTP/2 body source ended early on stream %u\n", stream->id);
+        session->pending.len = header_at;
+        h2_stream_reset(session, stream, stream->id, H2_INTERNAL_ERROR);
+        return 0;
+    }
+
+    len = take + got;
+    if (len == 0) {
+        session->pending.len = header_at;
+        if (!h2_stream_wait_body(session, stream)) {
+            h2_stream_reset(session, stream, stream->id, H2_INTERNAL_ERROR);
+            return 0;
+        }
+        *waiting = true;
+        return 0;
+    }
+    bool last = stream->data_len == stream->data_sent && stream->body_remaining == 0;
+    h2_frame_header_write(session->pending.data + header_at, len, H2_DATA, last ? H2_FLAG_END_STREAM : 0, stream->id);
+    return len;
+}
+
+bool h2_session_pump(H2Session* session) {
+    // after an upgrade, DATA waits until the client's preface and SETTINGS are in
+    if (!session || session->failed || !session->settings_received) return false;
+
+    size_t queued_before = sendq_pending(session->out) + session->pending.len;
+    while (session->ready_head && session->send_window > 0 && !sendq_above_high_water(session->out)) {
+        H2Stream* stream = session->ready_head;
+        session->ready_head = stream->ready_next;
+        if (!session->ready_head) session->ready_tail = NULL;
+        stream->ready_next = NULL;
+        stream->ready = false;
+
+        // deficit round robin, a stream's share of each round follows its weight
+        if (stream->deficit <= 0) stream->deficit += (int64_t)stream->weight * H2_QUANTUM_PER_WEIGHT;
+
+        bool reset = false;
+        bool waiting = false;
+        while (stream->deficit > 0 && stream->send_window > 0 && session->send_window > 0
+               && (stream->data_len - stream->data_sent) + stream->body_remaining > 0) {
+            size_t max = session->peer_max_frame;
+            if ((int64_t)max > stream->send_window) max = (size_t)stream->send_window;
+            if ((int64_t)max > session->send_window) max = (size_t)session->send_window;
+
+            size_t sent = h2_stream_send(session, stream, max, &waiting);
+            if (sent == 0) {
+                reset = !waiting;
+                break;
+            }
+            stream->send_window -= (int64_t)sent;
+            session->send_window -= (int64_t)sent;
+            stream->deficit -= (int64_t)sent;
+            if (session->pending.len >= SENDQ_LOW_WATER) h2_flush(session);
+            if (sendq_above_high_water(session->out)) break;
+        }
+        // a waiting stream is scheduled again by h2_stream_on_body
+        if (reset || waiting) continue;
+
+        if ((stream->data_len - stream->data_sent) + stream->body_remaining == 0) {
+            h2_stream_close(session, stream, true);
+        } else if (stream->send_window > 0) {
+            // a stream out of connection window keeps its place at the front
+            if (session->send_window <= 0 && stream->deficit > 0) {
+                stream->ready_next = session->ready_head;
+                session->ready_head = stream;
+                if (!session->ready_tail) session->ready_tail = stream;
+                stream->ready = true;
+            } else {
+                h2_schedule(session, stream);
+            }
+        }
+        // a stream out of its own window waits for a WINDOW_UPDATE to reschedule it
+    }
+
+    h2_flush(session);
+    return sendq_pending(session->out) > queued_before;
+}
+
+bool h2_session_finished(const H2Session* session) {
+    if (!session) return true;
+    return session->failed || (session->goaway_received && session->stream_count == 0);
+}
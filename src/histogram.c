@@ -0,0 +1,66 @@
+#include <string.h>
+#include "histogram.h"
+
+void histogram_init(Histogram* histogram) {
+    memset(histogram, 0, sizeof(Histogram));
+    histogram->min = UINT64_MAX;
+}
+
+static size_t histogram_index(uint64_t value) {
+    if (value < HISTOGRAM_SUB_BUCKETS) return (size_t)value;
+
+    // keep the top HISTOGRAM_SUB_BITS bits, the leading one is implied by the exponent
+    unsigned shift = (unsigned)(63 - __builtin_clzll(value)) - (HISTOGRAM_SUB_BITS - 1);
+    size_t sub = (size_t)(value >> shift) - HISTOGRAM_SUB_BUCKETS / 2;
+    return HISTOGRAM_SUB_BUCKETS + (shift - 1) * (HISTOGRAM_SUB_BUCKETS / 2) + sub;
+}
+
+// the largest value that maps to `index`
+static uint64_t histogram_highest(size_t index) {
+    if (index < HISTOGRAM_SUB_BUCKETS) return index;
+
+    size_t shift = (index - HISTOGRAM_SUB_BUCKETS) / (HISTOGRAM_SUB_BUCKETS / 2) + 1;
+    uint64_t sub = (index - HISTOGRAM_SUB_BUCKETS) % (HISTOGRAM_SUB_BUCKETS / 2) + HISTOGRAM_SUB_BUCKETS / 2;
+    return ((sub + 1) << shift) - 1;
+}
+
+void histogram_record(Histogram* histogram, uint64_t value) {
+    histogram->counts[histogram_index(value)]++;
+    histogram->total++;
+    histogram->sum += (double)value;
+    if (value < histogram->min) histogram->min = value;
+    if (value > histogram->max) histogram->max = value;
+}
+
+void histogram_merge(Histogram* histogram, const Histogram* other) {
+    for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        histogram->counts[i] += other->counts[i];
+    }
+    histogram->total += other->total;
+    histogram->sum += other->sum;
+    if (other->min < histogram->min) histogram->min = other->min;
+    if (other->max > histogram->max) histogram->max = other->max;
+}
+
+uint64_t histogram_percentile(const Histogram* histogram, double percentile) {
+    if (histogram->total == 0) return 0;
+    if (percentile >= 100.0) return histogram->max;
+
+    // the rank of the value, counting from 1, as HdrHistogram does
+    uint64_t rank = (uint64_t)(percentile / 100.0 * (double)histogram->total + 0.5);
+    if (rank == 0) rank = 1;
+
+    uint64_t seen = 0;
+    for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += histogram->counts[i];
+        if (seen >= rank) {
+            uint64_t value = histogram_highest(i);
+            return value < histogram->max ? value : histogram->max;
+        }
+    }
+    return histogram->max;
+}
+
+double histogram_mean(const Histogram* histogram) {
+    return histogram->total ? histogram->sum / (double)histogram->total : 0.0;
+}
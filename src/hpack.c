@@ -0,0 +1,480 @@
+#include <pthread.h>
+#include <string.h>
+#include <strings.h>
+#include "alloc.h"
+#include "hpack.h"
+
+typedef struct {
+    const char* name;
+    const char* value;
+} HpackStatic;
+
+// RFC 7541 Appendix A, index 1 first
+static const HpackStatic hpack_static[HPACK_STATIC_ENTRIES] = {
+    { ":authority", "" },
+    { ":method", "GET" },
+    { ":method", "POST" },
+    { ":path", "/" },
+    { ":path", "/index.html" },
+    { ":scheme", "http" },
+    { ":scheme", "https" },
+    { ":status", "200" },
+    { ":status", "204" },
+    { ":status", "206" },
+    { ":status", "304" },
+    { ":status", "400" },
+    { ":status", "404" },
+    { ":status", "500" },
+    { "accept-charset", "" },
+    { "accept-encoding", "gzip, deflate" },
+    { "accept-language", "" },
+    { "accept-ranges", "" },
+    { "accept", "" },
+    { "access-control-allow-origin", "" },
+    { "age", "" },
+    { "allow", "" },
+    { "authorization", "" },
+    { "cache-control", "" },
+    { "content-disposition", "" },
+    { "content-encoding", "" },
+    { "content-language", "" },
+    { "content-length", "" },
+    { "content-location", "" },
+    { "content-range", "" },
+    { "content-type", "" },
+    { "cookie", "" },
+    { "date", "" },
+    { "etag", "" },
+    { "expect", "" },
+    { "expires", "" },
+    { "from", "" },
+    { "host", "" },
+    { "if-match", "" },
+    { "if-modified-since", "" },
+    { "if-none-match", "" },
+    { "if-range", "" },
+    { "if-unmodified-since", "" },
+    { "last-modified", "" },
+    { "link", "" },
+    { "location", "" },
+    { "max-forwards", "" },
+    { "proxy-authenticate", "" },
+    { "proxy-authorization", "" },
+    { "range", "" },
+    { "referer", "" },
+    { "refresh", "" },
+    { "retry-after", "" },
+    { "server", "" },
+    { "set-cookie", "" },
+    { "strict-transport-security", "" },
+    { "transfer-encoding", "" },
+    { "user-agent", "" },
+    { "vary", "" },
+    { "via", "" },
+    { "www-authenticate", "" },
+};
+
+typedef struct {
+    uint32_t code;
+    uint8_t bits;
+} HpackCode;
+
+// RFC 7541 Appendix B, indexed by symbol, 256 is EOS
+static const HpackCode hpack_huffman[257] = {
+    { 0x1ff8, 13 }, { 0x7fffd8, 23 }, { 0xfffffe2, 28 }, { 0xfffffe3, 28 }, { 0xfffffe4, 28 }, { 0xfffffe5, 28 },
+    { 0xfffffe6, 28 }, { 0xfffffe7, 28 }, { 0xfffffe8, 28 }, { 0xffffea, 24 }, { 0x3ffffffc, 30 }, { 0xfffffe9, 28 },
+    { 0xfffffea, 28 }, { 0x3ffffffd, 30 }, { 0xfffffeb, 28 }, { 0xfffffec, 28 }, { 0xfffffed, 28 }, { 0xfffffee, 28 },
+    { 0xfffffef, 28 }, { 0xffffff0, 28 }, { 0xffffff1, 28 }, { 0xffffff2, 28 }, { 0x3ffffffe, 30 }, { 0xffffff3, 28 },
+    { 0xffffff4, 28 }, { 0xffffff5, 28 }, { 0xffffff6, 28 }, { 0xffffff7, 28 }, { 0xffffff8, 28 }, { 0xffffff9, 28 },
+    { 0xffffffa, 28 }, { 0xffffffb, 28 }, { 0x14, 6 }, { 0x3f8, 10 }, { 0x3f9, 10 }, { 0xffa, 12 },
+    { 0x1ff9, 13 }, { 0x15, 6 }, { 0xf8, 8 }, { 0x7fa, 11 }, { 0x3fa, 10 }, { 0x3fb, 10 },
+    { 0xf9, 8 }, { 0x7fb, 11 }, { 0xfa, 8 }, { 0x16, 6 }, { 0x17, 6 }, { 0x18, 6 },
+    { 0x0, 5 }, { 0x1, 5 }, { 0x2, 5 }, { 0x19, 6 }, { 0x1a, 6 }, { 0x1b, 6 },
+    { 0x1c, 6 }, { 0x1d, 6 }, { 0x1e, 6 }, { 0x1f, 6 }, { 0x5c, 7 }, { 0xfb, 8 },
+    { 0x7ffc, 15 }, { 0x20, 6 }, { 0xffb, 12 }, { 0x3fc, 10 }, { 0x1ffa, 13 }, { 0x21, 6 },
+    { 0x5d, 7 }, { 0x5e, 7 }, { 0x5f, 7 }, { 0x60, 7 }, { 0x61, 7 }, { 0x62, 7 },
+    { 0x63, 7 }, { 0x64, 7 }, { 0x65, 7 }, { 0x66, 7 }, { 0x67, 7 }, { 0x68, 7 },
+    { 0x69, 7 }, { 0x6a, 7 }, { 0x6b, 7 }, { 0x6c, 7 }, { 0x6d, 7 }, { 0x6e, 7 },
+    { 0x6f, 7 }, { 0x70, 7 }, { 0x71, 7 }, { 0x72, 7 }, { 0xfc, 8 }, { 0x73, 7 },
+    { 0xfd, 8 }, { 0x1ffb, 13 }, { 0x7fff0, 19 }, { 0x1ffc, 13 }, { 0x3ffc, 14 }, { 0x22, 6 },
+    { 0x7ffd, 15 }, { 0x3, 5 }, { 0x23, 6 }, { 0x4, 5 }, { 0x24, 6 }, { 0x5, 5 },
+    { 0x25, 6 }, { 0x26, 6 }, { 0x27, 6 }, { 0x6, 5 }, { 0x74, 7 }, { 0x75, 7 },
+    { 0x28, 6 }, { 0x29, 6 }, { 0x2a, 6 }, { 0x7, 5 }, { 0x2b, 6 }, { 0x76, 7 },
+    { 0x2c, 6 }, { 0x8, 5 }, { 0x9, 5 }, { 0x2d, 6 }, { 0x77, 7 }, { 0x78, 7 },
+    { 0x79, 7 }, { 0x7a, 7 }, { 0x7b, 7 }, { 0x7ffe, 15 }, { 0x7fc, 11 }, { 0x3ffd, 14 },
+    { 0x1ffd, 13 }, { 0xffffffc, 28 }, { 0xfffe6, 20 }, { 0x3fffd2, 22 }, { 0xfffe7, 20 }, { 0xfffe8, 20 },
+    { 0x3fffd3, 22 }, { 0x3fffd4, 22 }, { 0x3fffd5, 22 }, { 0x7fffd9, 23 }, { 0x3fffd6, 22 }, { 0x7fffda, 23 },
+    { 0x7fffdb, 23 }, { 0x7fffdc, 23 }, { 0x7fffdd, 23 }, { 0x7fffde, 23 }, { 0xffffeb, 24 }, { 0x7fffdf, 23 },
+    { 0xffffec, 24 }, { 0xffffed, 24 }, { 0x3fffd7, 22 }, { 0x7fffe0, 23 }, { 0xffffee, 24 }, { 0x7fffe1, 23 },
+    { 0x7fffe2, 23 }, { 0x7fffe3, 23 }, { 0x7fffe4, 23 }, { 0x1fffdc, 21 }, { 0x3fffd8, 22 }, { 0x7fffe5, 23 },
+    { 0x3fffd9, 22 }, { 0x7fffe6, 23 }, { 0x7fffe7, 23 }, { 0xffffef, 24 }, { 0x3fffda, 22 }, { 0x1fffdd, 21 },
+    { 0xfffe9, 20 }, { 0x3fffdb, 22 }, { 0x3fffdc, 22 }, { 0x7fffe8, 23 }, { 0x7fffe9, 23 }, { 0x1fffde, 21 },
+    { 0x7fffea, 23 }, { 0x3fffdd, 22 }, { 0x3fffde, 22 }, { 0xfffff0, 24 }, { 0x1fffdf, 21 }, { 0x3fffdf, 22 },
+    { 0x7fffeb, 23 }, { 0x7fffec, 23 }, { 0x1fffe0, 21 }, { 0x1fffe1, 21 }, { 0x3fffe0, 22 }, { 0x1fffe2, 21 },
+    { 0x7fffed, 23 }, { 0x3fffe1, 22 }, { 0x7fffee, 23 }, { 0x7fffef, 23 }, { 0xfffea, 20 }, { 0x3fffe2, 22 },
+    { 0x3fffe3, 22 }, { 0x3fffe4, 22 }, { 0x7ffff0, 23 }, { 0x3fffe5, 22 }, { 0x3fffe6, 22 }, { 0x7ffff1, 23 },
+    { 0x3ffffe0, 26 }, { 0x3ffffe1, 26 }, { 0xfffeb, 20 }, { 0x7fff1, 19 }, { 0x3fffe7, 22 }, { 0x7ffff2, 23 },
+    { 0x3fffe8, 22 }, { 0x1ffffec, 25 }, { 0x3ffffe2, 26 }, { 0x3ffffe3, 26 }, { 0x3ffffe4, 26 }, { 0x7ffffde, 27 },
+    { 0x7ffffdf, 27 }, { 0x3ffffe5, 26 }, { 0xfffff1, 24 }, { 0x1ffffed, 25 }, { 0x7fff2, 19 }, { 0x1fffe3, 21 },
+    { 0x3ffffe6, 26 }, { 0x7ffffe0, 27 }, { 0x7ffffe1, 27 }, { 0x3ffffe7, 26 }, { 0x7ffffe2, 27 }, { 0xfffff2, 24 },
+    { 0x1fffe4, 21 }, { 0x1fffe5, 21 }, { 0x3ffffe8, 26 }, { 0x3ffffe9, 26 }, { 0xffffffd, 28 }, { 0x7ffffe3, 27 },
+    { 0x7ffffe4, 27 }, { 0x7ffffe5, 27 }, { 0xfffec, 20 }, { 0xfffff3, 24 }, { 0xfffed, 20 }, { 0x1fffe6, 21 },
+    { 0x3fffe9, 22 }, { 0x1fffe7, 21 }, { 0x1fffe8, 21 }, { 0x7ffff3, 23 }, { 0x3fffea, 22 }, { 0x3fffeb, 22 },
+    { 0x1ffffee, 25 }, { 0x1ffffef, 25 }, { 0xfffff4, 24 }, { 0xfffff5, 24 }, { 0x3ffffea, 26 }, { 0x7ffff4, 23 },
+    { 0x3ffffeb, 26 }, { 0x7ffffe6, 27 }, { 0x3ffffec, 26 }, { 0x3ffffed, 26 }, { 0x7ffffe7, 27 }, { 0x7ffffe8, 27 },
+    { 0x7ffffe9, 27 }, { 0x7ffffea, 27 }, { 0x7ffffeb, 27 }, { 0xffffffe, 28 }, { 0x7ffffec, 27 }, { 0x7ffffed, 27 },
+    { 0x7ffffee, 27 }, { 0x7ffffef, 27 }, { 0x7fffff0, 27 }, { 0x3ffffee, 26 }, { 0x3fffffff, 30 },
+};
+
+// Decoding tree built from the code table. Children are node indices, leaves are
+// stored as -(symbol + 1).
+#define HPACK_TREE_NODES 512
+static int16_t hpack_tree[HPACK_TREE_NODES][2];
+static pthread_once_t hpack_tree_once = PTHREAD_ONCE_INIT;
+
+static void hpack_tree_build(void) {
+    int16_t used = 1;
+    for (int symbol = 0; symbol < 257; symbol++) {
+        uint32_t code = hpack_huffman[symbol].code;
+        int bits = hpack_huffman[symbol].bits;
+        int16_t node = 0;
+        for (int i = bits - 1; i >= 0; i--) {
+            int bit = (code >> i) & 1;
+            if (i == 0) {
+                hpack_tree[node][bit] = (int16_t)-(symbol + 1);
+            } else {
+                if (hpack_tree[node][bit] == 0) hpack_tree[node][bit] = used++;
+                node = hpack_tree[node][bit];
+            }
+        }
+    }
+}
+
+// Padding must be the EOS prefix, fewer than 8 one bits. EOS itself is an error.
+static bool hpack_huffman_decode(const uint8_t* data, size_t len, ByteBuffer* out) {
+    pthread_once(&hpack_tree_once, hpack_tree_build);
+
+    int16_t node = 0;
+    int depth = 0;
+    bool all_ones = true;
+    for (size_t i = 0; i < len; i++) {
+        for (int shift = 7; shift >= 0; shift--) {
+            int bit = (data[i] >> shift) & 1;
+            int16_t next = hpack_tree[node][bit];
+            depth++;
+            all_ones = all_ones && bit;
+            if (next < 0) {
+                int symbol = -next - 1;
+                if (symbol == 256 || !byte_buffer_push(out, (uint8_t)symbol)) return false;
+                node = 0;
+                depth = 0;
+                all_ones = true;
+            } else if (next == 0) {
+                return false;
+            } else {
+                node = next;
+            }
+        }
+    }
+    return depth < 8 && all_ones;
+}
+
+bool hpack_table_init(HpackTable* table, size_t limit, void* tag) {
+    if (!table) return false;
+
+    table->capacity = limit / HPACK_ENTRY_OVERHEAD + 1;
+    table->entries = pcalloc(table->capacity, sizeof(HpackEntry), tag);
+    if (!table->entries) return false;
+
+    table->head = 0;
+    table->count = 0;
+    table->size = 0;
+    table->max_size = limit;
+    table->limit = limit;
+    table->size_update = false;
+    table->tag = tag;
+    return true;
+}
+
+static void hpack_evict_oldest(HpackTable* table) {
+    size_t oldest = (table->head + table->capacity - (table->count - 1)) % table->capacity;
+    HpackEntry* entry = &table->entries[oldest];
+    table->size -= entry->name_len + entry->value_len + HPACK_ENTRY_OVERHEAD;
+    pfree(entry->name);
+    entry->name = NULL;
+    table->count--;
+}
+
+static void hpack_evict(HpackTable* table, size_t max_size) {
+    while (table->count > 0 && table->size > max_size) {
+        hpack_evict_oldest(table);
+    }
+}
+
+void hpack_table_free(HpackTable* table) {
+    if (!table || !table->entries) return;
+
+    hpack_evict(table, 0);
+    pfree(table->entries);
+    table->entries = NULL;
+}
+
+void hpack_table_resize(HpackTable* table, size_t peer_size) {
+    if (!table) return;
+
+    size_t max_size = peer_size < table->limit ? peer_size : table->limit;
+    if (max_size == table->max_size) return;
+    table->max_size = max_size;
+    table->size_update = true;
+    hpack_evict(table, max_size);
+}
+
+// An entry larger than the table empties it and is not added, RFC 7541 section 4.4
+static bool hpack_insert(HpackTable* table, const char* name, size_t name_len, const char* value, size_t value_len) {
+    size_t entry_size = name_len + value_len + HPACK_ENTRY_OVERHEAD;
+    if (entry_size > table->max_size) {
+        hpack_evict(table, 0);
+        return true;
+    }
+    hpack_evict(table, table->max_size - entry_size);
+
+    char* bytes = pmalloc(name_len + value_len + 1, table->tag);
+    if (!bytes) return false;
+    memcpy(bytes, name, name_len);
+    memcpy(bytes + name_len, value, value_len);
+
+    // the ring holds `max_size` worth of the smallest entries, so a slot is always free
+    table->head = (table->head + 1) % table->capacity;
+    HpackEntry* entry = &table->entries[table->head];
+    entry->name = bytes;
+    entry->name_len = name_len;
+    entry->value = bytes + name_len;
+    entry->value_len = value_len;
+    table->count++;
+    table->size += entry_size;
+    return true;
+}
+
+// 1-based across the static and dynamic tables
+static bool hpack_lookup(const HpackTable* table, uint64_t index, const char** name, size_t* name_len,
+                         const char** value, size_t* value_len) {
+    if (index == 0) return false;
+    if (index <= HPACK_STATIC_ENTRIES) {
+        const HpackStatic* entry = &hpack_static[index - 1];
+        *name = entry->name;
+        *name_len = strlen(entry->name);
+        *value = entry->value;
+        *value_len = strlen(entry->value);
+        return true;
+    }
+
+    uint64_t dynamic = index - HPACK_STATIC_ENTRIES - 1;
+    if (dynamic >= table->count) return false;
+    const HpackEntry* entry = &table->entries[(table->head + table->capacity - dynamic) % table->capacity];
+    *name = entry->name;
+    *name_len = entry->name_len;
+    *value = entry->value;
+    *value_len = entry->value_len;
+    return true;
+}
+
+// RFC 7541 section 5.1
+static bool hpack_decode_int(const uint8_t** p, const uint8_t* end, int prefix_bits, uint64_t* value) {
+    if (*p >= end) return false;
+
+    uint64_t max_prefix = (1u << prefix_bits) - 1;
+    uint64_t result = **p & max_prefix;
+    (*p)++;
+    if (result < max_prefix) {
+        *value = result;
+        return true;
+    }
+
+    for (int shift = 0; *p < end; shift += 7) {
+        if (shift > 28) return false; // nothing we accept needs more than 32 bits
+        uint8_t byte = **p;
+        (*p)++;
+        result += (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            *value = result;
+            return true;
+        }
+    }
+    return false;
+}
+
+// RFC 7541 section 5.2, the string ends up in `out`
+static bool hpack_decode_string(const uint8_t** p, const uint8_t* end, ByteBuffer* out) {
+    if (*p >= end) return false;
+
+    bool huffman = **p & 0x80;
+    uint64_t len;
+    if (!hpack_decode_int(p, end, 7, &len) || len > (uint64_t)(end - *p)) return false;
+
+    out->len = 0;
+    bool ok = huffman ? hpack_huffman_decode(*p, (size_t)len, out) : byte_buffer_append(out, *p, (size_t)len);
+    *p += len;
+    return ok;
+}
+
+static bool hpack_emit(HeaderArray* headers, const char* name, size_t name_len, const char* value, size_t value_len,
+                       void* tag) {
+    Header header = {
+        .key = string_new_len(name, name_len, tag),
+        .value = string_new_len(value, value_len, tag),
+    };
+    if (!header.key || !header.value || !HeaderArray_push(headers, header)) {
+        string_free(header.key);
+        string_free(header.value);
+        return false;
+    }
+    return true;
+}
+
+bool hpack_decode(HpackTable* table, const uint8_t* data, size_t len, HeaderArray* headers, void* tag) {
+    if (!table || (!data && len > 0) || !headers) return false;
+
+    const uint8_t* p = data;
+    const uint8_t* end = data + len;
+    ByteBuffer name_buf;
+    ByteBuffer value_buf;
+    byte_buffer_init(&name_buf, table->tag);
+    byte_buffer_init(&value_buf, table->tag);
+
+    bool ok = true;
+    bool fields_seen = false;
+    size_t list_size = 0;
+    while (ok && p < end) {
+        uint8_t first = *p;
+        const char* name = NULL;
+        const char* value = NULL;
+        size_t name_len = 0;
+        size_t value_len = 0;
+        uint64_t index;
+
+        if (first & 0x80) {
+            // indexed header field
+            ok = hpack_decode_int(&p, end, 7, &index)
+                && hpack_lookup(table, index, &name, &name_len, &value, &value_len);
+        } else if ((first & 0xe0) == 0x20) {
+            // dynamic table size update, only before the first field
+            uint64_t size;
+            ok = !fields_seen && hpack_decode_int(&p, end, 5, &size) && size <= table->limit;
+            if (ok) {
+                table->max_size = (size_t)size;
+                hpack_evict(table, table->max_size);
+            }
+            continue;
+        } else {
+            // literal, with incremental indexing (01), without (0000) or never indexed (0001)
+            bool indexing = (first & 0xc0) == 0x40;
+            ok = hpack_decode_int(&p, end, indexing ? 6 : 4, &index);
+            if (ok && index == 0) {
+                ok = hpack_decode_string(&p, end, &name_buf);
+                name = (const char*)name_buf.data;
+                name_len = name_buf.len;
+            } else if (ok) {
+                const char* unused;
+                size_t unused_len;
+                ok = hpack_lookup(table, index, &name, &name_len, &unused, &unused_len);
+                if (ok && index > HPACK_STATIC_ENTRIES) {
+                    // the insert below may evict the entry the name points into
+                    name_buf.len = 0;
+                    ok = byte_buffer_append(&name_buf, name, name_len);
+                    name = (const char*)name_buf.data;
+                }
+            }
+            ok = ok && hpack_decode_string(&p, end, &value_buf);
+            value = (const char*)value_buf.data;
+            value_len = value_buf.len;
+            if (ok && indexing) {
+                ok = hpack_insert(table, name ? name : "", name_len, value ? value : "", value_len);
+            }
+        }
+
+        if (!ok) break;
+        fields_seen = true;
+        list_size += name_len + value_len + HPACK_ENTRY_OVERHEAD;
+        ok = list_size <= HPACK_MAX_HEADER_LIST
+            && hpack_emit(headers, name ? name : "", name_len, value ? value : "", value_len, tag);
+    }
+
+    byte_buffer_free(&name_buf);
+    byte_buffer_free(&value_buf);
+    return ok;
+}
+
+static void hpack_encode_int(ByteBuffer* out, uint8_t flags, int prefix_bits, uint64_t value) {
+    uint64_t max_prefix = (1u << prefix_bits) - 1;
+    if (value < max_prefix) {
+        byte_buffer_push(out, (uint8_t)(flags | value));
+        return;
+    }
+
+    byte_buffer_push(out, (uint8_t)(flags | max_prefix));
+    value -= max_prefix;
+    while (value >= 0x80) {
+        byte_buffer_push(out, (uint8_t)(0x80 | (value & 0x7f)));
+        value >>= 7;
+    }
+    byte_buffer_push(out, (uint8_t)value);
+}
+
+// raw octets, Huffman coding would cost CPU on every response for a few bytes
+static void hpack_encode_string(ByteBuffer* out, const char* data, size_t len) {
+    hpack_encode_int(out, 0x00, 7, len);
+    byte_buffer_append(out, data, len);
+}
+
+void hpack_encode_begin(HpackTable* table, ByteBuffer* out) {
+    if (!table || !out || !table->size_update) return;
+
+    hpack_encode_int(out, 0x20, 5, table->max_size);
+    table->size_update = false;
+}
+
+// values that differ from one response to the next would only churn the table
+static bool hpack_volatile(const char* name, size_t name_len) {
+    static const char* const names[] = {
+        "content-length", "date", "etag", "last-modified", "age", "expires", "location", "content-range",
+    };
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        if (strlen(names[i]) == name_len && memcmp(names[i], name, name_len) == 0) return true;
+    }
+    return false;
+}
+
+void hpack_encode(HpackTable* table, const char* name, size_t name_len, const char* value, size_t value_len,
+                  ByteBuffer* out) {
+    if (!table || !name || !value || !out) return;
+
+    size_t name_index = 0;
+    for (size_t i = 1; i <= HPACK_STATIC_ENTRIES + table->count; i++) {
+        const char* entry_name;
+        const char* entry_value;
+        size_t entry_name_len;
+        size_t entry_value_len;
+        if (!hpack_lookup(table, i, &entry_name, &entry_name_len, &entry_value, &entry_value_len)) continue;
+        if (entry_name_len != name_len || memcmp(entry_name, name, name_len) != 0) continue;
+
+        if (entry_value_len == value_len && memcmp(entry_value, value, value_len) == 0) {
+            hpack_encode_int(out, 0x80, 7, i);
+            return;
+        }
+        if (name_index == 0) name_index = i;
+    }
+
+    // cookies and credentials are never indexed, intermediaries must not either
+    bool sensitive = (name_len == 10 && memcmp(name, "set-cookie", 10) == 0)
+        || (name_len == 13 && memcmp(name, "authorization", 13) == 0);
+    if (sensitive) {
+        hpack_encode_int(out, 0x10, 4, name_index);
+    } else if (hpack_volatile(name, name_len)) {
+        hpack_encode_int(out, 0x00, 4, name_index);
+    } else {
+        hpack_encode_int(out, 0x40, 6, name_index);
+        hpack_insert(table, name, name_len, value, value_len);
+    }
+    if (name_index == 0) hpack_encode_string(out, name, name_len);
+    hpack_encode_string(out, value, value_len);
+}
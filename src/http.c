@@ -1,9 +1,17 @@
+#define _GNU_SOURCE
 
 #include "alloc.h"
+#include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include "http.h"
+#include "router.h"
 
 ARRAY_DEFINE(Header, HeaderArray)
 
@@ -23,7 +31,12 @@ HttpRequest* http_request_new(void* tag) {
     }
 
     request->request_line.method = HTTP_UNKNOWN;
+    request->request_line.target = NULL;
     request->request_line.version = HTTP_UNKNOWN_VERSION;
+    request->body = NULL;
+    memset(&request->peer, 0, sizeof(request->peer));
+    request->received_ns = 0;
+    request->loop = NULL;
     request->tag = tag;
 
     if (!HeaderArray_init(request->headers, tag)) {
@@ -69,70 +82,85 @@ void http_request_print(const HttpRequest* request) {
     }
 }
 
-bool http_request_parse(HttpRequest* request, String* raw) {
-    if (!request || !raw) return false;
-
-    void* tag = request->tag;
-
-    // Split the raw request into lines
-    String* line = string_new_empty(tag);
+// Splits a message head into its first line and headers. Returns the offset just past
+// the blank line ending the head, or the length of `raw` if there is none.
+static size_t http_parse_head(String* raw, String** first_line, HeaderArray* headers, void* tag) {
+    // Split the raw head into lines
     size_t start = 0;
     size_t end = 0;
 
     while ((end = string_find_cstr(raw, "\r\n", start)) != SIZE_MAX) {
-        line = string_substring(raw, start, end - start, tag);
+        String* line = string_substring(raw, start, end - start, tag);
         start = end + 2; // Move past the CRLF
 
         if (string_length(line) == 0) {
-            break; // Empty line indicates end of headers
+            string_free(line);
+            return start; // Empty line indicates end of headers
         }
 
-        // Parse the request line
-        if (request->request_line.method == HTTP_UNKNOWN) {
-            // Parse the request line
-            String* method_str = string_substring(line, 0, string_find_cstr(line, " ", 0), tag);
-            if (string_equals_cstr(method_str, "GET")) {
-                request->request_line.method = HTTP_GET;
-            } else if (string_equals_cstr(method_str, "POST")) {
-                request->request_line.method = HTTP_POST;
-            } else if (string_equals_cstr(method_str, "PUT")) {
-                request->request_line.method = HTTP_PUT;
-            } else if (string_equals_cstr(method_str, "DELETE")) {
-                request->request_line.method = HTTP_DELETE;
-            } else if (string_equals_cstr(method_str, "PATCH")) {
-                request->request_line.method = HTTP_PATCH;
-            } else if (string_equals_cstr(method_str, "OPTIONS")) {
-                request->request_line.method = HTTP_OPTIONS;
-            } else if (string_equals_cstr(method_str, "HEAD")) {
-                request->request_line.method = HTTP_HEAD;
-            }
+        if (!*first_line) {
+            // the request or status line, parsed by the caller
+            *first_line = line;
+            continue;
+        }
 
-            // Parse the target
-            //
-            size_t target_start = string_find_cstr(line, " ", 0) + 1;
-            size_t target_end = string_find_cstr(line, " ", target_start);
-            request->request_line.target = string_substring(line, target_start, target_end - target_start, tag);
-
-            // Parse the version
-            size_t version_start = target_end + 1;
-            if (string_equals_cstr(string_substring(line, version_start, string_length(line) - version_start, line->tag), "HTTP/1.1")) {
-                request->request_line.version = HTTP_1_1;
-            } else if (string_equals_cstr(string_substring(line, version_start, string_length(line) - version_start, line->tag), "HTTP/2.0")) {
-                request->request_line.version = HTTP_2_0;
-            }
-        } else {
-            // Parse headers
-            size_t colon_pos = string_find_cstr(line, ": ", 0);
-            if (colon_pos != SIZE_MAX) {
-                String* key = string_substring(line, 0, colon_pos, tag);
-                String* value = string_substring(line, colon_pos + 2, string_length(line) - colon_pos - 2, tag);
-
-                Header header = { .key = key, .value = value };
-                HeaderArray_push(request->headers, header);
+        // Parse headers
+        size_t colon_pos = string_find_cstr(line, ":", 0);
+        if (colon_pos != SIZE_MAX) {
+            size_t value_start = colon_pos + 1;
+            while (value_start < string_length(line) && string_char_at(line, value_start) == ' ') {
+                value_start++;
             }
+            String* key = string_substring(line, 0, colon_pos, tag);
+            String* value = string_substring(line, value_start, string_length(line) - value_start, tag);
+
+            Header header = { .key = key, .value = value };
+            HeaderArray_push(headers, header);
         }
         string_free(line);
-        line = string_new_empty(tag);
+    }
+    return string_length(raw);
+}
+
+bool http_request_parse(HttpRequest* request, String* raw) {
+    if (!request || !raw) return false;
+
+    void* tag = request->tag;
+
+    String* line = NULL;
+    size_t start = http_parse_head(raw, &line, request->headers, tag);
+    if (!line) return false;
+
+    // Parse the request line
+    String* method_str = string_substring(line, 0, string_find_cstr(line, " ", 0), tag);
+    if (string_equals_cstr(method_str, "GET")) {
+        request->request_line.method = HTTP_GET;
+    } else if (string_equals_cstr(method_str, "POST")) {
+        request->request_line.method = HTTP_POST;
+    } else if (string_equals_cstr(method_str, "PUT")) {
+        request->request_line.method = HTTP_PUT;
+    } else if (string_equals_cstr(method_str, "DELETE")) {
+        request->request_line.method = HTTP_DELETE;
+    } else if (string_equals_cstr(method_str, "PATCH")) {
+        request->request_line.method = HTTP_PATCH;
+    } else if (string_equals_cstr(method_str, "OPTIONS")) {
+        request->request_line.method = HTTP_OPTIONS;
+    } else if (string_equals_cstr(method_str, "HEAD")) {
+        request->request_line.method = HTTP_HEAD;
+    }
+
+    // Parse the target
+    //
+    size_t target_start = string_find_cstr(line, " ", 0) + 1;
+    size_t target_end = string_find_cstr(line, " ", target_start);
+    request->request_line.target = string_substring(line, target_start, target_end - target_start, tag);
+
+    // Parse the version
+    size_t version_start = target_end + 1;
+    if (string_equals_cstr(string_substring(line, version_start, string_length(line) - version_start, line->tag), "HTTP/1.1")) {
+        request->request_line.version = HTTP_1_1;
+    } else if (string_equals_cstr(string_substring(line, version_start, string_length(line) - version_start, line->tag), "HTTP/2.0")) {
+        request->request_line.version = HTTP_2_0;
     }
 
     if (start < string_length(raw)) {
@@ -143,6 +171,67 @@ bool http_request_parse(HttpRequest* request, String* raw) {
     return true;
 }
 
+static size_t http_request_refuse(int* status, int code) {
+    if (status) *status = code;
+    return SIZE_MAX;
+}
+
+// Finds the first complete request in `data`. Returns its total length in bytes,
+// 0 if more bytes are needed, or SIZE_MAX if it can't be framed. `status` is then
+// the response to send before closing, or 0 when the connection should just close.
+size_t http_request_frame(const char* data, size_t len, size_t* head_len, size_t* body_len, int* status) {
+    if (status) *status = 0;
+    if (!data) return SIZE_MAX;
+
+    const char* end = memmem(data, len, "\r\n\r\n", 4);
+    if (!end) {
+        return len > HTTP_MAX_HEAD_SIZE ? SIZE_MAX : 0;
+    }
+
+    size_t head = (size_t)(end - data) + 4;
+    if (head > HTTP_MAX_HEAD_SIZE) return SIZE_MAX;
+
+    // Content-Length is the only body framing we support. Anything a proxy in front
+    // of us could frame differently is refused, guessing would desync the stream.
+    size_t content_length = 0;
+    bool has_length = false;
+    const char* line = memchr(data, '\n', head);
+    while (line && line + 1 < end) {
+        line++;
+        const char* next = memchr(line, '\n', (size_t)(end - line));
+        const char* line_end = next ? next : end;
+        const char* colon = memchr(line, ':', (size_t)(line_end - line));
+        size_t name_len = colon ? (size_t)(colon - line) : 0;
+
+        // whitespace between the name and the colon must be refused (RFC 9112 5.1)
+        if (name_len > 0 && (colon[-1] == ' ' || colon[-1] == '\t')) return http_request_refuse(status, 400);
+        if (name_len == 17 && strncasecmp(line, "Transfer-Encoding", 17) == 0) {
+            return http_request_refuse(status, 501);
+        }
+        if (name_len == 14 && strncasecmp(line, "Content-Length", 14) == 0) {
+            if (has_length) return http_request_refuse(status, 400);
+            has_length = true;
+            const char* p = colon + 1;
+            while (*p == ' ' || *p == '\t') p++;
+            if (*p < '0' || *p > '9') return http_request_refuse(status, 400);
+            while (*p >= '0' && *p <= '9') {
+                if (content_length > (SIZE_MAX - 9) / 10) return http_request_refuse(status, 400);
+                content_length = content_length * 10 + (size_t)(*p - '0');
+                p++;
+            }
+            while (*p == ' ' || *p == '\t') p++;
+            if (p < line_end && *p == '\r') p++;
+            if (p != line_end) return http_request_refuse(status, 400);
+        }
+        line = next;
+    }
+
+    if (head_len) *head_len = head;
+    if (body_len) *body_len = content_length;
+    if (len - head < content_length) return 0;
+    return head + content_length;
+}
+
 char* http_request_method_to_string(Method method) {
     switch (method) {
         case HTTP_GET: return "GET";
@@ -161,13 +250,37 @@ Header* http_request_get_header(const HttpRequest* request, const char* key) {
 
     for (size_t i = 0; i < HeaderArray_size(request->headers); i++) {
         Header* header = &request->headers->data[i];
-        if (string_equals_cstr(header->key, key)) {
+        // field names are case-insensitive
+        if (strcasecmp(string_cstr(header->key), key) == 0) {
             return header;
         }
     }
     return NULL;
 }
 
+// hands the body to `fn` in chunks of at most INFLATE_CHUNK bytes, decompressed
+// when it was sent with Content-Encoding gzip or deflate
+InflateStatus http_request_read_body(const HttpRequest* request, size_t max_len, InflateChunkFn fn, void* ctx) {
+    if (!request || !fn) return INFLATE_STOPPED;
+
+    const uint8_t* data = request->body ? (const uint8_t*)request->body->data : NULL;
+    size_t len = request->body ? request->body->byte_len : 0;
+
+    Header* encoding = http_request_get_header(request, "Content-Encoding");
+    const char* name = encoding ? string_cstr(encoding->value) : "identity";
+    if (strcasecmp(name, "gzip") == 0 || strcasecmp(name, "x-gzip") == 0 || strcasecmp(name, "deflate") == 0) {
+        return inflate_stream(data, len, max_len, fn, ctx);
+    }
+    if (strcasecmp(name, "identity") != 0) return INFLATE_UNSUPPORTED;
+
+    if (len > max_len) return INFLATE_TOO_LARGE;
+    for (size_t offset = 0; offset < len; offset += INFLATE_CHUNK) {
+        size_t chunk = len - offset < INFLATE_CHUNK ? len - offset : INFLATE_CHUNK;
+        if (!fn(data + offset, chunk, ctx)) return INFLATE_STOPPED;
+    }
+    return INFLATE_OK;
+}
+
 HttpResponse* http_response_new(void* tag) {
     HttpResponse* response = pmalloc(sizeof(HttpResponse), tag);
     if (!response) return NULL;
@@ -178,9 +291,19 @@ HttpResponse* http_response_new(void* tag) {
     }
 
     response->status = NULL;
+    response->encoding = COMPRESSION_NONE;
     response->tag = tag;
     response->body = string_new_empty(tag);
     response->raw_body = NULL;
+    response->body_fd = -1;
+    response->body_done = NULL;
+    response->body_done_data = NULL;
+    response->sse = NULL;
+    response->deferred = false;
+    response->cancel = NULL;
+    response->cancel_data = NULL;
+    response->resume = NULL;
+    response->resume_data = NULL;
 
     if (!HeaderArray_init(response->headers, tag)) {
         pfree(response);
@@ -192,6 +315,9 @@ HttpResponse* http_response_new(void* tag) {
 
 void http_response_free(HttpResponse* response) {
     if (!response) return;
+    if (response->deferred && response->cancel) {
+        response->cancel(response->cancel_data);
+    }
 
     for (size_t i = 0; i < HeaderArray_size(response->headers); i++) {
         Header* header = &response->headers->data[i];
@@ -205,6 +331,13 @@ void http_response_free(HttpResponse* response) {
         // TODO: make a shim for our allocators for zlib
         free(response->raw_body);
     }
+    if (response->body_fd >= 0) {
+        if (response->body_done) {
+            response->body_done(response->body_done_data, response->body_fd, false);
+        } else {
+            close(response->body_fd);
+        }
+    }
     pfree(response);
 }
 
@@ -219,13 +352,15 @@ void http_response_print(const HttpResponse* response) {
     printf("Body: %s\n", string_cstr(response->body));
 }
 
-bool http_response_send(const HttpResponse* response, int client_fd) {
-    if (!response || client_fd < 0) {
-        printf("Invalid response or client file descriptor\n");
+bool http_response_queue(HttpResponse* response, SendQueue* queue) {
+    if (!response || !queue) {
+        printf("Invalid response or send queue\n");
         return false;
     }
 
-    String* builder = string_new_empty(response->tag);
+    // the head outlives the request, so it belongs to the queue's tag
+    String* builder = string_new_empty(queue->tag);
+    if (!builder) return false;
 
     // Build the response string
     string_append_cstr(builder, response->status);
@@ -244,33 +379,415 @@ bool http_response_send(const HttpResponse* response, int client_fd) {
     string_append_cstr(builder, "\r\n");
 
     // Add the body
-    if (response->encoding == COMPRESSION_NONE) {
-        string_append(builder, response->body);
+    size_t body_len = string_byte_length(response->body);
+    bool body_segment = response->encoding == COMPRESSION_NONE && body_len >= queue->zerocopy_threshold
+        && response->body_fd < 0;
+    if (body_segment) {
+        // large bodies are queued as their own segment after the head instead of copied
+    } else if (response->encoding == COMPRESSION_NONE) {
+        string_append_bytes(builder, (const uint8_t*)string_bytes(response->body), body_len);
     } else if (response->encoding == COMPRESSION_GZIP) {
         // Send the compressed body
         printf("Sending raw body of length %zu\n", response->raw_body_len);
         string_append_bytes(builder, response->raw_body, response->raw_body_len);
     }
 
-    // Send the response
-    if (send(client_fd, builder->data, builder->byte_len, 0) == -1) {
-        printf("Failed to send response: %s\n", strerror(errno));
-        string_free(builder);
-        return false;
+    // head and a separate file body should leave in full-sized packets
+    if (response->body_fd >= 0) {
+        sendq_cork(queue);
     }
 
+    // hand the buffer over to the queue and drop the String wrapper
+    char* data = builder->data;
+    size_t len = builder->byte_len;
+    builder->data = NULL;
     string_free(builder);
+    if (!sendq_push_buffer(queue, (const uint8_t*)data, len, data)) {
+        return false;
+    }
+
+    if (body_segment) {
+        // steal the body buffer, it moves from the request tag to the queue's
+        char* body = prealloc(response->body->data, response->body->capacity, queue->tag);
+        if (!body) return false;
+        response->body->data = NULL;
+        string_free(response->body);
+        response->body = NULL;
+        if (!sendq_push_buffer(queue, (const uint8_t*)body, body_len, body)) {
+            return false;
+        }
+    }
+
+    if (response->body_fd >= 0) {
+        int fd = response->body_fd;
+        response->body_fd = -1; // the queue closes it from here on
+        bool queued = response->body_done
+            ? sendq_push_stream(queue, fd, response->body_len, response->body_done, response->body_done_data)
+            : sendq_push_file(queue, fd, response->body_offset, response->body_len);
+        sendq_uncork(queue);
+        if (!queued) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool http_response_send(HttpResponse* response, int client_fd) {
+    if (!response || client_fd < 0) {
+        printf("Invalid response or client file descriptor\n");
+        return false;
+    }
+
+    SendQueue queue;
+    if (!sendq_init(&queue, response->tag)) return false;
+
+    bool ok = http_response_queue(response, &queue) && sendq_flush_blocking(&queue, client_fd, -1);
+    sendq_free(&queue);
+    return ok;
+}
+
+bool http_response_set_file(HttpResponse* response, const char* path) {
+    if (!response || !path) return false;
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return false;
+    }
+
+    if (response->body_fd >= 0) {
+        close(response->body_fd);
+    }
+    response->body_fd = fd;
+    response->body_offset = 0;
+    response->body_len = (size_t)st.st_size;
+    response->body_done = NULL;
+    return true;
+}
+
+bool http_response_set_stream(HttpResponse* response, int fd, size_t len, SegmentDoneFn done, void* data) {
+    if (!response || fd < 0 || !done || response->body_fd >= 0) return false;
+
+    response->body_fd = fd;
+    response->body_offset = 0;
+    response->body_len = len;
+    response->body_done = done;
+    response->body_done_data = data;
     return true;
 }
 
+bool http_response_set_body(HttpResponse* response, const char* data, size_t len, const char* content_type) {
+    String* body = data ? string_new_len(data, len, response->tag) : NULL;
+    if (!body) {
+        response->status = HTTP_500;
+        return false;
+    }
+    response->body = body;
+
+    Header header = { .key = string_new("Content-Type", response->tag),
+                      .value = string_new(content_type, response->tag) };
+    if (!HeaderArray_push(response->headers, header)) {
+        printf("Failed to add Content-Type header\n");
+    }
+    response->status = HTTP_200;
+    return true;
+}
+
+void http_response_defer(HttpResponse* response, HttpDeferFn cancel, void* data) {
+    response->deferred = true;
+    response->cancel = cancel;
+    response->cancel_data = data;
+}
+
+void http_response_resume(HttpResponse* response) {
+    if (!response->deferred) return;
+    response->deferred = false;
+    if (response->resume) response->resume(response->resume_data);
+}
+
+bool http_response_parse(HttpResponse* response, String* raw) {
+    if (!response || !raw) return false;
+
+    String* line = NULL;
+    size_t start = http_parse_head(raw, &line, response->headers, response->tag);
+    if (!line) return false;
+
+    // the status line, kept as-is so it can be forwarded
+    if (!string_begins_with_cstr(line, "HTTP/1.") || string_length(line) < 12) {
+        string_free(line);
+        return false;
+    }
+    response->status = string_bytes(line);
+
+    if (start < string_length(raw)) {
+        size_t offset = string_char_index_to_byte(raw, start);
+        string_append_bytes(response->body, (const uint8_t*)string_bytes(raw) + offset, string_byte_length(raw) - offset);
+    }
+    return true;
+}
+
+int http_response_status_code(const HttpResponse* response) {
+    if (!response || !response->status) return 0;
+
+    // "HTTP/1.1 200 OK"
+    const char* code = strchr(response->status, ' ');
+    if (!code) return 0;
+    int status = 0;
+    for (int i = 1; i <= 3; i++) {
+        if (code[i] < '0' || code[i] > '9') return 0;
+        status = status * 10 + (code[i] - '0');
+    }
+    return status;
+}
+
 Header* http_response_get_header(const HttpResponse* request, const char* key) {
     if (!request || !key) return NULL;
 
     for (size_t i = 0; i < HeaderArray_size(request->headers); i++) {
         Header* header = &request->headers->data[i];
-        if (string_equals_cstr(header->key, key)) {
+        // field names are case-insensitive
+        if (strcasecmp(string_cstr(header->key), key) == 0) {
             return header;
         }
     }
     return NULL;
 }
+
+// Serializes the request line and headers, adding Content-Length when there is a
+// body and the caller didn't set one. The body itself is not copied.
+String* http_request_serialize_head(const HttpRequest* request, void* tag) {
+    if (!request || !request->request_line.target) return NULL;
+
+    String* head = string_new_empty(tag);
+    if (!head) return NULL;
+
+    string_append_cstr(head, http_request_method_to_string(request->request_line.method));
+    string_append_cstr(head, " ");
+    string_append(head, request->request_line.target);
+    string_append_cstr(head, request->request_line.version == HTTP_1_0 ? " HTTP/1.0\r\n" : " HTTP/1.1\r\n");
+
+    bool has_length = false;
+    for (size_t i = 0; i < HeaderArray_size(request->headers); i++) {
+        Header* header = &request->headers->data[i];
+        if (strcasecmp(string_cstr(header->key), "Content-Length") == 0) has_length = true;
+        string_append(head, header->key);
+        string_append_cstr(head, ": ");
+        string_append(head, header->value);
+        string_append_cstr(head, "\r\n");
+    }
+
+    size_t body_len = request->body ? string_byte_length(request->body) : 0;
+    Method method = request->request_line.method;
+    if (!has_length && (body_len > 0 || method == HTTP_POST || method == HTTP_PUT || method == HTTP_PATCH)) {
+        char content_length[48];
+        snprintf(content_length, sizeof(content_length), "Content-Length: %zu\r\n", body_len);
+        string_append_cstr(head, content_length);
+    }
+    string_append_cstr(head, "\r\n");
+    return head;
+}
+
+void http_response_parser_init(HttpResponseParser* parser, HttpResponse* response, Method method, size_t max_body) {
+    if (!parser) return;
+
+    parser->state = HTTP_PARSE_HEAD;
+    parser->response = response;
+    parser->method = method;
+    parser->keep_alive = false;
+    parser->content_length = SIZE_MAX;
+    parser->remaining = 0;
+    parser->max_body = max_body;
+    parser->error = 0;
+}
+
+static size_t http_parser_fail(HttpResponseParser* parser, int error, size_t used) {
+    parser->state = HTTP_PARSE_ERROR;
+    parser->error = error;
+    return used;
+}
+
+static void http_parser_clear_headers(HttpResponse* response) {
+    for (size_t i = 0; i < HeaderArray_size(response->headers); i++) {
+        string_free(response->headers->data[i].key);
+        string_free(response->headers->data[i].value);
+    }
+    HeaderArray_clear(response->headers);
+}
+
+// parses a complete head and picks the body framing from it
+static bool http_parser_head(HttpResponseParser* parser, const char* data, size_t len) {
+    HttpResponse* response = parser->response;
+
+    // an interim response may have left headers behind
+    http_parser_clear_headers(response);
+    String* raw = string_new_len(data, len, response->tag);
+    bool parsed = raw && http_response_parse(response, raw);
+    string_free(raw);
+    int status = http_response_status_code(response);
+    if (!parsed || status < 100) {
+        parser->error = EPROTO;
+        return false;
+    }
+
+    // 100 Continue and friends, the final response follows
+    if (status < 200 && status != 101) return true;
+
+    Header* connection = http_response_get_header(response, "Connection");
+    bool http10 = strncmp(response->status, "HTTP/1.0", 8) == 0;
+    if (!connection) {
+        parser->keep_alive = !http10;
+    } else if (strcasestr(string_cstr(connection->value), "close")) {
+        parser->keep_alive = false;
+    } else {
+        parser->keep_alive = !http10 || strcasestr(string_cstr(connection->value), "keep-alive");
+    }
+
+    // a 101 hands the connection over, whatever follows isn't HTTP
+    if (status == 101) {
+        parser->keep_alive = false;
+        parser->state = HTTP_PARSE_DONE;
+        return true;
+    }
+    if (parser->method == HTTP_HEAD || status == 204 || status == 304) {
+        parser->state = HTTP_PARSE_DONE;
+        return true;
+    }
+
+    Header* transfer_encoding = http_response_get_header(response, "Transfer-Encoding");
+    if (transfer_encoding && strcasestr(string_cstr(transfer_encoding->value), "chunked")) {
+        parser->state = HTTP_PARSE_CHUNK_SIZE;
+        return true;
+    }
+
+    Header* content_length = http_response_get_header(response, "Content-Length");
+    if (!content_length) {
+        parser->keep_alive = false;
+        parser->state = HTTP_PARSE_UNTIL_CLOSE;
+        return true;
+    }
+
+    const char* digits = string_cstr(content_length->value);
+    char* digits_end = NULL;
+    errno = 0;
+    unsigned long long length = strtoull(digits, &digits_end, 10);
+    if (digits_end == digits || *digits == '-' || errno == ERANGE || length >= SIZE_MAX) {
+        parser->error = EPROTO;
+        return false;
+    }
+    parser->content_length = (size_t)length;
+    parser->remaining = (size_t)length;
+    parser->state = length == 0 ? HTTP_PARSE_DONE : HTTP_PARSE_BODY;
+    return true;
+}
+
+static bool http_parser_take(HttpResponseParser* parser, const char* data, size_t len) {
+    if (string_byte_length(parser->response->body) + len > parser->max_body) return false;
+    string_append_bytes(parser->response->body, (const uint8_t*)data, len);
+    return true;
+}
+
+// Consumes as much of `data` as the current response needs and returns the number of
+// bytes used. Stops right after the head so the caller can look at it before the body,
+// and at the end of the response so pipelined bytes stay with the caller. Feed the
+// unused bytes again with more appended once they arrive.
+size_t http_response_parser_feed(HttpResponseParser* parser, const char* data, size_t len) {
+    if (!parser || !data) return 0;
+
+    size_t used = 0;
+    while (used < len) {
+        const char* p = data + used;
+        size_t avail = len - used;
+
+        switch (parser->state) {
+            case HTTP_PARSE_HEAD: {
+                const char* end = memmem(p, avail, "\r\n\r\n", 4);
+                if (!end) {
+                    return avail > HTTP_MAX_HEAD_SIZE ? http_parser_fail(parser, EPROTO, used) : used;
+                }
+                size_t head_len = (size_t)(end - p) + 4;
+                if (head_len > HTTP_MAX_HEAD_SIZE) return http_parser_fail(parser, EPROTO, used);
+                if (!http_parser_head(parser, p, head_len)) return http_parser_fail(parser, parser->error, used);
+                used += head_len;
+                if (parser->state != HTTP_PARSE_HEAD) return used;
+                break;
+            }
+
+            case HTTP_PARSE_BODY:
+            case HTTP_PARSE_CHUNK_DATA: {
+                size_t take = avail < parser->remaining ? avail : parser->remaining;
+                if (!http_parser_take(parser, p, take)) return http_parser_fail(parser, EFBIG, used);
+                used += take;
+                parser->remaining -= take;
+                if (parser->remaining == 0) {
+                    parser->state = parser->state == HTTP_PARSE_BODY ? HTTP_PARSE_DONE : HTTP_PARSE_CHUNK_END;
+                }
+                break;
+            }
+
+            case HTTP_PARSE_CHUNK_SIZE: {
+                // extensions after the size are ignored
+                const char* eol = memmem(p, avail, "\r\n", 2);
+                if (!eol) return avail > 1024 ? http_parser_fail(parser, EPROTO, used) : used;
+
+                size_t size = 0;
+                const char* c = p;
+                for (; c < eol && isxdigit((unsigned char)*c); c++) {
+                    if (size > (SIZE_MAX >> 4)) return http_parser_fail(parser, EPROTO, used);
+                    size = (size << 4) | (size_t)(isdigit((unsigned char)*c) ? *c - '0' : (tolower(*c) - 'a' + 10));
+                }
+                if (c == p) return http_parser_fail(parser, EPROTO, used);
+                if (size > parser->max_body) return http_parser_fail(parser, EFBIG, used);
+
+                used += (size_t)(eol - p) + 2;
+                parser->remaining = size;
+                parser->state = size == 0 ? HTTP_PARSE_TRAILERS : HTTP_PARSE_CHUNK_DATA;
+                break;
+            }
+
+            case HTTP_PARSE_CHUNK_END:
+                if (avail < 2) return used;
+                if (p[0] != '\r' || p[1] != '\n') return http_parser_fail(parser, EPROTO, used);
+                used += 2;
+                parser->state = HTTP_PARSE_CHUNK_SIZE;
+                break;
+
+            case HTTP_PARSE_TRAILERS: {
+                // trailers are dropped, the blank line ends the message
+                const char* eol = memmem(p, avail, "\r\n", 2);
+                if (!eol) return avail > HTTP_MAX_HEAD_SIZE ? http_parser_fail(parser, EPROTO, used) : used;
+                used += (size_t)(eol - p) + 2;
+                if (eol == p) parser->state = HTTP_PARSE_DONE;
+                break;
+            }
+
+            case HTTP_PARSE_UNTIL_CLOSE:
+                if (!http_parser_take(parser, p, avail)) return http_parser_fail(parser, EFBIG, used);
+                used += avail;
+                break;
+
+            case HTTP_PARSE_DONE:
+            case HTTP_PARSE_ERROR:
+                return used;
+        }
+    }
+    return used;
+}
+
+// Tells the parser the peer closed. Returns `true` if that completes the response.
+bool http_response_parser_finish(HttpResponseParser* parser) {
+    if (!parser) return false;
+
+    if (parser->state == HTTP_PARSE_UNTIL_CLOSE) parser->state = HTTP_PARSE_DONE;
+    if (parser->state == HTTP_PARSE_DONE) return true;
+    if (parser->state != HTTP_PARSE_ERROR) {
+        parser->state = HTTP_PARSE_ERROR;
+        parser->error = ECONNRESET;
+    }
+    return false;
+}
@@ -1,6 +1,9 @@
 #include "alloc.h"
 #include <stdio.h>
 #include "layers.h"
+#include "probes.h"
+#include "slowlog.h"
+#include "trace.h"
 
 ARRAY_DEFINE(Layer, LayerArray)
 
@@ -18,12 +21,13 @@ bool layer_new(Layer* layer, const char* name, LayerFn fn, bool can_fail, LayerL
     return true;
 }
 
+// layers are initialized in place, only the name belongs to them
 void layer_free(Layer* layer) {
     if (!layer) return;
     if (layer->name) {
         string_free(layer->name);
+        layer->name = NULL;
     }
-    pfree(layer);
 }
 
 bool layer_apply(Layer* layer, HttpRequest* request, HttpResponse* response) {
@@ -83,7 +87,13 @@ bool layers_apply(LayerCtx* ctx, LayerLC stage, HttpRequest* request, HttpRespon
     for (size_t i = 0; i < LayerArray_size(&ctx->layers); i++) {
         Layer* layer = LayerArray_get_ptr(&ctx->layers, i);
         if (layer->when != stage) continue;
-        if (!layer_apply(layer, request, response)) {
+        uint64_t start = trace_start();
+        uint64_t slow_start = slowlog_clock();
+        bool applied = layer_apply(layer, request, response);
+        trace_span(string_cstr(layer->name), start);
+        slowlog_layer(string_cstr(layer->name), slow_start, applied);
+        CHTTP_PROBE3(layer, string_cstr(layer->name), (int)stage, (int)applied);
+        if (!applied) {
             if (layer->can_fail) {
                 continue;
             } else {
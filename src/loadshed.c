@@ -0,0 +1,133 @@
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include "alloc.h"
+#include "loadshed.h"
+
+ARRAY_DEFINE(ShedRoute, ShedRouteArray)
+
+const char loadshed_response[] = "HTTP/1.1 503 Service Unavailable\r\nContent-Length: 0\r\n"
+                                 "Retry-After: 1\r\nCache-Control: no-store\r\n\r\n";
+const size_t loadshed_response_len = sizeof(loadshed_response) - 1;
+
+static const char* const priority_names[SHED_CLASSES] = { "low", "normal", "high", "critical" };
+
+static bool g_enabled = false;
+static uint64_t g_target_ns;
+static uint64_t g_interval_ns;
+static ShedRouteArray g_routes;
+static atomic_uint_fast64_t g_shed[SHED_CLASSES];
+static atomic_uint_fast64_t g_overloaded_intervals;
+
+// each worker judges its own queue, it is the only one draining it
+typedef struct {
+    uint64_t interval_end;
+    uint64_t min_delay;   // smallest delay seen in the current interval
+    bool overloaded;      // the previous interval never got under the target
+} ShedState;
+
+static _Thread_local ShedState t_state;
+
+static uint64_t loadshed_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+bool loadshed_enable(uint32_t target_ms, uint32_t interval_ms, void* tag) {
+    if (target_ms == 0 || interval_ms < target_ms) return false;
+
+    if (!g_enabled && !ShedRouteArray_init(&g_routes, tag)) return false;
+    g_target_ns = (uint64_t)target_ms * 1000000u;
+    g_interval_ns = (uint64_t)interval_ms * 1000000u;
+    g_enabled = true;
+    return true;
+}
+
+bool loadshed_set_priority(const char* prefix, ShedPriority priority) {
+    if (!g_enabled || !prefix || priority >= SHED_CLASSES) return false;
+
+    ShedRoute route = { .prefix = string_new(prefix, g_routes.tag), .priority = priority };
+    if (!route.prefix || !ShedRouteArray_push(&g_routes, route)) {
+        string_free(route.prefix);
+        return false;
+    }
+    return true;
+}
+
+bool loadshed_priority_parse(const char* name, ShedPriority* priority) {
+    for (int i = 0; i < SHED_CLASSES; i++) {
+        if (strcasecmp(name, priority_names[i]) == 0) {
+            *priority = (ShedPriority)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+void loadshed_clear(void) {
+    if (!g_enabled) return;
+
+    for (size_t i = 0; i < g_routes.size; i++) {
+        string_free(g_routes.data[i].prefix);
+    }
+    ShedRouteArray_destroy(&g_routes);
+    g_enabled = false;
+}
+
+void loadshed_print_stats(void) {
+    if (!g_enabled) return;
+
+    printf("\n=== Load Shedding Stats ===\n");
+    printf("Overloaded intervals: %llu\n", (unsigned long long)atomic_load(&g_overloaded_intervals));
+    for (int i = 0; i < SHED_CLASSES; i++) {
+        printf("Shed %s: %llu\n", priority_names[i], (unsigned long long)atomic_load(&g_shed[i]));
+    }
+    printf("=== End Load Shedding Stats ===\n\n");
+}
+
+static ShedPriority loadshed_priority(const String* target) {
+    ShedPriority priority = SHED_NORMAL;
+    size_t best = 0;
+    for (size_t i = 0; i < g_routes.size; i++) {
+        ShedRoute* route = &g_routes.data[i];
+        size_t len = string_byte_length(route->prefix);
+        if (len >= best && string_begins_with(target, route->prefix)) {
+            priority = route->priority;
+            best = len;
+        }
+    }
+    return priority;
+}
+
+bool loadshed_admit(const HttpRequest* request) {
+    if (!g_enabled || request->received_ns == 0) return true;
+
+    uint64_t now = loadshed_now_ns();
+    uint64_t delay = now > request->received_ns ? now - request->received_ns : 0;
+
+    // CoDel's signal: a queue is bad when even its shortest wait stays above the
+    // target for a whole interval, short bursts don't count
+    ShedState* state = &t_state;
+    if (now >= state->interval_end) {
+        state->overloaded = state->interval_end != 0 && state->min_delay > g_target_ns;
+        if (state->overloaded) atomic_fetch_add_explicit(&g_overloaded_intervals, 1, memory_order_relaxed);
+        state->min_delay = delay;
+        state->interval_end = now + g_interval_ns;
+    } else if (delay < state->min_delay) {
+        state->min_delay = delay;
+    }
+
+    ShedPriority priority = loadshed_priority(request->request_line.target);
+    if (priority == SHED_CRITICAL) return true;
+
+    // overloaded, anything over the target is dropped so the queue drains; otherwise only
+    // requests that already waited longer than a client would plausibly still care for
+    uint64_t limit = (state->overloaded ? g_target_ns : g_interval_ns) << priority;
+    if (delay <= limit) return true;
+
+    atomic_fetch_add_explicit(&g_shed[priority], 1, memory_order_relaxed);
+    return false;
+}
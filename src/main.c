@@ -11,17 +11,166 @@
 #include "cli.h"
 #include "cstring.h"
 #include "alloc.h"
+#include "builtin.h"
+#include "capture.h"
 #include "http.h"
+#include "loadshed.h"
+#include "memstats.h"
 #include "router.h"
 #include "routes.h"
+#include "profile.h"
+#include "proxy.h"
+#include "ratelimit.h"
 #include "server.h"
+#include "shmstats.h"
+#include "splice.h"
+#include "slowlog.h"
+#include "sse.h"
+#include "trace.h"
 
-// setup a handler for ctrl+c
+static HttpServer* g_server = NULL;
+static volatile sig_atomic_t g_stopping = 0;
+
+// ctrl+c only asks the workers to stop, main cleans up once they have returned.
+// Stopping a loop is a write to its eventfd, which is safe in a signal handler.
 void sigint_handler(int signum) {
     (void)signum;
-    printf("Caught SIGINT, exiting...\n");
-    pallocator_cleanup();
-    exit(0);
+    static const char message[] = "Caught SIGINT, exiting...\n";
+    ssize_t written = write(STDOUT_FILENO, message, sizeof(message) - 1);
+    (void)written;
+    g_stopping = 1;
+    if (g_server) http_server_stop(g_server);
+}
+
+// mounts every "prefix=address|address..." entry of a comma separated list
+static bool add_upstreams(HttpServer* server, const char* spec, const char* balance, const char* health, void* tag) {
+    BalancePolicy policy;
+    const char* hash_header = NULL;
+    if (!upstream_policy_parse(balance, &policy, &hash_header)) {
+        printf("Unknown balance policy: %s\n", balance);
+        return false;
+    }
+
+    char* copy = pmalloc(strlen(spec) + 1, tag);
+    if (!copy) return false;
+    strcpy(copy, spec);
+
+    char* save = NULL;
+    for (char* entry = strtok_r(copy, ",", &save); entry; entry = strtok_r(NULL, ",", &save)) {
+        char* addresses = strchr(entry, '=');
+        if (!addresses || addresses == entry) {
+            printf("Invalid upstream, expected prefix=address: %s\n", entry);
+            pfree(copy);
+            return false;
+        }
+        *addresses++ = '\0';
+
+        UpstreamGroup* group = upstream_group_new(policy, hash_header, tag);
+        if (!group) {
+            pfree(copy);
+            return false;
+        }
+        char* address_save = NULL;
+        for (char* address = strtok_r(addresses, "|", &address_save); address;
+             address = strtok_r(NULL, "|", &address_save)) {
+            if (!upstream_group_add(group, address)) {
+                upstream_group_free(group);
+                pfree(copy);
+                return false;
+            }
+        }
+        if (health && !upstream_group_set_probe(group, health, UPSTREAM_PROBE_INTERVAL_MS)) {
+            printf("Invalid health check path: %s\n", health);
+            upstream_group_free(group);
+            pfree(copy);
+            return false;
+        }
+        if (!proxy_add(entry, group, false, tag)) {
+            upstream_group_free(group);
+            pfree(copy);
+            return false;
+        }
+        router_add_route(server->router, entry,
+                         HTTP_GET | HTTP_POST | HTTP_PUT | HTTP_DELETE | HTTP_PATCH | HTTP_OPTIONS | HTTP_HEAD,
+                         proxy_route, false);
+        printf("Proxying %s to %zu upstream(s) with %s\n", entry, group->upstreams.size, balance);
+    }
+
+    pfree(copy);
+    return proxy_start_health_checks(tag);
+}
+
+// adds every "prefix=rate:burst[:header]" entry of a comma separated list
+static bool add_rate_limits(HttpServer* server, const char* spec, void* tag) {
+    char* copy = pmalloc(strlen(spec) + 1, tag);
+    if (!copy) return false;
+    strcpy(copy, spec);
+
+    char* save = NULL;
+    for (char* entry = strtok_r(copy, ",", &save); entry; entry = strtok_r(NULL, ",", &save)) {
+        char* limits = strchr(entry, '=');
+        char* end = NULL;
+        double rate = limits ? strtod(limits + 1, &end) : 0;
+        double burst = end && *end == ':' ? strtod(end + 1, &end) : 0;
+        const char* header = end && *end == ':' ? end + 1 : NULL;
+        if (!limits || limits == entry || !end || (*end != '\0' && *end != ':') || (header && !*header)) {
+            printf("Invalid rate limit, expected prefix=rate:burst[:header]: %s\n", entry);
+            pfree(copy);
+            return false;
+        }
+        *limits = '\0';
+        if (!ratelimit_add(entry, header, rate, burst, tag)) {
+            printf("Invalid rate limit for %s, rate must be positive and burst at least 1\n", entry);
+            pfree(copy);
+            return false;
+        }
+        printf("Limiting %s to %.2f/s, burst %.0f, by %s\n", entry, rate, burst, header ? header : "address");
+    }
+
+    pfree(copy);
+    return layers_add(server->layer_ctx, LAYER_PRE_ROUTE, "rate-limit", ratelimit_layer, false);
+}
+
+// turns on shedding and applies every "prefix=class" entry of a comma separated list
+static bool enable_load_shedding(int target_ms, const char* priorities, void* tag) {
+    if (!loadshed_enable((uint32_t)target_ms, LOADSHED_INTERVAL_MS, tag)) {
+        printf("Invalid shedding target, expected 1 to %d ms: %d\n", LOADSHED_INTERVAL_MS, target_ms);
+        return false;
+    }
+    if (!priorities) return true;
+
+    char* copy = pmalloc(strlen(priorities) + 1, tag);
+    if (!copy) return false;
+    strcpy(copy, priorities);
+
+    char* save = NULL;
+    for (char* entry = strtok_r(copy, ",", &save); entry; entry = strtok_r(NULL, ",", &save)) {
+        char* name = strchr(entry, '=');
+        ShedPriority priority;
+        if (!name || name == entry || !loadshed_priority_parse(name + 1, &priority)) {
+            printf("Invalid shedding priority, expected prefix=low|normal|high|critical: %s\n", entry);
+            pfree(copy);
+            return false;
+        }
+        *name = '\0';
+        if (!loadshed_set_priority(entry, priority)) {
+            pfree(copy);
+            return false;
+        }
+    }
+
+    pfree(copy);
+    return true;
+}
+
+static bool start_capture(const char* path, int sample, int max_mb) {
+    if (sample < 1 || max_mb < 1) {
+        printf("Invalid capture options, sample and size cap must be at least 1\n");
+        return false;
+    }
+    if (!capture_start(path, (uint32_t)sample, (uint64_t)max_mb * 1024 * 1024)) return false;
+    printf("Capturing one in %d connection(s) to %s, up to %d MB\n", sample, path, max_mb);
+    return true;
 }
 
 void hello_handler(HttpRequest* req, HttpResponse* res) {
@@ -29,15 +178,101 @@ void hello_handler(HttpRequest* req, HttpResponse* res) {
     res->body = string_new("Hello, World!", req->tag);
 }
 
+// WebSocket examples: /ws/echo answers every message, /ws/chat relays it to everyone
+static WebSocketGroup* g_chat = NULL;
+
+static void ws_echo_message(WebSocket* ws, WebSocketOpcode opcode, const uint8_t* data, size_t len) {
+    websocket_send(ws, opcode, data, len);
+}
+
+static void ws_chat_open(WebSocket* ws, HttpRequest* request) {
+    (void)request;
+    websocket_group_join(g_chat, ws);
+}
+
+static void ws_chat_message(WebSocket* ws, WebSocketOpcode opcode, const uint8_t* data, size_t len) {
+    (void)ws;
+    websocket_group_broadcast(g_chat, opcode, data, len);
+}
+
+static const WebSocketHandler ws_echo = { .on_message = ws_echo_message };
+static const WebSocketHandler ws_chat = { .on_open = ws_chat_open, .on_message = ws_chat_message };
+
+// Server-Sent Events example: GET /events streams what is POSTed to /events/publish
+static SseChannel* g_events = NULL;
+
+static void events_handler(HttpRequest* req, HttpResponse* res) {
+    (void)req;
+    if (!sse_response(res, g_events)) res->status = HTTP_500;
+}
+
+static void events_publish_handler(HttpRequest* req, HttpResponse* res) {
+    const char* data = req->body ? string_cstr(req->body) : "";
+    size_t len = req->body ? string_byte_length(req->body) : 0;
+    uint64_t id = sse_publish(g_events, NULL, data, len);
+    if (id == 0) {
+        res->status = HTTP_500;
+        return;
+    }
+    char text[32];
+    snprintf(text, sizeof(text), "%llu\n", (unsigned long long)id);
+    res->status = HTTP_201;
+    res->body = string_new(text, req->tag);
+}
+
 int main(int argc, char** argv) {
-    bool verbose = false;
+    int verbose = 0;
+    int inflate_requests = 0;
     int port;
+    int workers;
+    int zerocopy_threshold;
+    int max_connections;
+    int max_per_host;
     const char* directory = NULL;
+    const char* upstreams = NULL;
+    const char* balance = NULL;
+    const char* health = NULL;
+    const char* rate_limits = NULL;
+    int shed_target_ms;
+    const char* shed_priorities = NULL;
+    int alloc_check;
+    int alloc_check_fatal = 0;
+    const char* capture = NULL;
+    int capture_sample;
+    int capture_max_mb;
+    int trace_sample;
+    const char* trace_header = NULL;
+    int slow_ms;
+    int shm_stats = 0;
+    int profile_hz;
+    int debug_mem = 0;
 
     CLI_BEGIN(options, argc, argv)
         CLI_FLAG('v', "verbose", verbose, "Enable verbose output")
+        CLI_FLAG('i', "inflate-requests", inflate_requests, "Decompress gzip and deflate request bodies before routing")
         CLI_INT('p', "port", port, 8080, "Port number (default: 8080)")
         CLI_STRING('d', "directory", directory, NULL, "Path to search for files")
+        CLI_INT('w', "workers", workers, 0, "Worker threads, 0 for one per CPU (default: 0)")
+        CLI_INT('z', "zerocopy", zerocopy_threshold, 131072, "MSG_ZEROCOPY threshold in bytes, 0 to disable (default: 131072)")
+        CLI_STRING('u', "upstream", upstreams, NULL, "Proxy prefixes to upstreams, e.g. /api=127.0.0.1:9000|127.0.0.1:9001,/app=unix:/run/app.sock")
+        CLI_STRING('b', "balance", balance, "round-robin", "Upstream selection: round-robin, least, hash-path or hash-header:<name>")
+        CLI_STRING('H', "health-check", health, NULL, "Path probed on every upstream, unhealthy ones get no traffic")
+        CLI_INT('c', "max-connections", max_connections, 0, "Open connections at once, 0 for no cap (default: 0)")
+        CLI_INT('I', "max-per-host", max_per_host, 0, "Open connections from one address, 0 for no cap (default: 0)")
+        CLI_INT('L', "shed-target", shed_target_ms, 0, "Shed requests once queueing stays above this many ms, 0 disables (default: 0)")
+        CLI_STRING('P', "shed-priority", shed_priorities, NULL, "Shedding classes by prefix, e.g. /health=critical,/api=high,/static=low")
+        CLI_STRING('r', "rate-limit", rate_limits, NULL, "Per-client limits, e.g. /=100:200,/api=10:20:X-Api-Key (rate/s:burst[:header])")
+        CLI_INT('a', "alloc-check", alloc_check, -1, "Report requests that still allocate after this many per worker, -1 disables (default: -1)")
+        CLI_FLAG('A', "alloc-check-fatal", alloc_check_fatal, "Exit with status 3 on the first such request instead")
+        CLI_STRING('C', "capture", capture, NULL, "Record HTTP/1.1 requests with their timing to this file for chttp-bench --replay")
+        CLI_INT('S', "capture-sample", capture_sample, 1, "Capture one in this many connections (default: 1)")
+        CLI_INT('M', "capture-max", capture_max_mb, 100, "Stop capturing once the file reaches this many MB (default: 100)")
+        CLI_INT('t', "trace", trace_sample, -1, "Trace one in this many requests, 0 for only those with the trace header, -1 disables (default: -1)")
+        CLI_INT('s', "slow-ms", slow_ms, -1, "Keep the timeline of requests taking this many ms or more for /debug/slow, -1 disables (default: -1)")
+        CLI_INT('F', "profile-hz", profile_hz, 0, "Serve /debug/pprof/profile, sampling this many times per CPU second, 0 disables (default: 0)")
+        CLI_FLAG('D', "debug-mem", debug_mem, "Serve the allocator's live state as JSON on /debug/mem")
+        CLI_FLAG('m', "shm-stats", shm_stats, "Publish live counters in /dev/shm/chttp.<pid> for chttp-top")
+        CLI_STRING('T', "trace-header", trace_header, TRACE_DEFAULT_HEADER, "Requests with this header are traced while tracing is on (default: X-Trace)")
     CLI_END(options);
 
     // Register signal handler for SIGINT
@@ -46,25 +281,130 @@ int main(int argc, char** argv) {
     HttpServer server;
     void* tag = TAG(&server);
     http_server_init(&server, "0.0.0.0", port, tag);
+    if (workers > 0) server.worker_count = workers;
+    server.zerocopy_threshold = zerocopy_threshold > 0 ? (size_t)zerocopy_threshold : 0;
+    server.max_connections = max_connections > 0 ? (size_t)max_connections : 0;
+    server.max_connections_per_host = max_per_host > 0 ? (size_t)max_per_host : 0;
+    server.alloc_check = alloc_check >= 0;
+    server.alloc_check_fatal = alloc_check_fatal;
+    server.alloc_check_warmup = alloc_check > 0 ? (size_t)alloc_check : 0;
+    g_server = &server;
+
+    // before any thread starts, they must all leave SIGUSR2 to the dump thread
+    if (trace_sample >= 0) {
+        if (!trace_enable((uint32_t)trace_sample, trace_header, tag) || !trace_dump_on_signal(SIGUSR2)) {
+            printf("Failed to start tracing\n");
+            http_server_free(&server);
+            pfree_tag(tag);
+            pallocator_cleanup();
+            return 1;
+        }
+        router_add_route(server.router, "/debug/trace", HTTP_GET, trace_route, false);
+        if (trace_sample > 0) printf("Tracing one in %d request(s) and those with %s", trace_sample, trace_header);
+        else printf("Tracing requests with %s", trace_header);
+        printf(", GET /debug/trace or SIGUSR2 dumps the spans\n");
+    }
+    if (slow_ms >= 0) {
+        if (!slowlog_enable((uint32_t)slow_ms, tag)) {
+            printf("Failed to allocate the slow request log\n");
+            http_server_free(&server);
+            pfree_tag(tag);
+            pallocator_cleanup();
+            return 1;
+        }
+        router_add_route(server.router, "/debug/slow", HTTP_GET, slowlog_route, false);
+        printf("Keeping requests that take %d ms or more, GET /debug/slow lists them\n", slow_ms);
+    }
+    if (profile_hz > 0) {
+        if (!profile_enable((uint32_t)profile_hz, tag)) {
+            http_server_free(&server);
+            pfree_tag(tag);
+            pallocator_cleanup();
+            return 1;
+        }
+        router_add_route(server.router, "/debug/pprof/profile", HTTP_GET, profile_route, false);
+        printf("Sampling at %d Hz on GET /debug/pprof/profile?seconds=N\n", profile_hz);
+    }
+    if (debug_mem) {
+        router_add_route(server.router, "/debug/mem", HTTP_GET, memstats_route, false);
+    }
 
     // builtin files routes isn't enabled by default let's add it
 	set_file_search_dir(string_new(directory, tag));
 	router_add_route(server.router, "/files", HTTP_GET | HTTP_POST, files_route, false);
 	router_add_route(server.router, "/hello", HTTP_GET, hello_handler, false);
+	g_chat = websocket_group_new(tag);
+	http_server_add_websocket(&server, "/ws/echo", &ws_echo);
+	http_server_add_websocket(&server, "/ws/chat", &ws_chat);
+	g_events = sse_channel_new(SSE_SLOW_DROP, SSE_HISTORY, tag);
+	router_add_route(server.router, "/events", HTTP_GET, events_handler, false);
+	router_add_route(server.router, "/events/publish", HTTP_POST, events_publish_handler, false);
+	if (upstreams && !add_upstreams(&server, upstreams, balance, health, tag)) {
+	    http_server_free(&server);
+	    pfree_tag(tag);
+	    pallocator_cleanup();
+	    return 1;
+	}
+	if ((rate_limits && !add_rate_limits(&server, rate_limits, tag))
+	    || (shed_target_ms > 0 && !enable_load_shedding(shed_target_ms, shed_priorities, tag))
+	    || (capture && !start_capture(capture, capture_sample, capture_max_mb))) {
+	    http_server_free(&server);
+	    proxy_clear();
+	    ratelimit_clear();
+	    loadshed_clear();
+	    pfree_tag(tag);
+	    pallocator_cleanup();
+	    return 1;
+	}
 
 	// add built-in routes
     http_server_add_builtins(&server, verbose);
+    if (inflate_requests) {
+        layers_add(server.layer_ctx, LAYER_PRE_ROUTE, "request-decompression", request_decompression_layer, false);
+    }
+
+	// the segment is sized for the workers, so it comes last
+	if (shm_stats) {
+	    if (!shmstats_start(server.worker_count)) {
+	        http_server_free(&server);
+	        pfree_tag(tag);
+	        pallocator_cleanup();
+	        return 1;
+	    }
+	    printf("Publishing stats in %s/chttp.%d, chttp-top shows them\n", SHMSTATS_DIRECTORY, (int)getpid());
+	}
 
-	// start the server (blocking)
-	if (http_server_start(&server) != 0) {
+	// start the server (blocking), unless ctrl+c came first
+	if (!g_stopping && !http_server_start(&server)) {
 	    printf("Failed to start server: %s\n", strerror(errno));
-	    http_server_free(&server);
 	}
+	g_server = NULL;
 
+	// every worker has returned, nothing writes the stats or the capture any more
+	capture_stop();
+	shmstats_stop();
+	if (verbose) {
+	    capture_print_stats();
+	    slowlog_print_stats();
+	    splice_stats_print();
+	    proxy_print_stats();
+	    ratelimit_print_stats();
+	    loadshed_print_stats();
+	    admission_print_stats(&server.admission);
+	    http_server_print_alloc_check(&server);
+	}
+	http_server_free(&server);
+	proxy_clear();
+	ratelimit_clear();
+	loadshed_clear();
+	websocket_group_free(g_chat);
+	sse_channel_free(g_events);
 	pfree_tag(tag);
 
     // some memory leak checking
-    if (verbose) palloc_print_state();
+    if (verbose) {
+        palloc_print_state();
+    }
     pallocator_cleanup();
     return 0;
 }
@@ -0,0 +1,249 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "alloc.h"
+#include "memstats.h"
+#include "router.h"
+
+// Room left for tags created between counting them and copying them
+#define MEMSTATS_TAG_SLACK 64
+
+typedef struct {
+    void* tag;
+    size_t count;
+    size_t bytes;
+} MemTag;
+
+typedef struct {
+    uint64_t taken_ns;      // CLOCK_REALTIME
+    palloc_summary summary;
+    MemTag* tags;           // sorted by tag
+    size_t tag_count;
+    size_t tags_missed;     // created while copying, beyond the slack
+} MemSnapshot;
+
+// how much one tag changed between two snapshots
+typedef struct {
+    void* tag;
+    long long count;
+    long long bytes;
+} MemGrowth;
+
+typedef struct {
+    MemSnapshot* snapshot;
+    size_t capacity;
+} CopyCtx;
+
+// snapshots use the system allocator, so inspecting memory doesn't show up as growth
+static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
+static MemSnapshot g_previous;
+static MemSnapshot g_baseline;
+
+static uint64_t memstats_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static void memstats_copy_tag(void* tag, size_t count, size_t bytes, void* ctx) {
+    CopyCtx* copy = ctx;
+    MemSnapshot* snapshot = copy->snapshot;
+    if (snapshot->tag_count == copy->capacity) {
+        snapshot->tags_missed++;
+        return;
+    }
+    snapshot->tags[snapshot->tag_count++] = (MemTag){ .tag = tag, .count = count, .bytes = bytes };
+}
+
+static int memstats_compare_tags(const void* a, const void* b) {
+    uintptr_t left = (uintptr_t)((const MemTag*)a)->tag;
+    uintptr_t right = (uintptr_t)((const MemTag*)b)->tag;
+    return left < right ? -1 : left > right;
+}
+
+static int memstats_compare_bytes(const void* a, const void* b) {
+    size_t left = ((const MemTag*)a)->bytes;
+    size_t right = ((const MemTag*)b)->bytes;
+    return left > right ? -1 : left < right;
+}
+
+static int memstats_compare_growth(const void* a, const void* b) {
+    long long left = ((const MemGrowth*)a)->bytes;
+    long long right = ((const MemGrowth*)b)->bytes;
+    return left > right ? -1 : left < right;
+}
+
+static void memstats_free(MemSnapshot* snapshot) {
+    free(snapshot->tags);
+    memset(snapshot, 0, sizeof(*snapshot));
+}
+
+// the summary and the tag walk each hold the allocator lock once, sorting happens after
+static bool memstats_take(MemSnapshot* snapshot) {
+    memset(snapshot, 0, sizeof(*snapshot));
+    palloc_get_summary(&snapshot->summary);
+    CopyCtx copy = { .snapshot = snapshot, .capacity = snapshot->summary.tags + MEMSTATS_TAG_SLACK };
+    snapshot->tags = malloc(copy.capacity * sizeof(MemTag));
+    if (!snapshot->tags) return false;
+
+    palloc_visit_tags(memstats_copy_tag, &copy);
+    snapshot->taken_ns = memstats_now_ns();
+    qsort(snapshot->tags, snapshot->tag_count, sizeof(MemTag), memstats_compare_tags);
+    return true;
+}
+
+static bool memstats_clone(MemSnapshot* clone, const MemSnapshot* snapshot) {
+    *clone = *snapshot;
+    clone->tags = malloc((snapshot->tag_count ? snapshot->tag_count : 1) * sizeof(MemTag));
+    if (!clone->tags) return false;
+    memcpy(clone->tags, snapshot->tags, snapshot->tag_count * sizeof(MemTag));
+    return true;
+}
+
+static void memstats_write_tag(FILE* fp, void* tag) {
+    if (IS_CONNECTION_TAG(tag)) {
+        fprintf(fp, "\"tag\":\"connection %zu\",\"kind\":\"connection\"", (size_t)tag & ~CONNECTION_TAG_BIT);
+    } else {
+        fprintf(fp, "\"tag\":\"%p\",\"kind\":\"long-lived\"", tag);
+    }
+}
+
+static void memstats_write_classes(FILE* fp, const palloc_summary* now, const palloc_summary* then) {
+    fputc('[', fp);
+    bool first = true;
+    for (size_t i = 0; i < PALLOC_SIZE_CLASSES; i++) {
+        long long count = (long long)now->class_count[i] - (then ? (long long)then->class_count[i] : 0);
+        long long bytes = (long long)now->class_bytes[i] - (then ? (long long)then->class_bytes[i] : 0);
+        if (count == 0 && bytes == 0) continue;
+        if (!first) fputc(',', fp);
+        first = false;
+        if (i + 1 < PALLOC_SIZE_CLASSES) fprintf(fp, "{\"up_to\":%llu,", 1ull << i);
+        else fprintf(fp, "{\"up_to\":null,");
+        fprintf(fp, "\"allocations\":%lld,\"bytes\":%lld}", count, bytes);
+    }
+    fputc(']', fp);
+}
+
+// walks both sorted tag lists at once, tags only one of them has count from zero
+static bool memstats_write_diff(FILE* fp, const MemSnapshot* now, const MemSnapshot* then) {
+    size_t capacity = now->tag_count + then->tag_count;
+    MemGrowth* growth = malloc((capacity ? capacity : 1) * sizeof(MemGrowth));
+    if (!growth) return false;
+
+    size_t n = 0, i = 0, j = 0, appeared = 0, vanished = 0;
+    while (i < now->tag_count || j < then->tag_count) {
+        int order = i == now->tag_count ? 1 : j == then->tag_count ? -1 : memstats_compare_tags(&now->tags[i], &then->tags[j]);
+        if (order < 0) {
+            growth[n++] = (MemGrowth){ now->tags[i].tag, (long long)now->tags[i].count, (long long)now->tags[i].bytes };
+            appeared++;
+            i++;
+        } else if (order > 0) {
+            growth[n++] = (MemGrowth){ then->tags[j].tag, -(long long)then->tags[j].count, -(long long)then->tags[j].bytes };
+            vanished++;
+            j++;
+        } else {
+            growth[n++] = (MemGrowth){ now->tags[i].tag, (long long)now->tags[i].count - (long long)then->tags[j].count,
+                                       (long long)now->tags[i].bytes - (long long)then->tags[j].bytes };
+            i++;
+            j++;
+        }
+    }
+    qsort(growth, n, sizeof(MemGrowth), memstats_compare_growth);
+
+    fprintf(fp, "{\"seconds\":%.3f,\"allocations\":%lld,\"bytes\":%lld,\"tags_appeared\":%zu,\"tags_vanished\":%zu,",
+            (double)(now->taken_ns - then->taken_ns) / 1e9,
+            (long long)now->summary.allocations - (long long)then->summary.allocations,
+            (long long)now->summary.bytes - (long long)then->summary.bytes, appeared, vanished);
+    fprintf(fp, "\"size_classes\":");
+    memstats_write_classes(fp, &now->summary, &then->summary);
+    fprintf(fp, ",\"top_growth\":[");
+    for (size_t k = 0; k < n && k < MEMSTATS_TOP_TAGS && growth[k].bytes > 0; k++) {
+        if (k) fputc(',', fp);
+        fputc('{', fp);
+        memstats_write_tag(fp, growth[k].tag);
+        fprintf(fp, ",\"allocations\":%lld,\"bytes\":%lld}", growth[k].count, growth[k].bytes);
+    }
+    fprintf(fp, "]}");
+    free(growth);
+    return true;
+}
+
+bool memstats_write_json(FILE* fp, bool save_baseline, bool diff) {
+    MemSnapshot now;
+    if (!memstats_take(&now)) return false;
+
+    fprintf(fp, "{\"allocations\":%zu,\"bytes\":%zu,\"tags\":%zu,\"tags_missed\":%zu,\"size_classes\":",
+            now.summary.allocations, now.summary.bytes, now.tag_count, now.tags_missed);
+    memstats_write_classes(fp, &now.summary, NULL);
+
+    // the largest tags, from a copy so `now` stays sorted by tag for the diffs
+    MemTag* largest = malloc((now.tag_count ? now.tag_count : 1) * sizeof(MemTag));
+    if (!largest) {
+        memstats_free(&now);
+        return false;
+    }
+    memcpy(largest, now.tags, now.tag_count * sizeof(MemTag));
+    qsort(largest, now.tag_count, sizeof(MemTag), memstats_compare_bytes);
+    fprintf(fp, ",\"top_tags\":[");
+    for (size_t i = 0; i < now.tag_count && i < MEMSTATS_TOP_TAGS; i++) {
+        if (i) fputc(',', fp);
+        fputc('{', fp);
+        memstats_write_tag(fp, largest[i].tag);
+        fprintf(fp, ",\"allocations\":%zu,\"bytes\":%zu}", largest[i].count, largest[i].bytes);
+    }
+    fputc(']', fp);
+    free(largest);
+
+    bool ok = true;
+    pthread_mutex_lock(&g_lock);
+    fprintf(fp, ",\"since_last\":");
+    if (g_previous.taken_ns) ok = memstats_write_diff(fp, &now, &g_previous);
+    else fprintf(fp, "null");
+    if (ok && diff) {
+        fprintf(fp, ",\"since_baseline\":");
+        if (g_baseline.taken_ns) ok = memstats_write_diff(fp, &now, &g_baseline);
+        else fprintf(fp, "null");
+    }
+    if (ok && save_baseline) {
+        MemSnapshot baseline;
+        ok = memstats_clone(&baseline, &now);
+        if (ok) {
+            memstats_free(&g_baseline);
+            g_baseline = baseline;
+            fprintf(fp, ",\"baseline_saved\":true");
+        }
+    }
+    memstats_free(&g_previous);
+    g_previous = now;
+    pthread_mutex_unlock(&g_lock);
+
+    fprintf(fp, "}\n");
+    return ok && !ferror(fp);
+}
+
+// whether `name` is among the query parameters of `target`, with or without a value
+static bool memstats_has_param(const char* target, const char* name) {
+    const char* query = strchr(target, '?');
+    size_t name_len = strlen(name);
+    while (query) {
+        query++;
+        if (strncmp(query, name, name_len) == 0 && strchr("=&", query[name_len])) return true;
+        query = strchr(query, '&');
+    }
+    return false;
+}
+
+void memstats_route(HttpRequest* request, HttpResponse* response) {
+    const char* target = string_cstr(request->request_line.target);
+    char* json = NULL;
+    size_t len = 0;
+    FILE* fp = open_memstream(&json, &len);
+    bool ok = fp && memstats_write_json(fp, memstats_has_param(target, "baseline"), memstats_has_param(target, "diff"));
+    if (fp) fclose(fp);
+
+    http_response_set_body(response, ok ? json : NULL, len, "application/json");
+    free(json);
+}
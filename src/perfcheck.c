@@ -0,0 +1,474 @@
+#include <ctype.h>
+#include <errno.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/utsname.h>
+#include <time.h>
+#include <unistd.h>
+#include "alloc.h"
+#include "perfcheck.h"
+
+ARRAY_DEFINE(PerfResult, PerfResultArray)
+
+#define PERF_BOOTSTRAP_ROUNDS 2000
+#define PERF_MAX_FILE (16 * 1024 * 1024)
+
+// -- environment ----------------------------------------------------------------
+
+static void perf_read_line(const char* path, const char* key, char* out, size_t size) {
+    FILE* fp = fopen(path, "r");
+    if (!fp) return;
+
+    char line[256];
+    while (fgets(line, sizeof(line), fp)) {
+        const char* value = line;
+        if (key) {
+            if (strncmp(line, key, strlen(key)) != 0) continue;
+            value = strchr(line, ':');
+            if (!value) continue;
+            value++;
+            while (*value == ' ' || *value == '\t') value++;
+        }
+        snprintf(out, size, "%.*s", (int)strcspn(value, "\n"), value);
+        break;
+    }
+    fclose(fp);
+}
+
+void perf_env_collect(PerfEnv* env) {
+    memset(env, 0, sizeof(PerfEnv));
+
+    time_t now = time(NULL);
+    struct tm utc;
+    gmtime_r(&now, &utc);
+    strftime(env->timestamp, sizeof(env->timestamp), "%Y-%m-%dT%H:%M:%SZ", &utc);
+    gethostname(env->host, sizeof(env->host) - 1);
+
+    struct utsname name;
+    if (uname(&name) == 0) snprintf(env->kernel, sizeof(env->kernel), "%s %s %s", name.sysname, name.release, name.machine);
+
+    snprintf(env->cpu, sizeof(env->cpu), "unknown");
+    perf_read_line("/proc/cpuinfo", "model name", env->cpu, sizeof(env->cpu));
+    snprintf(env->governor, sizeof(env->governor), "unknown");
+    perf_read_line("/sys/devices/system/cpu/cpu0/cpufreq/scaling_governor", NULL, env->governor, sizeof(env->governor));
+#if defined(__clang__)
+    snprintf(env->compiler, sizeof(env->compiler), "clang %s", __clang_version__);
+#elif defined(__GNUC__)
+    snprintf(env->compiler, sizeof(env->compiler), "gcc %s", __VERSION__);
+#endif
+    env->cpus = (int)sysconf(_SC_NPROCESSORS_ONLN);
+}
+
+// -- JSON -------------------------------------------------------------------------
+
+static void json_write_string(FILE* fp, const char* str) {
+    fputc('"', fp);
+    for (const unsigned char* c = (const unsigned char*)str; *c; c++) {
+        if (*c == '"' || *c == '\\') fprintf(fp, "\\%c", *c);
+        else if (*c < 0x20) fprintf(fp, "\\u%04x", *c);
+        else fputc(*c, fp);
+    }
+    fputc('"', fp);
+}
+
+void perf_env_write_json(const PerfEnv* env, FILE* fp) {
+    fprintf(fp, "{\"timestamp\":");
+    json_write_string(fp, env->timestamp);
+    fprintf(fp, ",\"host\":");
+    json_write_string(fp, env->host);
+    fprintf(fp, ",\"kernel\":");
+    json_write_string(fp, env->kernel);
+    fprintf(fp, ",\"cpu\":");
+    json_write_string(fp, env->cpu);
+    fprintf(fp, ",\"cpus\":%d,\"governor\":", env->cpus);
+    json_write_string(fp, env->governor);
+    fprintf(fp, ",\"compiler\":");
+    json_write_string(fp, env->compiler);
+    fprintf(fp, "}");
+}
+
+bool perf_run_write(const PerfRun* run, const char* path) {
+    FILE* fp = strcmp(path, "-") == 0 ? stdout : fopen(path, "w");
+    if (!fp) {
+        printf("Failed to open %s: %s\n", path, strerror(errno));
+        return false;
+    }
+
+    fprintf(fp, "{\"env\":");
+    perf_env_write_json(&run->env, fp);
+    fprintf(fp, ",\n\"benchmarks\":[");
+    for (size_t i = 0; i < run->results.size; i++) {
+        const PerfResult* result = &run->results.data[i];
+        fprintf(fp, "%s\n{\"name\":", i ? "," : "");
+        json_write_string(fp, result->name);
+        fprintf(fp, ",\"iterations\":%zu,\"ns_per_op\":[", result->iterations);
+        for (size_t s = 0; s < result->sample_count; s++) {
+            fprintf(fp, "%s%.3f", s ? "," : "", result->samples[s]);
+        }
+        fprintf(fp, "],\"allocs_per_op\":%.4f,\"bytes_per_op\":%.2f}", result->allocs_per_op, result->bytes_per_op);
+    }
+    fprintf(fp, "\n]}\n");
+
+    if (fp != stdout) fclose(fp);
+    return true;
+}
+
+// a reader for the JSON perf_run_write produces, unknown keys are skipped
+typedef struct {
+    const char* p;
+    const char* end;
+} JsonReader;
+
+static void json_ws(JsonReader* r) {
+    while (r->p < r->end && isspace((unsigned char)*r->p)) r->p++;
+}
+
+static bool json_expect(JsonReader* r, char c) {
+    json_ws(r);
+    if (r->p >= r->end || *r->p != c) return false;
+    r->p++;
+    return true;
+}
+
+static bool json_peek(JsonReader* r, char c) {
+    json_ws(r);
+    return r->p < r->end && *r->p == c;
+}
+
+// `out` may be NULL to skip the string, escapes other than \" and \\ become '?'
+static bool json_string(JsonReader* r, char* out, size_t size) {
+    if (!json_expect(r, '"')) return false;
+    size_t len = 0;
+    while (r->p < r->end && *r->p != '"') {
+        char c = *r->p++;
+        if (c == '\\') {
+            if (r->p >= r->end) return false;
+            c = *r->p++;
+            if (c == 'u') {
+                r->p += r->end - r->p >= 4 ? 4 : r->end - r->p;
+                c = '?';
+            } else if (c != '"' && c != '\\' && c != '/') {
+                c = '?';
+            }
+        }
+        if (out && len + 1 < size) out[len++] = c;
+    }
+    if (out && size) out[len] = '\0';
+    return json_expect(r, '"');
+}
+
+static bool json_number(JsonReader* r, double* out) {
+    json_ws(r);
+    char* end = NULL;
+    double value = strtod(r->p, &end);
+    if (end == r->p || end > r->end) return false;
+    r->p = end;
+    *out = value;
+    return true;
+}
+
+static bool json_skip(JsonReader* r) {
+    json_ws(r);
+    if (r->p >= r->end) return false;
+    if (*r->p == '"') return json_string(r, NULL, 0);
+    if (*r->p == '{' || *r->p == '[') {
+        char close = *r->p == '{' ? '}' : ']';
+        r->p++;
+        if (json_expect(r, close)) return true;
+        do {
+            if (close == '}' && (!json_string(r, NULL, 0) || !json_expect(r, ':'))) return false;
+            if (!json_skip(r)) return false;
+        } while (json_expect(r, ','));
+        return json_expect(r, close);
+    }
+    // numbers, true, false and null
+    const char* start = r->p;
+    while (r->p < r->end && (isalnum((unsigned char)*r->p) || strchr("+-.", *r->p))) r->p++;
+    return r->p > start;
+}
+
+static bool json_load_env(JsonReader* r, PerfEnv* env) {
+    if (!json_expect(r, '{')) return false;
+    if (json_expect(r, '}')) return true;
+    do {
+        char key[32];
+        if (!json_string(r, key, sizeof(key)) || !json_expect(r, ':')) return false;
+        struct { const char* key; char* field; size_t size; } fields[] = {
+            { "timestamp", env->timestamp, sizeof(env->timestamp) },
+            { "host", env->host, sizeof(env->host) },
+            { "kernel", env->kernel, sizeof(env->kernel) },
+            { "cpu", env->cpu, sizeof(env->cpu) },
+            { "governor", env->governor, sizeof(env->governor) },
+            { "compiler", env->compiler, sizeof(env->compiler) },
+        };
+        bool ok = false;
+        bool known = false;
+        for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+            if (strcmp(key, fields[i].key) == 0) {
+                ok = json_string(r, fields[i].field, fields[i].size);
+                known = true;
+            }
+        }
+        if (!known && strcmp(key, "cpus") == 0) {
+            double cpus = 0;
+            ok = json_number(r, &cpus);
+            env->cpus = (int)cpus;
+        } else if (!known) {
+            ok = json_skip(r);
+        }
+        if (!ok) return false;
+    } while (json_expect(r, ','));
+    return json_expect(r, '}');
+}
+
+static bool json_load_result(JsonReader* r, PerfResult* result) {
+    memset(result, 0, sizeof(PerfResult));
+    if (!json_expect(r, '{')) return false;
+    if (json_expect(r, '}')) return true;
+    do {
+        char key[32];
+        double value;
+        if (!json_string(r, key, sizeof(key)) || !json_expect(r, ':')) return false;
+        if (strcmp(key, "name") == 0) {
+            if (!json_string(r, result->name, sizeof(result->name))) return false;
+        } else if (strcmp(key, "ns_per_op") == 0) {
+            if (!json_expect(r, '[')) return false;
+            if (json_peek(r, ']')) {
+                r->p++;
+                continue;
+            }
+            do {
+                if (!json_number(r, &value)) return false;
+                if (result->sample_count < PERF_MAX_SAMPLES) result->samples[result->sample_count++] = value;
+            } while (json_expect(r, ','));
+            if (!json_expect(r, ']')) return false;
+        } else if (strcmp(key, "iterations") == 0 || strcmp(key, "allocs_per_op") == 0
+                   || strcmp(key, "bytes_per_op") == 0) {
+            if (!json_number(r, &value)) return false;
+            if (key[0] == 'i') result->iterations = (size_t)value;
+            else if (key[0] == 'a') result->allocs_per_op = value;
+            else result->bytes_per_op = value;
+        } else if (!json_skip(r)) {
+            return false;
+        }
+    } while (json_expect(r, ','));
+    return json_expect(r, '}');
+}
+
+static bool json_load_run(JsonReader* r, PerfRun* run) {
+    if (!json_expect(r, '{')) return false;
+    if (json_expect(r, '}')) return true;
+    do {
+        char key[32];
+        if (!json_string(r, key, sizeof(key)) || !json_expect(r, ':')) return false;
+        if (strcmp(key, "env") == 0) {
+            if (!json_load_env(r, &run->env)) return false;
+        } else if (strcmp(key, "benchmarks") == 0) {
+            if (!json_expect(r, '[')) return false;
+            if (json_expect(r, ']')) continue;
+            do {
+                PerfResult result;
+                if (!json_load_result(r, &result) || !PerfResultArray_push(&run->results, result)) return false;
+            } while (json_expect(r, ','));
+            if (!json_expect(r, ']')) return false;
+        } else if (!json_skip(r)) {
+            return false;
+        }
+    } while (json_expect(r, ','));
+    return json_expect(r, '}');
+}
+
+bool perf_run_init(PerfRun* run, void* tag) {
+    perf_env_collect(&run->env);
+    return PerfResultArray_init(&run->results, tag);
+}
+
+void perf_run_free(PerfRun* run) {
+    PerfResultArray_destroy(&run->results);
+}
+
+bool perf_run_load(PerfRun* run, const char* path, void* tag) {
+    memset(&run->env, 0, sizeof(PerfEnv));
+    if (!PerfResultArray_init(&run->results, tag)) return false;
+
+    FILE* fp = fopen(path, "r");
+    if (!fp) {
+        printf("Failed to open %s: %s\n", path, strerror(errno));
+        perf_run_free(run);
+        return false;
+    }
+    char* data = pmalloc(PERF_MAX_FILE, tag);
+    size_t len = data ? fread(data, 1, PERF_MAX_FILE - 1, fp) : 0;
+    fclose(fp);
+    if (data) data[len] = '\0'; // strtod needs a terminator
+
+    JsonReader reader = { .p = data, .end = data + len };
+    bool ok = data && len < PERF_MAX_FILE - 1 && json_load_run(&reader, run);
+    if (data) pfree(data);
+    if (!ok) {
+        printf("%s is not a benchmark run\n", path);
+        perf_run_free(run);
+    }
+    return ok;
+}
+
+// -- statistics -----------------------------------------------------------------
+
+static int perf_compare_double(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+// 0 for no values, a result file may list a benchmark without samples
+static double perf_median(const double* values, size_t len) {
+    if (len == 0) return 0.0;
+    double sorted[PERF_MAX_SAMPLES];
+    memcpy(sorted, values, len * sizeof(double));
+    qsort(sorted, len, sizeof(double), perf_compare_double);
+    return len % 2 ? sorted[len / 2] : (sorted[len / 2 - 1] + sorted[len / 2]) / 2.0;
+}
+
+double perf_mann_whitney(const double* a, size_t a_len, const double* b, size_t b_len) {
+    if (a_len == 0 || b_len == 0) return 1.0;
+
+    // rank the pooled samples, ties share the average of their ranks
+    typedef struct { double value; bool from_a; } Sample;
+    Sample pooled[2 * PERF_MAX_SAMPLES];
+    size_t n = 0;
+    for (size_t i = 0; i < a_len; i++) pooled[n++] = (Sample){ a[i], true };
+    for (size_t i = 0; i < b_len; i++) pooled[n++] = (Sample){ b[i], false };
+    for (size_t i = 1; i < n; i++) {
+        Sample s = pooled[i];
+        size_t j = i;
+        for (; j > 0 && pooled[j - 1].value > s.value; j--) pooled[j] = pooled[j - 1];
+        pooled[j] = s;
+    }
+
+    double rank_sum = 0.0, ties = 0.0;
+    for (size_t i = 0; i < n;) {
+        size_t j = i;
+        while (j < n && pooled[j].value == pooled[i].value) j++;
+        double rank = (double)(i + j + 1) / 2.0;
+        for (size_t k = i; k < j; k++) {
+            if (pooled[k].from_a) rank_sum += rank;
+        }
+        double t = (double)(j - i);
+        ties += t * t * t - t;
+        i = j;
+    }
+
+    double n1 = (double)a_len, n2 = (double)b_len, total = (double)n;
+    double u = rank_sum - n1 * (n1 + 1.0) / 2.0;
+    double mean = n1 * n2 / 2.0;
+    double variance = n1 * n2 / 12.0 * ((total + 1.0) - ties / (total * (total - 1.0)));
+    if (variance <= 0.0) return 1.0;
+
+    // continuity corrected, two-sided
+    double z = (fabs(u - mean) - 0.5) / sqrt(variance);
+    if (z < 0.0) z = 0.0;
+    return erfc(z / sqrt(2.0));
+}
+
+static uint64_t perf_random(uint64_t* state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+void perf_bootstrap_ratio(const double* baseline, size_t baseline_len, const double* current,
+                          size_t current_len, double* low, double* high) {
+    *low = *high = 1.0;
+    if (baseline_len == 0 || current_len == 0) return;
+
+    // a fixed seed, the same two runs always give the same interval
+    uint64_t state = 0x2545f4914f6cdd1dull;
+    double ratios[PERF_BOOTSTRAP_ROUNDS];
+    double a[PERF_MAX_SAMPLES], b[PERF_MAX_SAMPLES];
+    for (size_t round = 0; round < PERF_BOOTSTRAP_ROUNDS; round++) {
+        for (size_t i = 0; i < baseline_len; i++) a[i] = baseline[perf_random(&state) % baseline_len];
+        for (size_t i = 0; i < current_len; i++) b[i] = current[perf_random(&state) % current_len];
+        double base = perf_median(a, baseline_len);
+        ratios[round] = base > 0.0 ? perf_median(b, current_len) / base : 1.0;
+    }
+    qsort(ratios, PERF_BOOTSTRAP_ROUNDS, sizeof(double), perf_compare_double);
+    *low = ratios[PERF_BOOTSTRAP_ROUNDS / 40];
+    *high = ratios[PERF_BOOTSTRAP_ROUNDS - 1 - PERF_BOOTSTRAP_ROUNDS / 40];
+}
+
+// -- comparison -----------------------------------------------------------------
+
+static void perf_env_warn(const char* what, const char* baseline, const char* current) {
+    if (strcmp(baseline, current) != 0) {
+        printf("warning: %s differs, baseline \"%s\", current \"%s\"\n", what, baseline, current);
+    }
+}
+
+static const PerfResult* perf_find(const PerfRun* run, const char* name) {
+    for (size_t i = 0; i < run->results.size; i++) {
+        if (strcmp(run->results.data[i].name, name) == 0) return &run->results.data[i];
+    }
+    return NULL;
+}
+
+size_t perf_compare(const PerfRun* baseline, const PerfRun* current, double threshold, double alpha) {
+    perf_env_warn("cpu", baseline->env.cpu, current->env.cpu);
+    perf_env_warn("compiler", baseline->env.compiler, current->env.compiler);
+    perf_env_warn("kernel", baseline->env.kernel, current->env.kernel);
+    perf_env_warn("governor", baseline->env.governor, current->env.governor);
+    if (baseline->env.cpus != current->env.cpus) {
+        printf("warning: cpu count differs, baseline %d, current %d\n", baseline->env.cpus, current->env.cpus);
+    }
+
+    printf("%-36s %12s %12s %8s %18s %8s %10s  %s\n", "benchmark", "baseline", "current", "change", "95% CI",
+           "p", "allocs", "verdict");
+
+    size_t regressions = 0;
+    bool few_samples = false;
+    for (size_t i = 0; i < current->results.size; i++) {
+        const PerfResult* cur = &current->results.data[i];
+        const PerfResult* base = perf_find(baseline, cur->name);
+        if (cur->sample_count == 0) {
+            printf("%-36s %12s %12s %8s %18s %8s %10.2f  no samples\n", cur->name, "-", "-", "", "", "",
+                   cur->allocs_per_op);
+            continue;
+        }
+        if (!base || base->sample_count == 0) {
+            printf("%-36s %12s %12.1f %8s %18s %8s %10.2f  new\n", cur->name, "-", perf_median(cur->samples, cur->sample_count),
+                   "", "", "", cur->allocs_per_op);
+            continue;
+        }
+
+        double base_median = perf_median(base->samples, base->sample_count);
+        double cur_median = perf_median(cur->samples, cur->sample_count);
+        double ratio = base_median > 0.0 ? cur_median / base_median : 1.0;
+        double p = perf_mann_whitney(base->samples, base->sample_count, cur->samples, cur->sample_count);
+        double low, high;
+        perf_bootstrap_ratio(base->samples, base->sample_count, cur->samples, cur->sample_count, &low, &high);
+        if (base->sample_count < 5 || cur->sample_count < 5) few_samples = true;
+
+        // allocation counts don't vary between runs, any real growth is a change in the code
+        bool allocs_grew = cur->allocs_per_op > base->allocs_per_op * (1.0 + threshold) + 0.005;
+        const char* verdict = "ok";
+        if (p < alpha && ratio > 1.0 + threshold) verdict = "REGRESSED";
+        else if (allocs_grew) verdict = "REGRESSED (allocs)";
+        else if (p < alpha && ratio < 1.0 - threshold) verdict = "faster";
+        if (verdict[0] == 'R') regressions++;
+
+        char ci[32];
+        snprintf(ci, sizeof(ci), "[%+.1f%%, %+.1f%%]", (low - 1.0) * 100.0, (high - 1.0) * 100.0);
+        printf("%-36s %12.1f %12.1f %+7.1f%% %18s %8.4f %4.1f->%-4.1f  %s\n", cur->name, base_median, cur_median,
+               (ratio - 1.0) * 100.0, ci, p, base->allocs_per_op, cur->allocs_per_op, verdict);
+    }
+    for (size_t i = 0; i < baseline->results.size; i++) {
+        if (!perf_find(current, baseline->results.data[i].name)) {
+            printf("%-36s missing from the current run\n", baseline->results.data[i].name);
+        }
+    }
+
+    if (few_samples) printf("warning: fewer than 5 samples per side, differences can't be significant\n");
+    printf("%zu regression(s) beyond %.1f%% at p < %g\n", regressions, threshold * 100.0, alpha);
+    return regressions;
+}
@@ -0,0 +1,461 @@
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <ucontext.h>
+#include <unistd.h>
+#include "alloc.h"
+#include "event.h"
+#include "profile.h"
+#include "router.h"
+
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+// Longest folded line written, deeper or longer stacks are cut at the leaf end
+#define PROFILE_LINE_LEN 8192
+
+typedef struct {
+    bool live;                 // a running thread holds the slot
+    bool armed;                // its timer exists
+    pid_t tid;
+    pthread_t thread;
+    uintptr_t stack_low;       // frame pointers outside the stack end the unwind
+    uintptr_t stack_high;
+    timer_t timer;
+    _Atomic(uintptr_t*) buffer; // samples go here while a profile runs
+    size_t used;               // words of `buffer` filled, written only by the signal handler
+    size_t dropped;
+    atomic_bool busy;          // the signal handler is writing to `buffer`
+} ProfileThread;
+
+// a profile requested over HTTP, run on a thread of its own
+typedef struct {
+    HttpResponse* response;
+    EventLoop* loop;       // the worker that answers it
+    uint32_t seconds;
+    char* folded;          // open_memstream output, from the system allocator
+    size_t len;
+    bool ok;
+    bool cancelled;        // the request went away, only touched on `loop`
+} ProfileJob;
+
+// a unique stack and how often it was sampled
+typedef struct {
+    char* line;
+    size_t count;
+} ProfileStack;
+
+static bool g_enabled = false;
+static uint32_t g_hz;
+static void* g_tag;
+static ProfileThread g_threads[PROFILE_MAX_THREADS];
+static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
+static atomic_bool g_running;
+static _Thread_local int t_slot = -1;
+
+// walks the saved frame pointer chain of the interrupted code, leaf first
+static size_t profile_unwind(const ucontext_t* context, const ProfileThread* thread, uintptr_t* pcs) {
+#if defined(__x86_64__)
+    uintptr_t pc = (uintptr_t)context->uc_mcontext.gregs[REG_RIP];
+    uintptr_t fp = (uintptr_t)context->uc_mcontext.gregs[REG_RBP];
+#elif defined(__aarch64__)
+    uintptr_t pc = (uintptr_t)context->uc_mcontext.pc;
+    uintptr_t fp = (uintptr_t)context->uc_mcontext.regs[29];
+#else
+    (void)context;
+    (void)thread;
+    (void)pcs;
+    return 0;
+#endif
+#if defined(__x86_64__) || defined(__aarch64__)
+    size_t depth = 0;
+    pcs[depth++] = pc;
+    while (depth < PROFILE_MAX_DEPTH && fp >= thread->stack_low && fp <= thread->stack_high - 2 * sizeof(uintptr_t)
+           && fp % sizeof(uintptr_t) == 0) {
+        const uintptr_t* frame = (const uintptr_t*)fp;
+        uintptr_t next = frame[0];
+        uintptr_t ret = frame[1];
+        if (ret == 0) break;
+        // one byte back lands in the call instruction, so the caller's line is found
+        pcs[depth++] = ret - 1;
+        // stacks grow down, a frame further up that isn't is garbage
+        if (next <= fp) break;
+        fp = next;
+    }
+    return depth;
+#endif
+}
+
+static void profile_on_signal(int signum, siginfo_t* info, void* context) {
+    (void)signum;
+    (void)info;
+    int slot = t_slot;
+    if (slot < 0) return;
+
+    int saved_errno = errno;
+    ProfileThread* thread = &g_threads[slot];
+    atomic_store(&thread->busy, true);
+    uintptr_t* buffer = atomic_load(&thread->buffer);
+    if (buffer) {
+        uintptr_t pcs[PROFILE_MAX_DEPTH];
+        size_t depth = profile_unwind(context, thread, pcs);
+        if (depth > 0 && thread->used + depth + 1 <= PROFILE_BUFFER_WORDS) {
+            buffer[thread->used] = depth;
+            memcpy(buffer + thread->used + 1, pcs, depth * sizeof(uintptr_t));
+            thread->used += depth + 1;
+        } else {
+            thread->dropped++;
+        }
+    }
+    atomic_store(&thread->busy, false);
+    errno = saved_errno;
+}
+
+bool profile_enable(uint32_t hz, void* tag) {
+    if (hz == 0 || hz > 1000000) return false;
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = profile_on_signal;
+    action.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGPROF, &action, NULL) != 0) {
+        printf("Failed to install the SIGPROF handler: %s\n", strerror(errno));
+        return false;
+    }
+    g_hz = hz;
+    g_tag = tag;
+    g_enabled = true;
+    return true;
+}
+
+bool profile_enabled(void) {
+    return g_enabled;
+}
+
+void profile_thread_register(void) {
+    if (!g_enabled || t_slot >= 0) return;
+
+    pthread_attr_t attr;
+    void* stack = NULL;
+    size_t stack_size = 0;
+    if (pthread_getattr_np(pthread_self(), &attr) != 0) return;
+    int status = pthread_attr_getstack(&attr, &stack, &stack_size);
+    pthread_attr_destroy(&attr);
+    if (status != 0) return;
+
+    pthread_mutex_lock(&g_lock);
+    for (int i = 0; i < PROFILE_MAX_THREADS; i++) {
+        ProfileThread* thread = &g_threads[i];
+        // a slot is only reused once the profile that sampled its last thread collected it
+        if (thread->live || atomic_load(&thread->buffer)) continue;
+        thread->live = true;
+        thread->tid = gettid();
+        thread->thread = pthread_self();
+        thread->stack_low = (uintptr_t)stack;
+        thread->stack_high = (uintptr_t)stack + stack_size;
+        t_slot = i;
+        break;
+    }
+    pthread_mutex_unlock(&g_lock);
+}
+
+void profile_thread_unregister(void) {
+    if (t_slot < 0) return;
+
+    pthread_mutex_lock(&g_lock);
+    ProfileThread* thread = &g_threads[t_slot];
+    if (thread->armed) {
+        timer_delete(thread->timer);
+        thread->armed = false;
+    }
+    thread->live = false;
+    // samples taken so far stay in the buffer for the running profile
+    t_slot = -1;
+    pthread_mutex_unlock(&g_lock);
+}
+
+static bool profile_arm(ProfileThread* thread) {
+    uintptr_t* buffer = pmalloc(PROFILE_BUFFER_WORDS * sizeof(uintptr_t), g_tag);
+    if (!buffer) return false;
+
+    clockid_t clock;
+    struct sigevent event;
+    memset(&event, 0, sizeof(event));
+    event.sigev_notify = SIGEV_THREAD_ID;
+    event.sigev_signo = SIGPROF;
+    event.sigev_notify_thread_id = thread->tid;
+    if (pthread_getcpuclockid(thread->thread, &clock) != 0 || timer_create(clock, &event, &thread->timer) != 0) {
+        pfree(buffer);
+        return false;
+    }
+
+    thread->used = 0;
+    thread->dropped = 0;
+    atomic_store(&thread->buffer, buffer);
+    thread->armed = true;
+
+    long interval_ns = 1000000000L / (long)g_hz;
+    struct itimerspec period = {
+        .it_interval = { .tv_sec = interval_ns / 1000000000L, .tv_nsec = interval_ns % 1000000000L },
+        .it_value = { .tv_sec = interval_ns / 1000000000L, .tv_nsec = interval_ns % 1000000000L },
+    };
+    timer_settime(thread->timer, 0, &period, NULL);
+    return true;
+}
+
+// names a frame for the folded output, the function when the dynamic symbol table has it,
+// otherwise the module and offset addr2line resolves
+static void profile_frame_name(uintptr_t pc, char* name, size_t size) {
+    Dl_info info;
+    bool found = dladdr((void*)pc, &info) != 0;
+    if (found && info.dli_sname) {
+        snprintf(name, size, "%s", info.dli_sname);
+    } else if (found && info.dli_fname && info.dli_fbase) {
+        const char* module = strrchr(info.dli_fname, '/');
+        snprintf(name, size, "%s+0x%lx", module ? module + 1 : info.dli_fname,
+                 (unsigned long)(pc - (uintptr_t)info.dli_fbase));
+    } else {
+        snprintf(name, size, "0x%lx", (unsigned long)pc);
+    }
+}
+
+static int profile_compare_samples(const void* a, const void* b) {
+    const uintptr_t* left = *(const uintptr_t* const*)a;
+    const uintptr_t* right = *(const uintptr_t* const*)b;
+    if (left[0] != right[0]) return left[0] < right[0] ? -1 : 1;
+    for (size_t i = 1; i <= left[0]; i++) {
+        if (left[i] != right[i]) return left[i] < right[i] ? -1 : 1;
+    }
+    return 0;
+}
+
+static int profile_compare_stacks(const void* a, const void* b) {
+    return strcmp(((const ProfileStack*)a)->line, ((const ProfileStack*)b)->line);
+}
+
+// renders one sampled stack root first, frames that resolve to the same name are merged later
+static char* profile_fold(const uintptr_t* sample) {
+    char line[PROFILE_LINE_LEN];
+    size_t len = 0;
+    for (size_t i = sample[0]; i >= 1 && len < sizeof(line) - 1; i--) {
+        char name[256];
+        profile_frame_name(sample[i], name, sizeof(name));
+        // ';' and spaces separate frames and the count
+        for (char* c = name; *c; c++) {
+            if (*c == ';' || *c == ' ') *c = '_';
+        }
+        len += (size_t)snprintf(line + len, sizeof(line) - len, "%s%s", len ? ";" : "", name);
+    }
+    if (len >= sizeof(line)) len = sizeof(line) - 1;
+
+    char* copy = pmalloc(len + 1, g_tag);
+    if (copy) {
+        memcpy(copy, line, len);
+        copy[len] = '\0';
+    }
+    return copy;
+}
+
+static bool profile_write(uintptr_t** buffers, const size_t* used, size_t count, size_t dropped, FILE* fp) {
+    size_t samples = 0;
+    for (size_t i = 0; i < count; i++) {
+        for (size_t at = 0; at < used[i]; at += buffers[i][at] + 1) samples++;
+    }
+    if (samples == 0) {
+        if (dropped > 0) fprintf(fp, "[dropped] %zu\n", dropped);
+        return true;
+    }
+
+    const uintptr_t** sorted = pmalloc(samples * sizeof(uintptr_t*), g_tag);
+    ProfileStack* stacks = pmalloc(samples * sizeof(ProfileStack), g_tag);
+    if (!sorted || !stacks) {
+        if (sorted) pfree(sorted);
+        if (stacks) pfree(stacks);
+        return false;
+    }
+    size_t n = 0;
+    for (size_t i = 0; i < count; i++) {
+        for (size_t at = 0; at < used[i]; at += buffers[i][at] + 1) sorted[n++] = buffers[i] + at;
+    }
+
+    // identical stacks are symbolized once
+    qsort(sorted, samples, sizeof(uintptr_t*), profile_compare_samples);
+    size_t unique = 0;
+    bool ok = true;
+    for (size_t i = 0; i < samples; i++) {
+        if (unique > 0 && profile_compare_samples(&sorted[i - 1], &sorted[i]) == 0) {
+            stacks[unique - 1].count++;
+            continue;
+        }
+        stacks[unique].line = profile_fold(sorted[i]);
+        stacks[unique].count = 1;
+        if (!stacks[unique].line) {
+            ok = false;
+            break;
+        }
+        unique++;
+    }
+
+    if (ok) {
+        qsort(stacks, unique, sizeof(ProfileStack), profile_compare_stacks);
+        for (size_t i = 0; i < unique; i++) {
+            size_t total = stacks[i].count;
+            while (i + 1 < unique && strcmp(stacks[i].line, stacks[i + 1].line) == 0) total += stacks[++i].count;
+            fprintf(fp, "%s %zu\n", stacks[i].line, total);
+        }
+        if (dropped > 0) fprintf(fp, "[dropped] %zu\n", dropped);
+    }
+
+    for (size_t i = 0; i < unique; i++) pfree(stacks[i].line);
+    pfree(stacks);
+    pfree(sorted);
+    return ok;
+}
+
+bool profile_run(uint32_t seconds, FILE* fp) {
+    bool idle = false;
+    if (!g_enabled || !atomic_compare_exchange_strong(&g_running, &idle, true)) return false;
+
+    pthread_mutex_lock(&g_lock);
+    bool armed = true;
+    for (int i = 0; i < PROFILE_MAX_THREADS && armed; i++) {
+        if (g_threads[i].live) armed = profile_arm(&g_threads[i]);
+    }
+    pthread_mutex_unlock(&g_lock);
+
+    if (armed) {
+        struct timespec left = { .tv_sec = seconds, .tv_nsec = 0 };
+        while (nanosleep(&left, &left) != 0 && errno == EINTR) {
+        }
+    } else {
+        printf("Failed to start profiling: %s\n", strerror(errno));
+    }
+
+    // stop the timers, then wait out a handler that may still be writing
+    uintptr_t* buffers[PROFILE_MAX_THREADS];
+    size_t used[PROFILE_MAX_THREADS];
+    size_t count = 0;
+    size_t dropped = 0;
+    pthread_mutex_lock(&g_lock);
+    for (int i = 0; i < PROFILE_MAX_THREADS; i++) {
+        ProfileThread* thread = &g_threads[i];
+        if (thread->armed) {
+            timer_delete(thread->timer);
+            thread->armed = false;
+        }
+        uintptr_t* buffer = atomic_exchange(&thread->buffer, NULL);
+        if (!buffer) continue;
+        while (atomic_load(&thread->busy)) sched_yield();
+        buffers[count] = buffer;
+        used[count] = thread->used;
+        dropped += thread->dropped;
+        count++;
+    }
+    pthread_mutex_unlock(&g_lock);
+
+    bool ok = armed && profile_write(buffers, used, count, dropped, fp);
+    for (size_t i = 0; i < count; i++) pfree(buffers[i]);
+    atomic_store(&g_running, false);
+    return ok;
+}
+
+// the value of `name` in the query string of `target`, NULL when it isn't there
+static const char* profile_query(const char* target, const char* name) {
+    const char* query = strchr(target, '?');
+    size_t name_len = strlen(name);
+    while (query) {
+        query++;
+        if (strncmp(query, name, name_len) == 0 && query[name_len] == '=') return query + name_len + 1;
+        query = strchr(query, '&');
+    }
+    return NULL;
+}
+
+// runs on the worker once the profile is done
+static void profile_job_done(EventLoop* loop, void* data) {
+    (void)loop;
+    ProfileJob* job = data;
+    if (!job->cancelled) {
+        if (job->ok) {
+            http_response_set_body(job->response, job->folded, job->len, "text/plain");
+        } else {
+            // either busy with another profile or out of memory, both pass with time
+            job->response->status = HTTP_503;
+        }
+        http_response_resume(job->response);
+    }
+    free(job->folded);
+    pfree(job);
+}
+
+// the response is gone, the profile still finishes and is dropped by profile_job_done
+static void profile_job_cancel(void* data) {
+    ProfileJob* job = data;
+    job->cancelled = true;
+}
+
+static void* profile_job_run(void* data) {
+    ProfileJob* job = data;
+    // signals are for the server's own threads
+    sigset_t all;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, NULL);
+
+    FILE* fp = open_memstream(&job->folded, &job->len);
+    job->ok = fp && profile_run(job->seconds, fp);
+    if (fp) fclose(fp);
+    if (!event_loop_post(job->loop, profile_job_done, job)) {
+        // the worker can't be reached, its connection waits until the client gives up
+        printf("Failed to hand the profile back to its worker\n");
+    }
+    return NULL;
+}
+
+void profile_route(HttpRequest* request, HttpResponse* response) {
+    long seconds = PROFILE_DEFAULT_SECONDS;
+    const char* value = profile_query(string_cstr(request->request_line.target), "seconds");
+    if (value) {
+        char* end = NULL;
+        seconds = strtol(value, &end, 10);
+        if (end == value || (*end && *end != '&') || seconds < 1 || seconds > PROFILE_MAX_SECONDS) {
+            response->status = HTTP_400;
+            return;
+        }
+    }
+
+    // the worker goes on serving others while the profile runs, one at a time
+    if (atomic_load(&g_running)) {
+        response->status = HTTP_503;
+        return;
+    }
+    ProfileJob* job = request->loop ? pcalloc(1, sizeof(ProfileJob), g_tag) : NULL;
+    if (!job) {
+        response->status = HTTP_500;
+        return;
+    }
+    job->response = response;
+    job->loop = request->loop;
+    job->seconds = (uint32_t)seconds;
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_t thread;
+    http_response_defer(response, profile_job_cancel, job);
+    if (pthread_create(&thread, &attr, profile_job_run, job) != 0) {
+        printf("Failed to start the profile thread: %s\n", strerror(errno));
+        pfree(job);
+        response->status = HTTP_500;
+        http_response_resume(response);
+    }
+    pthread_attr_destroy(&attr);
+}
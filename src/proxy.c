@@ -0,0 +1,574 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include "alloc.h"
+#include "proxy.h"
+#include "router.h"
+
+ARRAY_DEFINE(ProxyMount, ProxyMountArray)
+
+static ProxyMountArray g_mounts;
+static bool g_mounts_ready = false;
+
+typedef enum {
+    PROXY_OK,
+    PROXY_RETRY,               // a reused connection was closed under us before any response byte
+    PROXY_UNREACHABLE,         // connect failed, 502
+    PROXY_UNREACHABLE_TIMEOUT, // connect timed out, 504
+    PROXY_FAILED,              // 502
+    PROXY_TIMEOUT,             // 504
+    PROXY_UNAVAILABLE,         // no upstream to try, 503
+    PROXY_PENDING,             // waiting for the upstream socket
+} ProxyResult;
+
+typedef enum {
+    PROXY_CONNECTING,
+    PROXY_WRITING,
+    PROXY_READING_HEAD,
+    PROXY_READING_BODY,
+} ProxyStage;
+
+// one proxied request, driven by the worker's event loop while its response is deferred
+typedef struct {
+    HttpRequest* request;
+    HttpResponse* response;
+    EventLoop* loop;
+    ProxyMount* mount;
+    const char* key;           // consistent-hash key, NULL if the policy doesn't hash
+    size_t key_len;
+    bool idempotent;
+    int attempts;
+    ProxyResult result;        // of the last attempt
+    Upstream* failed;          // couldn't be reached, another upstream gets the retry
+    // the current attempt
+    Upstream* upstream;
+    UpstreamConn* conn;
+    EventWatch* watch;
+    EventTimer* timer;         // the connect timeout, then the io timeout between reads and writes
+    ProxyStage stage;
+    String* head;
+    struct iovec iov[2];       // head and body, `next` and `count` track what is left of them
+    struct iovec* iov_next;
+    int iov_count;
+    HttpResponse* upstream_response;
+    HttpResponseParser parser;
+    bool received;             // a response byte arrived
+    bool streaming;            // the response streams the rest of the body from `conn`
+    uint64_t start_us;
+    uint64_t latency_us;
+} ProxyExchange;
+
+// hop-by-hop fields describe a single connection and are never forwarded,
+// Content-Length is recomputed for whichever side we write unless the answer has no body
+static const char* const hop_by_hop[] = {
+    "Connection", "Keep-Alive", "Proxy-Connection", "Proxy-Authenticate", "Proxy-Authorization",
+    "TE", "Trailer", "Transfer-Encoding", "Upgrade", "Content-Length",
+};
+
+static bool is_hop_by_hop(const String* key) {
+    for (size_t i = 0; i < sizeof(hop_by_hop) / sizeof(hop_by_hop[0]); i++) {
+        if (strcasecmp(string_cstr(key), hop_by_hop[i]) == 0) return true;
+    }
+    return false;
+}
+
+bool proxy_add(const char* prefix, UpstreamGroup* group, bool strip_prefix, void* tag) {
+    if (!prefix || !group) return false;
+
+    if (!g_mounts_ready) {
+        if (!ProxyMountArray_init(&g_mounts, tag)) return false;
+        g_mounts_ready = true;
+    }
+
+    ProxyMount mount = { .prefix = string_new(prefix, tag), .strip_prefix = strip_prefix, .group = group };
+    if (!mount.prefix || !ProxyMountArray_push(&g_mounts, mount)) {
+        string_free(mount.prefix);
+        return false;
+    }
+    return true;
+}
+
+void proxy_clear(void) {
+    if (!g_mounts_ready) return;
+
+    upstream_health_stop();
+    for (size_t i = 0; i < g_mounts.size; i++) {
+        string_free(g_mounts.data[i].prefix);
+        upstream_group_free(g_mounts.data[i].group);
+    }
+    ProxyMountArray_destroy(&g_mounts);
+    g_mounts_ready = false;
+}
+
+bool proxy_start_health_checks(void* tag) {
+    if (!g_mounts_ready || g_mounts.size == 0) return true;
+
+    UpstreamGroup* groups[g_mounts.size];
+    for (size_t i = 0; i < g_mounts.size; i++) {
+        groups[i] = g_mounts.data[i].group;
+    }
+    return upstream_health_start(groups, g_mounts.size, tag);
+}
+
+void proxy_print_stats(void) {
+    if (!g_mounts_ready) return;
+
+    printf("\n=== Proxy Stats ===\n");
+    for (size_t i = 0; i < g_mounts.size; i++) {
+        printf("Mount %s:\n", string_cstr(g_mounts.data[i].prefix));
+        upstream_group_print(g_mounts.data[i].group);
+    }
+    printf("=== End Proxy Stats ===\n\n");
+}
+
+static ProxyMount* proxy_find(const String* target) {
+    if (!g_mounts_ready) return NULL;
+
+    ProxyMount* best = NULL;
+    for (size_t i = 0; i < g_mounts.size; i++) {
+        ProxyMount* mount = &g_mounts.data[i];
+        if (!string_begins_with(target, mount->prefix)) continue;
+        if (!best || string_length(mount->prefix) > string_length(best->prefix)) {
+            best = mount;
+        }
+    }
+    return best;
+}
+
+// serializes the request head as it goes to the upstream
+static String* proxy_build_head(HttpRequest* request, ProxyMount* mount, Upstream* upstream, size_t body_len) {
+    void* tag = request->tag;
+    String* head = string_new_empty(tag);
+    if (!head) return NULL;
+
+    string_append_cstr(head, http_request_method_to_string(request->request_line.method));
+    string_append_cstr(head, " ");
+    if (mount->strip_prefix) {
+        size_t skip = string_length(mount->prefix);
+        String* rest = string_substring(request->request_line.target, skip,
+                                        string_length(request->request_line.target) - skip, tag);
+        if (string_byte_length(rest) == 0 || string_bytes(rest)[0] != '/') {
+            string_append_cstr(head, "/");
+        }
+        string_append(head, rest);
+        string_free(rest);
+    } else {
+        string_append(head, request->request_line.target);
+    }
+    string_append_cstr(head, " HTTP/1.1\r\n");
+
+    bool has_host = false;
+    for (size_t i = 0; i < HeaderArray_size(request->headers); i++) {
+        Header* header = &request->headers->data[i];
+        if (is_hop_by_hop(header->key)) continue;
+        if (strcasecmp(string_cstr(header->key), "Host") == 0) has_host = true;
+        string_append(head, header->key);
+        string_append_cstr(head, ": ");
+        string_append(head, header->value);
+        string_append_cstr(head, "\r\n");
+    }
+    if (!has_host) {
+        string_append_cstr(head, "Host: ");
+        string_append(head, upstream->address);
+        string_append_cstr(head, "\r\n");
+    }
+
+    Method method = request->request_line.method;
+    if (body_len > 0 || method == HTTP_POST || method == HTTP_PUT || method == HTTP_PATCH) {
+        char content_length[48];
+        snprintf(content_length, sizeof(content_length), "Content-Length: %zu\r\n", body_len);
+        string_append_cstr(head, content_length);
+    }
+    string_append_cstr(head, "\r\n");
+    return head;
+}
+
+static ProxyResult proxy_error(UpstreamConn* conn, const char* what) {
+    int err = errno;
+    printf("Proxy to %s failed %s: %s\n", string_cstr(conn->upstream->address), what, strerror(err));
+    return err == ETIMEDOUT ? PROXY_TIMEOUT : PROXY_FAILED;
+}
+
+// the io timeout starts over whenever the upstream makes progress
+static void proxy_touch(ProxyExchange* exchange) {
+    if (exchange->timer) {
+        event_timer_reset(exchange->loop, exchange->timer, (uint32_t)exchange->upstream->io_timeout_ms);
+    }
+}
+
+// reads one response head into the parser's response, interim 1xx responses are skipped
+static ProxyResult proxy_read_head(ProxyExchange* exchange) {
+    UpstreamConn* conn = exchange->conn;
+    HttpResponseParser* parser = &exchange->parser;
+    while (true) {
+        upstream_consume(conn, http_response_parser_feed(parser, conn->buf, conn->len));
+        if (parser->state == HTTP_PARSE_ERROR) {
+            printf("Proxy to %s failed: malformed response head\n", string_cstr(conn->upstream->address));
+            return PROXY_FAILED;
+        }
+        if (parser->state != HTTP_PARSE_HEAD) break;
+
+        ssize_t n = upstream_recv(conn);
+        if (n > 0) {
+            exchange->received = true;
+            proxy_touch(exchange);
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return PROXY_PENDING;
+        if (conn->reused && !exchange->received && (n == 0 || errno == ECONNRESET)) {
+            return PROXY_RETRY;
+        }
+        if (n == 0) errno = ECONNRESET;
+        return proxy_error(conn, "reading the response head");
+    }
+
+    int status = http_response_status_code(parser->response);
+    if (status == 101) {
+        // no upgrades through the proxy, a 101 would hand the socket over
+        printf("Proxy to %s failed: unsupported status %d\n", string_cstr(conn->upstream->address), status);
+        return PROXY_FAILED;
+    }
+    return PROXY_OK;
+}
+
+// hands the connection back once the client has the whole streamed body
+static void proxy_stream_done(void* data, int fd, bool complete) {
+    (void)fd;
+    UpstreamConn* conn = data;
+    upstream_release(conn, complete && conn->keep_alive);
+}
+
+// Large Content-Length bodies are left on the socket and streamed, which keeps `conn`.
+// The client's connection reads them as the upstream sends them.
+static ProxyResult proxy_stream_body(ProxyExchange* exchange) {
+    UpstreamConn* conn = exchange->conn;
+    HttpResponseParser* parser = &exchange->parser;
+
+    // whatever arrived with the head goes first
+    size_t buffered = conn->len < parser->remaining ? conn->len : parser->remaining;
+    string_append_bytes(exchange->response->body, (const uint8_t*)conn->buf, buffered);
+    upstream_consume(conn, buffered);
+    size_t remaining = parser->remaining - buffered;
+    if (remaining == 0) return PROXY_OK;
+
+    // the rest goes upstream socket -> pipe -> client socket
+    if (!http_response_set_stream(exchange->response, conn->fd, remaining, proxy_stream_done, conn)) {
+        return PROXY_FAILED;
+    }
+    exchange->streaming = true;
+    return PROXY_OK;
+}
+
+// reads the body the parser found in the head into the response
+static ProxyResult proxy_read_body(ProxyExchange* exchange) {
+    UpstreamConn* conn = exchange->conn;
+    HttpResponseParser* parser = &exchange->parser;
+    while (true) {
+        upstream_consume(conn, http_response_parser_feed(parser, conn->buf, conn->len));
+        if (parser->state == HTTP_PARSE_DONE) break;
+        if (parser->state == HTTP_PARSE_ERROR) {
+            errno = parser->error;
+            return proxy_error(conn, "reading the body");
+        }
+
+        ssize_t n = upstream_recv(conn);
+        if (n > 0) {
+            proxy_touch(exchange);
+            continue;
+        }
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return PROXY_PENDING;
+            return proxy_error(conn, "reading the body");
+        }
+        if (!http_response_parser_finish(parser)) {
+            errno = parser->error;
+            return proxy_error(conn, "reading the body");
+        }
+    }
+
+    // the parser decoded into the upstream response, hand the body over whole
+    String* body = exchange->response->body;
+    exchange->response->body = parser->response->body;
+    parser->response->body = body;
+    return PROXY_OK;
+}
+
+// moves the end-to-end headers and the status line over to the client response
+static void proxy_forward_head(HttpResponse* upstream_response, HttpResponse* response, Method method) {
+    // a HEAD or 304 answer has no body, its length is the one a GET would have had
+    int status = http_response_status_code(upstream_response);
+    bool keep_length = method == HTTP_HEAD || status == 304;
+    for (size_t i = 0; i < HeaderArray_size(upstream_response->headers); i++) {
+        Header header = upstream_response->headers->data[i];
+        bool forwarded = !is_hop_by_hop(header.key)
+            || (keep_length && strcasecmp(string_cstr(header.key), "Content-Length") == 0);
+        if (!forwarded || !HeaderArray_push(response->headers, header)) {
+            string_free(header.key);
+            string_free(header.value);
+        }
+    }
+    HeaderArray_clear(upstream_response->headers);
+
+    // we speak HTTP/1.1 to the client whatever the upstream used
+    upstream_response->status[7] = '1';
+    response->status = upstream_response->status;
+}
+
+static void proxy_fail(HttpResponse* response, ProxyResult result) {
+    for (size_t i = 0; i < HeaderArray_size(response->headers); i++) {
+        string_free(response->headers->data[i].key);
+        string_free(response->headers->data[i].value);
+    }
+    HeaderArray_clear(response->headers);
+    string_clear(response->body);
+
+    if (result == PROXY_TIMEOUT || result == PROXY_UNREACHABLE_TIMEOUT) {
+        response->status = HTTP_504;
+    } else if (result == PROXY_UNAVAILABLE) {
+        response->status = HTTP_503;
+    } else {
+        response->status = HTTP_502;
+    }
+}
+
+// the consistent-hash key for this request, NULL if the policy doesn't hash
+static const char* proxy_hash_key(UpstreamGroup* group, HttpRequest* request, size_t* len) {
+    if (group->policy == BALANCE_HASH_PATH) {
+        // the path without its query string
+        const char* target = string_cstr(request->request_line.target);
+        const char* query = strchr(target, '?');
+        *len = query ? (size_t)(query - target) : string_byte_length(request->request_line.target);
+        return target;
+    }
+    if (group->policy == BALANCE_HASH_HEADER) {
+        Header* header = http_request_get_header(request, string_cstr(group->hash_header));
+        if (!header) return NULL;
+        *len = string_byte_length(header->value);
+        return string_cstr(header->value);
+    }
+    return NULL;
+}
+
+static uint64_t proxy_now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000u + (uint64_t)ts.tv_nsec / 1000u;
+}
+
+// carries the current attempt as far as the upstream socket allows
+static ProxyResult proxy_step(ProxyExchange* exchange) {
+    UpstreamConn* conn = exchange->conn;
+    if (exchange->stage == PROXY_CONNECTING) {
+        int err = 0;
+        socklen_t err_len = sizeof(err);
+        if (getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &err, &err_len) != 0) err = errno;
+        if (err != 0) {
+            printf("Proxy to %s failed connecting: %s\n", string_cstr(conn->upstream->address), strerror(err));
+            return PROXY_UNREACHABLE;
+        }
+        exchange->stage = PROXY_WRITING;
+        proxy_touch(exchange);
+    }
+
+    if (exchange->stage == PROXY_WRITING) {
+        while (exchange->iov_count > 0) {
+            if (upstream_send(conn, &exchange->iov_next, &exchange->iov_count) >= 0) {
+                proxy_touch(exchange);
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return PROXY_PENDING;
+            return conn->reused && (errno == EPIPE || errno == ECONNRESET)
+                ? PROXY_RETRY : proxy_error(conn, "writing the request");
+        }
+        exchange->stage = PROXY_READING_HEAD;
+        event_loop_modify(exchange->loop, exchange->watch, EV_READ);
+    }
+
+    if (exchange->stage == PROXY_READING_HEAD) {
+        ProxyResult result = proxy_read_head(exchange);
+        if (result != PROXY_OK) return result;
+        exchange->latency_us = proxy_now_us() - exchange->start_us;
+        conn->keep_alive = exchange->parser.keep_alive;
+        exchange->stage = PROXY_READING_BODY;
+
+        HttpResponseParser* parser = &exchange->parser;
+        if (parser->state == HTTP_PARSE_BODY && parser->content_length > PROXY_BUFFER_BODY_MAX) {
+            return proxy_stream_body(exchange);
+        }
+    }
+    return proxy_read_body(exchange);
+}
+
+static void proxy_on_event(EventLoop* loop, int fd, uint32_t events, void* data);
+static void proxy_on_timeout(EventLoop* loop, void* data);
+
+// starts an attempt on the next upstream, PROXY_UNAVAILABLE when there is none left
+static ProxyResult proxy_attempt(ProxyExchange* exchange) {
+    Upstream* upstream = upstream_group_pick(exchange->mount->group, exchange->key, exchange->key_len,
+                                             exchange->failed);
+    if (!upstream) return PROXY_UNAVAILABLE;
+
+    HttpRequest* request = exchange->request;
+    exchange->upstream = upstream;
+    exchange->received = false;
+    exchange->streaming = false;
+    exchange->latency_us = 0;
+    exchange->start_us = proxy_now_us();
+    upstream_begin(upstream);
+
+    size_t body_len = string_byte_length(request->body);
+    exchange->head = proxy_build_head(request, exchange->mount, upstream, body_len);
+    exchange->upstream_response = http_response_new(request->tag);
+    if (!exchange->head || !exchange->upstream_response) return PROXY_FAILED;
+    http_response_parser_init(&exchange->parser, exchange->upstream_response, request->request_line.method,
+                              PROXY_MAX_DECODED_BODY);
+
+    bool connecting = false;
+    exchange->conn = upstream_take(upstream, &connecting);
+    if (!exchange->conn) {
+        printf("Proxy to %s failed connecting: %s\n", string_cstr(upstream->address), strerror(errno));
+        return PROXY_UNREACHABLE;
+    }
+
+    exchange->iov[0] = (struct iovec){ .iov_base = string_bytes(exchange->head), .iov_len = string_byte_length(exchange->head) };
+    exchange->iov[1] = (struct iovec){ .iov_base = body_len > 0 ? string_bytes(request->body) : NULL, .iov_len = body_len };
+    exchange->iov_next = exchange->iov;
+    exchange->iov_count = body_len > 0 ? 2 : 1;
+    exchange->stage = connecting ? PROXY_CONNECTING : PROXY_WRITING;
+
+    int timeout_ms = connecting ? upstream->connect_timeout_ms : upstream->io_timeout_ms;
+    exchange->watch = event_loop_add(exchange->loop, exchange->conn->fd, EV_WRITE, 0, proxy_on_event, exchange);
+    exchange->timer = event_timer_add(exchange->loop, (uint32_t)timeout_ms, 0, proxy_on_timeout, exchange);
+    if (!exchange->watch || !exchange->timer) return PROXY_FAILED;
+    return connecting ? PROXY_PENDING : proxy_step(exchange);
+}
+
+// unhooks the current attempt from the loop and gives its connection back
+static void proxy_attempt_release(ProxyExchange* exchange, bool reusable) {
+    if (exchange->watch) event_loop_remove(exchange->loop, exchange->watch);
+    if (exchange->timer) event_timer_cancel(exchange->loop, exchange->timer);
+    exchange->watch = NULL;
+    exchange->timer = NULL;
+
+    // a streamed body keeps the connection until the client has it all
+    if (exchange->conn && !exchange->streaming) upstream_release(exchange->conn, reusable);
+    exchange->conn = NULL;
+    http_response_free(exchange->upstream_response);
+    exchange->upstream_response = NULL;
+    string_free(exchange->head);
+    exchange->head = NULL;
+}
+
+// ends the attempt with `result`. Returns `true` if another attempt should be made:
+// a failed connect sent nothing, so another upstream may take the request, and a stale
+// pooled connection is retried unless resending could repeat a side effect.
+static bool proxy_attempt_end(ProxyExchange* exchange, ProxyResult result) {
+    Upstream* upstream = exchange->upstream;
+    if (!upstream) {
+        if (exchange->attempts == 0) exchange->result = PROXY_UNAVAILABLE;
+        return false;
+    }
+    exchange->upstream = NULL;
+    exchange->attempts++;
+    exchange->result = result;
+
+    if (result == PROXY_OK) {
+        proxy_forward_head(exchange->upstream_response, exchange->response, exchange->request->request_line.method);
+    }
+    proxy_attempt_release(exchange, result == PROXY_OK && exchange->conn->keep_alive);
+    bool ok = result == PROXY_OK || result == PROXY_RETRY;
+    upstream_end(upstream, ok, result == PROXY_OK ? exchange->latency_us : 0);
+
+    if (exchange->attempts >= 2) return false;
+    if (result == PROXY_UNREACHABLE || result == PROXY_UNREACHABLE_TIMEOUT) {
+        exchange->failed = upstream;
+        return true;
+    }
+    return result == PROXY_RETRY && exchange->idempotent;
+}
+
+// answers the client once no attempt is left waiting
+static void proxy_settle(ProxyExchange* exchange, ProxyResult result) {
+    while (result != PROXY_PENDING) {
+        if (!proxy_attempt_end(exchange, result)) {
+            HttpResponse* response = exchange->response;
+            if (exchange->result != PROXY_OK) {
+                proxy_fail(response, exchange->result);
+            }
+            pfree(exchange);
+            http_response_resume(response);
+            return;
+        }
+        result = proxy_attempt(exchange);
+    }
+}
+
+static void proxy_on_event(EventLoop* loop, int fd, uint32_t events, void* data) {
+    (void)loop;
+    (void)fd;
+    (void)events;
+    proxy_settle(data, proxy_step(data));
+}
+
+static void proxy_on_timeout(EventLoop* loop, void* data) {
+    (void)loop;
+    ProxyExchange* exchange = data;
+    exchange->timer = NULL; // one-shot, freed once this returns
+
+    ProxyResult result;
+    if (exchange->stage == PROXY_CONNECTING) {
+        printf("Proxy to %s failed connecting: %s\n", string_cstr(exchange->upstream->address), strerror(ETIMEDOUT));
+        result = PROXY_UNREACHABLE_TIMEOUT;
+    } else {
+        errno = ETIMEDOUT;
+        const char* what = exchange->stage == PROXY_WRITING ? "writing the request"
+            : exchange->stage == PROXY_READING_HEAD ? "reading the response head" : "reading the body";
+        result = proxy_error(exchange->conn, what);
+    }
+    proxy_settle(exchange, result);
+}
+
+// the client went away while the upstream still had the request
+static void proxy_cancel(void* data) {
+    ProxyExchange* exchange = data;
+    proxy_attempt_release(exchange, false);
+    if (exchange->upstream) upstream_end(exchange->upstream, true, 0);
+    pfree(exchange);
+}
+
+void proxy_route(HttpRequest* request, HttpResponse* response) {
+    if (!request || !response) {
+        printf("Invalid request or response\n");
+        return;
+    }
+
+    ProxyMount* mount = proxy_find(request->request_line.target);
+    if (!mount) {
+        printf("No upstream configured for %s\n", string_cstr(request->request_line.target));
+        response->status = HTTP_502;
+        return;
+    }
+
+    // the upstream is only ever waited on through the worker's loop
+    ProxyExchange* exchange = request->loop ? pcalloc(1, sizeof(ProxyExchange), request->tag) : NULL;
+    if (!exchange) {
+        response->status = HTTP_500;
+        return;
+    }
+    exchange->request = request;
+    exchange->response = response;
+    exchange->loop = request->loop;
+    exchange->mount = mount;
+    exchange->key = proxy_hash_key(mount->group, request, &exchange->key_len);
+    Method method = request->request_line.method;
+    exchange->idempotent = method != HTTP_POST && method != HTTP_PATCH;
+    exchange->result = PROXY_FAILED;
+
+    // an exchange finished before this returns resumes the response right away
+    http_response_defer(response, proxy_cancel, exchange);
+    proxy_settle(exchange, proxy_attempt(exchange));
+}
@@ -0,0 +1,244 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "alloc.h"
+#include "ratelimit.h"
+#include "router.h"
+
+ARRAY_DEFINE(RateLimitRule*, RateLimitRuleArray)
+
+static RateLimitRuleArray g_rules;
+static bool g_rules_ready = false;
+
+// refills only need millisecond precision, the coarse clock is a plain vDSO read
+static uint64_t ratelimit_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static void ratelimit_rule_free(RateLimitRule* rule) {
+    if (!rule) return;
+
+    if (rule->shards) {
+        for (size_t i = 0; i < RATELIMIT_SHARDS; i++) {
+            pthread_mutex_destroy(&rule->shards[i].lock);
+            if (rule->shards[i].buckets) pfree(rule->shards[i].buckets);
+        }
+        pfree(rule->shards);
+    }
+    string_free(rule->prefix);
+    string_free(rule->header);
+    pfree(rule);
+}
+
+bool ratelimit_add(const char* prefix, const char* header, double rate, double burst, void* tag) {
+    if (!prefix || rate <= 0 || burst < 1) return false;
+
+    if (!g_rules_ready) {
+        if (!RateLimitRuleArray_init(&g_rules, tag)) return false;
+        g_rules_ready = true;
+    }
+
+    RateLimitRule* rule = pcalloc(1, sizeof(RateLimitRule), tag);
+    if (!rule) return false;
+    rule->prefix = string_new(prefix, tag);
+    rule->header = header ? string_new(header, tag) : NULL;
+    rule->rate = rate;
+    rule->burst = burst;
+    // an empty bucket is full again after burst / rate seconds
+    rule->idle_ns = (uint64_t)(burst / rate * 1e9);
+    rule->shards = pcalloc(RATELIMIT_SHARDS, sizeof(RateShard), tag);
+    if (!rule->prefix || (header && !rule->header) || !rule->shards) {
+        ratelimit_rule_free(rule);
+        return false;
+    }
+
+    for (size_t i = 0; i < RATELIMIT_SHARDS; i++) {
+        RateShard* shard = &rule->shards[i];
+        pthread_mutex_init(&shard->lock, NULL);
+        shard->tag = tag;
+        shard->capacity = RATELIMIT_SHARD_INITIAL;
+        shard->buckets = pcalloc(shard->capacity, sizeof(RateBucket), tag);
+        if (!shard->buckets) {
+            ratelimit_rule_free(rule);
+            return false;
+        }
+    }
+
+    if (!RateLimitRuleArray_push(&g_rules, rule)) {
+        ratelimit_rule_free(rule);
+        return false;
+    }
+    return true;
+}
+
+void ratelimit_clear(void) {
+    if (!g_rules_ready) return;
+
+    for (size_t i = 0; i < g_rules.size; i++) {
+        ratelimit_rule_free(g_rules.data[i]);
+    }
+    RateLimitRuleArray_destroy(&g_rules);
+    g_rules_ready = false;
+}
+
+void ratelimit_print_stats(void) {
+    if (!g_rules_ready) return;
+
+    printf("\n=== Rate Limit Stats ===\n");
+    for (size_t i = 0; i < g_rules.size; i++) {
+        RateLimitRule* rule = g_rules.data[i];
+        printf("Rule %s (%.2f/s, burst %.0f, by %s): %llu allowed, %llu limited\n", string_cstr(rule->prefix),
+               rule->rate, rule->burst, rule->header ? string_cstr(rule->header) : "address",
+               (unsigned long long)atomic_load(&rule->allowed), (unsigned long long)atomic_load(&rule->limited));
+    }
+    printf("=== End Rate Limit Stats ===\n\n");
+}
+
+static RateBucket* ratelimit_slot(RateBucket* buckets, size_t capacity, uint64_t key) {
+    size_t mask = capacity - 1;
+    for (size_t i = key & mask;; i = (i + 1) & mask) {
+        if (buckets[i].key == key || buckets[i].key == 0) return &buckets[i];
+    }
+}
+
+// rebuilds the table without expired buckets, doubling it if it stays over half full
+static bool ratelimit_shard_rehash(RateShard* shard, uint64_t now, uint64_t idle_ns) {
+    size_t live = 0;
+    for (size_t i = 0; i < shard->capacity; i++) {
+        RateBucket* bucket = &shard->buckets[i];
+        if (bucket->key != 0 && now - bucket->updated_ns < idle_ns) live++;
+    }
+
+    size_t capacity = shard->capacity;
+    while (live + 1 > capacity / 2) capacity *= 2;
+    RateBucket* buckets = pcalloc(capacity, sizeof(RateBucket), shard->tag);
+    if (!buckets) return false;
+
+    for (size_t i = 0; i < shard->capacity; i++) {
+        RateBucket* bucket = &shard->buckets[i];
+        if (bucket->key == 0 || now - bucket->updated_ns >= idle_ns) continue;
+        *ratelimit_slot(buckets, capacity, bucket->key) = *bucket;
+    }
+    pfree(shard->buckets);
+    shard->buckets = buckets;
+    shard->capacity = capacity;
+    shard->count = live;
+    return true;
+}
+
+// Refills the client's bucket, then takes `take` tokens if it holds one: 1 to take a
+// token, 0 to only look. A negative `take` gives tokens back. Returns 0 when a token
+// was there, otherwise the seconds until one is.
+static uint32_t ratelimit_bucket(RateLimitRule* rule, uint64_t key, double take) {
+    // the low bits pick the slot within a shard, the high ones the shard
+    RateShard* shard = &rule->shards[(key >> 32) % RATELIMIT_SHARDS];
+    uint64_t now = ratelimit_now_ns();
+    uint32_t retry_after = 0;
+
+    pthread_mutex_lock(&shard->lock);
+    RateBucket* bucket = ratelimit_slot(shard->buckets, shard->capacity, key);
+    if (bucket->key == 0) {
+        // new clients start with a full bucket, and buckets left idle expire lazily here
+        if ((shard->count + 1) * 4 > shard->capacity * 3) {
+            if (!ratelimit_shard_rehash(shard, now, rule->idle_ns)) {
+                pthread_mutex_unlock(&shard->lock);
+                return 0; // fail open, a client is not refused because we're out of memory
+            }
+            bucket = ratelimit_slot(shard->buckets, shard->capacity, key);
+        }
+        bucket->key = key;
+        bucket->tokens = rule->burst;
+        bucket->updated_ns = now;
+        shard->count++;
+    } else if (now > bucket->updated_ns) {
+        // refilled lazily, for the time since it was last touched
+        bucket->tokens += (double)(now - bucket->updated_ns) * rule->rate / 1e9;
+        if (bucket->tokens > rule->burst) bucket->tokens = rule->burst;
+        bucket->updated_ns = now;
+    }
+
+    if (take < 0) {
+        bucket->tokens -= take;
+        if (bucket->tokens > rule->burst) bucket->tokens = rule->burst;
+    } else if (bucket->tokens >= 1.0) {
+        bucket->tokens -= take;
+    } else {
+        // whole seconds, rounded up
+        double wait = (1.0 - bucket->tokens) / rule->rate;
+        retry_after = (uint32_t)wait;
+        if (retry_after < wait || retry_after == 0) retry_after++;
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return retry_after;
+}
+
+// the key telling this request's client apart for `rule`
+static uint64_t ratelimit_key(RateLimitRule* rule, const HttpRequest* request) {
+    if (rule->header) {
+        Header* header = http_request_get_header(request, string_cstr(rule->header));
+        if (header) return hash_bytes(string_cstr(header->value), string_byte_length(header->value));
+    }
+
+    return hash_peer(&request->peer);
+}
+
+// gives back the tokens the first `count` matching rules took for this request
+static void ratelimit_refund(const HttpRequest* request, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        RateLimitRule* rule = g_rules.data[i];
+        if (!string_begins_with(request->request_line.target, rule->prefix)) continue;
+        ratelimit_bucket(rule, ratelimit_key(rule, request), -1.0);
+    }
+}
+
+bool ratelimit_layer(HttpRequest* request, HttpResponse* response) {
+    if (!g_rules_ready) return true;
+
+    // every matching rule is asked first, a refused request takes no token from any of them
+    uint32_t retry_after = 0;
+    for (size_t i = 0; i < g_rules.size; i++) {
+        RateLimitRule* rule = g_rules.data[i];
+        if (!string_begins_with(request->request_line.target, rule->prefix)) continue;
+
+        uint32_t wait = ratelimit_bucket(rule, ratelimit_key(rule, request), 0.0);
+        if (wait == 0) continue;
+        atomic_fetch_add_explicit(&rule->limited, 1, memory_order_relaxed);
+        if (wait > retry_after) retry_after = wait;
+    }
+
+    for (size_t i = 0; i < g_rules.size && retry_after == 0; i++) {
+        RateLimitRule* rule = g_rules.data[i];
+        if (!string_begins_with(request->request_line.target, rule->prefix)) continue;
+
+        retry_after = ratelimit_bucket(rule, ratelimit_key(rule, request), 1.0);
+        if (retry_after != 0) {
+            // another request took the last token since we looked
+            atomic_fetch_add_explicit(&rule->limited, 1, memory_order_relaxed);
+            ratelimit_refund(request, i);
+        }
+    }
+    if (retry_after == 0) {
+        for (size_t i = 0; i < g_rules.size; i++) {
+            RateLimitRule* rule = g_rules.data[i];
+            if (string_begins_with(request->request_line.target, rule->prefix)) {
+                atomic_fetch_add_explicit(&rule->allowed, 1, memory_order_relaxed);
+            }
+        }
+        return true;
+    }
+
+    char seconds[16];
+    snprintf(seconds, sizeof(seconds), "%u", retry_after);
+    Header header = { .key = string_new("Retry-After", request->tag), .value = string_new(seconds, request->tag) };
+    if (!HeaderArray_push(response->headers, header)) {
+        string_free(header.key);
+        string_free(header.value);
+    }
+    response->status = HTTP_429;
+    string_free(response->body);
+    response->body = string_new("Too Many Requests\n", request->tag);
+    return false;
+}
@@ -1,6 +1,7 @@
 #include "router.h"
 #include "alloc.h"
 #include "http.h"
+#include "probes.h"
 #include <stdio.h>
 
 ARRAY_DEFINE(Route, RouteArray)
@@ -56,15 +57,18 @@ bool router_route(Router* router, HttpRequest* request, HttpResponse* response)
         if (!IN_METHODS(route->methods, request->request_line.method)) continue;
         if (route->exact_only && string_equals(route->path, request->request_line.target)) {
             printf("Routing to %s %s\n", http_request_method_to_string(request->request_line.method), route->path->data);
+            CHTTP_PROBE2(route__match, request->request_line.target->data, route->path->data);
             route->handler(request, response);
             return true;
         } else if (!route->exact_only && string_begins_with(request->request_line.target, route->path)) {
             printf("Routing to %s %s\n", http_request_method_to_string(request->request_line.method), route->path->data);
+            CHTTP_PROBE2(route__match, request->request_line.target->data, route->path->data);
             route->handler(request, response);
             return true;
         }
     }
     printf("No matching route found for %s %s\n", http_request_method_to_string(request->request_line.method), request->request_line.target->data);
+    CHTTP_PROBE1(route__miss, request->request_line.target->data);
     // set the response to 404
     response->status = "HTTP/1.1 404 Not Found";
     return false;
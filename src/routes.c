@@ -1,4 +1,6 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include "alloc.h"
 #include "cstring.h"
 #include "http.h"
@@ -117,8 +119,7 @@ void files_route(HttpRequest *request, HttpResponse *response) {
     string_append(full_path, filename);
 
     if (request->request_line.method == HTTP_GET) {
-        response->body = string_from_file(string_cstr(full_path), request->tag);
-        if (!response->body) {
+        if (!http_response_set_file(response, string_cstr(full_path))) {
             printf("Failed to read file\n");
             response->status = HTTP_404;
             response->body = string_new("File Not Found", request->tag);
@@ -147,3 +148,42 @@ void files_route(HttpRequest *request, HttpResponse *response) {
     }
 
 }
+
+// answers /bytes/<n> with n bytes of filler, a body of any size built in memory
+void bytes_route(HttpRequest* request, HttpResponse* response) {
+    if (!request || !response) {
+        printf("Invalid request or response\n");
+        return;
+    }
+
+    const String* target = request->request_line.target;
+    const char* count = string_byte_length(target) > 7 ? string_cstr(target) + 7 : ""; // skip "/bytes/"
+    char* end = NULL;
+    unsigned long long len = strtoull(count, &end, 10);
+    if (end == count || count[0] == '-' || (*end != '\0' && *end != '?') || len > ROUTES_MAX_BYTES) {
+        response->status = HTTP_400;
+        response->body = string_new("Bad Request", request->tag);
+        return;
+    }
+
+    char* data = pmalloc((size_t)len + 1, request->tag);
+    String* body = data ? string_new_from_owned(data, (size_t)len, request->tag) : NULL;
+    if (!body) {
+        if (data) pfree(data);
+        response->status = HTTP_500;
+        return;
+    }
+    memset(data, 'x', (size_t)len);
+
+    Header content_type_header = { .key = string_new("Content-Type", request->tag),
+                                    .value = string_new("application/octet-stream", request->tag) };
+    if (!HeaderArray_push(response->headers, content_type_header)) {
+        printf("Failed to add Content-Type header\n");
+        string_free(body);
+        response->status = HTTP_500;
+        return;
+    }
+    string_free(response->body);
+    response->body = body;
+    response->status = HTTP_200;
+}
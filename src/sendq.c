@@ -0,0 +1,489 @@
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/errqueue.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include "alloc.h"
+#include "sendq.h"
+
+ARRAY_DEFINE(Segment, SegmentArray)
+ARRAY_DEFINE(ZerocopyHold, ZerocopyHoldArray)
+
+static void buffer_drop(void* owned, SharedBuffer* shared) {
+    if (shared) {
+        shared_buffer_release(shared);
+    } else if (owned) {
+        pfree(owned);
+    }
+}
+
+static void segment_release(SendQueue* queue, Segment* segment) {
+    if (segment->kind == SEGMENT_BUFFER) {
+        if (!segment->owned && !segment->shared) return;
+        // the kernel may still be reading pages sent with MSG_ZEROCOPY
+        ZerocopyHold hold = { .owned = segment->owned, .shared = segment->shared, .zc_seq = segment->zc_seq };
+        if (!segment->zerocopy || !ZerocopyHoldArray_push(&queue->zc_held, hold)) {
+            buffer_drop(segment->owned, segment->shared);
+        }
+        segment->owned = NULL;
+        segment->shared = NULL;
+    } else if (segment->fd >= 0) {
+        if (segment->pipe) {
+            pipe_pool_release(pipe_pool_get(), segment->pipe);
+            segment->pipe = NULL;
+        }
+        if (segment->done) {
+            segment->done(segment->done_data, segment->fd, segment->sent == segment->len);
+        } else {
+            close(segment->fd);
+        }
+        segment->fd = -1;
+    }
+}
+
+static void sendq_set_cork(SendQueue* queue, int socket_fd, bool on) {
+    if (queue->corked == on) return;
+
+    int value = on ? 1 : 0;
+    if (setsockopt(socket_fd, IPPROTO_TCP, TCP_CORK, &value, sizeof(value)) == 0) {
+        queue->corked = on;
+    }
+}
+
+bool sendq_init(SendQueue* queue, void* tag) {
+    if (!queue) return false;
+
+    queue->head = 0;
+    queue->pending = 0;
+    queue->total_sent = 0;
+    queue->high_water = SENDQ_HIGH_WATER;
+    queue->low_water = SENDQ_LOW_WATER;
+    queue->cork_next = false;
+    queue->corked = false;
+    queue->zerocopy = false;
+    queue->zerocopy_threshold = SENDQ_ZEROCOPY_THRESHOLD;
+    queue->zc_next_seq = 0;
+    queue->zc_sends = 0;
+    queue->zc_copied = 0;
+    queue->tag = tag;
+
+    if (!ZerocopyHoldArray_init(&queue->zc_held, tag)) return false;
+    return SegmentArray_init(&queue->segments, tag);
+}
+
+void sendq_free(SendQueue* queue) {
+    if (!queue) return;
+
+    for (size_t i = queue->head; i < queue->segments.size; i++) {
+        Segment* segment = &queue->segments.data[i];
+        segment->zerocopy = false;
+        segment_release(queue, segment);
+    }
+    SegmentArray_destroy(&queue->segments);
+
+    // the socket is going away, nothing will report these completions anymore
+    for (size_t i = 0; i < queue->zc_held.size; i++) {
+        buffer_drop(queue->zc_held.data[i].owned, queue->zc_held.data[i].shared);
+    }
+    ZerocopyHoldArray_destroy(&queue->zc_held);
+
+    queue->head = 0;
+    queue->pending = 0;
+}
+
+static bool sendq_push(SendQueue* queue, Segment segment) {
+    // reuse the array from the start once everything before it was sent
+    if (queue->head > 0 && queue->head == queue->segments.size) {
+        SegmentArray_clear(&queue->segments);
+        queue->head = 0;
+    }
+
+    segment.cork = queue->cork_next;
+    if (!SegmentArray_push(&queue->segments, segment)) {
+        return false;
+    }
+    queue->cork_next = false;
+    queue->pending += segment.len;
+    return true;
+}
+
+bool sendq_push_buffer(SendQueue* queue, const uint8_t* data, size_t len, void* owned) {
+    if (!queue || (!data && len > 0)) return false;
+
+    if (len == 0) {
+        if (owned) pfree(owned);
+        return true;
+    }
+
+    Segment segment = { .kind = SEGMENT_BUFFER, .data = data, .owned = owned, .shared = NULL,
+                        .fd = -1, .offset = 0, .done = NULL, .len = len, .sent = 0 };
+    if (!sendq_push(queue, segment)) {
+        if (owned) pfree(owned);
+        return false;
+    }
+    return true;
+}
+
+SharedBuffer* shared_buffer_new(const void* data, size_t len, void* tag) {
+    SharedBuffer* buffer = pmalloc(sizeof(SharedBuffer) + len, tag);
+    if (!buffer) return NULL;
+
+    atomic_init(&buffer->refs, 1);
+    buffer->len = len;
+    if (data && len > 0) memcpy(buffer->data, data, len);
+    return buffer;
+}
+
+SharedBuffer* shared_buffer_retain(SharedBuffer* buffer) {
+    if (buffer) atomic_fetch_add_explicit(&buffer->refs, 1, memory_order_relaxed);
+    return buffer;
+}
+
+void shared_buffer_release(SharedBuffer* buffer) {
+    if (!buffer) return;
+    if (atomic_fetch_sub_explicit(&buffer->refs, 1, memory_order_acq_rel) == 1) {
+        pfree(buffer);
+    }
+}
+
+bool sendq_push_shared(SendQueue* queue, SharedBuffer* buffer) {
+    if (!queue || !buffer) return false;
+    if (buffer->len == 0) return true;
+
+    Segment segment = { .kind = SEGMENT_BUFFER, .data = buffer->data, .owned = NULL,
+                        .shared = shared_buffer_retain(buffer),
+                        .fd = -1, .offset = 0, .done = NULL, .len = buffer->len, .sent = 0 };
+    if (!sendq_push(queue, segment)) {
+        shared_buffer_release(buffer);
+        return false;
+    }
+    return true;
+}
+
+bool sendq_push_file(SendQueue* queue, int fd, off_t offset, size_t len) {
+    if (!queue || fd < 0) return false;
+
+    if (len == 0) {
+        close(fd);
+        return true;
+    }
+
+    Segment segment = { .kind = SEGMENT_FILE, .data = NULL, .owned = NULL, .shared = NULL,
+                        .fd = fd, .offset = offset, .read_pos = offset, .pipe = NULL,
+                        .done = NULL, .len = len, .sent = 0 };
+    if (!sendq_push(queue, segment)) {
+        close(fd);
+        return false;
+    }
+    return true;
+}
+
+bool sendq_push_stream(SendQueue* queue, int fd, size_t len, SegmentDoneFn done, void* data) {
+    if (!queue || fd < 0 || !done) return false;
+
+    if (len == 0) {
+        done(data, fd, true);
+        return true;
+    }
+
+    Segment segment = { .kind = SEGMENT_STREAM, .data = NULL, .owned = NULL, .shared = NULL,
+                        .fd = fd, .offset = 0, .read_pos = 0, .pipe = NULL,
+                        .done = done, .done_data = data, .len = len, .sent = 0 };
+    if (!sendq_push(queue, segment)) {
+        done(data, fd, false);
+        return false;
+    }
+    return true;
+}
+
+void sendq_cork(SendQueue* queue) {
+    if (!queue) return;
+    queue->cork_next = true;
+}
+
+void sendq_uncork(SendQueue* queue) {
+    if (!queue) return;
+
+    queue->cork_next = false;
+    if (queue->head < queue->segments.size) {
+        queue->segments.data[queue->segments.size - 1].uncork = true;
+    }
+}
+
+bool sendq_enable_zerocopy(SendQueue* queue, int socket_fd, size_t threshold) {
+    if (!queue || socket_fd < 0 || threshold == 0) return false;
+
+#ifdef SO_ZEROCOPY
+    int one = 1;
+    if (setsockopt(socket_fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) != 0) {
+        return false;
+    }
+    queue->zerocopy = true;
+    queue->zerocopy_threshold = threshold;
+    return true;
+#else
+    return false;
+#endif
+}
+
+// frees every held buffer whose last zerocopy send is at or before `hi`
+static void sendq_release_held(SendQueue* queue, uint32_t hi) {
+    size_t kept = 0;
+    for (size_t i = 0; i < queue->zc_held.size; i++) {
+        ZerocopyHold* hold = &queue->zc_held.data[i];
+        // TCP completes sends in order, compare wrap safe
+        if ((int32_t)(hold->zc_seq - hi) <= 0) {
+            buffer_drop(hold->owned, hold->shared);
+        } else {
+            queue->zc_held.data[kept++] = *hold;
+        }
+    }
+    queue->zc_held.size = kept;
+}
+
+size_t sendq_reap_zerocopy(SendQueue* queue, int socket_fd) {
+    if (!queue || socket_fd < 0) return 0;
+
+    size_t reaped = 0;
+    while (true) {
+        char control[128];
+        struct msghdr msg = { .msg_control = control, .msg_controllen = sizeof(control) };
+        if (recvmsg(socket_fd, &msg, MSG_ERRQUEUE) < 0) {
+            break; // EAGAIN once the error queue is empty
+        }
+
+        for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            bool is_recverr = (cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR)
+                || (cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR);
+            if (!is_recverr) continue;
+
+            struct sock_extended_err err;
+            memcpy(&err, CMSG_DATA(cmsg), sizeof(err));
+            if (err.ee_errno != 0 || err.ee_origin != SO_EE_ORIGIN_ZEROCOPY) continue;
+
+            // ee_info..ee_data is the range of completed sends
+            if (err.ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                // the kernel copied anyway (loopback, no SG support), stop paying for pinning
+                queue->zc_copied++;
+                queue->zerocopy = false;
+            }
+            sendq_release_held(queue, err.ee_data);
+            reaped++;
+        }
+    }
+    return reaped;
+}
+
+size_t sendq_zerocopy_pending(const SendQueue* queue) {
+    return queue ? queue->zc_held.size : 0;
+}
+
+void sendq_shrink(SendQueue* queue) {
+    if (!queue || queue->head < queue->segments.size || queue->zc_held.size > 0) return;
+
+    SegmentArray_destroy(&queue->segments);
+    ZerocopyHoldArray_destroy(&queue->zc_held);
+    queue->head = 0;
+}
+
+// account for `written` bytes starting at the head segment
+static void sendq_advance(SendQueue* queue, int socket_fd, size_t written) {
+    queue->pending -= written;
+    queue->total_sent += written;
+
+    while (written > 0 && queue->head < queue->segments.size) {
+        Segment* segment = &queue->segments.data[queue->head];
+        size_t left = segment->len - segment->sent;
+        if (written < left) {
+            segment->sent += written;
+            return;
+        }
+        written -= left;
+        segment->sent = segment->len;
+        if (segment->uncork) {
+            sendq_set_cork(queue, socket_fd, false);
+        }
+        segment_release(queue, segment);
+        queue->head++;
+    }
+}
+
+// makes room for `count` more holds, so segment_release never has to free a buffer
+// the kernel may still be reading
+static bool sendq_reserve_holds(SendQueue* queue, size_t count) {
+    size_t needed = queue->zc_held.size + count;
+    if (needed <= queue->zc_held.capacity) return true;
+    size_t capacity = queue->zc_held.capacity * 2;
+    return ZerocopyHoldArray_grow(&queue->zc_held, capacity > needed ? capacity : needed);
+}
+
+static SendqStatus sendq_flush_buffers(SendQueue* queue, int socket_fd) {
+    struct iovec iov[SENDQ_MAX_IOV];
+    int iov_count = 0;
+    size_t requested = 0;
+    size_t held = 0; // gathered segments an earlier zerocopy send still covers
+
+    for (size_t i = queue->head; i < queue->segments.size && iov_count < SENDQ_MAX_IOV; i++) {
+        Segment* segment = &queue->segments.data[i];
+        if (segment->kind != SEGMENT_BUFFER) break;
+        // a corked run starts with a send of its own, sendq_flush sets the cork first
+        if (iov_count > 0 && segment->cork && segment->sent == 0) break;
+        iov[iov_count].iov_base = (void*)(segment->data + segment->sent);
+        iov[iov_count].iov_len = segment->len - segment->sent;
+        requested += iov[iov_count].iov_len;
+        iov_count++;
+        if (segment->zerocopy) held++;
+        // a corked run ends here, leave the rest for after the uncork
+        if (segment->uncork) break;
+    }
+
+    int flags = MSG_NOSIGNAL;
+#ifdef MSG_ZEROCOPY
+    // every segment this send finishes may need a hold, the room is taken up front
+    bool zerocopy = queue->zerocopy && requested >= queue->zerocopy_threshold;
+    if (zerocopy && !sendq_reserve_holds(queue, (size_t)iov_count)) {
+        // without the room, a plain copy is the safe way to send
+        zerocopy = false;
+    }
+    if (!zerocopy && held > 0 && !sendq_reserve_holds(queue, held)) {
+        printf("Failed to reserve zerocopy holds\n");
+        return SENDQ_ERROR;
+    }
+    if (zerocopy) flags |= MSG_ZEROCOPY;
+#else
+    (void)held;
+#endif
+
+    struct msghdr msg = { .msg_iov = iov, .msg_iovlen = iov_count };
+    ssize_t written = sendmsg(socket_fd, &msg, flags);
+#ifdef MSG_ZEROCOPY
+    if (written < 0 && errno == ENOBUFS && (flags & MSG_ZEROCOPY)) {
+        // out of optmem for pinned pages, fall back to a plain copy
+        flags &= ~MSG_ZEROCOPY;
+        written = sendmsg(socket_fd, &msg, flags);
+    }
+#endif
+    if (written < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) return SENDQ_AGAIN;
+        if (errno == EINTR) return SENDQ_DONE;
+        printf("Failed to send response: %s\n", strerror(errno));
+        return SENDQ_ERROR;
+    }
+
+#ifdef MSG_ZEROCOPY
+    if (flags & MSG_ZEROCOPY) {
+        // every segment this call touched waits for completion `seq`
+        uint32_t seq = queue->zc_next_seq++;
+        queue->zc_sends++;
+        size_t covered = 0;
+        for (size_t i = queue->head; i < queue->segments.size && covered < (size_t)written; i++) {
+            Segment* segment = &queue->segments.data[i];
+            segment->zerocopy = true;
+            segment->zc_seq = seq;
+            covered += segment->len - segment->sent;
+        }
+    }
+#endif
+
+    sendq_advance(queue, socket_fd, (size_t)written);
+    return (size_t)written < requested ? SENDQ_AGAIN : SENDQ_DONE;
+}
+
+static SendqStatus sendq_flush_file(SendQueue* queue, int socket_fd) {
+    Segment* segment = &queue->segments.data[queue->head];
+    size_t left = segment->len - segment->sent;
+
+    // file and stream bodies go source -> pipe -> socket, never through userspace
+    PipePool* pool = pipe_pool_get();
+    if (!segment->pipe) {
+        segment->pipe = pipe_pool_acquire(pool);
+        if (!segment->pipe) return SENDQ_ERROR;
+    }
+
+    off_t* read_pos = segment->kind == SEGMENT_FILE ? &segment->read_pos : NULL;
+    ssize_t written = splice_transfer(segment->pipe, segment->fd, read_pos, socket_fd, left,
+                                      pool ? &pool->stats : NULL);
+    if (written < 0) {
+        if (errno == EINTR) return SENDQ_DONE;
+        if (errno == ENODATA) {
+            // the file shrank or the upstream hung up, the promised length can't be met
+            printf("Body source ended early, %zu bytes missing\n", left);
+        } else {
+            printf("Failed to send body segment: %s\n", strerror(errno));
+        }
+        return SENDQ_ERROR;
+    }
+
+    // an empty pipe means the source ran dry, not that the socket is full
+    bool starved = segment->kind == SEGMENT_STREAM && segment->pipe->buffered == 0;
+    sendq_advance(queue, socket_fd, (size_t)written);
+    if ((size_t)written == left) return SENDQ_DONE;
+    return starved ? SENDQ_SOURCE : SENDQ_AGAIN;
+}
+
+SendqStatus sendq_flush(SendQueue* queue, int socket_fd) {
+    if (!queue || socket_fd < 0) return SENDQ_ERROR;
+
+    while (queue->head < queue->segments.size) {
+        Segment* segment = &queue->segments.data[queue->head];
+        if (segment->cork && segment->sent == 0) {
+            sendq_set_cork(queue, socket_fd, true);
+        }
+        SendqStatus status = segment->kind == SEGMENT_BUFFER
+            ? sendq_flush_buffers(queue, socket_fd)
+            : sendq_flush_file(queue, socket_fd);
+        if (status != SENDQ_DONE) return status;
+    }
+
+    SegmentArray_clear(&queue->segments);
+    queue->head = 0;
+    return SENDQ_DONE;
+}
+
+bool sendq_flush_blocking(SendQueue* queue, int socket_fd, int timeout_ms) {
+    while (true) {
+        SendqStatus status = sendq_flush(queue, socket_fd);
+        if (status == SENDQ_DONE) return true;
+        if (status == SENDQ_ERROR) return false;
+
+        struct pollfd pfd = { .fd = socket_fd, .events = POLLOUT };
+        if (status == SENDQ_SOURCE) {
+            pfd.fd = sendq_source_fd(queue);
+            pfd.events = POLLIN;
+        }
+        int ready = poll(&pfd, 1, timeout_ms);
+        if (ready < 0 && errno != EINTR) return false;
+        if (ready == 0) {
+            printf("Timed out waiting for the socket to become writable\n");
+            return false;
+        }
+    }
+}
+
+int sendq_source_fd(const SendQueue* queue) {
+    if (!queue || queue->head >= queue->segments.size) return -1;
+    const Segment* segment = &queue->segments.data[queue->head];
+    return segment->kind == SEGMENT_STREAM ? segment->fd : -1;
+}
+
+size_t sendq_pending(const SendQueue* queue) {
+    return queue ? queue->pending : 0;
+}
+
+bool sendq_is_empty(const SendQueue* queue) {
+    return !queue || queue->pending == 0;
+}
+
+bool sendq_above_high_water(const SendQueue* queue) {
+    return queue && queue->pending >= queue->high_water;
+}
+
+bool sendq_below_low_water(const SendQueue* queue) {
+    return !queue || queue->pending <= queue->low_water;
+}
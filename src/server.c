@@ -1,110 +1,863 @@
+#define _GNU_SOURCE
 #include <errno.h>
+#include <signal.h>
 #include <stdio.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
+#include <sys/resource.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <netinet/ip.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include "alloc.h"
 #include "builtin.h"
+#include "capture.h"
+#include "loadshed.h"
+#include "probes.h"
+#include "profile.h"
 #include "routes.h"
 #include "server.h"
+#include "slowlog.h"
+#include "trace.h"
 
-typedef struct {
-    int client_fd;
-    HttpServer* server;
-} InternalRequest;
+static void connection_on_event(EventLoop* loop, int fd, uint32_t events, void* data);
+static bool connection_process(Connection* conn);
 
-void* handle_client_request(void* ctx) {
-    InternalRequest* request = ctx;
-    HttpServer* server = request->server;
-    int client_fd = request->client_fd;
-    void* tag = TAG(client_fd);
-    bool active = true;
+// allocation check state of the worker running on this thread
+static _Thread_local size_t t_alloc_requests;
+static _Thread_local uint64_t t_alloc_sites[SERVER_ALLOC_CHECK_SITES];
+static _Thread_local size_t t_alloc_site_count;
 
-    while (active) {
+static uint64_t server_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static Connection* connection_new(ServerWorker* worker, int client_fd, const struct sockaddr_storage* peer) {
+    HttpServer* server = worker->server;
+
+    Connection* conn = pmalloc(sizeof(Connection), server->tag);
+    if (!conn) {
+        printf("Failed to allocate memory for Connection\n");
+        return NULL;
+    }
+
+    conn->fd = client_fd;
+    conn->id = atomic_fetch_add_explicit(&server->connections_opened, 1, memory_order_relaxed);
+    conn->worker = worker;
+    conn->tag = CONNECTION_TAG(conn->id);
+    conn->peer = *peer;
+    conn->in = NULL;
+    conn->in_len = 0;
+    conn->in_cap = 0;
+    conn->paused = false;
+    conn->closing = false;
+    conn->h2 = NULL;
+    conn->ws = NULL;
+    conn->sse = NULL;
+    conn->pending_request = NULL;
+    conn->pending_response = NULL;
+    conn->pending_slow = NULL;
+    conn->pending_trace = 0;
+    conn->pending_trace_start = 0;
+    conn->source_watch = NULL;
+    conn->source_timer = NULL;
+    conn->accept_start_ns = 0;
+    conn->accept_end_ns = 0;
+    conn->recv_start_ns = 0;
+    conn->recv_end_ns = 0;
+    conn->trace_send = 0;
+
+    if (!sendq_init(&conn->out, server->tag)) {
+        pfree(conn);
+        return NULL;
+    }
+    conn->out.high_water = server->send_high_water;
+    conn->out.low_water = server->send_low_water;
+
+    // small responses are a single write, don't let Nagle hold them back
+    int one = 1;
+    setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (server->zerocopy_threshold > 0) {
+        sendq_enable_zerocopy(&conn->out, client_fd, server->zerocopy_threshold);
+    }
+
+    conn->watch = event_loop_add(worker->loop, client_fd, EV_READ, 0, connection_on_event, conn);
+    if (!conn->watch) {
+        sendq_free(&conn->out);
+        pfree(conn);
+        return NULL;
+    }
+
+    shmstats_connection(worker->stats, true);
+    return conn;
+}
+
+static void connection_close(Connection* conn) {
+    event_loop_remove(conn->worker->loop, conn->watch);
+
+    h2_session_free(conn->h2);
+    websocket_free(conn->ws);
+    sse_unsubscribe(conn->sse);
+    if (conn->pending_response) {
+        // the handler's cancel runs as the response is freed
+        layers_apply(conn->worker->server->layer_ctx, LAYER_CLEANUP, conn->pending_request, conn->pending_response);
+        http_request_free(conn->pending_request);
+        http_response_free(conn->pending_response);
+    }
+    // the source goes back to its owner with the queue
+    if (conn->source_watch) event_loop_remove(conn->worker->loop, conn->source_watch);
+    if (conn->source_timer) event_timer_cancel(conn->worker->loop, conn->source_timer);
+    sendq_free(&conn->out);
+    if (conn->in) pfree(conn->in);
+    pfree_tag(conn->tag);
+
+    // once closed, the fd number can be accepted again by any worker
+    if (close(conn->fd) < 0) {
+        printf("Close failed: %s \n", strerror(errno));
+    }
+
+    admission_release(&conn->worker->server->admission, &conn->peer);
+    shmstats_connection(conn->worker->stats, false);
+    pfree(conn);
+}
+
+bool http_server_add_websocket(HttpServer* server, const char* path, const WebSocketHandler* handler) {
+    if (!server || !path || !handler) return false;
+
+    size_t len = strlen(path);
+    WebSocketRoute route = { .path = pmalloc(len + 1, server->tag), .handler = handler };
+    if (!route.path) return false;
+    memcpy(route.path, path, len + 1);
+    if (!WebSocketRouteArray_push(&server->websocket_routes, route)) {
+        pfree(route.path);
+        return false;
+    }
+    return true;
+}
+
+void http_server_handle(HttpServer* server, HttpRequest* request, HttpResponse* response) {
+    // a pre-route layer that fails after setting a status has answered the request itself
+    if (layers_apply(server->layer_ctx, LAYER_PRE_ROUTE, request, response) || !response->status) {
+        uint64_t start = trace_start();
+        slowlog_mark(SLOW_ROUTE_START);
+        router_route(server->router, request, response);
+        slowlog_mark(SLOW_ROUTE_END);
+        trace_span("handler", start);
+    }
+    if (!response->deferred) http_server_finish(server, request, response);
+}
+
+void http_server_finish(HttpServer* server, HttpRequest* request, HttpResponse* response) {
+    layers_apply(server->layer_ctx, LAYER_POST_ROUTE, request, response);
+    slowlog_mark(SLOW_LAYERS_END);
+}
+
+// HTTP/2 frames were queued outside the connection's own event handling, e.g. a
+// deferred response: wake up to flush them and pump the stream bodies
+static void connection_h2_notify(void* data) {
+    Connection* conn = data;
+    uint32_t interest = EV_WRITE;
+    if (!conn->paused && !conn->closing) interest |= EV_READ;
+    event_loop_modify(conn->worker->loop, conn->watch, interest);
+}
+
+// switches to HTTP/2 if the request asks for `Upgrade: h2c`, the request is then
+// answered as stream 1
+static bool connection_upgrade_h2(Connection* conn, HttpRequest* request) {
+    Header* upgrade = http_request_get_header(request, "Upgrade");
+    Header* settings = http_request_get_header(request, "HTTP2-Settings");
+    if (!upgrade || !settings || string_find_cstr(upgrade->value, "h2c", 0) == SIZE_MAX) return false;
+
+    static const char switching[] = "HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n";
+    if (!sendq_push_buffer(&conn->out, (const uint8_t*)switching, sizeof(switching) - 1, NULL)) return false;
+
+    conn->h2 = h2_session_new(conn->worker->server, conn->worker->loop, &conn->out, connection_h2_notify, conn,
+                              conn->worker->server->tag);
+    if (conn->h2) conn->h2->peer = conn->peer;
+    if (!conn->h2 || !h2_session_upgrade(conn->h2, request, string_cstr(settings->value))) {
+        printf("Failed to upgrade to HTTP/2\n");
+        conn->closing = true;
+    }
+    return true;
+}
+
+// frames were queued from outside the connection's own event handling, or the
+// WebSocket is done: make sure the connection wakes up to flush or close
+static void connection_ws_notify(void* data) {
+    Connection* conn = data;
+    if (conn->ws->finished) conn->closing = true;
+
+    uint32_t interest = EV_WRITE;
+    if (!conn->paused && !conn->closing) interest |= EV_READ;
+    event_loop_modify(conn->worker->loop, conn->watch, interest);
+}
+
+// events were queued for the subscriber, or its channel gave up on it
+static void connection_sse_notify(void* data) {
+    Connection* conn = data;
+    if (conn->sse->closed) conn->closing = true;
+
+    uint32_t interest = EV_WRITE;
+    if (!conn->paused && !conn->closing) interest |= EV_READ;
+    event_loop_modify(conn->worker->loop, conn->watch, interest);
+}
+
+static const WebSocketHandler* server_find_websocket(HttpServer* server, const String* target) {
+    const char* path = string_cstr(target);
+    size_t path_len = strcspn(path, "?");
+    for (size_t i = 0; i < WebSocketRouteArray_size(&server->websocket_routes); i++) {
+        WebSocketRoute* route = &server->websocket_routes.data[i];
+        if (strlen(route->path) == path_len && strncmp(route->path, path, path_len) == 0) {
+            return route->handler;
+        }
+    }
+    return NULL;
+}
+
+// completes the handshake if the request asks for a WebSocket on a registered path
+static bool connection_upgrade_websocket(Connection* conn, HttpRequest* request) {
+    HttpServer* server = conn->worker->server;
+    Header* upgrade = http_request_get_header(request, "Upgrade");
+    if (!upgrade || !strcasestr(string_cstr(upgrade->value), "websocket")) return false;
+
+    const WebSocketHandler* handler = server_find_websocket(server, request->request_line.target);
+    if (!handler) return false;
+
+    char accept[32];
+    int refused = websocket_handshake_check(request, accept);
+    if (refused == 426) {
+        static const char version[] = "HTTP/1.1 426 Upgrade Required\r\nSec-WebSocket-Version: 13\r\n"
+                                      "Content-Length: 0\r\n\r\n";
+        sendq_push_buffer(&conn->out, (const uint8_t*)version, sizeof(version) - 1, NULL);
+        return true;
+    }
+    if (refused) {
+        static const char bad[] = "HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\n\r\n";
+        sendq_push_buffer(&conn->out, (const uint8_t*)bad, sizeof(bad) - 1, NULL);
+        return true;
+    }
+
+    char* head = pmalloc(160, server->tag);
+    if (!head) return false;
+    int head_len = snprintf(head, 160, "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\n"
+                            "Connection: Upgrade\r\nSec-WebSocket-Accept: %s\r\n\r\n", accept);
+    if (!sendq_push_buffer(&conn->out, (const uint8_t*)head, (size_t)head_len, head)) {
+        conn->closing = true;
+        return true;
+    }
+
+    conn->ws = websocket_new(conn->worker->loop, &conn->out, handler, connection_ws_notify, conn, server->tag);
+    if (!conn->ws) {
+        printf("Failed to start the WebSocket\n");
+        conn->closing = true;
+        return true;
+    }
+    websocket_open(conn->ws, request);
+    return true;
+}
+
+// queues a complete response and frees the request, `start` is when handling began
+static bool connection_respond(Connection* conn, HttpRequest* request, HttpResponse* response,
+                               const struct timespec* start, size_t request_len) {
+    HttpServer* server = conn->worker->server;
+    void* tag = conn->tag;
+
+    uint64_t queue_start = trace_start();
+    size_t pending = sendq_pending(&conn->out);
+    bool queued = http_response_queue(response, &conn->out);
+    trace_span("queue", queue_start);
+    slowlog_mark(SLOW_QUEUED);
+    slowlog_end(request, response, request_len, queued ? sendq_pending(&conn->out) - pending : 0);
+    if (conn->worker->stats) {
+        shmstats_request(conn->worker->stats, queued ? http_response_status_code(response) : 500, server_now_ns() - request->received_ns);
+    }
+    if (!queued) {
+        printf("Failed to send HTTP response\n");
+        layers_apply(server->layer_ctx, LAYER_CLEANUP, request, response);
+        http_request_free(request);
+        http_response_free(response);
+        pfree_tag(tag);
+        return false;
+    }
+
+    if (response->sse) {
+        // the head is queued, from here on the connection only carries events
+        Header* last_event_id = http_request_get_header(request, "Last-Event-ID");
+        conn->sse = sse_subscribe(response->sse, conn->worker->loop, &conn->out, connection_sse_notify, conn,
+                                  last_event_id ? string_cstr(last_event_id->value) : NULL);
+        if (!conn->sse) {
+            printf("Failed to subscribe to the event stream\n");
+            conn->closing = true;
+        } else if (conn->sse->closed) {
+            // the replay alone was more than the channel lets a subscriber queue
+            conn->closing = true;
+        }
+    }
+
+    // end time
+    struct timespec end;
+    clock_gettime(CLOCK_REALTIME, &end);
+
+    // calculate the time taken in microseconds
+    long time_taken = (end.tv_sec - start->tv_sec) * 1000000 + (end.tv_nsec - start->tv_nsec) / 1000;
+    printf("TIME: %ld microseconds\n", time_taken);
+    CHTTP_PROBE3(request__done, conn->fd, response->status, time_taken);
+
+    // check for Connection: close header
+    Header* connection_header = http_request_get_header(request, "Connection");
+    if (connection_header && string_equals_cstr(connection_header->value, "close")) {
+        printf("Connection: close header found, closing connection\n");
+        conn->closing = true;
+    } else {
+        printf("Connection: keep-alive header found or not present, keeping connection open\n");
+    }
+
+    layers_apply(server->layer_ctx, LAYER_CLEANUP, request, response);
+    http_request_free(request);
+    http_response_free(response);
+    pfree_tag(tag);
+    return true;
+}
+
+// a deferred response is complete: queue it, then carry on with what the client sent meanwhile
+static void connection_resume(void* data) {
+    Connection* conn = data;
+    HttpRequest* request = conn->pending_request;
+    HttpResponse* response = conn->pending_response;
+    conn->pending_request = NULL;
+    conn->pending_response = NULL;
+
+    // the resume may come from inside another request's handler, whose timeline and
+    // trace are kept aside
+    SlowTimeline outer;
+    slowlog_save(&outer);
+    slowlog_restore(conn->pending_slow);
+    conn->pending_slow = NULL;
+    uint64_t trace_id = conn->pending_trace;
+    uint64_t outer_trace = trace_request_swap(trace_id);
+    conn->pending_trace = 0;
+
+    http_server_finish(conn->worker->server, request, response);
+    bool ok = connection_respond(conn, request, response, &conn->pending_start, 0);
+    if (ok && trace_id) {
+        trace_record("request", trace_id, conn->pending_trace_start, trace_clock());
+        conn->trace_send = trace_id;
+    }
+    slowlog_restore(&outer);
+    trace_request_swap(outer_trace);
+    if (!ok || !connection_process(conn)) {
+        connection_close(conn);
+        return;
+    }
+    connection_on_event(conn->worker->loop, conn->fd, EV_WRITE, conn);
+}
+
+// runs one complete request through the layers and router, queueing the response
+static bool connection_handle_request(Connection* conn, size_t head_len, size_t body_len) {
+    HttpServer* server = conn->worker->server;
+    void* tag = conn->tag;
+
+    // start time
+    struct timespec start;
+    clock_gettime(CLOCK_REALTIME, &start);
+
+    // parse the request
+    HttpRequest* request = http_request_new(tag);
+    if (!request) {
+        printf("Failed to allocate memory for HttpRequest\n");
+        return false;
+    }
+    request->peer = conn->peer;
+
+    // turn the request head into a string
+    slowlog_begin(conn->worker->loop->ready_ns);
+    slowlog_mark(SLOW_PARSE_START);
+    uint64_t parse_start = trace_clock();
+    String* request_string = string_new_len(conn->in, head_len, tag);
+
+    // parse the request string
+    bool status = http_request_parse(request, request_string);
+    uint64_t parse_end = trace_clock();
+    slowlog_mark(SLOW_PARSE_END);
+
+    if (!status) {
+        printf("Failed to parse HTTP request\n");
+        layers_apply(server->layer_ctx, LAYER_CLEANUP, request, NULL);
+        http_request_free(request);
+        pfree_tag(tag);
+        return false;
+    }
+
+    // what happened before the request was picked is recorded from the saved timestamps
+    uint64_t trace_id = trace_request_begin(request);
+    if (trace_id) {
+        if (conn->accept_end_ns) trace_record("accept", trace_id, conn->accept_start_ns, conn->accept_end_ns);
+        trace_record("recv", trace_id, conn->recv_start_ns, conn->recv_end_ns);
+        trace_record("parse", trace_id, parse_start, parse_end);
+    }
+    conn->accept_end_ns = 0;
+    CHTTP_PROBE3(request__start, conn->fd, http_request_method_to_string(request->request_line.method),
+                 string_cstr(request->request_line.target));
+
+    // shed before anything else is spent on it
+    request->received_ns = conn->worker->loop->ready_ns;
+    if (!loadshed_admit(request)) {
+        bool queued = sendq_push_buffer(&conn->out, (const uint8_t*)loadshed_response, loadshed_response_len, NULL);
+        shmstats_request(conn->worker->stats, 503, 0);
+        http_request_free(request);
+        pfree_tag(tag);
+        return queued;
+    }
+
+    // the body is taken by length, it may be binary
+    if (body_len > 0) {
+        request->body = string_new_len(conn->in + head_len, body_len, tag);
+    }
+
+    if (connection_upgrade_websocket(conn, request) || connection_upgrade_h2(conn, request)) {
+        layers_apply(server->layer_ctx, LAYER_CLEANUP, request, NULL);
+        http_request_free(request);
+        pfree_tag(tag);
+        return true;
+    }
+
+    HttpResponse* response = http_response_new(tag);
+    request->loop = conn->worker->loop;
+    http_server_handle(server, request, response);
+    if (response->deferred) {
+        // connection_resume queues it, the requests behind it stay in `in` until then
+        conn->pending_request = request;
+        conn->pending_response = response;
+        conn->pending_start = start;
+        conn->pending_slow = slowlog_detach(tag);
+        conn->pending_trace = trace_id;
+        conn->pending_trace_start = parse_start;
+        response->resume = connection_resume;
+        response->resume_data = conn;
+        return true;
+    }
+
+    if (!connection_respond(conn, request, response, &start, head_len + body_len)) return false;
+    if (trace_id) {
+        trace_record("request", trace_id, parse_start, trace_clock());
+        conn->trace_send = trace_id;
+    }
+    return true;
+}
+
+// reports a steady-state request that reached the system allocator, `conn->in` still
+// starts with the request
+static void connection_check_allocations(Connection* conn, const palloc_probe* probe) {
+    HttpServer* server = conn->worker->server;
+    if (t_alloc_requests++ < server->alloc_check_warmup) return;
+
+    atomic_fetch_add_explicit(&server->alloc_checked, 1, memory_order_relaxed);
+    if (probe->system_calls == 0) return;
+    atomic_fetch_add_explicit(&server->alloc_failed, 1, memory_order_relaxed);
+
+    // each call stack is reported once per worker, a busy route would flood the log
+    uint64_t site = hash_bytes(probe->sites, probe->depth * sizeof(void*));
+    for (size_t i = 0; i < t_alloc_site_count && !server->alloc_check_fatal; i++) {
+        if (t_alloc_sites[i] == site) return;
+    }
+    if (t_alloc_site_count == SERVER_ALLOC_CHECK_SITES) return;
+    t_alloc_sites[t_alloc_site_count++] = site;
+
+    const char* eol = memchr(conn->in, '\r', conn->in_len);
+    int line_len = eol ? (int)(eol - conn->in) : 0;
+    printf("ALLOC: steady-state request \"%.*s\" made %zu allocator call(s) for %zu bytes, first from:\n",
+           line_len, conn->in, probe->system_calls, probe->bytes);
+    palloc_probe_print(probe);
+    if (server->alloc_check_fatal) {
+        fflush(stdout);
+        _exit(SERVER_ALLOC_CHECK_EXIT);
+    }
+}
+
+// feeds received frames to the HTTP/2 session and sends what it produced
+static bool connection_process_h2(Connection* conn) {
+    conn->h2->received_ns = conn->worker->loop->ready_ns;
+    size_t used = 0;
+    bool ok = h2_session_input(conn->h2, conn->in, conn->in_len, &used);
+    conn->in_len -= used;
+    memmove(conn->in, conn->in + used, conn->in_len);
+
+    h2_session_pump(conn->h2);
+
+    // a connection error still has its GOAWAY to flush
+    if (!ok || h2_session_finished(conn->h2)) {
+        conn->closing = true;
+    } else if (sendq_above_high_water(&conn->out)) {
+        conn->paused = true;
+    }
+    return true;
+}
+
+// feeds received frames to the WebSocket
+static bool connection_process_ws(Connection* conn) {
+    size_t used = 0;
+    bool open = websocket_input(conn->ws, (uint8_t*)conn->in, conn->in_len, &used);
+    conn->in_len -= used;
+    memmove(conn->in, conn->in + used, conn->in_len);
+
+    if (!open) {
+        conn->closing = true;
+    } else if (sendq_above_high_water(&conn->out)) {
+        conn->paused = true;
+    }
+    return true;
+}
+
+// answers a request that can't be framed and closes, the rest of the input can't be trusted
+static bool connection_refuse(Connection* conn, int status) {
+    static const char bad[] = "HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+    static const char unsupported[] = "HTTP/1.1 501 Not Implemented\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+    const char* response = status == 501 ? unsupported : bad;
+    size_t len = status == 501 ? sizeof(unsupported) - 1 : sizeof(bad) - 1;
+    conn->in_len = 0;
+    conn->closing = true;
+    return sendq_push_buffer(&conn->out, (const uint8_t*)response, len, NULL);
+}
+
+// handles every complete request in the input buffer, stops early under backpressure
+static bool connection_process(Connection* conn) {
+    while (conn->in_len > 0 && !conn->paused && !conn->closing && !conn->pending_response) {
+        if (conn->h2) {
+            return connection_process_h2(conn);
+        }
+        if (conn->ws) {
+            return connection_process_ws(conn);
+        }
+        if (conn->sse) {
+            // an event stream has nothing more to receive
+            conn->in_len = 0;
+            return true;
+        }
+
+        // HTTP/2 with prior knowledge starts with the connection preface instead
+        int preface = h2_preface_check(conn->in, conn->in_len);
+        if (preface == 0) break;
+        if (preface == 1) {
+            conn->h2 = h2_session_new(conn->worker->server, conn->worker->loop, &conn->out, connection_h2_notify, conn,
+                                      conn->worker->server->tag);
+            if (!conn->h2) return false;
+            conn->h2->peer = conn->peer;
+            continue;
+        }
+
+        size_t head_len = 0;
+        size_t body_len = 0;
+        int refused = 0;
+        size_t frame_len = http_request_frame(conn->in, conn->in_len, &head_len, &body_len, &refused);
+
+        if (frame_len == SIZE_MAX) {
+            printf("Failed to parse HTTP request\n");
+            return refused != 0 && connection_refuse(conn, refused);
+        }
+        if (frame_len == 0) {
+            if (head_len > 0 && head_len + body_len > SERVER_MAX_REQUEST_SIZE) {
+                printf("Request of %zu bytes exceeds the limit\n", head_len + body_len);
+                return false;
+            }
+            break; // wait for the rest of the request
+        }
+
+        if (capture_enabled()) {
+            capture_request(conn->id, conn->worker->loop->ready_ns, conn->in, frame_len);
+        }
+
+        HttpServer* server = conn->worker->server;
+        if (server->alloc_check) palloc_probe_begin();
+        bool handled = connection_handle_request(conn, head_len, body_len);
+        trace_request_end();
+        slowlog_cancel();
+        if (server->alloc_check) {
+            palloc_probe probe;
+            palloc_probe_end(&probe);
+            connection_check_allocations(conn, &probe);
+        }
+        if (!handled) {
+            return false;
+        }
+
+        // drop the consumed request, pipelined bytes move to the front
+        conn->in_len -= frame_len;
+        memmove(conn->in, conn->in + frame_len, conn->in_len);
+
+        if (sendq_above_high_water(&conn->out)) {
+            conn->paused = true;
+        }
+    }
+    return true;
+}
+
+// discards what an event stream client sends, so idle subscribers keep no receive buffer
+static bool connection_drain(Connection* conn) {
+    if (conn->in) {
+        pfree(conn->in);
+        conn->in = NULL;
+        conn->in_len = 0;
+        conn->in_cap = 0;
+    }
+    char scratch[256];
+    while (true) {
+        ssize_t bytes_received = recv(conn->fd, scratch, sizeof(scratch), 0);
+        if (bytes_received > 0) continue;
+        if (bytes_received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return true;
+        if (bytes_received < 0 && errno == EINTR) continue;
+        printf("Client closed event stream\n");
+        return false;
+    }
+}
+
+// reads whatever the socket has, returns false when the connection should close
+static bool connection_read(Connection* conn) {
+    if (conn->sse) {
+        return connection_drain(conn);
+    }
+    while (!conn->paused && !conn->closing && !conn->pending_response) {
+        ServerWorker* worker = conn->worker;
+        if (!conn->in && worker->spare_count > 0) {
+            // waking up from idle, take a buffer another connection gave back
+            conn->in = worker->spare_buffers[--worker->spare_count];
+            conn->in_cap = SERVER_BUFFER_SIZE;
+            shmstats_buffer(worker->stats, true);
+        } else if (conn->in_cap - conn->in_len < SERVER_READ_CHUNK) {
+            size_t new_cap = conn->in_cap ? conn->in_cap * 2 : SERVER_BUFFER_SIZE;
+            if (new_cap > SERVER_MAX_REQUEST_SIZE + SERVER_READ_CHUNK) {
+                printf("Request exceeds the buffer limit\n");
+                return false;
+            }
+            char* grown = prealloc(conn->in, new_cap, conn->worker->server->tag);
+            if (!grown) {
+                printf("Failed to grow the receive buffer\n");
+                return false;
+            }
+            conn->in = grown;
+            conn->in_cap = new_cap;
+            shmstats_buffer(worker->stats, false);
+        }
 
         // get the client's request
-        char buffer[4096];
-        ssize_t bytes_received = recv(client_fd, buffer, sizeof(buffer) - 1, 0);
+        uint64_t recv_start = trace_clock();
+        ssize_t bytes_received = recv(conn->fd, conn->in + conn->in_len, conn->in_cap - conn->in_len, 0);
         if (bytes_received <= 0) {
             if (bytes_received < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) return true;
+                if (errno == EINTR) continue;
                 printf("Receive failed: %s \n", strerror(errno));
             } else {
                 printf("Client closed connection\n");
             }
-            break;
+            return false;
         }
 
-        // start time
-        struct timespec start;
-        clock_gettime(CLOCK_REALTIME, &start);
-
-        buffer[bytes_received] = '\0'; // Null-terminate the received data
+        conn->in_len += (size_t)bytes_received;
+        shmstats_received(worker->stats, (size_t)bytes_received);
+        if (recv_start) {
+            conn->recv_start_ns = recv_start;
+            conn->recv_end_ns = trace_clock();
+        }
+        if (!connection_process(conn)) {
+            return false;
+        }
+        if (conn->sse) {
+            return connection_drain(conn);
+        }
+    }
+    return true;
+}
 
-        // parse the request
-        HttpRequest* request = http_request_new(tag);
-        if (!request) {
-            printf("Failed to allocate memory for HttpRequest\n");
-            break;
+// a keep-alive connection waiting for its next request gives its buffers back, so
+// idle ones cost little more than the Connection itself
+static void connection_release_idle(Connection* conn) {
+    ServerWorker* worker = conn->worker;
+    if (conn->in) {
+        if (conn->in_cap == SERVER_BUFFER_SIZE && worker->spare_count < SERVER_SPARE_BUFFERS) {
+            worker->spare_buffers[worker->spare_count++] = conn->in;
+        } else {
+            pfree(conn->in);
         }
+        conn->in = NULL;
+        conn->in_len = 0;
+        conn->in_cap = 0;
+    }
+    sendq_shrink(&conn->out);
+    palloc_release_tag(conn->tag);
+}
 
-        // turn the request into a string
-        String* request_string = string_new(buffer, tag);
+static void connection_on_event(EventLoop* loop, int fd, uint32_t events, void* data);
 
-        // parse the request string
-        bool status = http_request_parse(request, request_string);
+// the source of the streamed body has bytes again, or reached its end
+static void connection_on_source(EventLoop* loop, int fd, uint32_t events, void* data) {
+    (void)fd;
+    (void)events;
+    Connection* conn = data;
+    event_loop_remove(loop, conn->source_watch);
+    conn->source_watch = NULL;
+    event_timer_cancel(loop, conn->source_timer);
+    conn->source_timer = NULL;
 
-        if (!status) {
-            printf("Failed to parse HTTP request\n");
-            layers_apply(server->layer_ctx, LAYER_CLEANUP, request, NULL);
-            http_request_free(request);
-            break;
-        }
+    connection_on_event(loop, conn->fd, EV_WRITE, conn);
+}
 
-        HttpResponse* response = http_response_new(tag);
+static void connection_on_source_timeout(EventLoop* loop, void* data) {
+    Connection* conn = data;
+    conn->source_timer = NULL; // one-shot, freed once this returns
+    event_loop_remove(loop, conn->source_watch);
+    conn->source_watch = NULL;
 
-        layers_apply(server->layer_ctx, LAYER_PRE_ROUTE, request, response);
-        router_route(server->router, request, response);
-        layers_apply(server->layer_ctx, LAYER_POST_ROUTE, request, response);
+    // the head already went out, the response can only be cut short
+    printf("Streamed body source stalled, closing connection\n");
+    connection_close(conn);
+}
 
-        if (!http_response_send(response, client_fd)) {
-            printf("Failed to send HTTP response\n");
-            layers_apply(server->layer_ctx, LAYER_CLEANUP, request, response);
-            http_request_free(request);
-            http_response_free(response);
-            break;
+// holds off writing until the streamed body at the front of `out` has bytes to send
+static bool connection_wait_source(Connection* conn) {
+    EventLoop* loop = conn->worker->loop;
+    conn->source_watch = event_loop_add(loop, sendq_source_fd(&conn->out), EV_READ, 0, connection_on_source, conn);
+    if (!conn->source_watch) return false;
+    conn->source_timer = event_timer_add(loop, SERVER_STREAM_READ_TIMEOUT_MS, 0, connection_on_source_timeout, conn);
+    if (!conn->source_timer) {
+        event_loop_remove(loop, conn->source_watch);
+        conn->source_watch = NULL;
+        return false;
+    }
+    return true;
+}
+
+static void connection_on_event(EventLoop* loop, int fd, uint32_t events, void* data) {
+    (void)loop;
+    (void)fd;
+    Connection* conn = data;
+
+    if (events & EV_ERROR) {
+        // zerocopy completions are reported through the socket error queue
+        sendq_reap_zerocopy(&conn->out, conn->fd);
+        int error = 0;
+        socklen_t error_len = sizeof(error);
+        getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &error, &error_len);
+        if (error != 0) {
+            printf("Client connection error: %s\n", strerror(error));
+            connection_close(conn);
+            return;
         }
+    }
 
-        // end time
-        struct timespec end;
-        clock_gettime(CLOCK_REALTIME, &end);
+    if (events & EPOLLHUP) {
+        printf("Client connection reset\n");
+        connection_close(conn);
+        return;
+    }
 
-        // calculate the time taken in microseconds
-        long time_taken = (end.tv_sec - start.tv_sec) * 1000000 + (end.tv_nsec - start.tv_nsec) / 1000;
-        printf("TIME: %ld microseconds\n", time_taken);
+    if ((events & (EV_READ | EV_HUP)) && !conn->paused && !conn->closing && !conn->pending_response) {
+        if (!connection_read(conn)) {
+            connection_close(conn);
+            return;
+        }
+    }
 
-        // check for Connection: close header
-        Header* connection_header = http_request_get_header(request, "Connection");
-        if (connection_header && string_equals_cstr(connection_header->value, "close")) {
-            printf("Connection: close header found, closing connection\n");
-            active = false;
-        } else {
-            printf("Connection: keep-alive header found or not present, keeping connection open\n");
+    uint64_t send_start = conn->trace_send ? trace_clock() : 0;
+    while (true) {
+        SendqStatus status = sendq_flush(&conn->out, conn->fd);
+        if (status == SENDQ_ERROR
+            || (status == SENDQ_SOURCE && !conn->source_watch && !connection_wait_source(conn))) {
+            connection_close(conn);
+            return;
         }
 
-        layers_apply(server->layer_ctx, LAYER_CLEANUP, request, response);
-        http_request_free(request);
-        http_response_free(response);
-        pfree_tag(tag);
+        // resume a paused connection once the client caught up
+        if (conn->paused && sendq_below_low_water(&conn->out)) {
+            conn->paused = false;
+            if (!connection_process(conn)) {
+                connection_close(conn);
+                return;
+            }
+            continue;
+        }
+
+        // HTTP/2 responses go out as the queue drains
+        if (conn->h2 && !conn->closing && sendq_below_low_water(&conn->out) && h2_session_pump(conn->h2)) {
+            continue;
+        }
+        break;
     }
 
-    if (close(client_fd) < 0) {
-        printf("Close failed: %s \n", strerror(errno));
+    // a response that needs several writes shows up as several send spans
+    if (conn->trace_send) {
+        trace_record("send", conn->trace_send, send_start, trace_clock());
+        if (sendq_is_empty(&conn->out)) conn->trace_send = 0;
+    }
+
+    // buffers still pinned by zerocopy sends must outlive the close
+    if (conn->closing && sendq_is_empty(&conn->out) && sendq_zerocopy_pending(&conn->out) == 0) {
+        connection_close(conn);
+        return;
+    }
+
+    // HTTP/2 and WebSocket sessions keep state of their own between messages
+    if (!conn->h2 && !conn->ws && !conn->paused && !conn->closing && !conn->pending_response && conn->in_len == 0
+        && sendq_is_empty(&conn->out) && sendq_zerocopy_pending(&conn->out) == 0) {
+        connection_release_idle(conn);
+    }
+
+    // reading waits for a deferred response, pipelined requests would overtake it
+    uint32_t interest = 0;
+    if (!conn->paused && !conn->closing && !conn->pending_response) interest |= EV_READ;
+    if (!sendq_is_empty(&conn->out) && !conn->source_watch) interest |= EV_WRITE;
+    event_loop_modify(conn->worker->loop, conn->watch, interest);
+}
+
+static void server_on_accept(EventLoop* loop, int server_fd, uint32_t events, void* data) {
+    (void)loop;
+    (void)events;
+    ServerWorker* worker = data;
+
+    while (1) {
+        uint64_t accept_start = trace_clock();
+        // Accept a new client connection
+        struct sockaddr_storage client_addr;
+        socklen_t client_addr_len = sizeof(client_addr);
+        int client_fd = accept4(server_fd, (struct sockaddr *) &client_addr, &client_addr_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+        if (client_fd < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                printf("Accept failed: %s \n", strerror(errno));
+            }
+            return;
+        }
+
+        // over a cap: reset at once, before the connection costs anything
+        if (!admission_acquire(&worker->server->admission, &client_addr)) {
+            struct linger reset = { .l_onoff = 1, .l_linger = 0 };
+            setsockopt(client_fd, SOL_SOCKET, SO_LINGER, &reset, sizeof(reset));
+            close(client_fd);
+            continue;
+        }
+        printf("Client connected\n");
+
+        Connection* conn = connection_new(worker, client_fd, &client_addr);
+        if (!conn) {
+            admission_release(&worker->server->admission, &client_addr);
+            close(client_fd);
+        } else if (accept_start) {
+            conn->accept_start_ns = accept_start;
+            conn->accept_end_ns = trace_clock();
+        }
     }
+}
 
-    pfree(request);
+static void* server_worker_run(void* ctx) {
+    ServerWorker* worker = ctx;
+    profile_thread_register();
+    event_loop_run(worker->loop);
+    profile_thread_unregister();
     return NULL;
 }
 
@@ -113,7 +866,23 @@ bool http_server_init(HttpServer* server, const char* host, int port, void* tag)
 
     server->host = string_new(host, tag);
     server->port = port;
+    server->server_fd = -1;
     server->tag = tag;
+    server->workers = NULL;
+    server->send_high_water = SENDQ_HIGH_WATER;
+    server->send_low_water = SENDQ_LOW_WATER;
+    server->zerocopy_threshold = SENDQ_ZEROCOPY_THRESHOLD;
+    server->max_connections = 0;
+    server->max_connections_per_host = 0;
+    server->alloc_check = false;
+    server->alloc_check_fatal = false;
+    server->alloc_check_warmup = 0;
+    atomic_init(&server->alloc_checked, 0);
+    atomic_init(&server->alloc_failed, 0);
+    atomic_init(&server->connections_opened, 0);
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    server->worker_count = cpus > 0 ? (int)cpus : 1;
 
     server->router = router_new(tag);
     if (!server->router) {
@@ -127,42 +896,72 @@ bool http_server_init(HttpServer* server, const char* host, int port, void* tag)
         string_free(server->host);
         return false;
     }
+    WebSocketRouteArray_init(&server->websocket_routes, tag);
 
     return true;
 }
 
+void http_server_print_alloc_check(HttpServer* server) {
+    if (!server->alloc_check) return;
+
+    printf("\n=== Allocation Check ===\n");
+    printf("Warmup: %zu request(s) per worker\n", server->alloc_check_warmup);
+    printf("Requests checked: %llu\n", (unsigned long long)atomic_load(&server->alloc_checked));
+    printf("Requests that allocated: %llu\n", (unsigned long long)atomic_load(&server->alloc_failed));
+    printf("=== End Allocation Check ===\n\n");
+}
+
 void http_server_free(HttpServer* server) {
     if (!server) return;
 
     router_free(server->router);
     layers_free(server->layer_ctx);
+    for (size_t i = 0; i < WebSocketRouteArray_size(&server->websocket_routes); i++) {
+        pfree(server->websocket_routes.data[i].path);
+    }
+    WebSocketRouteArray_destroy(&server->websocket_routes);
     string_free(server->host);
+    // the connection table lives from a successful start until here
+    if (server->workers) {
+        admission_free(&server->admission);
+        pfree(server->workers);
+        server->workers = NULL;
+    }
 }
 
 
-bool http_server_stop(HttpServer* server);
-
 bool http_server_start(HttpServer* server) {
-    int server_fd, client_addr_len;
-	struct sockaddr_in client_addr;
+    int server_fd;
 
-	server_fd = socket(AF_INET, SOCK_STREAM, 0);
+    // a peer closing mid-response must surface as EPIPE, not kill the process
+    signal(SIGPIPE, SIG_IGN);
+
+    // every connection is a descriptor, the default soft limit of 1024 is far too low
+    struct rlimit files;
+    if (getrlimit(RLIMIT_NOFILE, &files) == 0 && files.rlim_cur < files.rlim_max) {
+        files.rlim_cur = files.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &files);
+    }
+
+	server_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
 	if (server_fd == -1) {
 		printf("Socket creation failed: %s...\n", strerror(errno));
-		return 1;
+		return false;
 	}
 
 	int reuse = 1;
 	if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) < 0) {
 		printf("SO_REUSEADDR failed: %s \n", strerror(errno));
-		return 1;
+		close(server_fd);
+		return false;
 	}
 
 	// convert from string host to IP address
 	struct in_addr addr;
 	if (inet_pton(AF_INET, string_cstr(server->host), &addr) <= 0) {
         printf("Invalid address: %s \n", string_cstr(server->host));
-        return 1;
+        close(server_fd);
+        return false;
     }
 
 	struct sockaddr_in serv_addr = { .sin_family = AF_INET ,
@@ -172,56 +971,97 @@ bool http_server_start(HttpServer* server) {
 
 	if (bind(server_fd, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) != 0) {
 		printf("Bind failed: %s \n", strerror(errno));
-		return 1;
+		close(server_fd);
+		return false;
 	}
 
-
-	int connection_backlog = 5;
-	if (listen(server_fd, connection_backlog) != 0) {
+	if (listen(server_fd, SOMAXCONN) != 0) {
 		printf("Listen failed: %s \n", strerror(errno));
-		return 1;
+		close(server_fd);
+		return false;
 	}
-	printf("Server started on %s:%d\n", string_cstr(server->host), server->port);
-	printf("Waiting for a client to connect...\n");
+	server->server_fd = server_fd;
 
-	// oh look a loop
-    while (1) {
-        // Accept a new client connection
-        int client_fd = accept(server_fd, (struct sockaddr *) &client_addr, (socklen_t*)&client_addr_len);
-        printf("Client connected\n");
+    if (!admission_init(&server->admission, server->max_connections, server->max_connections_per_host, server->tag)) {
+        printf("Failed to allocate the connection table\n");
+        close(server_fd);
+        return false;
+    }
+    if (server->max_connections > 0 || server->max_connections_per_host > 0) {
+        int defer = SERVER_DEFER_ACCEPT_S;
+        setsockopt(server_fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &defer, sizeof(defer));
+    }
 
-        if (client_fd < 0) {
-            printf("Accept failed: %s \n", strerror(errno));
-            return 1;
-        }
+    // every worker runs its own event loop, they share the listening socket
+    if (server->worker_count < 1) server->worker_count = 1;
+    server->workers = pcalloc(server->worker_count, sizeof(ServerWorker), server->tag);
+    if (!server->workers) {
+        printf("Failed to allocate memory for workers\n");
+        admission_free(&server->admission);
+        close(server_fd);
+        return false;
+    }
 
-        // create the InternalRequest struct
-        InternalRequest* request = pmalloc(sizeof(InternalRequest), server->tag);
-        if (!request) {
-            printf("Failed to allocate memory for InternalRequest\n");
-            close(client_fd);
-            return 1;
+    int started = 0;
+    for (int i = 0; i < server->worker_count; i++) {
+        ServerWorker* worker = &server->workers[i];
+        worker->server = server;
+        worker->id = i;
+        worker->stats = shmstats_worker(i);
+        worker->loop = event_loop_new(server->tag);
+        if (!worker->loop) break;
+        // EPOLLEXCLUSIVE wakes a single worker per incoming connection
+        if (!event_loop_add(worker->loop, server_fd, EV_READ, EPOLLEXCLUSIVE, server_on_accept, worker)) {
+            event_loop_free(worker->loop);
+            worker->loop = NULL;
+            break;
         }
-        request->client_fd = client_fd;
-        request->server = server;
-
-        // spawn a thread that calls handle_client_request
-        pthread_t thread;
-        if (pthread_create(&thread, NULL, handle_client_request, request) != 0) {
+        // worker 0 runs on the calling thread
+        if (i > 0 && pthread_create(&worker->thread, NULL, server_worker_run, worker) != 0) {
             printf("Thread creation failed: %s \n", strerror(errno));
-            close(client_fd);
-            return 1;
+            event_loop_free(worker->loop);
+            worker->loop = NULL;
+            break;
         }
+        started++;
+    }
 
-        // Detach the thread to allow it to run independently
-        if (pthread_detach(thread) != 0) {
-            printf("Thread detach failed: %s \n", strerror(errno));
-            close(client_fd);
-            return 1;
-        }
+	printf("Server started on %s:%d with %d workers\n", string_cstr(server->host), server->port, started);
+	printf("Waiting for a client to connect...\n");
+
+    bool ok = started == server->worker_count;
+    if (ok) {
+        server_worker_run(&server->workers[0]);
+    } else {
+        http_server_stop(server);
+    }
+
+    for (int i = 0; i < started; i++) {
+        ServerWorker* worker = &server->workers[i];
+        if (i > 0) pthread_join(worker->thread, NULL);
+        // unhooked before it is freed, http_server_stop may run from a signal handler
+        EventLoop* loop = worker->loop;
+        worker->loop = NULL;
+        event_loop_free(loop);
+        // the segment may be unmapped once we return
+        worker->stats = NULL;
+        while (worker->spare_count > 0) pfree(worker->spare_buffers[--worker->spare_count]);
     }
 
     close(server_fd);
+    server->server_fd = -1;
+    return ok;
+}
+
+bool http_server_stop(HttpServer* server) {
+    if (!server || !server->workers) return false;
+
+    for (int i = 0; i < server->worker_count; i++) {
+        if (server->workers[i].loop) {
+            event_loop_stop(server->workers[i].loop);
+        }
+    }
+    return true;
 }
 
 void http_server_add_builtins(HttpServer* server, bool verbose) {
@@ -229,6 +1069,7 @@ void http_server_add_builtins(HttpServer* server, bool verbose) {
     router_add_route(server->router, "/", HTTP_GET, index_route, true);
 	router_add_route(server->router, "/echo", HTTP_GET, echo_route, false);
 	router_add_route(server->router, "/user-agent", HTTP_GET, user_agent_route, false);
+	router_add_route(server->router, "/bytes", HTTP_GET, bytes_route, false);
 
 	// add built-in layers
 	if (verbose) {
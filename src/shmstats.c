@@ -0,0 +1,309 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "alloc.h"
+#include "shmstats.h"
+
+// a reader that finds a block mid-write this many times in a row takes it as it is,
+// the writer most likely died halfway through
+#define SHMSTATS_READ_RETRIES 10000
+
+static ShmStatsHeader* g_header = NULL;
+static size_t g_size = 0;
+static char g_name[64];
+static pthread_t g_publisher;
+static bool g_publishing = false;
+static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_wake = PTHREAD_COND_INITIALIZER;
+
+static uint64_t shmstats_realtime_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static void shmstats_write_begin(atomic_uint_fast64_t* seq) {
+    atomic_store_explicit(seq, atomic_load_explicit(seq, memory_order_relaxed) + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+}
+
+static void shmstats_write_end(atomic_uint_fast64_t* seq) {
+    atomic_store_explicit(seq, atomic_load_explicit(seq, memory_order_relaxed) + 1, memory_order_release);
+}
+
+static void shmstats_read(const atomic_uint_fast64_t* seq, const void* block, void* copy, size_t size) {
+    atomic_uint_fast64_t* counter = (atomic_uint_fast64_t*)seq;
+    for (int attempt = 0; attempt < SHMSTATS_READ_RETRIES; attempt++) {
+        uint_fast64_t before = atomic_load_explicit(counter, memory_order_acquire);
+        if (before & 1) {
+            sched_yield();
+            continue;
+        }
+        memcpy(copy, block, size);
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(counter, memory_order_relaxed) == before) return;
+    }
+    memcpy(copy, block, size);
+}
+
+// the allocator keeps these totals as blocks come and go, so this only copies them
+static void shmstats_publish(void) {
+    palloc_summary summary;
+    palloc_get_summary(&summary);
+    palloc_stats stats;
+    palloc_get_stats(&stats);
+
+    ShmGlobalStats* global = &g_header->global;
+    shmstats_write_begin(&global->seq);
+    global->updated_ns = shmstats_realtime_ns();
+    global->live_allocations = summary.allocations;
+    global->live_bytes = summary.bytes;
+    global->connection_allocations = summary.connection_allocations;
+    global->connection_bytes = summary.connection_bytes;
+    global->other_allocations = summary.allocations - summary.connection_allocations;
+    global->other_bytes = summary.bytes - summary.connection_bytes;
+    global->total_allocations = stats.allocations;
+    global->total_bytes = stats.bytes;
+    global->total_frees = stats.frees;
+    shmstats_write_end(&global->seq);
+}
+
+static void* shmstats_publisher_run(void* ctx) {
+    (void)ctx;
+    // signals are for the server's own threads
+    sigset_t all;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, NULL);
+
+    pthread_mutex_lock(&g_lock);
+    while (g_publishing) {
+        pthread_mutex_unlock(&g_lock);
+        shmstats_publish();
+        pthread_mutex_lock(&g_lock);
+
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_sec += SHMSTATS_PUBLISH_MS / 1000;
+        until.tv_nsec += (SHMSTATS_PUBLISH_MS % 1000) * 1000000L;
+        if (until.tv_nsec >= 1000000000L) {
+            until.tv_sec++;
+            until.tv_nsec -= 1000000000L;
+        }
+        while (g_publishing && pthread_cond_timedwait(&g_wake, &g_lock, &until) != ETIMEDOUT) {
+        }
+    }
+    pthread_mutex_unlock(&g_lock);
+    return NULL;
+}
+
+bool shmstats_start(int worker_count) {
+    if (g_header || worker_count < 1) return false;
+
+    snprintf(g_name, sizeof(g_name), SHMSTATS_NAME_FORMAT, (int)getpid());
+    shm_unlink(g_name);
+    int fd = shm_open(g_name, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fd < 0) {
+        printf("Failed to create the stats segment %s: %s\n", g_name, strerror(errno));
+        return false;
+    }
+
+    size_t size = sizeof(ShmStatsHeader) + (size_t)worker_count * sizeof(ShmWorkerStats);
+    if (ftruncate(fd, (off_t)size) != 0) {
+        printf("Failed to size the stats segment: %s\n", strerror(errno));
+        close(fd);
+        shm_unlink(g_name);
+        return false;
+    }
+    void* mapped = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED) {
+        printf("Failed to map the stats segment: %s\n", strerror(errno));
+        shm_unlink(g_name);
+        return false;
+    }
+
+    // ftruncate hands back zeroed pages, so every counter already starts at 0
+    g_header = mapped;
+    g_size = size;
+    g_header->version = SHMSTATS_VERSION;
+    g_header->size = (uint32_t)size;
+    g_header->worker_count = (uint32_t)worker_count;
+    g_header->pid = (int32_t)getpid();
+    g_header->started_ns = shmstats_realtime_ns();
+    shmstats_publish();
+    // the magic goes in last, a reader attaching earlier treats the segment as unknown
+    atomic_thread_fence(memory_order_release);
+    memcpy(g_header->magic, SHMSTATS_MAGIC, sizeof(g_header->magic));
+
+    g_publishing = true;
+    if (pthread_create(&g_publisher, NULL, shmstats_publisher_run, NULL) != 0) {
+        printf("Failed to start the stats publisher: %s\n", strerror(errno));
+        g_publishing = false;
+        munmap(g_header, g_size);
+        g_header = NULL;
+        shm_unlink(g_name);
+        return false;
+    }
+    return true;
+}
+
+ShmWorkerStats* shmstats_worker(int id) {
+    if (!g_header || id < 0 || (uint32_t)id >= g_header->worker_count) return NULL;
+    return &g_header->workers[id];
+}
+
+void shmstats_stop(void) {
+    if (!g_header) return;
+
+    pthread_mutex_lock(&g_lock);
+    bool publishing = g_publishing;
+    g_publishing = false;
+    pthread_cond_signal(&g_wake);
+    pthread_mutex_unlock(&g_lock);
+    if (publishing) pthread_join(g_publisher, NULL);
+
+    shm_unlink(g_name);
+    munmap(g_header, g_size);
+    g_header = NULL;
+    g_size = 0;
+}
+
+void shmstats_request(ShmWorkerStats* stats, int status, uint64_t latency_ns) {
+    if (!stats) return;
+
+    uint64_t us = latency_ns / 1000;
+    size_t bucket = us ? (size_t)(64 - __builtin_clzll(us)) : 0;
+    if (bucket >= SHMSTATS_LATENCY_BUCKETS) bucket = SHMSTATS_LATENCY_BUCKETS - 1;
+    int class = status / 100;
+
+    shmstats_write_begin(&stats->seq);
+    stats->requests++;
+    stats->status[class >= 1 && class <= 5 ? class : 0]++;
+    stats->latency[bucket]++;
+    stats->latency_sum_us += us;
+    shmstats_write_end(&stats->seq);
+}
+
+void shmstats_connection(ShmWorkerStats* stats, bool opened) {
+    if (!stats) return;
+
+    shmstats_write_begin(&stats->seq);
+    if (opened) {
+        stats->connections_open++;
+        stats->connections_accepted++;
+    } else {
+        stats->connections_open--;
+    }
+    shmstats_write_end(&stats->seq);
+}
+
+void shmstats_received(ShmWorkerStats* stats, size_t bytes) {
+    if (!stats) return;
+
+    shmstats_write_begin(&stats->seq);
+    stats->bytes_received += bytes;
+    shmstats_write_end(&stats->seq);
+}
+
+void shmstats_buffer(ShmWorkerStats* stats, bool reused) {
+    if (!stats) return;
+
+    shmstats_write_begin(&stats->seq);
+    if (reused) stats->buffer_reuses++;
+    else stats->buffer_allocations++;
+    shmstats_write_end(&stats->seq);
+}
+
+// maps a segment, checking it is complete and laid out the way this build expects
+static const ShmStatsHeader* shmstats_map(const char* name) {
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0) return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(ShmStatsHeader)) {
+        close(fd);
+        return NULL;
+    }
+    const ShmStatsHeader* header = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (header == MAP_FAILED) return NULL;
+
+    atomic_thread_fence(memory_order_acquire);
+    if (memcmp(header->magic, SHMSTATS_MAGIC, sizeof(header->magic)) != 0
+        || header->version != SHMSTATS_VERSION
+        || header->size != (size_t)st.st_size
+        || header->size != sizeof(ShmStatsHeader) + header->worker_count * sizeof(ShmWorkerStats)) {
+        munmap((void*)header, (size_t)st.st_size);
+        return NULL;
+    }
+    return header;
+}
+
+const ShmStatsHeader* shmstats_attach(pid_t pid) {
+    char name[64];
+    if (pid > 0) {
+        snprintf(name, sizeof(name), SHMSTATS_NAME_FORMAT, (int)pid);
+        return shmstats_map(name);
+    }
+
+    // segments of servers that were killed stay behind, only living ones count
+    DIR* dir = opendir(SHMSTATS_DIRECTORY);
+    if (!dir) return NULL;
+    const ShmStatsHeader* newest = NULL;
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        int candidate;
+        char rest;
+        if (sscanf(entry->d_name, "chttp.%d%c", &candidate, &rest) != 1 || candidate <= 0) continue;
+        if (kill(candidate, 0) != 0 && errno == ESRCH) continue;
+        snprintf(name, sizeof(name), SHMSTATS_NAME_FORMAT, candidate);
+        const ShmStatsHeader* header = shmstats_map(name);
+        if (!header) continue;
+        if (!newest || header->started_ns > newest->started_ns) {
+            shmstats_detach(newest);
+            newest = header;
+        } else {
+            shmstats_detach(header);
+        }
+    }
+    closedir(dir);
+    return newest;
+}
+
+void shmstats_detach(const ShmStatsHeader* header) {
+    if (header) munmap((void*)header, header->size);
+}
+
+void shmstats_read_worker(const ShmWorkerStats* stats, ShmWorkerStats* copy) {
+    shmstats_read(&stats->seq, stats, copy, sizeof(*copy));
+}
+
+void shmstats_read_global(const ShmGlobalStats* stats, ShmGlobalStats* copy) {
+    shmstats_read(&stats->seq, stats, copy, sizeof(*copy));
+}
+
+uint64_t shmstats_latency_percentile(const uint64_t latency[SHMSTATS_LATENCY_BUCKETS], double percentile) {
+    uint64_t total = 0;
+    for (size_t i = 0; i < SHMSTATS_LATENCY_BUCKETS; i++) total += latency[i];
+    if (total == 0) return 0;
+
+    uint64_t rank = (uint64_t)(percentile / 100.0 * (double)total + 0.5);
+    if (rank < 1) rank = 1;
+    uint64_t seen = 0;
+    for (size_t i = 0; i < SHMSTATS_LATENCY_BUCKETS; i++) {
+        seen += latency[i];
+        if (seen >= rank) return (uint64_t)1 << i;
+    }
+    return (uint64_t)1 << (SHMSTATS_LATENCY_BUCKETS - 1);
+}
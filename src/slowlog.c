@@ -0,0 +1,315 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include "alloc.h"
+#include "router.h"
+#include "slowlog.h"
+
+typedef struct {
+    char name[64];
+    uint64_t ns;
+    bool ok;
+} SlowLayer;
+
+typedef struct {
+    char name[64];
+    char value[SLOWLOG_TEXT_LEN];
+} SlowHeader;
+
+typedef struct {
+    uint64_t sequence;          // 0 for an unused slot
+    time_t wall_time;
+    char method[16];
+    char target[SLOWLOG_TEXT_LEN];
+    char status[64];
+    uint64_t marks[SLOW_MARKS];
+    SlowLayer layers[SLOWLOG_MAX_LAYERS];
+    size_t layer_count;         // may exceed SLOWLOG_MAX_LAYERS
+    SlowHeader headers[SLOWLOG_MAX_HEADERS];
+    size_t header_count;        // may exceed SLOWLOG_MAX_HEADERS
+    size_t request_bytes;
+    size_t response_bytes;
+    size_t allocated_bytes;     // held by the request's tag when it finished
+} SlowEntry;
+
+static const char* const mark_names[SLOW_MARKS] = {
+    "received", "parse_start", "parse_end", "route_start", "route_end", "layers_end", "queued",
+};
+
+// stages reported for each slow request, as the time between two marks
+static const struct {
+    const char* name;
+    SlowMark from;
+    SlowMark to;
+} stages[] = {
+    { "queue_wait", SLOW_RECEIVED, SLOW_PARSE_START },
+    { "parse", SLOW_PARSE_START, SLOW_PARSE_END },
+    { "pre_route", SLOW_PARSE_END, SLOW_ROUTE_START },
+    { "handler", SLOW_ROUTE_START, SLOW_ROUTE_END },
+    { "post_route", SLOW_ROUTE_END, SLOW_LAYERS_END },
+    { "serialize", SLOW_LAYERS_END, SLOW_QUEUED },
+    { "total", SLOW_RECEIVED, SLOW_QUEUED },
+};
+
+// header names that carry credentials, matched anywhere in the name
+static const char* const redacted_names[] = {
+    "authorization", "cookie", "token", "secret", "password", "api-key", "apikey",
+};
+
+static bool g_enabled = false;
+static uint64_t g_threshold_ns;
+static SlowEntry* g_entries = NULL;
+static uint64_t g_sequence = 0;
+static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
+static atomic_uint_fast64_t g_checked;
+static atomic_uint_fast64_t g_slow;
+
+static _Thread_local SlowTimeline t_timeline;
+
+static uint64_t slowlog_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static void slowlog_copy(char* out, size_t size, const char* text) {
+    size_t len = text ? strnlen(text, size - 1) : 0;
+    if (len) memcpy(out, text, len);
+    out[len] = '\0';
+}
+
+bool slowlog_enable(uint32_t threshold_ms, void* tag) {
+    if (g_enabled) return false;
+
+    g_entries = pcalloc(SLOWLOG_ENTRIES, sizeof(SlowEntry), tag);
+    if (!g_entries) return false;
+    g_threshold_ns = (uint64_t)threshold_ms * 1000000u;
+    g_enabled = true;
+    return true;
+}
+
+bool slowlog_enabled(void) {
+    return g_enabled;
+}
+
+void slowlog_begin(uint64_t received_ns) {
+    if (!g_enabled) return;
+
+    SlowTimeline* timeline = &t_timeline;
+    memset(timeline->marks, 0, sizeof(timeline->marks));
+    timeline->layer_count = 0;
+    timeline->active = true;
+    // without a receive time the request is timed from the start of its parse
+    timeline->marks[SLOW_RECEIVED] = received_ns ? received_ns : slowlog_now_ns();
+}
+
+void slowlog_mark(SlowMark mark) {
+    if (t_timeline.active && mark < SLOW_MARKS) t_timeline.marks[mark] = slowlog_now_ns();
+}
+
+uint64_t slowlog_clock(void) {
+    return t_timeline.active ? slowlog_now_ns() : 0;
+}
+
+void slowlog_layer(const char* name, uint64_t start_ns, bool ok) {
+    SlowTimeline* timeline = &t_timeline;
+    if (!start_ns || !timeline->active) return;
+
+    size_t index = timeline->layer_count++;
+    if (index >= SLOWLOG_MAX_LAYERS) return;
+    timeline->layer_names[index] = name;
+    timeline->layer_ns[index] = slowlog_now_ns() - start_ns;
+    timeline->layer_ok[index] = ok;
+}
+
+static bool slowlog_redacted(const char* name) {
+    for (size_t i = 0; i < sizeof(redacted_names) / sizeof(redacted_names[0]); i++) {
+        if (strcasestr(name, redacted_names[i])) return true;
+    }
+    return false;
+}
+
+void slowlog_end(const HttpRequest* request, const HttpResponse* response, size_t request_bytes,
+                 size_t response_bytes) {
+    SlowTimeline* timeline = &t_timeline;
+    if (!timeline->active) return;
+    timeline->active = false;
+
+    atomic_fetch_add_explicit(&g_checked, 1, memory_order_relaxed);
+    uint64_t now = slowlog_now_ns();
+    if (!timeline->marks[SLOW_QUEUED]) timeline->marks[SLOW_QUEUED] = now;
+    if (now - timeline->marks[SLOW_RECEIVED] < g_threshold_ns) return;
+    atomic_fetch_add_explicit(&g_slow, 1, memory_order_relaxed);
+
+    // measured outside the lock, ptag_size takes the allocator's
+    size_t allocated = ptag_size(request->tag);
+
+    pthread_mutex_lock(&g_lock);
+    SlowEntry* entry = &g_entries[g_sequence % SLOWLOG_ENTRIES];
+    entry->sequence = ++g_sequence;
+    entry->wall_time = time(NULL);
+    slowlog_copy(entry->method, sizeof(entry->method),
+                 http_request_method_to_string(request->request_line.method));
+    slowlog_copy(entry->target, sizeof(entry->target),
+                 request->request_line.target ? string_cstr(request->request_line.target) : "");
+    slowlog_copy(entry->status, sizeof(entry->status), response && response->status ? response->status : "");
+    memcpy(entry->marks, timeline->marks, sizeof(entry->marks));
+
+    entry->layer_count = timeline->layer_count;
+    for (size_t i = 0; i < timeline->layer_count && i < SLOWLOG_MAX_LAYERS; i++) {
+        slowlog_copy(entry->layers[i].name, sizeof(entry->layers[i].name), timeline->layer_names[i]);
+        entry->layers[i].ns = timeline->layer_ns[i];
+        entry->layers[i].ok = timeline->layer_ok[i];
+    }
+
+    entry->header_count = request->headers ? HeaderArray_size(request->headers) : 0;
+    for (size_t i = 0; i < entry->header_count && i < SLOWLOG_MAX_HEADERS; i++) {
+        const Header* header = &request->headers->data[i];
+        const char* name = string_cstr(header->key);
+        slowlog_copy(entry->headers[i].name, sizeof(entry->headers[i].name), name);
+        slowlog_copy(entry->headers[i].value, sizeof(entry->headers[i].value),
+                     slowlog_redacted(name) ? "[redacted]" : string_cstr(header->value));
+    }
+
+    entry->request_bytes = request_bytes;
+    entry->response_bytes = response_bytes;
+    entry->allocated_bytes = allocated;
+    pthread_mutex_unlock(&g_lock);
+}
+
+void slowlog_cancel(void) {
+    t_timeline.active = false;
+}
+
+void slowlog_save(SlowTimeline* saved) {
+    *saved = t_timeline;
+    t_timeline.active = false;
+}
+
+SlowTimeline* slowlog_detach(void* tag) {
+    if (!t_timeline.active) return NULL;
+
+    SlowTimeline* saved = pmalloc(sizeof(SlowTimeline), tag);
+    if (saved) {
+        slowlog_save(saved);
+    } else {
+        // unrecorded rather than ended by whatever request the thread handles next
+        t_timeline.active = false;
+    }
+    return saved;
+}
+
+void slowlog_restore(const SlowTimeline* saved) {
+    if (saved) {
+        t_timeline = *saved;
+    } else {
+        t_timeline.active = false;
+    }
+}
+
+static void slowlog_write_string(FILE* fp, const char* text) {
+    fputc('"', fp);
+    for (const unsigned char* c = (const unsigned char*)text; *c; c++) {
+        if (*c == '"' || *c == '\\') fprintf(fp, "\\%c", *c);
+        else if (*c < 0x20) fprintf(fp, "\\u%04x", *c);
+        else fputc(*c, fp);
+    }
+    fputc('"', fp);
+}
+
+static void slowlog_write_entry(FILE* fp, const SlowEntry* entry) {
+    char when[32];
+    struct tm tm;
+    gmtime_r(&entry->wall_time, &tm);
+    strftime(when, sizeof(when), "%Y-%m-%dT%H:%M:%SZ", &tm);
+
+    fprintf(fp, "{\"sequence\":%llu,\"time\":\"%s\",\"method\":", (unsigned long long)entry->sequence, when);
+    slowlog_write_string(fp, entry->method);
+    fprintf(fp, ",\"target\":");
+    slowlog_write_string(fp, entry->target);
+    fprintf(fp, ",\"status\":");
+    slowlog_write_string(fp, entry->status);
+    fprintf(fp, ",\"request_bytes\":%zu,\"response_bytes\":%zu,\"allocated_bytes\":%zu,",
+            entry->request_bytes, entry->response_bytes, entry->allocated_bytes);
+
+    // a stage whose marks were never set was skipped, e.g. the handler of a refused request
+    fprintf(fp, "\"stages_us\":{");
+    bool first = true;
+    for (size_t i = 0; i < sizeof(stages) / sizeof(stages[0]); i++) {
+        uint64_t from = entry->marks[stages[i].from];
+        uint64_t to = entry->marks[stages[i].to];
+        if (!from || !to || to < from) continue;
+        fprintf(fp, "%s\"%s\":%.3f", first ? "" : ",", stages[i].name, (to - from) / 1e3);
+        first = false;
+    }
+    fprintf(fp, "},\"marks_us\":{");
+    first = true;
+    for (int i = 0; i < SLOW_MARKS; i++) {
+        if (!entry->marks[i]) continue;
+        fprintf(fp, "%s\"%s\":%.3f", first ? "" : ",", mark_names[i],
+                (entry->marks[i] - entry->marks[SLOW_RECEIVED]) / 1e3);
+        first = false;
+    }
+
+    fprintf(fp, "},\"layers\":[");
+    for (size_t i = 0; i < entry->layer_count && i < SLOWLOG_MAX_LAYERS; i++) {
+        fprintf(fp, "%s{\"name\":", i ? "," : "");
+        slowlog_write_string(fp, entry->layers[i].name);
+        fprintf(fp, ",\"us\":%.3f,\"ok\":%s}", entry->layers[i].ns / 1e3, entry->layers[i].ok ? "true" : "false");
+    }
+    fprintf(fp, "],\"layers_dropped\":%zu,\"headers\":[",
+            entry->layer_count > SLOWLOG_MAX_LAYERS ? entry->layer_count - SLOWLOG_MAX_LAYERS : 0);
+    for (size_t i = 0; i < entry->header_count && i < SLOWLOG_MAX_HEADERS; i++) {
+        fputs(i ? ",[" : "[", fp);
+        slowlog_write_string(fp, entry->headers[i].name);
+        fputc(',', fp);
+        slowlog_write_string(fp, entry->headers[i].value);
+        fputc(']', fp);
+    }
+    fprintf(fp, "],\"headers_dropped\":%zu}",
+            entry->header_count > SLOWLOG_MAX_HEADERS ? entry->header_count - SLOWLOG_MAX_HEADERS : 0);
+}
+
+bool slowlog_write_json(FILE* fp) {
+    fprintf(fp, "{\"threshold_ms\":%llu,\"checked\":%llu,\"slow\":%llu,\"requests\":[",
+            (unsigned long long)(g_threshold_ns / 1000000u), (unsigned long long)atomic_load(&g_checked),
+            (unsigned long long)atomic_load(&g_slow));
+
+    pthread_mutex_lock(&g_lock);
+    size_t kept = g_sequence < SLOWLOG_ENTRIES ? (size_t)g_sequence : SLOWLOG_ENTRIES;
+    for (size_t i = 0; i < kept; i++) {
+        if (i) fputc(',', fp);
+        slowlog_write_entry(fp, &g_entries[(g_sequence - 1 - i) % SLOWLOG_ENTRIES]);
+    }
+    pthread_mutex_unlock(&g_lock);
+
+    fprintf(fp, "]}\n");
+    return !ferror(fp);
+}
+
+void slowlog_route(HttpRequest* request, HttpResponse* response) {
+    (void)request;
+    if (!g_enabled) {
+        response->status = HTTP_404;
+        return;
+    }
+
+    char* json = NULL;
+    size_t len = 0;
+    FILE* fp = open_memstream(&json, &len);
+    bool ok = fp && slowlog_write_json(fp);
+    if (fp) fclose(fp);
+
+    http_response_set_body(response, ok ? json : NULL, len, "application/json");
+    free(json);
+}
+
+void slowlog_print_stats(void) {
+    if (!g_enabled) return;
+    printf("Slow requests: %llu of %llu took %llu ms or more\n", (unsigned long long)atomic_load(&g_slow),
+           (unsigned long long)atomic_load(&g_checked), (unsigned long long)(g_threshold_ns / 1000000u));
+}
@@ -0,0 +1,241 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "alloc.h"
+#include "splice.h"
+
+static __thread PipePool* t_pool = NULL;
+
+// every pool ever created, walked for the stats totals
+static PipePool* g_pools = NULL;
+static pthread_mutex_t g_pools_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+PipePool* pipe_pool_get(void) {
+    if (t_pool) return t_pool;
+
+    PipePool* pool = pmalloc(sizeof(PipePool), TAG(&g_pools));
+    if (!pool) return NULL;
+
+    pool->idle = NULL;
+    pool->idle_count = 0;
+    memset(&pool->stats, 0, sizeof(pool->stats));
+
+    pthread_mutex_lock(&g_pools_lock);
+    pool->next = g_pools;
+    g_pools = pool;
+    pthread_mutex_unlock(&g_pools_lock);
+
+    t_pool = pool;
+    return pool;
+}
+
+SplicePipe* pipe_pool_acquire(PipePool* pool) {
+    if (!pool) return NULL;
+
+    if (pool->idle) {
+        SplicePipe* pipe = pool->idle;
+        pool->idle = pipe->next;
+        pool->idle_count--;
+        pipe->next = NULL;
+        return pipe;
+    }
+
+    SplicePipe* pipe = pmalloc(sizeof(SplicePipe), TAG(&g_pools));
+    if (!pipe) return NULL;
+    pipe->buffered = 0;
+    pipe->bounce = NULL;
+    pipe->bounce_off = 0;
+    pipe->next = NULL;
+
+    int fds[2];
+    if (pipe2(fds, O_NONBLOCK | O_CLOEXEC) != 0) {
+        // out of descriptors, this transfer goes through the bounce buffer
+        pipe->read_fd = -1;
+        pipe->write_fd = -1;
+        pipe->capacity = SPLICE_BOUNCE_SIZE;
+        return pipe;
+    }
+
+    pipe->read_fd = fds[0];
+    pipe->write_fd = fds[1];
+    int size = fcntl(fds[1], F_SETPIPE_SZ, SPLICE_PIPE_SIZE);
+    if (size < 0) {
+        size = fcntl(fds[1], F_GETPIPE_SZ);
+    }
+    pipe->capacity = size > 0 ? (size_t)size : 65536;
+    return pipe;
+}
+
+static void splice_pipe_destroy(SplicePipe* pipe) {
+    if (pipe->read_fd >= 0) close(pipe->read_fd);
+    if (pipe->write_fd >= 0) close(pipe->write_fd);
+    if (pipe->bounce) pfree(pipe->bounce);
+    pfree(pipe);
+}
+
+void pipe_pool_release(PipePool* pool, SplicePipe* pipe) {
+    if (!pipe) return;
+
+    // leftover bytes would leak into the next transfer, and bounce pipes aren't real pipes
+    if (!pool || pipe->buffered > 0 || pipe->read_fd < 0 || pipe->bounce
+        || pool->idle_count >= SPLICE_POOL_MAX_IDLE) {
+        splice_pipe_destroy(pipe);
+        return;
+    }
+
+    pipe->next = pool->idle;
+    pool->idle = pipe;
+    pool->idle_count++;
+}
+
+static inline void splice_count(atomic_uint_fast64_t* counter, uint64_t n) {
+    atomic_fetch_add_explicit(counter, n, memory_order_relaxed);
+}
+
+// fills the pipe (or bounce buffer) from the source, returns bytes read
+static ssize_t splice_fill(SplicePipe* pipe, int in_fd, off_t* in_offset, size_t want, SpliceStats* stats) {
+    if (!pipe->bounce) {
+        ssize_t n = splice(in_fd, in_offset, pipe->write_fd, NULL, want, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n >= 0 || (errno != EINVAL && errno != ENOSYS && errno != EBADF)) {
+            return n;
+        }
+
+        // this pair of descriptors can't be spliced, switch to read/write for good
+        pipe->bounce = pmalloc(SPLICE_BOUNCE_SIZE, TAG(&g_pools));
+        if (!pipe->bounce) return -1;
+        if (stats) splice_count(&stats->fallbacks, 1);
+    }
+
+    if (want > SPLICE_BOUNCE_SIZE) want = SPLICE_BOUNCE_SIZE;
+    ssize_t n;
+    if (in_offset) {
+        n = pread(in_fd, pipe->bounce, want, *in_offset);
+        if (n > 0) *in_offset += n;
+    } else {
+        n = read(in_fd, pipe->bounce, want);
+    }
+    pipe->bounce_off = 0;
+    return n;
+}
+
+// delivers parked bytes to the destination, returns bytes written
+static ssize_t splice_drain(SplicePipe* pipe, int out_fd) {
+    if (!pipe->bounce) {
+        return splice(pipe->read_fd, NULL, out_fd, NULL, pipe->buffered, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    }
+
+    ssize_t n = send(out_fd, pipe->bounce + pipe->bounce_off, pipe->buffered, MSG_NOSIGNAL);
+    if (n < 0 && errno == ENOTSOCK) {
+        n = write(out_fd, pipe->bounce + pipe->bounce_off, pipe->buffered);
+    }
+    if (n > 0) pipe->bounce_off += (size_t)n;
+    return n;
+}
+
+ssize_t splice_transfer(SplicePipe* pipe, int in_fd, off_t* in_offset, int out_fd, size_t remaining, SpliceStats* stats) {
+    if (!pipe || in_fd < 0 || out_fd < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    uint64_t start = monotonic_ns();
+    size_t delivered = 0;
+    ssize_t result = 0;
+
+    // a pipe without descriptors only has the bounce buffer to offer
+    if (pipe->read_fd < 0 && !pipe->bounce) {
+        pipe->bounce = pmalloc(SPLICE_BOUNCE_SIZE, TAG(&g_pools));
+        if (!pipe->bounce) return -1;
+        if (stats) splice_count(&stats->fallbacks, 1);
+    }
+
+    while (delivered < remaining) {
+        if (pipe->buffered == 0) {
+            size_t want = remaining - delivered;
+            if (want > pipe->capacity) want = pipe->capacity;
+
+            ssize_t filled = splice_fill(pipe, in_fd, in_offset, want, stats);
+            if (filled < 0) {
+                // a socket source with nothing to read yet, the pipe is left empty
+                if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+                if (errno == EINTR) continue;
+                result = -1;
+                break;
+            }
+            if (filled == 0) {
+                errno = ENODATA; // the source ended early
+                result = -1;
+                break;
+            }
+            pipe->buffered = (size_t)filled;
+        }
+
+        bool bounced = pipe->bounce != NULL;
+        ssize_t drained = splice_drain(pipe, out_fd);
+        if (drained < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            if (errno == EINTR) continue;
+            result = -1;
+            break;
+        }
+
+        pipe->buffered -= (size_t)drained;
+        delivered += (size_t)drained;
+        if (stats) {
+            splice_count(bounced ? &stats->fallback_bytes : &stats->spliced_bytes, (uint64_t)drained);
+        }
+    }
+
+    if (stats) {
+        splice_count(&stats->transfers, 1);
+        splice_count(&stats->busy_ns, monotonic_ns() - start);
+    }
+
+    if (result < 0 && delivered == 0) return -1;
+    return (ssize_t)delivered;
+}
+
+void splice_stats_total(SpliceStats* out) {
+    if (!out) return;
+
+    memset(out, 0, sizeof(*out));
+    pthread_mutex_lock(&g_pools_lock);
+    for (PipePool* pool = g_pools; pool; pool = pool->next) {
+        splice_count(&out->transfers, atomic_load_explicit(&pool->stats.transfers, memory_order_relaxed));
+        splice_count(&out->spliced_bytes, atomic_load_explicit(&pool->stats.spliced_bytes, memory_order_relaxed));
+        splice_count(&out->fallback_bytes, atomic_load_explicit(&pool->stats.fallback_bytes, memory_order_relaxed));
+        splice_count(&out->fallbacks, atomic_load_explicit(&pool->stats.fallbacks, memory_order_relaxed));
+        splice_count(&out->busy_ns, atomic_load_explicit(&pool->stats.busy_ns, memory_order_relaxed));
+    }
+    pthread_mutex_unlock(&g_pools_lock);
+}
+
+void splice_stats_print(void) {
+    SpliceStats stats;
+    splice_stats_total(&stats);
+
+    uint64_t bytes = atomic_load(&stats.spliced_bytes) + atomic_load(&stats.fallback_bytes);
+    double seconds = (double)atomic_load(&stats.busy_ns) / 1e9;
+    printf("\n=== Splice Stats ===\n");
+    printf("Transfers: %llu (%llu fell back to read/write)\n",
+           (unsigned long long)atomic_load(&stats.transfers), (unsigned long long)atomic_load(&stats.fallbacks));
+    printf("Spliced: %llu bytes, read/write: %llu bytes\n",
+           (unsigned long long)atomic_load(&stats.spliced_bytes), (unsigned long long)atomic_load(&stats.fallback_bytes));
+    if (seconds > 0) {
+        printf("Throughput: %.2f MB/s over %.3f s of transfer time\n",
+               (double)bytes / (1024.0 * 1024.0) / seconds, seconds);
+    }
+    printf("=== End Splice Stats ===\n\n");
+}
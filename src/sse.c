@@ -0,0 +1,354 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "alloc.h"
+#include "router.h"
+#include "sse.h"
+#include "utils.h"
+
+static const char sse_heartbeat_chunk[] = "4\r\n: \n\n\r\n";
+
+SseChannel* sse_channel_new(SseSlowPolicy policy, size_t history, void* tag) {
+    SseChannel* channel = pcalloc(1, sizeof(SseChannel), tag);
+    if (!channel) return NULL;
+
+    channel->policy = policy;
+    channel->max_queued = SSE_MAX_QUEUED;
+    channel->history_size = history;
+    channel->tag = tag;
+    pthread_mutex_init(&channel->lock, NULL);
+
+    channel->heartbeat = shared_buffer_new(sse_heartbeat_chunk, sizeof(sse_heartbeat_chunk) - 1, tag);
+    if (history > 0) {
+        channel->history = pcalloc(history, sizeof(SharedBuffer*), tag);
+        channel->history_ids = pcalloc(history, sizeof(uint64_t), tag);
+    }
+    if (!channel->heartbeat || (history > 0 && (!channel->history || !channel->history_ids))) {
+        sse_channel_free(channel);
+        return NULL;
+    }
+    return channel;
+}
+
+void sse_channel_free(SseChannel* channel) {
+    if (!channel) return;
+
+    // the loops, and the heartbeat timers with them, are already gone
+    for (size_t i = 0; i < channel->shard_count; i++) {
+        SseShard* shard = channel->shards[i];
+        for (size_t j = 0; j < shard->count; j++) {
+            pfree(shard->members[j]);
+        }
+        if (shard->members) pfree(shard->members);
+        pthread_mutex_destroy(&shard->lock);
+        pfree(shard);
+    }
+    if (channel->shards) pfree(channel->shards);
+
+    for (size_t i = 0; i < channel->history_count; i++) {
+        shared_buffer_release(channel->history[i]);
+    }
+    if (channel->history) pfree(channel->history);
+    if (channel->history_ids) pfree(channel->history_ids);
+    shared_buffer_release(channel->heartbeat);
+    pthread_mutex_destroy(&channel->lock);
+    pfree(channel);
+}
+
+static bool sse_add_header(HttpResponse* response, const char* key, const char* value) {
+    Header header = { .key = string_new(key, response->tag), .value = string_new(value, response->tag) };
+    if (!header.key || !header.value || !HeaderArray_push(response->headers, header)) {
+        string_free(header.key);
+        string_free(header.value);
+        return false;
+    }
+    return true;
+}
+
+bool sse_response(HttpResponse* response, SseChannel* channel) {
+    if (!response || !channel) return false;
+
+    response->status = HTTP_200;
+    // chunked framing keeps the connection usable for HTTP/1.1 clients and proxies
+    bool ok = sse_add_header(response, "Content-Type", "text/event-stream")
+        && sse_add_header(response, "Cache-Control", "no-cache")
+        && sse_add_header(response, "Transfer-Encoding", "chunked");
+    if (ok) response->sse = channel;
+    return ok;
+}
+
+// queues one event or heartbeat, applying the channel's policy to a subscriber that is behind
+static bool sse_queue(SseChannel* channel, SseSubscriber* subscriber, SharedBuffer* chunk) {
+    if (subscriber->closed) return false;
+
+    if (sendq_pending(subscriber->out) > channel->max_queued) {
+        if (channel->policy == SSE_SLOW_CLOSE) {
+            subscriber->closed = true;
+            atomic_fetch_add_explicit(&channel->closed, 1, memory_order_relaxed);
+            // unset while sse_subscribe replays, its caller checks `closed` instead
+            if (subscriber->notify) subscriber->notify(subscriber->notify_data);
+        } else {
+            subscriber->dropped++;
+            atomic_fetch_add_explicit(&channel->dropped, 1, memory_order_relaxed);
+        }
+        return false;
+    }
+    return sendq_push_shared(subscriber->out, chunk);
+}
+
+// queues what history holds between the subscriber's last event and `before`, with the lock held
+static void sse_replay(SseChannel* channel, SseSubscriber* subscriber, uint64_t before) {
+    for (size_t i = 0; i < channel->history_count; i++) {
+        // oldest first
+        size_t slot = (channel->history_next + channel->history_size - channel->history_count + i) % channel->history_size;
+        uint64_t id = channel->history_ids[slot];
+        if (id <= subscriber->last_id || id >= before) continue;
+        if (!sse_queue(channel, subscriber, channel->history[slot])) return;
+        subscriber->last_id = id;
+    }
+}
+
+// one published event on its way to the subscribers of one shard
+typedef struct {
+    SseShard* shard;
+    SharedBuffer* chunk;
+    uint64_t id;
+} SseDelivery;
+
+// runs on the shard's loop, the only thread that changes its members, so the walk takes
+// no lock and the channel's is only needed to read history
+static void sse_deliver(EventLoop* loop, void* data) {
+    (void)loop;
+    SseDelivery* delivery = data;
+    SseShard* shard = delivery->shard;
+    SseChannel* channel = shard->channel;
+
+    for (size_t i = 0; i < shard->count; i++) {
+        SseSubscriber* subscriber = shard->members[i];
+        if (delivery->id <= subscriber->last_id) continue;
+
+        // a subscriber that skipped events catches up from history first
+        if (subscriber->last_id + 1 < delivery->id) {
+            pthread_mutex_lock(&channel->lock);
+            sse_replay(channel, subscriber, delivery->id);
+            pthread_mutex_unlock(&channel->lock);
+        }
+        if (sse_queue(channel, subscriber, delivery->chunk)) {
+            subscriber->last_id = delivery->id;
+            subscriber->notify(subscriber->notify_data);
+        }
+    }
+
+    shared_buffer_release(delivery->chunk);
+    pfree(delivery);
+}
+
+// appends `data` as one `data:` line per line
+static bool sse_append_data(ByteBuffer* out, const char* data, size_t len) {
+    size_t start = 0;
+    do {
+        size_t end = start;
+        while (end < len && data[end] != '\n') end++;
+        size_t line_len = end - start;
+        if (line_len > 0 && data[start + line_len - 1] == '\r') line_len--;
+
+        if (!byte_buffer_append(out, "data: ", 6) || !byte_buffer_append(out, data + start, line_len)
+            || !byte_buffer_push(out, '\n')) {
+            return false;
+        }
+        start = end + 1;
+    } while (start < len);
+    return true;
+}
+
+uint64_t sse_publish(SseChannel* channel, const char* event, const char* data, size_t len) {
+    if (!channel || (!data && len > 0)) return 0;
+
+    pthread_mutex_lock(&channel->lock);
+    uint64_t id = ++channel->next_id;
+
+    // the whole event as one HTTP chunk, built once for every subscriber
+    char line[96];
+    int line_len = snprintf(line, sizeof(line), "id: %llu\n", (unsigned long long)id);
+    ByteBuffer body;
+    byte_buffer_init(&body, channel->tag);
+    bool ok = byte_buffer_append(&body, line, (size_t)line_len);
+    if (ok && event) {
+        ok = byte_buffer_append(&body, "event: ", 7) && byte_buffer_append(&body, event, strlen(event))
+            && byte_buffer_push(&body, '\n');
+    }
+    ok = ok && sse_append_data(&body, data ? data : "", len) && byte_buffer_push(&body, '\n');
+
+    SharedBuffer* chunk = NULL;
+    if (ok) {
+        char size[24];
+        int size_len = snprintf(size, sizeof(size), "%zx\r\n", body.len);
+        chunk = shared_buffer_new(NULL, (size_t)size_len + body.len + 2, channel->tag);
+        if (chunk) {
+            memcpy(chunk->data, size, (size_t)size_len);
+            memcpy(chunk->data + size_len, body.data, body.len);
+            memcpy(chunk->data + size_len + body.len, "\r\n", 2);
+        }
+    }
+    byte_buffer_free(&body);
+    if (!chunk) {
+        pthread_mutex_unlock(&channel->lock);
+        return 0;
+    }
+
+    if (channel->history_size > 0) {
+        size_t slot = channel->history_next;
+        if (channel->history_count == channel->history_size) {
+            shared_buffer_release(channel->history[slot]);
+        } else {
+            channel->history_count++;
+        }
+        channel->history[slot] = shared_buffer_retain(chunk);
+        channel->history_ids[slot] = id;
+        channel->history_next = (slot + 1) % channel->history_size;
+    }
+    channel->published++;
+
+    // posted under the lock so every loop sees events in id order
+    for (size_t i = 0; i < channel->shard_count; i++) {
+        SseShard* shard = channel->shards[i];
+        pthread_mutex_lock(&shard->lock);
+        bool empty = shard->count == 0;
+        pthread_mutex_unlock(&shard->lock);
+        if (empty) continue;
+
+        SseDelivery* delivery = pmalloc(sizeof(SseDelivery), channel->tag);
+        if (!delivery) continue;
+        delivery->shard = shard;
+        delivery->chunk = shared_buffer_retain(chunk);
+        delivery->id = id;
+        if (!event_loop_post(shard->loop, sse_deliver, delivery)) {
+            shared_buffer_release(chunk);
+            pfree(delivery);
+        }
+    }
+    pthread_mutex_unlock(&channel->lock);
+
+    shared_buffer_release(chunk);
+    return id;
+}
+
+// runs on the shard's loop like sse_deliver, the heartbeat buffer never changes
+static void sse_on_heartbeat(EventLoop* loop, void* data) {
+    (void)loop;
+    SseShard* shard = data;
+    SseChannel* channel = shard->channel;
+
+    for (size_t i = 0; i < shard->count; i++) {
+        SseSubscriber* subscriber = shard->members[i];
+        if (sse_queue(channel, subscriber, channel->heartbeat)) {
+            subscriber->notify(subscriber->notify_data);
+        }
+    }
+}
+
+// the shard for `loop`, created on first use, with the lock held
+static SseShard* sse_shard_get(SseChannel* channel, EventLoop* loop) {
+    for (size_t i = 0; i < channel->shard_count; i++) {
+        if (channel->shards[i]->loop == loop) return channel->shards[i];
+    }
+
+    SseShard** shards = prealloc(channel->shards, (channel->shard_count + 1) * sizeof(SseShard*), channel->tag);
+    if (!shards) return NULL;
+    channel->shards = shards;
+
+    SseShard* shard = pcalloc(1, sizeof(SseShard), channel->tag);
+    if (!shard) return NULL;
+    pthread_mutex_init(&shard->lock, NULL);
+    shard->loop = loop;
+    shard->channel = channel;
+    channel->shards[channel->shard_count++] = shard;
+    return shard;
+}
+
+SseSubscriber* sse_subscribe(SseChannel* channel, EventLoop* loop, SendQueue* out, SseNotifyFn notify,
+                             void* notify_data, const char* last_event_id) {
+    if (!channel || !loop || !out || !notify) return NULL;
+
+    SseSubscriber* subscriber = pcalloc(1, sizeof(SseSubscriber), channel->tag);
+    if (!subscriber) return NULL;
+    subscriber->channel = channel;
+    subscriber->out = out;
+
+    // the channel lock comes first, sse_publish takes them in the same order
+    pthread_mutex_lock(&channel->lock);
+    SseShard* shard = sse_shard_get(channel, loop);
+    if (!shard) {
+        pthread_mutex_unlock(&channel->lock);
+        pfree(subscriber);
+        return NULL;
+    }
+    pthread_mutex_lock(&shard->lock);
+    if (shard->count == shard->capacity) {
+        size_t capacity = shard->capacity ? shard->capacity * 2 : 64;
+        SseSubscriber** members = prealloc(shard->members, capacity * sizeof(SseSubscriber*), channel->tag);
+        if (members) {
+            shard->members = members;
+            shard->capacity = capacity;
+        }
+    }
+    if (shard->count == shard->capacity) {
+        pthread_mutex_unlock(&shard->lock);
+        pthread_mutex_unlock(&channel->lock);
+        pfree(subscriber);
+        return NULL;
+    }
+
+    subscriber->shard = shard;
+    subscriber->index = shard->count;
+    shard->members[shard->count++] = subscriber;
+    pthread_mutex_unlock(&shard->lock);
+    atomic_fetch_add_explicit(&channel->subscribers, 1, memory_order_relaxed);
+    if (!shard->heartbeat) {
+        shard->heartbeat = event_timer_add(loop, SSE_HEARTBEAT_MS, SSE_HEARTBEAT_MS, sse_on_heartbeat, shard);
+    }
+
+    // a reconnecting client gets what it missed, as far as history reaches back
+    subscriber->last_id = channel->next_id;
+    if (last_event_id && *last_event_id) {
+        char* end = NULL;
+        unsigned long long seen = strtoull(last_event_id, &end, 10);
+        if (end && *end == '\0' && seen < channel->next_id) {
+            // left at the last event queued, the next delivery catches up on what didn't fit
+            subscriber->last_id = seen;
+            sse_replay(channel, subscriber, channel->next_id + 1);
+        }
+    }
+    pthread_mutex_unlock(&channel->lock);
+
+    // the caller only learns of the subscriber now, it is told of later events from here on
+    subscriber->notify = notify;
+    subscriber->notify_data = notify_data;
+    return subscriber;
+}
+
+void sse_unsubscribe(SseSubscriber* subscriber) {
+    if (!subscriber) return;
+
+    SseChannel* channel = subscriber->channel;
+    SseShard* shard = subscriber->shard;
+
+    pthread_mutex_lock(&shard->lock);
+    shard->count--;
+    if (subscriber->index != shard->count) {
+        SseSubscriber* moved = shard->members[shard->count];
+        moved->index = subscriber->index;
+        shard->members[subscriber->index] = moved;
+    }
+    bool empty = shard->count == 0;
+    pthread_mutex_unlock(&shard->lock);
+    atomic_fetch_sub_explicit(&channel->subscribers, 1, memory_order_relaxed);
+
+    // the timer belongs to the loop this runs on
+    if (empty && shard->heartbeat) {
+        event_timer_cancel(shard->loop, shard->heartbeat);
+        shard->heartbeat = NULL;
+    }
+
+    pfree(subscriber);
+}
@@ -0,0 +1,169 @@
+// chttp-top, a live view of a server started with --shm-stats
+#define CLI_IMPLEMENTATION
+
+#include <errno.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "cli.h"
+#include "shmstats.h"
+
+// Workers shown one per line, beyond this only the totals are
+#define TOP_MAX_WORKERS 256
+
+typedef struct {
+    ShmWorkerStats workers[TOP_MAX_WORKERS];
+    ShmWorkerStats total;
+    ShmGlobalStats global;
+    uint64_t taken_ns;
+} TopSnapshot;
+
+static uint64_t top_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static void top_add(ShmWorkerStats* total, const ShmWorkerStats* worker) {
+    total->requests += worker->requests;
+    for (size_t i = 0; i < 6; i++) total->status[i] += worker->status[i];
+    for (size_t i = 0; i < SHMSTATS_LATENCY_BUCKETS; i++) total->latency[i] += worker->latency[i];
+    total->latency_sum_us += worker->latency_sum_us;
+    total->connections_open += worker->connections_open;
+    total->connections_accepted += worker->connections_accepted;
+    total->bytes_received += worker->bytes_received;
+    total->buffer_reuses += worker->buffer_reuses;
+    total->buffer_allocations += worker->buffer_allocations;
+}
+
+static void top_take(const ShmStatsHeader* header, uint32_t workers, TopSnapshot* snapshot) {
+    memset(&snapshot->total, 0, sizeof(snapshot->total));
+    for (uint32_t i = 0; i < header->worker_count; i++) {
+        ShmWorkerStats copy;
+        shmstats_read_worker(&header->workers[i], &copy);
+        if (i < workers) snapshot->workers[i] = copy;
+        top_add(&snapshot->total, &copy);
+    }
+    shmstats_read_global(&header->global, &snapshot->global);
+    snapshot->taken_ns = top_now_ns();
+}
+
+static void top_bytes(char* text, size_t size, double bytes) {
+    static const char* const units[] = { "B", "KB", "MB", "GB", "TB" };
+    size_t unit = 0;
+    while (bytes >= 1024.0 && unit < 4) {
+        bytes /= 1024.0;
+        unit++;
+    }
+    snprintf(text, size, unit ? "%.1f%s" : "%.0f%s", bytes, units[unit]);
+}
+
+// one line of what changed between two snapshots of a worker
+static void top_row(const char* name, const ShmWorkerStats* now, const ShmWorkerStats* then, double seconds) {
+    uint64_t latency[SHMSTATS_LATENCY_BUCKETS];
+    for (size_t i = 0; i < SHMSTATS_LATENCY_BUCKETS; i++) latency[i] = now->latency[i] - then->latency[i];
+    uint64_t requests = now->requests - then->requests;
+    uint64_t reuses = now->buffer_reuses - then->buffer_reuses;
+    uint64_t buffers = reuses + now->buffer_allocations - then->buffer_allocations;
+
+    char p50[16], p99[16], received[16], hit[16];
+    if (requests > 0) {
+        snprintf(p50, sizeof(p50), "<%lluus", (unsigned long long)shmstats_latency_percentile(latency, 50.0));
+        snprintf(p99, sizeof(p99), "<%lluus", (unsigned long long)shmstats_latency_percentile(latency, 99.0));
+    } else {
+        snprintf(p50, sizeof(p50), "-");
+        snprintf(p99, sizeof(p99), "-");
+    }
+    top_bytes(received, sizeof(received), (double)(now->bytes_received - then->bytes_received) / seconds);
+    if (buffers > 0) snprintf(hit, sizeof(hit), "%.0f%%", 100.0 * (double)reuses / (double)buffers);
+    else snprintf(hit, sizeof(hit), "-");
+
+    printf("%-7s %9.0f %9s %9s %7llu %7.0f %8llu %6llu %6llu %6llu %9s/s %5s\n", name, (double)requests / seconds, p50,
+           p99, (unsigned long long)now->connections_open,
+           (double)(now->connections_accepted - then->connections_accepted) / seconds,
+           (unsigned long long)(now->status[2] - then->status[2]),
+           (unsigned long long)(now->status[3] - then->status[3]),
+           (unsigned long long)(now->status[4] - then->status[4]),
+           (unsigned long long)(now->status[5] + now->status[0] - then->status[5] - then->status[0]), received, hit);
+}
+
+static void top_render(const ShmStatsHeader* header, uint32_t workers, const TopSnapshot* now,
+                       const TopSnapshot* then, bool clear) {
+    double seconds = (double)(now->taken_ns - then->taken_ns) / 1e9;
+    if (seconds <= 0) seconds = 1e-9;
+
+    if (clear) printf("\033[H\033[2J");
+    struct timespec real;
+    clock_gettime(CLOCK_REALTIME, &real);
+    uint64_t up = ((uint64_t)real.tv_sec * 1000000000u + (uint64_t)real.tv_nsec - header->started_ns) / 1000000000u;
+    printf("chttp %d, %u workers, up %llus, %llu requests\n", header->pid, header->worker_count,
+           (unsigned long long)up, (unsigned long long)now->total.requests);
+    printf("%-7s %9s %9s %9s %7s %7s %8s %6s %6s %6s %11s %5s\n", "worker", "req/s", "p50", "p99", "conns", "new/s",
+           "2xx", "3xx", "4xx", "5xx", "received", "pool");
+    for (uint32_t i = 0; i < workers; i++) {
+        char name[16];
+        snprintf(name, sizeof(name), "%u", i);
+        top_row(name, &now->workers[i], &then->workers[i], seconds);
+    }
+    top_row("total", &now->total, &then->total, seconds);
+
+    char live[16], connection[16], other[16], allocated[16];
+    top_bytes(live, sizeof(live), (double)now->global.live_bytes);
+    top_bytes(connection, sizeof(connection), (double)now->global.connection_bytes);
+    top_bytes(other, sizeof(other), (double)now->global.other_bytes);
+    top_bytes(allocated, sizeof(allocated), (double)now->global.total_bytes);
+    printf("memory  %s in %llu blocks: connections %s (%llu), long-lived %s (%llu); %llu allocations, %s, %llu frees "
+           "since start\n", live, (unsigned long long)now->global.live_allocations, connection,
+           (unsigned long long)now->global.connection_allocations, other,
+           (unsigned long long)now->global.other_allocations, (unsigned long long)now->global.total_allocations,
+           allocated, (unsigned long long)now->global.total_frees);
+    fflush(stdout);
+}
+
+int main(int argc, char** argv) {
+    int pid;
+    int interval_ms;
+    int iterations;
+
+    CLI_BEGIN(options, argc, argv)
+        CLI_INT('p', "pid", pid, 0, "Server to watch, 0 for the most recently started one (default: 0)")
+        CLI_INT('i', "interval", interval_ms, 1000, "Milliseconds between refreshes (default: 1000)")
+        CLI_INT('n', "iterations", iterations, 0, "Refreshes before exiting, 0 to run until interrupted (default: 0)")
+    CLI_END(options);
+
+    if (pid < 0 || interval_ms < 1 || iterations < 0) {
+        printf("Invalid options: need pid >= 0, interval >= 1 and iterations >= 0\n");
+        return 1;
+    }
+
+    const ShmStatsHeader* header = shmstats_attach((pid_t)pid);
+    if (!header) {
+        if (pid > 0) printf("No stats for process %d, was it started with --shm-stats?\n", pid);
+        else printf("No server publishes stats in %s, start one with --shm-stats\n", SHMSTATS_DIRECTORY);
+        return 1;
+    }
+    uint32_t workers = header->worker_count < TOP_MAX_WORKERS ? header->worker_count : TOP_MAX_WORKERS;
+    bool clear = isatty(STDOUT_FILENO);
+
+    static TopSnapshot snapshots[2];
+    top_take(header, workers, &snapshots[0]);
+    for (int frame = 1; iterations == 0 || frame <= iterations; frame++) {
+        struct timespec pause = { .tv_sec = interval_ms / 1000, .tv_nsec = (long)(interval_ms % 1000) * 1000000L };
+        while (nanosleep(&pause, &pause) != 0 && errno == EINTR) {
+        }
+        if (kill(header->pid, 0) != 0 && errno == ESRCH) {
+            printf("Server %d exited\n", header->pid);
+            break;
+        }
+        TopSnapshot* now = &snapshots[frame % 2];
+        top_take(header, workers, now);
+        top_render(header, workers, now, &snapshots[(frame + 1) % 2], clear);
+    }
+
+    shmstats_detach(header);
+    return 0;
+}
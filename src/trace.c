@@ -0,0 +1,217 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "alloc.h"
+#include "router.h"
+#include "trace.h"
+
+typedef struct {
+    const char* name;
+    uint64_t request;
+    uint64_t start_ns;
+    uint64_t end_ns;
+} TraceEvent;
+
+// written only by its own thread, read by whoever dumps the trace
+typedef struct TraceRing {
+    TraceEvent events[TRACE_RING_EVENTS];
+    atomic_uint_fast64_t written; // events ever recorded, the newest is at written - 1
+    int tid;
+    struct TraceRing* next;
+} TraceRing;
+
+static bool g_enabled = false;
+static uint32_t g_sample = 0;
+static String* g_header = NULL;
+static void* g_tag = NULL;
+static atomic_uint_fast64_t g_next_id = 1;
+static atomic_uint_fast64_t g_dumps;
+static int g_signal;
+
+static pthread_mutex_t g_rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static TraceRing* g_rings = NULL;
+
+static _Thread_local TraceRing* t_ring = NULL;
+static _Thread_local uint64_t t_request = 0;
+static _Thread_local uint64_t t_seen = 0;
+
+static uint64_t trace_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+// the calling thread's ring, made on its first span
+static TraceRing* trace_ring(void) {
+    if (t_ring) return t_ring;
+
+    TraceRing* ring = pcalloc(1, sizeof(TraceRing), g_tag);
+    if (!ring) return NULL;
+    ring->tid = (int)gettid();
+    pthread_mutex_lock(&g_rings_lock);
+    ring->next = g_rings;
+    g_rings = ring;
+    pthread_mutex_unlock(&g_rings_lock);
+    t_ring = ring;
+    return ring;
+}
+
+bool trace_enable(uint32_t sample, const char* header, void* tag) {
+    g_tag = tag;
+    g_sample = sample;
+    if (header) {
+        g_header = string_new(header, tag);
+        if (!g_header) return false;
+    }
+    g_enabled = true;
+    return true;
+}
+
+bool trace_enabled(void) {
+    return g_enabled;
+}
+
+uint64_t trace_clock(void) {
+    return g_enabled ? trace_now_ns() : 0;
+}
+
+uint64_t trace_request_begin(const HttpRequest* request) {
+    t_request = 0;
+    if (!g_enabled) return 0;
+
+    bool sampled = g_sample > 0 && t_seen++ % g_sample == 0;
+    if (!sampled && !(g_header && http_request_get_header(request, string_cstr(g_header)))) return 0;
+
+    t_request = atomic_fetch_add_explicit(&g_next_id, 1, memory_order_relaxed);
+    return t_request;
+}
+
+void trace_request_end(void) {
+    t_request = 0;
+}
+
+uint64_t trace_request_swap(uint64_t request) {
+    uint64_t previous = t_request;
+    t_request = request;
+    return previous;
+}
+
+uint64_t trace_start(void) {
+    return t_request ? trace_now_ns() : 0;
+}
+
+void trace_span(const char* name, uint64_t start_ns) {
+    if (start_ns) trace_record(name, t_request, start_ns, trace_now_ns());
+}
+
+void trace_record(const char* name, uint64_t request, uint64_t start_ns, uint64_t end_ns) {
+    if (!g_enabled || !start_ns || !end_ns) return;
+    TraceRing* ring = trace_ring();
+    if (!ring) return;
+
+    uint64_t written = atomic_load_explicit(&ring->written, memory_order_relaxed);
+    ring->events[written % TRACE_RING_EVENTS] = (TraceEvent){
+        .name = name,
+        .request = request,
+        .start_ns = start_ns,
+        .end_ns = end_ns > start_ns ? end_ns : start_ns,
+    };
+    atomic_store_explicit(&ring->written, written + 1, memory_order_release);
+}
+
+static void trace_write_string(FILE* fp, const char* text) {
+    fputc('"', fp);
+    for (const char* c = text; *c; c++) {
+        if (*c == '"' || *c == '\\') fputc('\\', fp);
+        if ((unsigned char)*c >= 0x20) fputc(*c, fp);
+    }
+    fputc('"', fp);
+}
+
+bool trace_write_json(FILE* fp) {
+    int pid = (int)getpid();
+    bool first = true;
+    fprintf(fp, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+
+    pthread_mutex_lock(&g_rings_lock);
+    for (TraceRing* ring = g_rings; ring; ring = ring->next) {
+        fprintf(fp, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"thread %d\"}}",
+                first ? "" : ",", pid, ring->tid, ring->tid);
+        first = false;
+
+        // the owner keeps writing, the oldest slots may be overwritten while this runs
+        // and show up as a newer span, which a debugging aid can live with
+        uint64_t written = atomic_load_explicit(&ring->written, memory_order_acquire);
+        uint64_t from = written > TRACE_RING_EVENTS ? written - TRACE_RING_EVENTS : 0;
+        for (uint64_t i = from; i < written; i++) {
+            TraceEvent event = ring->events[i % TRACE_RING_EVENTS];
+            fprintf(fp, ",{\"name\":");
+            trace_write_string(fp, event.name ? event.name : "?");
+            fprintf(fp, ",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f",
+                    event.request ? "request" : "connection", pid, ring->tid, event.start_ns / 1e3,
+                    (event.end_ns - event.start_ns) / 1e3);
+            if (event.request) fprintf(fp, ",\"args\":{\"request\":%llu}", (unsigned long long)event.request);
+            fputc('}', fp);
+        }
+    }
+    pthread_mutex_unlock(&g_rings_lock);
+
+    fprintf(fp, "]}\n");
+    return !ferror(fp);
+}
+
+void trace_route(HttpRequest* request, HttpResponse* response) {
+    (void)request;
+    char* json = NULL;
+    size_t len = 0;
+    FILE* fp = open_memstream(&json, &len);
+    bool ok = fp && trace_write_json(fp);
+    if (fp) fclose(fp);
+
+    http_response_set_body(response, ok ? json : NULL, len, "application/json");
+    free(json);
+}
+
+static void* trace_signal_thread(void* arg) {
+    (void)arg;
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, g_signal);
+
+    while (true) {
+        int signum = 0;
+        if (sigwait(&set, &signum) != 0) continue;
+
+        char path[64];
+        snprintf(path, sizeof(path), "chttp-trace-%d-%llu.json", (int)getpid(),
+                 (unsigned long long)atomic_fetch_add(&g_dumps, 1));
+        FILE* fp = fopen(path, "w");
+        if (!fp) {
+            printf("Failed to open %s: %s\n", path, strerror(errno));
+            continue;
+        }
+        bool ok = trace_write_json(fp);
+        ok = fclose(fp) == 0 && ok;
+        printf(ok ? "Trace written to %s\n" : "Failed to write the trace to %s\n", path);
+    }
+    return NULL;
+}
+
+bool trace_dump_on_signal(int signum) {
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, signum);
+    if (pthread_sigmask(SIG_BLOCK, &set, NULL) != 0) return false;
+
+    g_signal = signum;
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, trace_signal_thread, NULL) != 0) return false;
+    pthread_detach(thread);
+    return true;
+}
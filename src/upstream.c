@@ -0,0 +1,681 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/un.h>
+#include "alloc.h"
+#include "upstream.h"
+
+ARRAY_DEFINE(Upstream*, UpstreamPtrArray)
+ARRAY_DEFINE(HashPoint, HashPointArray)
+
+// this worker's idle connections, for every upstream
+static __thread UpstreamConn* t_idle = NULL;
+
+// the health check thread, shared by every group
+static struct {
+    EventLoop* loop;
+    pthread_t thread;
+    bool running;
+} g_health;
+
+static uint64_t monotonic_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000u + (uint64_t)ts.tv_nsec / 1000000u;
+}
+
+static bool upstream_resolve(Upstream* upstream, const char* address) {
+    memset(&upstream->addr, 0, sizeof(upstream->addr));
+
+    if (strncmp(address, "unix:", 5) == 0) {
+        const char* path = address + 5;
+        struct sockaddr_un* un = (struct sockaddr_un*)&upstream->addr;
+        if (strlen(path) == 0 || strlen(path) >= sizeof(un->sun_path)) {
+            printf("Invalid unix socket path: %s\n", path);
+            return false;
+        }
+        un->sun_family = AF_UNIX;
+        strcpy(un->sun_path, path);
+        upstream->addr_len = sizeof(struct sockaddr_un);
+        return true;
+    }
+
+    // split "host:port", the host may be a bracketed IPv6 literal
+    char host[256];
+    const char* port = strrchr(address, ':');
+    if (!port || port == address || (size_t)(port - address) >= sizeof(host)) {
+        printf("Invalid upstream address, expected host:port: %s\n", address);
+        return false;
+    }
+    const char* host_start = address;
+    size_t host_len = (size_t)(port - address);
+    if (host_start[0] == '[' && host_len >= 2 && host_start[host_len - 1] == ']') {
+        host_start++;
+        host_len -= 2;
+    }
+    memcpy(host, host_start, host_len);
+    host[host_len] = '\0';
+    port++;
+
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+    struct addrinfo* result = NULL;
+    int err = getaddrinfo(host, port, &hints, &result);
+    if (err != 0 || !result) {
+        printf("Failed to resolve upstream %s: %s\n", address, gai_strerror(err));
+        return false;
+    }
+
+    memcpy(&upstream->addr, result->ai_addr, result->ai_addrlen);
+    upstream->addr_len = result->ai_addrlen;
+    freeaddrinfo(result);
+    return true;
+}
+
+Upstream* upstream_new(const char* address, void* tag) {
+    if (!address) return NULL;
+
+    Upstream* upstream = pmalloc(sizeof(Upstream), tag);
+    if (!upstream) return NULL;
+
+    if (!upstream_resolve(upstream, address)) {
+        pfree(upstream);
+        return NULL;
+    }
+
+    upstream->address = string_new(address, tag);
+    upstream->connect_timeout_ms = UPSTREAM_CONNECT_TIMEOUT_MS;
+    upstream->io_timeout_ms = UPSTREAM_IO_TIMEOUT_MS;
+    atomic_init(&upstream->inflight, 0);
+    atomic_init(&upstream->latency_us, 0);
+    atomic_init(&upstream->latency_at, 0);
+    atomic_init(&upstream->requests, 0);
+    atomic_init(&upstream->failures, 0);
+    atomic_init(&upstream->consecutive_failures, 0);
+    atomic_init(&upstream->ejected_until, 0);
+    atomic_init(&upstream->healthy, true);
+    return upstream;
+}
+
+void upstream_free(Upstream* upstream) {
+    if (!upstream) return;
+
+    string_free(upstream->address);
+    pfree(upstream);
+}
+
+static void upstream_conn_destroy(UpstreamConn* conn) {
+    close(conn->fd);
+    pfree(conn->buf);
+    pfree(conn);
+}
+
+int upstream_dial(Upstream* upstream, bool* in_progress) {
+    if (!upstream || !in_progress) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    int fd = socket(upstream->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    if (upstream->addr.ss_family != AF_UNIX) {
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+
+    *in_progress = false;
+    if (connect(fd, (struct sockaddr*)&upstream->addr, upstream->addr_len) != 0) {
+        if (errno != EINPROGRESS) {
+            int saved = errno;
+            close(fd);
+            errno = saved;
+            return -1;
+        }
+        *in_progress = true;
+    }
+    return fd;
+}
+
+// waits up to `timeout_ms` for `fd` to become ready for `events`, ETIMEDOUT if it doesn't
+static bool upstream_wait(int fd, short events, int timeout_ms) {
+    struct pollfd pfd = { .fd = fd, .events = events };
+    int ready;
+    do {
+        ready = poll(&pfd, 1, timeout_ms);
+    } while (ready < 0 && errno == EINTR);
+
+    if (ready == 0) errno = ETIMEDOUT;
+    return ready > 0;
+}
+
+static UpstreamConn* upstream_conn_new(Upstream* upstream, int fd, int io_timeout_ms) {
+    UpstreamConn* conn = pmalloc(sizeof(UpstreamConn), TAG(&t_idle));
+    char* buf = pmalloc(UPSTREAM_BUFFER_SIZE, TAG(&t_idle));
+    if (!conn || !buf) {
+        if (conn) pfree(conn);
+        if (buf) pfree(buf);
+        close(fd);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    conn->upstream = upstream;
+    conn->fd = fd;
+    conn->io_timeout_ms = io_timeout_ms;
+    conn->buf = buf;
+    conn->len = 0;
+    conn->cap = UPSTREAM_BUFFER_SIZE;
+    conn->reused = false;
+    conn->keep_alive = false;
+    conn->idle_since = 0;
+    conn->next = NULL;
+    return conn;
+}
+
+static UpstreamConn* upstream_connect(Upstream* upstream, int io_timeout_ms) {
+    bool in_progress = false;
+    int fd = upstream_dial(upstream, &in_progress);
+    if (fd < 0) return NULL;
+
+    if (in_progress) {
+        int err = 0;
+        socklen_t err_len = sizeof(err);
+        if (!upstream_wait(fd, POLLOUT, upstream->connect_timeout_ms)) {
+            err = errno;
+        } else if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &err_len) != 0) {
+            err = errno;
+        }
+        if (err != 0) {
+            close(fd);
+            errno = err;
+            return NULL;
+        }
+    }
+    return upstream_conn_new(upstream, fd, io_timeout_ms);
+}
+
+// a pooled connection is only worth reusing if the peer hasn't closed or written to it
+static bool upstream_conn_alive(UpstreamConn* conn, uint64_t now) {
+    if (now - conn->idle_since > UPSTREAM_IDLE_TIMEOUT_MS) return false;
+
+    char byte;
+    ssize_t n = recv(conn->fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+    return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+// the freshest live pooled connection to `upstream`, dead ones are closed on the way
+static UpstreamConn* upstream_pooled(Upstream* upstream) {
+    uint64_t now = monotonic_ms();
+    UpstreamConn** link = &t_idle;
+    while (*link) {
+        UpstreamConn* conn = *link;
+        if (conn->upstream != upstream) {
+            link = &conn->next;
+            continue;
+        }
+
+        *link = conn->next;
+        conn->next = NULL;
+        if (upstream_conn_alive(conn, now)) {
+            conn->reused = true;
+            return conn;
+        }
+        upstream_conn_destroy(conn);
+    }
+    return NULL;
+}
+
+UpstreamConn* upstream_acquire(Upstream* upstream) {
+    if (!upstream) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    UpstreamConn* conn = upstream_pooled(upstream);
+    return conn ? conn : upstream_connect(upstream, upstream->io_timeout_ms);
+}
+
+UpstreamConn* upstream_take(Upstream* upstream, bool* connecting) {
+    if (!upstream || !connecting) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    *connecting = false;
+    UpstreamConn* conn = upstream_pooled(upstream);
+    if (conn) return conn;
+
+    int fd = upstream_dial(upstream, connecting);
+    if (fd < 0) return NULL;
+    return upstream_conn_new(upstream, fd, upstream->io_timeout_ms);
+}
+
+void upstream_release(UpstreamConn* conn, bool reusable) {
+    if (!conn) return;
+
+    size_t idle = 0;
+    for (UpstreamConn* other = t_idle; other; other = other->next) {
+        if (other->upstream == conn->upstream) idle++;
+    }
+
+    if (!reusable || conn->len > 0 || idle >= UPSTREAM_POOL_MAX_IDLE) {
+        upstream_conn_destroy(conn);
+        return;
+    }
+
+    // most recently used first, it is the least likely to have been closed
+    conn->idle_since = monotonic_ms();
+    conn->next = t_idle;
+    t_idle = conn;
+}
+
+ssize_t upstream_recv(UpstreamConn* conn) {
+    if (!conn) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (conn->len == conn->cap) {
+        char* grown = prealloc(conn->buf, conn->cap * 2, TAG(&t_idle));
+        if (!grown) {
+            errno = ENOMEM;
+            return -1;
+        }
+        conn->buf = grown;
+        conn->cap *= 2;
+    }
+
+    ssize_t n;
+    do {
+        n = recv(conn->fd, conn->buf + conn->len, conn->cap - conn->len, 0);
+    } while (n < 0 && errno == EINTR);
+
+    if (n > 0) conn->len += (size_t)n;
+    return n;
+}
+
+ssize_t upstream_fill(UpstreamConn* conn) {
+    while (true) {
+        ssize_t n = upstream_recv(conn);
+        if (n >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) return n;
+        if (!upstream_wait(conn->fd, POLLIN, conn->io_timeout_ms)) return -1;
+    }
+}
+
+void upstream_consume(UpstreamConn* conn, size_t n) {
+    if (!conn) return;
+
+    if (n >= conn->len) {
+        conn->len = 0;
+        return;
+    }
+    memmove(conn->buf, conn->buf + n, conn->len - n);
+    conn->len -= n;
+}
+
+ssize_t upstream_send(UpstreamConn* conn, struct iovec** iov, int* count) {
+    if (!conn || !iov || !count) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    struct msghdr msg = { .msg_iov = *iov, .msg_iovlen = (size_t)*count };
+    ssize_t n;
+    do {
+        n = sendmsg(conn->fd, &msg, MSG_NOSIGNAL);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0) return -1;
+
+    // skip past what was written
+    size_t written = (size_t)n;
+    while (*count > 0 && written >= (*iov)->iov_len) {
+        written -= (*iov)->iov_len;
+        (*iov)++;
+        (*count)--;
+    }
+    if (*count > 0) {
+        (*iov)->iov_base = (char*)(*iov)->iov_base + written;
+        (*iov)->iov_len -= written;
+    }
+    return n;
+}
+
+bool upstream_write(UpstreamConn* conn, struct iovec* iov, int count) {
+    if (!conn || !iov) {
+        errno = EINVAL;
+        return false;
+    }
+
+    while (count > 0) {
+        if (upstream_send(conn, &iov, &count) >= 0) continue;
+        if (errno != EAGAIN && errno != EWOULDBLOCK) return false;
+        if (!upstream_wait(conn->fd, POLLOUT, conn->io_timeout_ms)) return false;
+    }
+    return true;
+}
+
+// FNV-1a plus a murmur3 finalizer. Keys often differ only in their last bytes,
+// which plain FNV leaves clustered in the low bits.
+static uint32_t upstream_hash(const char* data, size_t len) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (uint8_t)data[i];
+        hash *= 16777619u;
+    }
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6bu;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35u;
+    hash ^= hash >> 16;
+    return hash;
+}
+
+static int hash_point_compare(const void* a, const void* b) {
+    uint32_t x = ((const HashPoint*)a)->hash;
+    uint32_t y = ((const HashPoint*)b)->hash;
+    return x < y ? -1 : x > y;
+}
+
+UpstreamGroup* upstream_group_new(BalancePolicy policy, const char* hash_header, void* tag) {
+    if (policy == BALANCE_HASH_HEADER && !hash_header) return NULL;
+
+    UpstreamGroup* group = pmalloc(sizeof(UpstreamGroup), tag);
+    if (!group) return NULL;
+
+    if (!UpstreamPtrArray_init(&group->upstreams, tag) || !HashPointArray_init(&group->ring, tag)) {
+        pfree(group);
+        return NULL;
+    }
+    group->policy = policy;
+    group->hash_header = hash_header ? string_new(hash_header, tag) : NULL;
+    atomic_init(&group->cursor, 0);
+    group->probe_path = NULL;
+    group->probe_interval_ms = UPSTREAM_PROBE_INTERVAL_MS;
+    group->tag = tag;
+    return group;
+}
+
+void upstream_group_free(UpstreamGroup* group) {
+    if (!group) return;
+
+    for (size_t i = 0; i < group->upstreams.size; i++) {
+        upstream_free(group->upstreams.data[i]);
+    }
+    UpstreamPtrArray_destroy(&group->upstreams);
+    HashPointArray_destroy(&group->ring);
+    string_free(group->hash_header);
+    string_free(group->probe_path);
+    pfree(group);
+}
+
+Upstream* upstream_group_add(UpstreamGroup* group, const char* address) {
+    if (!group || !address) return NULL;
+
+    Upstream* upstream = upstream_new(address, group->tag);
+    if (!upstream) return NULL;
+    if (!UpstreamPtrArray_push(&group->upstreams, upstream)) {
+        upstream_free(upstream);
+        return NULL;
+    }
+
+    // each upstream owns many small arcs of the ring so removals reshuffle little
+    char point[300];
+    for (int i = 0; i < UPSTREAM_HASH_VNODES; i++) {
+        int len = snprintf(point, sizeof(point), "%s#%d", address, i);
+        HashPoint hash_point = { .hash = upstream_hash(point, (size_t)len), .upstream = upstream };
+        HashPointArray_push(&group->ring, hash_point);
+    }
+    qsort(group->ring.data, group->ring.size, sizeof(HashPoint), hash_point_compare);
+    return upstream;
+}
+
+bool upstream_policy_parse(const char* text, BalancePolicy* policy, const char** header) {
+    if (!text || !policy) return false;
+
+    if (header) *header = NULL;
+    if (strcmp(text, "round-robin") == 0) {
+        *policy = BALANCE_ROUND_ROBIN;
+    } else if (strcmp(text, "least") == 0) {
+        *policy = BALANCE_LEAST_OUTSTANDING;
+    } else if (strcmp(text, "hash-path") == 0) {
+        *policy = BALANCE_HASH_PATH;
+    } else if (strncmp(text, "hash-header:", 12) == 0 && text[12] != '\0') {
+        *policy = BALANCE_HASH_HEADER;
+        if (header) *header = text + 12;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+static bool upstream_available(Upstream* upstream, Upstream* skip, uint64_t now) {
+    return upstream != skip && atomic_load(&upstream->healthy) && atomic_load(&upstream->ejected_until) <= now;
+}
+
+static Upstream* upstream_pick_hashed(UpstreamGroup* group, const char* key, size_t key_len, Upstream* skip,
+                                      uint64_t now) {
+    uint32_t hash = upstream_hash(key, key_len);
+
+    // first point clockwise from the key
+    size_t lo = 0;
+    size_t hi = group->ring.size;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (group->ring.data[mid].hash < hash) lo = mid + 1;
+        else hi = mid;
+    }
+
+    for (size_t i = 0; i < group->ring.size; i++) {
+        Upstream* upstream = group->ring.data[(lo + i) % group->ring.size].upstream;
+        if (upstream_available(upstream, skip, now)) return upstream;
+    }
+    return group->ring.data[lo % group->ring.size].upstream;
+}
+
+Upstream* upstream_group_pick(UpstreamGroup* group, const char* key, size_t key_len, Upstream* skip) {
+    if (!group || group->upstreams.size == 0) return NULL;
+
+    size_t count = group->upstreams.size;
+    uint64_t now = monotonic_ms();
+    if (count == 1) {
+        // with nothing to fall back on, a down upstream is reported instead of tried
+        Upstream* only = group->upstreams.data[0];
+        return upstream_available(only, skip, now) ? only : NULL;
+    }
+
+    bool hashed = group->policy == BALANCE_HASH_PATH || group->policy == BALANCE_HASH_HEADER;
+    if (hashed && key) {
+        return upstream_pick_hashed(group, key, key_len, skip, now);
+    }
+
+    // rotate the starting point so ties spread out
+    uint32_t start = atomic_fetch_add(&group->cursor, 1);
+    if (group->policy == BALANCE_LEAST_OUTSTANDING) {
+        Upstream* best = NULL;
+        uint64_t best_score = UINT64_MAX;
+        for (size_t i = 0; i < count; i++) {
+            Upstream* upstream = group->upstreams.data[(start + i) % count];
+            if (!upstream_available(upstream, skip, now)) continue;
+
+            // a slow instance needs fewer requests in flight to look busy
+            uint64_t latency = atomic_load(&upstream->latency_us);
+            uint64_t idle = (now - atomic_load(&upstream->latency_at)) / UPSTREAM_LATENCY_DECAY_MS;
+            latency = idle >= 64 ? 0 : latency >> idle;
+            uint64_t score = (atomic_load(&upstream->inflight) + 1) * (latency > 0 ? latency : 1);
+            if (score < best_score) {
+                best = upstream;
+                best_score = score;
+            }
+        }
+        if (best) return best;
+    } else {
+        for (size_t i = 0; i < count; i++) {
+            Upstream* upstream = group->upstreams.data[(start + i) % count];
+            if (upstream_available(upstream, skip, now)) return upstream;
+        }
+    }
+
+    // everything is down, failing open beats refusing every request, but not by going
+    // straight back to the upstream that just failed
+    Upstream* fallback = group->upstreams.data[start % count];
+    return fallback != skip ? fallback : group->upstreams.data[(start + 1) % count];
+}
+
+void upstream_begin(Upstream* upstream) {
+    if (!upstream) return;
+    atomic_fetch_add(&upstream->inflight, 1);
+}
+
+void upstream_end(Upstream* upstream, bool ok, uint64_t latency_us) {
+    if (!upstream) return;
+
+    atomic_fetch_sub(&upstream->inflight, 1);
+    atomic_fetch_add(&upstream->requests, 1);
+
+    if (ok) {
+        atomic_store(&upstream->consecutive_failures, 0);
+        if (latency_us > 0) {
+            // moving average with a 1/8 weight for the new sample, racy updates only lose samples
+            uint64_t average = atomic_load(&upstream->latency_us);
+            average = average == 0 ? latency_us : average - average / 8 + latency_us / 8;
+            atomic_store(&upstream->latency_us, average);
+            atomic_store(&upstream->latency_at, monotonic_ms());
+        }
+        return;
+    }
+
+    atomic_fetch_add(&upstream->failures, 1);
+    uint32_t failures = atomic_fetch_add(&upstream->consecutive_failures, 1) + 1;
+    if (failures >= UPSTREAM_EJECT_FAILURES) {
+        atomic_store(&upstream->ejected_until, monotonic_ms() + UPSTREAM_EJECT_MS);
+        printf("Ejecting upstream %s for %d ms after %u consecutive failures\n",
+               string_cstr(upstream->address), UPSTREAM_EJECT_MS, failures);
+    }
+}
+
+bool upstream_group_set_probe(UpstreamGroup* group, const char* path, uint32_t interval_ms) {
+    if (!group || !path || path[0] != '/') return false;
+
+    string_free(group->probe_path);
+    group->probe_path = string_new(path, group->tag);
+    group->probe_interval_ms = interval_ms > 0 ? interval_ms : UPSTREAM_PROBE_INTERVAL_MS;
+    return group->probe_path != NULL;
+}
+
+// one GET on a fresh connection, healthy on 2xx or 3xx
+static bool upstream_probe(Upstream* upstream, const String* path) {
+    UpstreamConn* conn = upstream_connect(upstream, UPSTREAM_PROBE_TIMEOUT_MS);
+    if (!conn) return false;
+
+    const char* host = upstream->addr.ss_family == AF_UNIX ? "localhost" : string_cstr(upstream->address);
+    char request[1024];
+    int len = snprintf(request, sizeof(request),
+                       "GET %s HTTP/1.1\r\nHost: %s\r\nUser-Agent: chttp-health\r\nConnection: close\r\n\r\n",
+                       string_cstr(path), host);
+    bool ok = len > 0 && (size_t)len < sizeof(request);
+
+    struct iovec iov = { .iov_base = request, .iov_len = (size_t)len };
+    ok = ok && upstream_write(conn, &iov, 1);
+    while (ok && !memchr(conn->buf, '\n', conn->len)) {
+        ok = conn->len < 1024 && upstream_fill(conn) > 0;
+    }
+
+    // "HTTP/1.1 200 OK"
+    int status = 0;
+    if (ok && conn->len >= 12 && strncmp(conn->buf, "HTTP/1.", 7) == 0) {
+        status = atoi(conn->buf + 9);
+    }
+    upstream_conn_destroy(conn);
+    return status >= 200 && status < 400;
+}
+
+static void upstream_probe_group(EventLoop* loop, void* data) {
+    (void)loop;
+    UpstreamGroup* group = data;
+
+    for (size_t i = 0; i < group->upstreams.size; i++) {
+        Upstream* upstream = group->upstreams.data[i];
+        bool healthy = upstream_probe(upstream, group->probe_path);
+        bool was = atomic_exchange(&upstream->healthy, healthy);
+        if (healthy && !was) {
+            // a passing probe also lifts a passive ejection
+            atomic_store(&upstream->consecutive_failures, 0);
+            atomic_store(&upstream->ejected_until, 0);
+            printf("Upstream %s passed its health check\n", string_cstr(upstream->address));
+        } else if (!healthy && was) {
+            printf("Upstream %s failed its health check\n", string_cstr(upstream->address));
+        }
+    }
+}
+
+static void* upstream_health_run(void* arg) {
+    event_loop_run(arg);
+    return NULL;
+}
+
+bool upstream_health_start(UpstreamGroup** groups, size_t count, void* tag) {
+    if (g_health.running) return true;
+
+    size_t probed = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (groups[i] && groups[i]->probe_path) probed++;
+    }
+    if (probed == 0) return true;
+
+    g_health.loop = event_loop_new(tag);
+    if (!g_health.loop) return false;
+
+    for (size_t i = 0; i < count; i++) {
+        UpstreamGroup* group = groups[i];
+        if (!group || !group->probe_path) continue;
+        // probe right away, then on the interval
+        if (!event_timer_add(g_health.loop, 0, group->probe_interval_ms, upstream_probe_group, group)) {
+            event_loop_free(g_health.loop);
+            g_health.loop = NULL;
+            return false;
+        }
+    }
+
+    if (pthread_create(&g_health.thread, NULL, upstream_health_run, g_health.loop) != 0) {
+        printf("Failed to start the health check thread: %s\n", strerror(errno));
+        event_loop_free(g_health.loop);
+        g_health.loop = NULL;
+        return false;
+    }
+    g_health.running = true;
+    return true;
+}
+
+void upstream_health_stop(void) {
+    if (!g_health.running) return;
+
+    event_loop_stop(g_health.loop);
+    pthread_join(g_health.thread, NULL);
+    event_loop_free(g_health.loop); // frees the probe timers
+    g_health.loop = NULL;
+    g_health.running = false;
+}
+
+void upstream_group_print(UpstreamGroup* group) {
+    if (!group) return;
+
+    uint64_t now = monotonic_ms();
+    for (size_t i = 0; i < group->upstreams.size; i++) {
+        Upstream* upstream = group->upstreams.data[i];
+        printf("Upstream %s: %llu requests, %llu failures, %u in flight, %llu us average, %s\n",
+               string_cstr(upstream->address),
+               (unsigned long long)atomic_load(&upstream->requests),
+               (unsigned long long)atomic_load(&upstream->failures),
+               atomic_load(&upstream->inflight),
+               (unsigned long long)atomic_load(&upstream->latency_us),
+               !atomic_load(&upstream->healthy) ? "unhealthy"
+                   : atomic_load(&upstream->ejected_until) > now ? "ejected" : "up");
+    }
+}
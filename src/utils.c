@@ -1,9 +1,13 @@
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <zlib.h>
+#include <netinet/in.h>
 
+#include "alloc.h"
+#include "probes.h"
 #include "utils.h"
 
 
@@ -78,6 +82,259 @@ size_t gzip_string(String* str, uint8_t** out_ptr) {
 
     size_t compressed_size = z.total_out;
     deflateEnd(&z);
+    CHTTP_PROBE2(gzip, string_byte_length(str), compressed_size);
 
     return compressed_size;
 }
+
+// one inflate stream and output chunk per thread, kept for the thread's lifetime
+typedef struct {
+    z_stream z;
+    uint8_t out[INFLATE_CHUNK];
+} InflateContext;
+
+static pthread_key_t inflate_key;
+static pthread_once_t inflate_key_once = PTHREAD_ONCE_INIT;
+
+static void inflate_context_free(void* data) {
+    InflateContext* context = data;
+    inflateEnd(&context->z);
+    free(context);
+}
+
+static void inflate_key_create(void) {
+    pthread_key_create(&inflate_key, inflate_context_free);
+}
+
+static InflateContext* inflate_context(void) {
+    pthread_once(&inflate_key_once, inflate_key_create);
+    InflateContext* context = pthread_getspecific(inflate_key);
+    if (context) {
+        inflateReset(&context->z);
+        return context;
+    }
+
+    // plain malloc: the context outlives any allocation tag and zlib allocates its window the same way
+    context = calloc(1, sizeof(InflateContext));
+    if (!context) return NULL;
+    // 32 + MAX_WBITS detects gzip or zlib from the header
+    if (inflateInit2(&context->z, 32 + MAX_WBITS) != Z_OK) {
+        free(context);
+        return NULL;
+    }
+    pthread_setspecific(inflate_key, context);
+    return context;
+}
+
+InflateStatus inflate_stream(const uint8_t* data, size_t len, size_t max_len, InflateChunkFn fn, void* ctx) {
+    if ((!data && len > 0) || !fn) return INFLATE_CORRUPT;
+
+    InflateContext* context = inflate_context();
+    if (!context) return INFLATE_STOPPED;
+
+    z_stream* z = &context->z;
+    z->next_in = (Bytef*)data;
+    z->avail_in = (uInt)len;
+    size_t total = 0;
+
+    while (true) {
+        z->next_out = context->out;
+        z->avail_out = sizeof(context->out);
+        int ret = inflate(z, Z_NO_FLUSH);
+        if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) return INFLATE_CORRUPT;
+
+        size_t produced = sizeof(context->out) - z->avail_out;
+        total += produced;
+        if (total > max_len) return INFLATE_TOO_LARGE;
+        if (produced > 0 && !fn(context->out, produced, ctx)) return INFLATE_STOPPED;
+
+        if (ret == Z_STREAM_END) {
+            if (z->avail_in == 0) return INFLATE_OK;
+            // gzip allows several members back to back
+            inflateReset(z);
+        } else if (produced == 0 && z->avail_in == 0) {
+            return INFLATE_CORRUPT; // input ended mid-stream
+        } else if (ret == Z_BUF_ERROR && produced == 0) {
+            return INFLATE_CORRUPT;
+        }
+    }
+}
+
+void byte_buffer_init(ByteBuffer* buffer, void* tag) {
+    if (!buffer) return;
+
+    buffer->data = NULL;
+    buffer->len = 0;
+    buffer->cap = 0;
+    buffer->tag = tag;
+}
+
+void byte_buffer_free(ByteBuffer* buffer) {
+    if (!buffer) return;
+
+    if (buffer->data) pfree(buffer->data);
+    buffer->data = NULL;
+    buffer->len = 0;
+    buffer->cap = 0;
+}
+
+// makes room for `len` more bytes without changing the contents
+bool byte_buffer_reserve(ByteBuffer* buffer, size_t len) {
+    if (!buffer) return false;
+    if (buffer->cap - buffer->len >= len) return true;
+
+    size_t cap = buffer->cap ? buffer->cap : 256;
+    while (cap - buffer->len < len) cap *= 2;
+    uint8_t* grown = prealloc(buffer->data, cap, buffer->tag);
+    if (!grown) return false;
+    buffer->data = grown;
+    buffer->cap = cap;
+    return true;
+}
+
+bool byte_buffer_append(ByteBuffer* buffer, const void* data, size_t len) {
+    if (!buffer || (!data && len > 0)) return false;
+    if (len == 0) return true;
+
+    if (!byte_buffer_reserve(buffer, len)) return false;
+    memcpy(buffer->data + buffer->len, data, len);
+    buffer->len += len;
+    return true;
+}
+
+bool byte_buffer_push(ByteBuffer* buffer, uint8_t byte) {
+    return byte_buffer_append(buffer, &byte, 1);
+}
+
+// hands the bytes to the caller, who pfree's them, and leaves the buffer empty
+uint8_t* byte_buffer_take(ByteBuffer* buffer, size_t* len) {
+    if (!buffer) return NULL;
+
+    uint8_t* data = buffer->data;
+    if (len) *len = buffer->len;
+    buffer->data = NULL;
+    buffer->len = 0;
+    buffer->cap = 0;
+    return data;
+}
+
+uint64_t hash_bytes(const void* data, size_t len) {
+    const uint8_t* bytes = data;
+    uint64_t hash = 1469598103934665603ull;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ull;
+    }
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdull;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ull;
+    hash ^= hash >> 33;
+    return hash ? hash : 1;
+}
+
+uint64_t hash_peer(const struct sockaddr_storage* peer) {
+    if (peer->ss_family == AF_INET) {
+        const struct sockaddr_in* in = (const struct sockaddr_in*)peer;
+        return hash_bytes(&in->sin_addr, sizeof(in->sin_addr));
+    }
+    if (peer->ss_family == AF_INET6) {
+        const struct sockaddr_in6* in6 = (const struct sockaddr_in6*)peer;
+        return hash_bytes(&in6->sin6_addr, sizeof(in6->sin6_addr));
+    }
+    // unix sockets and unknown peers all count as one host
+    return hash_bytes("", 0);
+}
+
+static uint32_t sha1_rotl(uint32_t value, int bits) {
+    return (value << bits) | (value >> (32 - bits));
+}
+
+static void sha1_block(uint32_t state[5], const uint8_t block[64]) {
+    uint32_t w[80];
+    for (int i = 0; i < 16; i++) {
+        w[i] = ((uint32_t)block[i * 4] << 24) | ((uint32_t)block[i * 4 + 1] << 16)
+            | ((uint32_t)block[i * 4 + 2] << 8) | block[i * 4 + 3];
+    }
+    for (int i = 16; i < 80; i++) {
+        w[i] = sha1_rotl(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+    }
+
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3], e = state[4];
+    for (int i = 0; i < 80; i++) {
+        uint32_t f, k;
+        if (i < 20) {
+            f = (b & c) | (~b & d);
+            k = 0x5a827999;
+        } else if (i < 40) {
+            f = b ^ c ^ d;
+            k = 0x6ed9eba1;
+        } else if (i < 60) {
+            f = (b & c) | (b & d) | (c & d);
+            k = 0x8f1bbcdc;
+        } else {
+            f = b ^ c ^ d;
+            k = 0xca62c1d6;
+        }
+        uint32_t temp = sha1_rotl(a, 5) + f + e + k + w[i];
+        e = d;
+        d = c;
+        c = sha1_rotl(b, 30);
+        b = a;
+        a = temp;
+    }
+
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+}
+
+void sha1(const void* data, size_t len, uint8_t digest[SHA1_DIGEST_SIZE]) {
+    uint32_t state[5] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0 };
+    const uint8_t* bytes = data;
+
+    size_t offset = 0;
+    for (; offset + 64 <= len; offset += 64) {
+        sha1_block(state, bytes + offset);
+    }
+
+    // the tail, a 1 bit, zero padding and the length in bits fill one or two blocks
+    uint8_t tail[128] = { 0 };
+    size_t rest = len - offset;
+    memcpy(tail, bytes + offset, rest);
+    tail[rest] = 0x80;
+    size_t tail_len = rest < 56 ? 64 : 128;
+    uint64_t bits = (uint64_t)len * 8;
+    for (int i = 0; i < 8; i++) {
+        tail[tail_len - 1 - i] = (uint8_t)(bits >> (i * 8));
+    }
+    sha1_block(state, tail);
+    if (tail_len == 128) sha1_block(state, tail + 64);
+
+    for (int i = 0; i < 5; i++) {
+        digest[i * 4] = (uint8_t)(state[i] >> 24);
+        digest[i * 4 + 1] = (uint8_t)(state[i] >> 16);
+        digest[i * 4 + 2] = (uint8_t)(state[i] >> 8);
+        digest[i * 4 + 3] = (uint8_t)state[i];
+    }
+}
+
+size_t base64_encode(const uint8_t* data, size_t len, char* out) {
+    static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+    size_t n = 0;
+    for (size_t i = 0; i < len; i += 3) {
+        uint32_t group = (uint32_t)data[i] << 16;
+        if (i + 1 < len) group |= (uint32_t)data[i + 1] << 8;
+        if (i + 2 < len) group |= data[i + 2];
+
+        out[n++] = alphabet[(group >> 18) & 0x3f];
+        out[n++] = alphabet[(group >> 12) & 0x3f];
+        out[n++] = i + 1 < len ? alphabet[(group >> 6) & 0x3f] : '=';
+        out[n++] = i + 2 < len ? alphabet[group & 0x3f] : '=';
+    }
+    out[n] = '\0';
+    return n;
+}
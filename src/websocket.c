@@ -0,0 +1,569 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+#include "alloc.h"
+#include "websocket.h"
+
+ARRAY_DEFINE(WebSocketRoute, WebSocketRouteArray)
+
+// RFC 6455 section 1.3, appended to the client's key before hashing
+static const char websocket_guid[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+
+void websocket_unmask(uint8_t* data, size_t len, const uint8_t key[4], size_t offset) {
+    if (!data || !key) return;
+
+    // rotate the key so lane 0 lines up with data[0]
+    uint8_t k[4] = { key[offset & 3], key[(offset + 1) & 3], key[(offset + 2) & 3], key[(offset + 3) & 3] };
+    uint32_t k32;
+    memcpy(&k32, k, 4);
+    size_t i = 0;
+
+    // every stride is a multiple of 4 bytes, the key phase stays the same
+#if defined(__AVX2__)
+    __m256i k256 = _mm256_set1_epi32((int)k32);
+    for (; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(data + i));
+        _mm256_storeu_si256((__m256i*)(data + i), _mm256_xor_si256(v, k256));
+    }
+#endif
+#if defined(__SSE2__)
+    __m128i k128 = _mm_set1_epi32((int)k32);
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(data + i));
+        _mm_storeu_si128((__m128i*)(data + i), _mm_xor_si128(v, k128));
+    }
+#elif defined(__ARM_NEON)
+    uint8x16_t k128 = vreinterpretq_u8_u32(vdupq_n_u32(k32));
+    for (; i + 16 <= len; i += 16) {
+        vst1q_u8(data + i, veorq_u8(vld1q_u8(data + i), k128));
+    }
+#endif
+    uint64_t k64 = ((uint64_t)k32 << 32) | k32;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t v;
+        memcpy(&v, data + i, 8);
+        v ^= k64;
+        memcpy(data + i, &v, 8);
+    }
+    for (; i < len; i++) {
+        data[i] ^= k[i & 3];
+    }
+}
+
+size_t websocket_frame_header(uint8_t* header, WebSocketOpcode opcode, bool fin, size_t len) {
+    header[0] = (uint8_t)((fin ? 0x80 : 0) | opcode);
+    if (len < 126) {
+        header[1] = (uint8_t)len;
+        return 2;
+    }
+    if (len <= 0xffff) {
+        header[1] = 126;
+        header[2] = (uint8_t)(len >> 8);
+        header[3] = (uint8_t)len;
+        return 4;
+    }
+    header[1] = 127;
+    for (int i = 0; i < 8; i++) {
+        header[2 + i] = (uint8_t)((uint64_t)len >> (56 - i * 8));
+    }
+    return 10;
+}
+
+int websocket_handshake_check(const HttpRequest* request, char* accept) {
+    if (!request || !accept) return 400;
+
+    Header* upgrade = http_request_get_header(request, "Upgrade");
+    Header* connection = http_request_get_header(request, "Connection");
+    Header* version = http_request_get_header(request, "Sec-WebSocket-Version");
+    Header* key = http_request_get_header(request, "Sec-WebSocket-Key");
+
+    if (request->request_line.method != HTTP_GET) return 400;
+    if (!upgrade || !strcasestr(string_cstr(upgrade->value), "websocket")) return 400;
+    if (!connection || !strcasestr(string_cstr(connection->value), "upgrade")) return 400;
+    if (!version || !string_equals_cstr(version->value, "13")) return 426;
+    // the key is 16 random bytes, base64 encoded
+    if (!key || string_byte_length(key->value) != 24) return 400;
+
+    char input[24 + sizeof(websocket_guid)];
+    memcpy(input, string_cstr(key->value), 24);
+    memcpy(input + 24, websocket_guid, sizeof(websocket_guid) - 1);
+
+    uint8_t digest[SHA1_DIGEST_SIZE];
+    sha1(input, 24 + sizeof(websocket_guid) - 1, digest);
+    base64_encode(digest, sizeof(digest), accept);
+    return 0;
+}
+
+static void websocket_notify(WebSocket* ws) {
+    if (ws->notify) ws->notify(ws->notify_data);
+}
+
+// queues a frame, `false` if we already closed or the client stopped reading
+static bool websocket_queue(WebSocket* ws, WebSocketOpcode opcode, bool fin, const void* data, size_t len) {
+    if (ws->close_sent || ws->finished) return false;
+
+    if (sendq_pending(ws->out) > WEBSOCKET_MAX_QUEUED) {
+        printf("WebSocket client is too slow, closing\n");
+        websocket_close(ws, WS_CLOSE_POLICY, "too slow");
+        return false;
+    }
+
+    uint8_t header[WEBSOCKET_MAX_HEADER];
+    size_t header_len = websocket_frame_header(header, opcode, fin, len);
+    uint8_t* frame = pmalloc(header_len + len, ws->tag);
+    if (!frame) return false;
+    memcpy(frame, header, header_len);
+    if (len > 0) memcpy(frame + header_len, data, len);
+
+    if (!sendq_push_buffer(ws->out, frame, header_len + len, frame)) return false;
+    websocket_notify(ws);
+    return true;
+}
+
+static void websocket_finish(WebSocket* ws) {
+    if (ws->finished) return;
+    ws->finished = true;
+    websocket_notify(ws);
+}
+
+// a protocol violation: tell the client why, then drop the connection
+static void websocket_fail(WebSocket* ws, uint16_t code, const char* why) {
+    printf("WebSocket error: %s\n", why);
+    if (!ws->close_sent) {
+        websocket_close(ws, code, NULL);
+    }
+    websocket_finish(ws);
+}
+
+static void websocket_on_timer(EventLoop* loop, void* data) {
+    (void)loop;
+    WebSocket* ws = data;
+
+    if (ws->close_sent) {
+        // the client never answered our close
+        websocket_finish(ws);
+        return;
+    }
+    if (ws->awaiting_pong) {
+        printf("WebSocket client stopped answering pings\n");
+        websocket_finish(ws);
+        return;
+    }
+    if (ws->heard) {
+        ws->heard = false;
+        return;
+    }
+    ws->awaiting_pong = websocket_queue(ws, WS_PING, true, NULL, 0);
+}
+
+WebSocket* websocket_new(EventLoop* loop, SendQueue* out, const WebSocketHandler* handler,
+                         WebSocketNotifyFn notify, void* notify_data, void* tag) {
+    if (!loop || !out || !handler) return NULL;
+
+    WebSocket* ws = pcalloc(1, sizeof(WebSocket), tag);
+    if (!ws) return NULL;
+
+    ws->loop = loop;
+    ws->out = out;
+    ws->handler = handler;
+    ws->notify = notify;
+    ws->notify_data = notify_data;
+    ws->message_opcode = WS_CONTINUATION;
+    ws->close_code = WS_CLOSE_ABNORMAL;
+    ws->tag = tag;
+    byte_buffer_init(&ws->message, tag);
+
+    ws->timer = event_timer_add(loop, WEBSOCKET_PING_INTERVAL_MS, WEBSOCKET_PING_INTERVAL_MS, websocket_on_timer, ws);
+    if (!ws->timer) {
+        pfree(ws);
+        return NULL;
+    }
+    return ws;
+}
+
+void websocket_open(WebSocket* ws, HttpRequest* request) {
+    if (!ws) return;
+    if (ws->handler->on_open) ws->handler->on_open(ws, request);
+}
+
+void websocket_free(WebSocket* ws) {
+    if (!ws) return;
+
+    // a close the client never confirmed didn't end cleanly
+    uint16_t code = ws->close_received ? ws->close_code : WS_CLOSE_ABNORMAL;
+    // the connection is already gone, nothing sent from on_close could go out
+    ws->finished = true;
+    if (ws->handler->on_close) ws->handler->on_close(ws, code);
+
+    while (ws->group_count > 0) {
+        websocket_group_leave(ws->groups[0], ws);
+    }
+    event_timer_cancel(ws->loop, ws->timer);
+    byte_buffer_free(&ws->message);
+    pfree(ws);
+}
+
+bool websocket_send(WebSocket* ws, WebSocketOpcode opcode, const void* data, size_t len) {
+    if (!ws || (!data && len > 0)) return false;
+    if (opcode != WS_TEXT && opcode != WS_BINARY && opcode != WS_PING && opcode != WS_PONG) return false;
+    if ((opcode & 0x8) && len > 125) return false;
+    // a whole message can't go out in the middle of a fragmented one
+    if (!(opcode & 0x8) && ws->sending_fragments) return false;
+
+    return websocket_queue(ws, opcode, true, data, len);
+}
+
+bool websocket_send_fragment(WebSocket* ws, WebSocketOpcode opcode, const void* data, size_t len, bool fin) {
+    if (!ws || (!data && len > 0)) return false;
+    if (!ws->sending_fragments && opcode != WS_TEXT && opcode != WS_BINARY) return false;
+
+    WebSocketOpcode frame_opcode = ws->sending_fragments ? WS_CONTINUATION : opcode;
+    if (!websocket_queue(ws, frame_opcode, fin, data, len)) return false;
+    ws->sending_fragments = !fin;
+    return true;
+}
+
+void websocket_close(WebSocket* ws, uint16_t code, const char* reason) {
+    if (!ws || ws->close_sent || ws->finished) return;
+
+    uint8_t payload[125];
+    size_t len = 0;
+    if (code != WS_CLOSE_NO_STATUS) {
+        payload[0] = (uint8_t)(code >> 8);
+        payload[1] = (uint8_t)code;
+        len = 2;
+        if (reason) {
+            size_t reason_len = strlen(reason);
+            if (reason_len > sizeof(payload) - 2) reason_len = sizeof(payload) - 2;
+            memcpy(payload + 2, reason, reason_len);
+            len += reason_len;
+        }
+    }
+
+    // bypasses the slow client check, the close has to go out regardless
+    uint8_t header[WEBSOCKET_MAX_HEADER];
+    size_t header_len = websocket_frame_header(header, WS_CLOSE, true, len);
+    uint8_t* frame = pmalloc(header_len + len, ws->tag);
+    if (frame) {
+        memcpy(frame, header, header_len);
+        memcpy(frame + header_len, payload, len);
+        sendq_push_buffer(ws->out, frame, header_len + len, frame);
+    }
+    ws->close_sent = true;
+    if (!ws->close_received) ws->close_code = code;
+
+    if (ws->close_received || !frame) {
+        websocket_finish(ws);
+    } else {
+        event_timer_reset(ws->loop, ws->timer, WEBSOCKET_CLOSE_TIMEOUT_MS);
+        websocket_notify(ws);
+    }
+}
+
+static bool websocket_close_code_valid(uint16_t code) {
+    if (code >= 3000 && code <= 4999) return true;
+    return (code >= 1000 && code <= 1003) || (code >= 1007 && code <= 1011);
+}
+
+static void websocket_on_close(WebSocket* ws, const uint8_t* payload, size_t len) {
+    uint16_t code = WS_CLOSE_NO_STATUS;
+    if (len == 1) {
+        websocket_fail(ws, WS_CLOSE_PROTOCOL_ERROR, "truncated close code");
+        return;
+    }
+    if (len >= 2) {
+        code = (uint16_t)((payload[0] << 8) | payload[1]);
+        if (!websocket_close_code_valid(code)) {
+            websocket_fail(ws, WS_CLOSE_PROTOCOL_ERROR, "invalid close code");
+            return;
+        }
+        if (!string_is_valid_utf8((const char*)payload + 2, len - 2)) {
+            websocket_fail(ws, WS_CLOSE_INVALID_DATA, "close reason is not UTF-8");
+            return;
+        }
+    }
+
+    ws->close_received = true;
+    ws->close_code = code;
+    // echo the code back, then the server closes the TCP connection first
+    if (!ws->close_sent) websocket_close(ws, code, NULL);
+    websocket_finish(ws);
+}
+
+static void websocket_deliver(WebSocket* ws, WebSocketOpcode opcode, const uint8_t* data, size_t len) {
+    if (opcode == WS_TEXT && !string_is_valid_utf8((const char*)data, len)) {
+        websocket_fail(ws, WS_CLOSE_INVALID_DATA, "text message is not UTF-8");
+        return;
+    }
+    // once we sent a close the application is done with this connection
+    if (ws->close_sent) return;
+    if (ws->handler->on_message) ws->handler->on_message(ws, opcode, data, len);
+}
+
+static void websocket_on_frame(WebSocket* ws, bool fin, WebSocketOpcode opcode, const uint8_t* payload, size_t len) {
+    switch (opcode) {
+        case WS_TEXT:
+        case WS_BINARY:
+            if (ws->message_opcode != WS_CONTINUATION) {
+                websocket_fail(ws, WS_CLOSE_PROTOCOL_ERROR, "new message inside a fragmented one");
+                return;
+            }
+            if (fin) {
+                // unfragmented messages are handed over straight from the receive buffer
+                websocket_deliver(ws, opcode, payload, len);
+                return;
+            }
+            ws->message_opcode = opcode;
+            ws->message.len = 0;
+            byte_buffer_append(&ws->message, payload, len);
+            return;
+
+        case WS_CONTINUATION:
+            if (ws->message_opcode == WS_CONTINUATION) {
+                websocket_fail(ws, WS_CLOSE_PROTOCOL_ERROR, "continuation without a message");
+                return;
+            }
+            if (ws->message.len + len > WEBSOCKET_MAX_MESSAGE) {
+                websocket_fail(ws, WS_CLOSE_TOO_BIG, "message too large");
+                return;
+            }
+            if (!byte_buffer_append(&ws->message, payload, len)) {
+                websocket_fail(ws, WS_CLOSE_INTERNAL, "out of memory");
+                return;
+            }
+            if (fin) {
+                WebSocketOpcode message_opcode = ws->message_opcode;
+                ws->message_opcode = WS_CONTINUATION;
+                websocket_deliver(ws, message_opcode, ws->message.data, ws->message.len);
+                // don't hold on to the memory of an unusually large message
+                if (ws->message.cap > 64 * 1024) byte_buffer_free(&ws->message);
+                ws->message.len = 0;
+            }
+            return;
+
+        case WS_CLOSE:
+            websocket_on_close(ws, payload, len);
+            return;
+
+        case WS_PING:
+            websocket_queue(ws, WS_PONG, true, payload, len);
+            return;
+
+        case WS_PONG:
+            return;
+
+        default:
+            websocket_fail(ws, WS_CLOSE_PROTOCOL_ERROR, "unknown opcode");
+            return;
+    }
+}
+
+bool websocket_input(WebSocket* ws, uint8_t* data, size_t len, size_t* used) {
+    if (!ws || !used) return false;
+
+    size_t offset = 0;
+    while (!ws->finished && len - offset >= 2) {
+        const uint8_t* p = data + offset;
+        bool fin = p[0] & 0x80;
+        WebSocketOpcode opcode = (WebSocketOpcode)(p[0] & 0x0f);
+        uint64_t payload_len = p[1] & 0x7f;
+        size_t header_len = 2;
+
+        if (p[0] & 0x70) {
+            websocket_fail(ws, WS_CLOSE_PROTOCOL_ERROR, "reserved bits set");
+            break;
+        }
+        if (!(p[1] & 0x80)) {
+            websocket_fail(ws, WS_CLOSE_PROTOCOL_ERROR, "unmasked client frame");
+            break;
+        }
+
+        if (payload_len == 126) {
+            if (len - offset < 4) break;
+            payload_len = ((uint64_t)p[2] << 8) | p[3];
+            header_len = 4;
+        } else if (payload_len == 127) {
+            if (len - offset < 10) break;
+            payload_len = 0;
+            for (int i = 0; i < 8; i++) payload_len = (payload_len << 8) | p[2 + i];
+            header_len = 10;
+        }
+
+        if ((opcode & 0x8) && (!fin || payload_len > 125)) {
+            websocket_fail(ws, WS_CLOSE_PROTOCOL_ERROR, "bad control frame");
+            break;
+        }
+        if (payload_len > WEBSOCKET_MAX_MESSAGE) {
+            websocket_fail(ws, WS_CLOSE_TOO_BIG, "frame too large");
+            break;
+        }
+
+        header_len += 4;
+        if (len - offset < header_len || len - offset - header_len < payload_len) break;
+
+        const uint8_t* key = p + header_len - 4;
+        uint8_t* payload = data + offset + header_len;
+        websocket_unmask(payload, (size_t)payload_len, key, 0);
+        offset += header_len + (size_t)payload_len;
+
+        ws->heard = true;
+        ws->awaiting_pong = false;
+        websocket_on_frame(ws, fin, opcode, payload, (size_t)payload_len);
+    }
+
+    *used = offset;
+    return !ws->finished;
+}
+
+WebSocketGroup* websocket_group_new(void* tag) {
+    WebSocketGroup* group = pcalloc(1, sizeof(WebSocketGroup), tag);
+    if (!group) return NULL;
+
+    pthread_mutex_init(&group->lock, NULL);
+    group->tag = tag;
+    return group;
+}
+
+void websocket_group_free(WebSocketGroup* group) {
+    if (!group) return;
+
+    for (size_t i = 0; i < group->count; i++) {
+        WebSocket* ws = group->members[i];
+        for (size_t j = 0; j < ws->group_count; j++) {
+            if (ws->groups[j] == group) ws->groups[j] = ws->groups[--ws->group_count];
+        }
+    }
+    pthread_mutex_destroy(&group->lock);
+    if (group->members) pfree(group->members);
+    if (group->loops) pfree(group->loops);
+    pfree(group);
+}
+
+bool websocket_group_join(WebSocketGroup* group, WebSocket* ws) {
+    if (!group || !ws || ws->group_count == WEBSOCKET_MAX_GROUPS) return false;
+    for (size_t i = 0; i < ws->group_count; i++) {
+        if (ws->groups[i] == group) return true;
+    }
+
+    pthread_mutex_lock(&group->lock);
+    if (group->count == group->capacity) {
+        size_t capacity = group->capacity ? group->capacity * 2 : 16;
+        WebSocket** members = prealloc(group->members, capacity * sizeof(WebSocket*), group->tag);
+        if (members) group->members = members;
+        EventLoop** loops = members ? prealloc(group->loops, capacity * sizeof(EventLoop*), group->tag) : NULL;
+        if (loops) group->loops = loops;
+        if (!members || !loops) {
+            pthread_mutex_unlock(&group->lock);
+            return false;
+        }
+        group->capacity = capacity;
+    }
+    group->members[group->count] = ws;
+    group->loops[group->count] = ws->loop;
+    group->count++;
+    pthread_mutex_unlock(&group->lock);
+
+    ws->groups[ws->group_count++] = group;
+    return true;
+}
+
+void websocket_group_leave(WebSocketGroup* group, WebSocket* ws) {
+    if (!group || !ws) return;
+
+    pthread_mutex_lock(&group->lock);
+    for (size_t i = 0; i < group->count; i++) {
+        if (group->members[i] == ws) {
+            group->count--;
+            group->members[i] = group->members[group->count];
+            group->loops[i] = group->loops[group->count];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&group->lock);
+
+    for (size_t i = 0; i < ws->group_count; i++) {
+        if (ws->groups[i] == group) {
+            ws->groups[i] = ws->groups[--ws->group_count];
+            break;
+        }
+    }
+}
+
+// one broadcast frame on its way to the members of one event loop
+typedef struct {
+    WebSocketGroup* group;
+    SharedBuffer* frame;
+} WebSocketDelivery;
+
+// runs on the members' loop, which is also the only thread that removes them
+static void websocket_group_deliver(EventLoop* loop, void* data) {
+    WebSocketDelivery* delivery = data;
+    WebSocketGroup* group = delivery->group;
+
+    pthread_mutex_lock(&group->lock);
+    for (size_t i = 0; i < group->count; i++) {
+        if (group->loops[i] != loop) continue;
+
+        WebSocket* ws = group->members[i];
+        if (ws->close_sent || ws->finished) continue;
+        if (sendq_pending(ws->out) > WEBSOCKET_MAX_QUEUED) {
+            printf("WebSocket client is too slow, closing\n");
+            websocket_close(ws, WS_CLOSE_POLICY, "too slow");
+            continue;
+        }
+        if (sendq_push_shared(ws->out, delivery->frame)) websocket_notify(ws);
+    }
+    pthread_mutex_unlock(&group->lock);
+
+    shared_buffer_release(delivery->frame);
+    pfree(delivery);
+}
+
+bool websocket_group_broadcast(WebSocketGroup* group, WebSocketOpcode opcode, const void* data, size_t len) {
+    if (!group || (!data && len > 0) || (opcode != WS_TEXT && opcode != WS_BINARY)) return false;
+
+    // serialized once, every member's queue references the same bytes
+    uint8_t header[WEBSOCKET_MAX_HEADER];
+    size_t header_len = websocket_frame_header(header, opcode, true, len);
+    SharedBuffer* frame = shared_buffer_new(NULL, header_len + len, group->tag);
+    if (!frame) return false;
+    memcpy(frame->data, header, header_len);
+    if (len > 0) memcpy(frame->data + header_len, data, len);
+
+    // the distinct loops members run on, usually one per worker
+    pthread_mutex_lock(&group->lock);
+    size_t loop_count = 0;
+    EventLoop** loops = group->count ? pmalloc(group->count * sizeof(EventLoop*), group->tag) : NULL;
+    bool ok = group->count == 0 || loops;
+    for (size_t i = 0; loops && i < group->count; i++) {
+        size_t j = 0;
+        while (j < loop_count && loops[j] != group->loops[i]) j++;
+        if (j == loop_count) loops[loop_count++] = group->loops[i];
+    }
+    pthread_mutex_unlock(&group->lock);
+
+    for (size_t i = 0; i < loop_count; i++) {
+        WebSocketDelivery* delivery = pmalloc(sizeof(WebSocketDelivery), group->tag);
+        if (!delivery) {
+            ok = false;
+            continue;
+        }
+        delivery->group = group;
+        delivery->frame = shared_buffer_retain(frame);
+        if (!event_loop_post(loops[i], websocket_group_deliver, delivery)) {
+            shared_buffer_release(frame);
+            pfree(delivery);
+            ok = false;
+        }
+    }
+
+    if (loops) pfree(loops);
+    shared_buffer_release(frame);
+    return ok;
+}